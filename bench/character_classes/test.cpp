@@ -0,0 +1,100 @@
+#include <lib/character.h>
+#include <program/http_parser.h>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using namespace flashpoint::lib;
+using namespace flashpoint::program;
+
+// The classifiers as they were written before the character class table.
+
+bool switch_is_unreserved_char(char ch) {
+    if (isalnum(ch)) {
+        return true;
+    }
+    switch (ch) {
+        case Minus:
+        case Dot:
+        case Underscore:
+        case Tilde:
+            return true;
+    }
+    return false;
+}
+
+bool switch_is_sub_delimiter(char ch) {
+    switch (ch) {
+        case Exclamation:
+        case Dollar:
+        case Ampersand:
+        case SingleQuote:
+        case OpenParen:
+        case CloseParen:
+        case Asterisk:
+        case Plus:
+        case Comma:
+        case Semicolon:
+        case Equal:
+            return true;
+    }
+    return false;
+}
+
+bool switch_is_pchar(char ch) {
+    return switch_is_unreserved_char(ch) || switch_is_sub_delimiter(ch) || ch == Colon || ch == At;
+}
+
+bool switch_is_name_part(char32_t ch) {
+    return (ch >= a && ch <= z) ||
+           (ch >= A && ch <= Z) ||
+           (ch >= _0 && ch <= _9) ||
+           ch == _;
+}
+
+template<typename F>
+void run(const char* name, const std::string& text, std::size_t iterations, F classify) {
+    std::size_t matches = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; i++) {
+        for (char ch : text) {
+            matches += classify(ch);
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::size_t duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    std::cout << name << ": " << duration << "us (" << matches << " matches)" << std::endl;
+}
+
+int main() {
+    std::string text;
+    for (int i = 0; i < 64; i++) {
+        text += "/graphql/v1/users;matrix=1/query_name-~!$&'()*+,=:@%20field_";
+        text += static_cast<char>(0x80 + i);
+    }
+    const std::size_t iterations = 100000;
+
+    run("pchar, switch", text, iterations, [](char ch) { return switch_is_pchar(ch); });
+    run("pchar, table", text, iterations, [](char ch) { return is_character_class(ch, CharacterClass::PathCharacter); });
+    run("name part, compare", text, iterations, [](char ch) { return switch_is_name_part(static_cast<unsigned char>(ch)); });
+    run("name part, table", text, iterations, [](char ch) { return is_character_class(static_cast<char32_t>(static_cast<unsigned char>(ch)), CharacterClass::NamePart); });
+
+    // Whole request parse with a long request target, where the scanner spends
+    // most of its time in is_pchar.
+    std::string request = "GET ";
+    for (int i = 0; i < 32; i++) {
+        request += "/graphql/v1/users;matrix=1/query_name-~!$&'()*+,=:@%20field_";
+    }
+    request += " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations / 10; i++) {
+        HttpParser parser(request.c_str(), request.size());
+        auto result = parser.Parse();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::size_t duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    std::cout << "HttpParser::Parse: " << duration << "us" << std::endl;
+}
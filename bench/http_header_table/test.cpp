@@ -0,0 +1,101 @@
+#include <program/http_parser.h>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <new>
+
+using namespace flashpoint::program;
+
+static std::size_t allocations = 0;
+static std::size_t allocated_bytes = 0;
+
+void* operator new(std::size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    void* p = std::malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+const char* request =
+    "POST /graphql HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: curl/7.54.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Authorization: Bearer abcdef\r\n"
+    "Content-Type: application/json\r\n"
+    "X-Request-Id: 7f0c2d3e\r\n"
+    "Content-Length: 20\r\n"
+    "\r\n"
+    "{\"query\":\"{ field }\"}";
+
+int main() {
+    const std::size_t iterations = 100000;
+    const std::size_t size = std::strlen(request);
+
+    // Allocations of the header storage alone, i.e. without the scanner's
+    // value strings, for the previous std::map layout and the flat table.
+    std::size_t start_allocations = allocations;
+    std::size_t start_bytes = allocated_bytes;
+    for (std::size_t i = 0; i < iterations; i++) {
+        std::map<HttpHeader, char*> headers;
+        headers[HttpHeader::Host] = nullptr;
+        headers[HttpHeader::UserAgent] = nullptr;
+        headers[HttpHeader::Accept] = nullptr;
+        headers[HttpHeader::AcceptEncoding] = nullptr;
+        headers[HttpHeader::Authorization] = nullptr;
+        headers[HttpHeader::ContentType] = nullptr;
+        headers[HttpHeader::Unknown] = nullptr;
+        headers[HttpHeader::ContentLength] = nullptr;
+    }
+    std::cout << "std::map headers: "
+        << (allocations - start_allocations) / iterations << " allocations, "
+        << (allocated_bytes - start_bytes) / iterations << " bytes per request" << std::endl;
+
+    start_allocations = allocations;
+    start_bytes = allocated_bytes;
+    for (std::size_t i = 0; i < iterations; i++) {
+        HttpHeaders headers;
+        headers.Set(HttpHeader::Host, nullptr);
+        headers.Set(HttpHeader::UserAgent, nullptr);
+        headers.Set(HttpHeader::Accept, nullptr);
+        headers.Set(HttpHeader::AcceptEncoding, nullptr);
+        headers.Set(HttpHeader::Authorization, nullptr);
+        headers.Set(HttpHeader::ContentType, nullptr);
+        headers.AddUnknown(nullptr, nullptr);
+        headers.Set(HttpHeader::ContentLength, nullptr);
+    }
+    std::cout << "HttpHeaders: "
+        << (allocations - start_allocations) / iterations << " allocations, "
+        << (allocated_bytes - start_bytes) / iterations << " bytes per request"
+        << " (" << sizeof(HttpHeaders) << " bytes inline)" << std::endl;
+
+    // Whole request parse, including the scanner's value strings.
+    start_allocations = allocations;
+    start_bytes = allocated_bytes;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; i++) {
+        HttpParser parser(request, size);
+        auto http_request = parser.Parse();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::size_t duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    std::cout << "HttpParser::Parse: "
+        << (allocations - start_allocations) / iterations << " allocations, "
+        << (allocated_bytes - start_bytes) / iterations << " bytes per request" << std::endl;
+    std::cout << "Duration: " << duration << "us" << std::endl;
+}
@@ -0,0 +1,66 @@
+#include <program/http_parser.h>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace flashpoint::program;
+
+struct HostileInput {
+    const char* name;
+    std::string text;
+};
+
+std::string many_headers() {
+    std::string text = "POST /graphql HTTP/1.1\r\n";
+    for (int i = 0; i < 1000; i++) {
+        text += "X-Header: value\r\n";
+    }
+    return text + "\r\n";
+}
+
+std::string large_header() {
+    return "POST /graphql HTTP/1.1\r\nCookie: " + std::string(1024 * 16, 'a') + "\r\n\r\n";
+}
+
+std::string garbage() {
+    std::string text;
+    for (int i = 0; i < 512; i++) {
+        text += static_cast<char>((i * 7919) & 0xff);
+    }
+    return text;
+}
+
+int main() {
+    std::vector<HostileInput> inputs = {
+        { "valid", "POST /graphql HTTP/1.1\r\nHost: localhost\r\nContent-Length: 20\r\n\r\n{\"query\":\"{ field }\"}" },
+        { "invalid method", "FETCH /graphql HTTP/1.1\r\n\r\n" },
+        { "invalid percent encoding", "GET /graph%zzql HTTP/1.1\r\n\r\n" },
+        { "invalid version", "GET /graphql HTTP/9.9\r\n\r\n" },
+        { "missing line feed", "GET /graphql HTTP/1.1\rHost: localhost\r\n\r\n" },
+        { "truncated", "POST /graphql HTTP/1.1\r\nHost: local" },
+        { "truncated body", "POST /graphql HTTP/1.1\r\nContent-Length: 100\r\n\r\n{}" },
+        { "invalid content length", "POST /graphql HTTP/1.1\r\nContent-Length: 1e9\r\n\r\n" },
+        { "payload too large", "POST /graphql HTTP/1.1\r\nContent-Length: 999999999999\r\n\r\n" },
+        { "too many headers", many_headers() },
+        { "header too large", large_header() },
+        { "garbage", garbage() },
+    };
+
+    const std::size_t iterations = 100000;
+    for (const auto& input : inputs) {
+        HttpParseError error = HttpParseError::None;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < iterations; i++) {
+            HttpParser parser(input.text.c_str(), input.text.size());
+            error = parser.Parse().error;
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        std::size_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        std::cout << input.name << ": error " << static_cast<int>(error) << ", "
+            << duration / iterations << "ns per request, "
+            << static_cast<std::size_t>(iterations * 1e9 / duration) << " requests/s" << std::endl;
+    }
+}
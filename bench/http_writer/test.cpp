@@ -0,0 +1,150 @@
+#include <program/http_response.h>
+#include <uv.h>
+#include <sys/socket.h>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using namespace flashpoint;
+using namespace flashpoint::lib;
+
+// The writer as it was written before the bulk copy writer. It copies one
+// byte at a time, calls strlen on every iteration and writes every time its
+// 4KB buffer is full.
+class ByteHttpWriter {
+public:
+    ByteHttpWriter(uv_stream_t* tcp_handle):
+        tcp_handle(tcp_handle) { }
+
+    ~ByteHttpWriter() {
+        delete[] write_buffer_;
+    }
+
+    void Write(const char *text) {
+        for (std::size_t i = 0; i < strlen(text); i++) {
+            if (position_ == buffer_size_) {
+                FlushBuffer();
+            }
+            write_buffer_[position_] = text[i];
+            position_++;
+        }
+    }
+
+    void End() {
+        FlushBuffer();
+    }
+
+private:
+    static void OnWriteEnd(uv_write_t *write_request, int status) {
+        delete[] static_cast<char*>(write_request->data);
+        delete write_request;
+    }
+
+    // The writer used to reuse its buffer before the write completed, here
+    // the buffer is handed to the write request so that the output is valid.
+    void FlushBuffer() {
+        if (position_ == 0) {
+            return;
+        }
+        auto write_request = new uv_write_t;
+        write_request->data = write_buffer_;
+        uv_buf_t buffer = uv_buf_init(write_buffer_, (unsigned int)position_);
+        uv_write(write_request, tcp_handle, &buffer, 1, OnWriteEnd);
+        write_buffer_ = new char[buffer_size_];
+        position_ = 0;
+    }
+
+    uv_stream_t* tcp_handle;
+    std::size_t buffer_size_ = 4096;
+    char* write_buffer_ = new char[4096];
+    std::size_t position_ = 0;
+};
+
+std::size_t read_bytes = 0;
+
+void AllocateReadBuffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    static char buffer[1024 * 64];
+    buf->base = buffer;
+    buf->len = sizeof(buffer);
+}
+
+void OnRead(uv_stream_t *stream, ssize_t length, const uv_buf_t *buf) {
+    if (length > 0) {
+        read_bytes += length;
+    }
+}
+
+template<typename F>
+void run(const char* name, uv_loop_t* loop, std::size_t iterations, std::size_t response_size, F write_response) {
+    read_bytes = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; i++) {
+        write_response();
+        while (read_bytes < (i + 1) * response_size) {
+            uv_run(loop, UV_RUN_ONCE);
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::size_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::cout << name << ": " << duration / iterations << "ns per response" << std::endl;
+}
+
+int main() {
+    uv_loop_t* loop = uv_default_loop();
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    uv_pipe_t writer_pipe;
+    uv_pipe_t reader_pipe;
+    uv_pipe_init(loop, &writer_pipe, 0);
+    uv_pipe_open(&writer_pipe, fds[0]);
+    uv_pipe_init(loop, &reader_pipe, 0);
+    uv_pipe_open(&reader_pipe, fds[1]);
+    uv_read_start((uv_stream_t*)&reader_pipe, AllocateReadBuffer, OnRead);
+    auto stream = (uv_stream_t*)&writer_pipe;
+
+    const char* head =
+        "HTTP/1.1 200 OK\r\n"
+        "Server: flash\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 8192\r\n"
+        "\r\n";
+    std::string body = "{\"data\":{\"field\":\"" + std::string(8192 - 21, 'x') + "\"}}";
+    std::size_t response_size = std::strlen(head) + body.size();
+    const std::size_t iterations = 10000;
+
+    run("ByteHttpWriter", loop, iterations, response_size, [&]() {
+        ByteHttpWriter writer(stream);
+        writer.Write(head);
+        writer.Write(body.c_str());
+        writer.End();
+    });
+    run("HttpWriter, copy", loop, iterations, response_size, [&]() {
+        HttpWriter writer(stream);
+        writer.Write(head);
+        writer.Write(body);
+        writer.End();
+    });
+    run("HttpWriter, reference", loop, iterations, response_size, [&]() {
+        HttpWriter writer(stream);
+        writer.Write(head);
+        writer.WriteReference(body.data(), body.size());
+        writer.End();
+    });
+
+    MemoryPool memory_pool(1024 * 4 * 64, 1024 * 4);
+    HttpWriterPool writer_pool(&memory_pool);
+    run("HttpWriter, pooled", loop, iterations, response_size, [&]() {
+        HttpWriter writer(stream, &writer_pool);
+        writer.Write(head);
+        writer.Write(body);
+        writer.End();
+    });
+    const HttpWriterPoolStats& stats = writer_pool.Stats();
+    std::cout << "HttpWriterPool: "
+        << stats.write_requests_taken << " write requests taken, "
+        << stats.write_request_allocations << " allocated, "
+        << stats.buffers_taken << " buffers taken, "
+        << stats.buffer_allocations << " allocated" << std::endl;
+}
@@ -1,27 +1,69 @@
+#include <lib/number_format.h>
 #include <cstddef>
 #include <cstdio>
+#include <charconv>
 #include <chrono>
 #include <stdlib.h>
 #include <iostream>
-#include <sstream>
-#include <cmath>
+
+using namespace flashpoint::lib;
+
+const std::size_t iterations = 1000000;
+
+template<typename F>
+void run(const char* name, F format) {
+    std::size_t bytes = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; i++) {
+        bytes += format(i);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::size_t duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    std::cout << name << ": " << duration << "us (" << bytes << " bytes)" << std::endl;
+}
 
 int main() {
-    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();;
-    int y = 1000000;
-    int tmp_y;
+    // Content lengths, spread over a few magnitudes.
+    auto content_length = [](std::size_t i) -> std::uint64_t {
+        return (i * 7919) % 10000000;
+    };
 
-    for (int i = 0; i < 100000; i++) {
-        int number_of_chars = 0;
-        tmp_y = y;
+    run("malloc + sprintf", [&](std::size_t i) -> std::size_t {
+        std::uint64_t y = content_length(i);
+        int number_of_chars = 1;
+        std::uint64_t tmp_y = y;
         while (tmp_y /= 10) {
             number_of_chars++;
         }
-        char* content_length = (char*)malloc(number_of_chars);
-        sprintf(content_length, "%d", y);
-    }
+        // One byte for each digit and one for the null terminator.
+        char* text = (char*)malloc(number_of_chars + 1);
+        int size = sprintf(text, "%llu", (unsigned long long)y);
+        free(text);
+        return size;
+    });
 
-    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-    std::size_t duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
-    std::cout << "Duration: " << duration << "us" << std::endl;
-}
\ No newline at end of file
+    char text[max_double_size];
+    run("snprintf", [&](std::size_t i) -> std::size_t {
+        return snprintf(text, sizeof(text), "%llu", (unsigned long long)content_length(i));
+    });
+    run("std::to_chars", [&](std::size_t i) -> std::size_t {
+        return std::to_chars(text, text + sizeof(text), content_length(i)).ptr - text;
+    });
+    run("format_u64", [&](std::size_t i) -> std::size_t {
+        return format_u64(content_length(i), text);
+    });
+
+    run("snprintf, i64", [&](std::size_t i) -> std::size_t {
+        return snprintf(text, sizeof(text), "%lld", -(long long)(i * 104729));
+    });
+    run("format_i64", [&](std::size_t i) -> std::size_t {
+        return format_i64(-(std::int64_t)(i * 104729), text);
+    });
+
+    run("snprintf, double", [&](std::size_t i) -> std::size_t {
+        return snprintf(text, sizeof(text), "%.17g", i * 0.37);
+    });
+    run("format_double", [&](std::size_t i) -> std::size_t {
+        return format_double(i * 0.37, text);
+    });
+}
@@ -1,6 +1,9 @@
 #ifndef FLASHPOINT_CHARACTER_H
 #define FLASHPOINT_CHARACTER_H
 
+#include <array>
+#include <cstdint>
+
 namespace flashpoint::lib {
 
 enum Character {
@@ -122,5 +125,115 @@ enum Character {
     End = 0xFFFF,
 };
 
+// Character classes of the HTTP and GraphQL grammars. A byte can belong to
+// several classes, so each class is one bit in the character class table.
+enum class CharacterClass : std::uint16_t {
+    Digit = 1 << 0,                // DIGIT
+    HexDigit = 1 << 1,             // HEXDIG
+    Alpha = 1 << 2,                // ALPHA
+    Upper = 1 << 3,                // A-Z
+    Unreserved = 1 << 4,           // RFC 3986 unreserved
+    SubDelimiter = 1 << 5,         // RFC 3986 sub-delims
+    PathCharacter = 1 << 6,        // RFC 3986 pchar, except pct-encoded
+    VisibleCharacter = 1 << 7,     // RFC 7230 VCHAR
+    ObsText = 1 << 8,              // RFC 7230 obs-text
+    HeaderFieldPart = 1 << 9,      // RFC 7230 tchar
+    NameStart = 1 << 10,           // GraphQL NameStart
+    NamePart = 1 << 11,            // GraphQL NameContinue
+    LineBreak = 1 << 12,           // \n / \r
+    Whitespace = 1 << 13,          // SP / HTAB
+};
+
+constexpr std::uint16_t operator|(CharacterClass a, CharacterClass b) {
+    return static_cast<std::uint16_t>(a) | static_cast<std::uint16_t>(b);
+}
+
+constexpr std::array<std::uint16_t, 256> make_character_classes() {
+    std::array<std::uint16_t, 256> classes {};
+    auto add = [&](unsigned int ch, CharacterClass character_class) {
+        classes[ch] |= static_cast<std::uint16_t>(character_class);
+    };
+    for (unsigned int ch = _0; ch <= _9; ch++) {
+        add(ch, CharacterClass::Digit);
+        add(ch, CharacterClass::HexDigit);
+        add(ch, CharacterClass::Unreserved);
+        add(ch, CharacterClass::HeaderFieldPart);
+        add(ch, CharacterClass::NamePart);
+    }
+    for (unsigned int ch = a; ch <= z; ch++) {
+        add(ch, CharacterClass::Alpha);
+        add(ch, CharacterClass::Unreserved);
+        add(ch, CharacterClass::HeaderFieldPart);
+        add(ch, CharacterClass::NameStart);
+        add(ch, CharacterClass::NamePart);
+        add(ch - a + A, CharacterClass::Alpha);
+        add(ch - a + A, CharacterClass::Upper);
+        add(ch - a + A, CharacterClass::Unreserved);
+        add(ch - a + A, CharacterClass::HeaderFieldPart);
+        add(ch - a + A, CharacterClass::NameStart);
+        add(ch - a + A, CharacterClass::NamePart);
+    }
+    for (unsigned int ch = a; ch <= f; ch++) {
+        add(ch, CharacterClass::HexDigit);
+        add(ch - a + A, CharacterClass::HexDigit);
+    }
+    for (unsigned int ch : { Minus, Dot, Underscore, Tilde }) {
+        add(ch, CharacterClass::Unreserved);
+    }
+    for (unsigned int ch : { Exclamation, Dollar, Ampersand, SingleQuote, OpenParen, CloseParen, Asterisk, Plus, Comma, Semicolon, Equal }) {
+        add(ch, CharacterClass::SubDelimiter);
+    }
+    for (unsigned int ch = 0; ch < 256; ch++) {
+        if (classes[ch] & (CharacterClass::Unreserved | CharacterClass::SubDelimiter) || ch == Colon || ch == At) {
+            add(ch, CharacterClass::PathCharacter);
+        }
+    }
+    for (unsigned int ch = Exclamation; ch <= Tilde; ch++) {
+        add(ch, CharacterClass::VisibleCharacter);
+    }
+    for (unsigned int ch = 0x80; ch <= 0xFF; ch++) {
+        add(ch, CharacterClass::ObsText);
+    }
+    for (unsigned int ch : { Exclamation, Hash, Dollar, Percent, Ampersand, SingleQuote, Asterisk, Plus, Minus, Dot, Caret, Underscore, Backtick, Pipe, Tilde }) {
+        add(ch, CharacterClass::HeaderFieldPart);
+    }
+    add(Underscore, CharacterClass::NameStart);
+    add(Underscore, CharacterClass::NamePart);
+    add(NewLine, CharacterClass::LineBreak);
+    add(CarriageReturn, CharacterClass::LineBreak);
+    add(Space, CharacterClass::Whitespace);
+    add(HorizontalTab, CharacterClass::Whitespace);
+    return classes;
+}
+
+inline constexpr std::array<std::uint16_t, 256> character_classes = make_character_classes();
+
+// Check if a byte belongs to a character class. The table is indexed by the
+// unsigned byte value, so it doesn't depend on the locale or on char being signed.
+constexpr bool is_character_class(char ch, CharacterClass character_class) {
+    return (character_classes[static_cast<unsigned char>(ch)] & static_cast<std::uint16_t>(character_class)) != 0;
+}
+
+// Code points outside of Latin-1 don't belong to any class.
+constexpr bool is_character_class(char32_t ch, CharacterClass character_class) {
+    return ch < character_classes.size() && (character_classes[ch] & static_cast<std::uint16_t>(character_class)) != 0;
+}
+
+constexpr std::array<char, 256> make_lower_case_characters() {
+    std::array<char, 256> characters {};
+    for (unsigned int ch = 0; ch < 256; ch++) {
+        characters[ch] = static_cast<char>(ch >= A && ch <= Z ? ch - A + a : ch);
+    }
+    return characters;
+}
+
+inline constexpr std::array<char, 256> lower_case_characters = make_lower_case_characters();
+
+// Lower-case an ASCII letter. Other bytes are kept as they are, whatever the
+// locale is.
+constexpr char to_lower(char ch) {
+    return lower_case_characters[static_cast<unsigned char>(ch)];
+}
+
 }
 #endif //FLASHPOINT_CHARACTER_H
@@ -1,5 +1,10 @@
 #include "memory_pool.h"
+#include <cstdlib>
 #include <memory>
+#include <stdexcept>
+#ifdef _DEBUG
+#include <iostream>
+#endif
 
 #define start_address_of_block(x) x * block_size
 
@@ -15,21 +20,55 @@ MemoryPool::MemoryPool(std::size_t total_size, std::size_t block_size)
 
 std::size_t
 MemoryPool::AllocateBlock() {
+    if (free_blocks.empty()) {
+        return static_cast<std::size_t>(-1);
+    }
     std::size_t block = free_blocks.top();
     free_blocks.pop();
     return block;
 }
 
+char* MemoryPool::TakeBlock() {
+    if (free_blocks.empty()) {
+        return nullptr;
+    }
+    return start_address_of_pool + start_address_of_block(AllocateBlock());
+}
+
+void MemoryPool::ReturnBlock(char* block) {
+    free_blocks.push((block - start_address_of_pool) / block_size);
+}
+
+std::size_t MemoryPool::BlockSize() const {
+    return block_size;
+}
+
+std::size_t MemoryPool::FreeBlocks() const {
+    return free_blocks.size();
+}
+
 MemoryPoolTicket* MemoryPool::TakeTicket() {
     auto block = AllocateBlock();
+    if (block == static_cast<std::size_t>(-1)) {
+        return nullptr;
+    }
     auto ticket = (MemoryPoolTicket*)(start_address_of_pool + start_address_of_block(block));
     ticket->block = block;
     ticket->offset = sizeof(MemoryPoolTicket);
     return ticket;
 }
 
+// A continued block starts with the index of the previous block of its
+// ticket, so the blocks are returned from the last one back to the ticket's.
 void MemoryPool::ReturnTicket(MemoryPoolTicket *ticket) {
-    free_blocks.push(ticket->block);
+    std::size_t first_block = ((char*)ticket - start_address_of_pool) / block_size;
+    std::size_t block = ticket->block;
+    while (block != first_block) {
+        std::size_t previous_block = *(std::size_t*)(start_address_of_pool + start_address_of_block(block));
+        free_blocks.push(block);
+        block = previous_block;
+    }
+    free_blocks.push(first_block);
 }
 
 void* MemoryPool::Allocate(std::size_t size, std::size_t alignment, MemoryPoolTicket *ticket) {
@@ -43,11 +82,16 @@ void* MemoryPool::Allocate(std::size_t size, std::size_t alignment, MemoryPoolTi
     }
 
     if (ticket->offset + padding + size > block_size) {
-        ticket->block = AllocateBlock();
-        ticket->offset = 0;
-        if (ticket->block == -1) {
+        if (sizeof(std::size_t) + alignment + size > block_size) {
+            throw std::logic_error("Out of memory: trying to allocate more than a block of memory for a request.");
+        }
+        std::size_t block = AllocateBlock();
+        if (block == static_cast<std::size_t>(-1)) {
             throw std::logic_error("Out of memory: trying to allocate a block of memory for a request.");
         }
+        *(std::size_t*)(start_address_of_pool + start_address_of_block(block)) = ticket->block;
+        ticket->block = block;
+        ticket->offset = sizeof(std::size_t);
         return Allocate(size, alignment, ticket);
     }
 
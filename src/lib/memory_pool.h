@@ -1,6 +1,7 @@
 #ifndef FLASHPOINT_REQUEST_ALLOACTOR_H
 #define FLASHPOINT_REQUEST_ALLOACTOR_H
 
+#include <cstddef>
 #include <stack>
 #include <vector>
 
@@ -26,18 +27,41 @@ public:
 
     MemoryPool(std::size_t total_size, std::size_t block_size);
 
+    // Allocate memory of a ticket. A ticket whose block is full continues in
+    // a new block, which is linked to the previous one.
+    // @throw std::logic_error if the pool has no free blocks or the size
+    // doesn't fit into a block.
     void*
     Allocate(std::size_t size, std::size_t alignment, MemoryPoolTicket *ticket);
 
+    // Take a ticket, which is stored at the start of its first block.
+    // @return the ticket or nullptr if the pool has no free blocks.
     MemoryPoolTicket*
     TakeTicket();
 
+    // Return all blocks of a ticket, including the ones it continued in.
     void
     ReturnTicket(MemoryPoolTicket *ticket);
 
+    // @return the block or -1 if the pool has no free blocks.
     std::size_t
     AllocateBlock();
 
+    // Take a whole block for a buffer that is returned as a block rather
+    // than through a ticket.
+    // @return the block or nullptr if the pool has no free blocks.
+    char*
+    TakeBlock();
+
+    void
+    ReturnBlock(char* block);
+
+    std::size_t
+    BlockSize() const;
+
+    std::size_t
+    FreeBlocks() const;
+
     void
     Reset();
 
@@ -0,0 +1,16 @@
+#include "number_format.h"
+#include <charconv>
+#include <cmath>
+
+namespace flashpoint::lib {
+
+std::size_t format_double(double value, char* text) {
+    if (!std::isfinite(value)) {
+        std::memcpy(text, "null", 4);
+        return 4;
+    }
+    auto result = std::to_chars(text, text + max_double_size, value);
+    return result.ptr - text;
+}
+
+}
@@ -0,0 +1,95 @@
+#ifndef FLASHPOINT_NUMBER_FORMAT_H
+#define FLASHPOINT_NUMBER_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace flashpoint::lib {
+
+// The largest number of bytes the formatters write.
+const std::size_t max_u64_size = 20;
+const std::size_t max_i64_size = 20;
+const std::size_t max_double_size = 24;
+
+constexpr char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+constexpr std::uint64_t powers_of_10[20] = {
+    0,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+// Count the decimal digits of a value without a loop. The bit length gives an
+// estimate of log10 that is at most one too large.
+inline std::size_t count_digits(std::uint64_t value) {
+    std::size_t estimate = ((64 - __builtin_clzll(value | 1)) * 1233) >> 12;
+    return estimate + 1 - (value < powers_of_10[estimate]);
+}
+
+// Write the decimal digits of a value, two digits per division.
+// @param value the value.
+// @param text a buffer of at least max_u64_size bytes.
+// @return the number of bytes written.
+inline std::size_t format_u64(std::uint64_t value, char* text) {
+    std::size_t size = count_digits(value);
+    char* end = text + size;
+    while (value >= 100) {
+        std::size_t pair = (value % 100) * 2;
+        value /= 100;
+        end -= 2;
+        std::memcpy(end, digit_pairs + pair, 2);
+    }
+    if (value >= 10) {
+        std::memcpy(end - 2, digit_pairs + value * 2, 2);
+    }
+    else {
+        end[-1] = static_cast<char>('0' + value);
+    }
+    return size;
+}
+
+// @param text a buffer of at least max_i64_size bytes.
+inline std::size_t format_i64(std::int64_t value, char* text) {
+    if (value >= 0) {
+        return format_u64(static_cast<std::uint64_t>(value), text);
+    }
+    text[0] = '-';
+    return format_u64(~static_cast<std::uint64_t>(value) + 1, text + 1) + 1;
+}
+
+// Write the shortest representation of a double that reads back as the same
+// value. JSON has no NaN or Infinity, so they are written as null.
+// @param text a buffer of at least max_double_size bytes.
+std::size_t format_double(double value, char* text);
+
+}
+
+#endif //FLASHPOINT_NUMBER_FORMAT_H
@@ -0,0 +1,177 @@
+#include <program/dns_cache.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+
+namespace flashpoint {
+
+DnsCache::DnsCache(uv_loop_t* loop, const DnsCacheOptions& options):
+    loop_(loop),
+    options_(options),
+    stats_() {
+    uv_timer_init(loop, &timer_);
+    timer_.data = this;
+}
+
+void DnsCache::Start() {
+    uv_timer_start(&timer_, OnTick, options_.refresh_interval, options_.refresh_interval);
+    uv_unref((uv_handle_t*)&timer_);
+}
+
+void DnsCache::Stop() {
+    uv_timer_stop(&timer_);
+}
+
+const DnsCacheStats& DnsCache::Stats() const {
+    return stats_;
+}
+
+DnsEntry* DnsCache::GetEntry(const char* hostname) {
+    auto entry_it = entries_.find(hostname);
+    if (entry_it != entries_.end()) {
+        return entry_it->second;
+    }
+    auto entry = new DnsEntry {};
+    entry->cache = this;
+    entry->hostname = hostname;
+    entry->getaddrinfo_request.data = entry;
+    entries_.emplace(entry->hostname, entry);
+    return entry;
+}
+
+bool DnsCache::IsUsable(const DnsEntry* entry, std::uint64_t now) const {
+    return !entry->addresses.empty() && now < entry->expires_at + options_.max_stale_time;
+}
+
+void DnsCache::Resolve(const char* hostname, unsigned int port, DnsResolveCallback callback, void* data) {
+    std::uint64_t now = uv_now(loop_);
+    auto entry = GetEntry(hostname);
+    entry->last_used = now;
+    if (IsUsable(entry, now)) {
+        if (now < entry->expires_at) {
+            stats_.hits++;
+        }
+        else {
+            stats_.stale_hits++;
+        }
+        if (now >= entry->refresh_at && !entry->resolving) {
+            StartResolve(entry);
+        }
+        Answer(entry, port, callback, data);
+        return;
+    }
+    stats_.misses++;
+    entry->waiters.push_back({ port, callback, data });
+    if (!entry->resolving) {
+        StartResolve(entry);
+    }
+}
+
+void DnsCache::Prefetch(const char* hostname) {
+    auto entry = GetEntry(hostname);
+    entry->last_used = uv_now(loop_);
+    if (entry->addresses.empty() && !entry->resolving) {
+        StartResolve(entry);
+    }
+}
+
+void DnsCache::Set(const char* hostname, const std::vector<sockaddr_storage>& addresses) {
+    std::uint64_t now = uv_now(loop_);
+    auto entry = GetEntry(hostname);
+    entry->addresses = addresses;
+    entry->last_used = now;
+    entry->expires_at = now + options_.ttl;
+    entry->refresh_at = entry->expires_at - options_.refresh_ahead_time;
+}
+
+void DnsCache::StartResolve(DnsEntry* entry) {
+    addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    entry->resolving = true;
+    stats_.resolutions++;
+    int r = uv_getaddrinfo(loop_, &entry->getaddrinfo_request, OnResolved, entry->hostname.c_str(), nullptr, &hints);
+    if (r) {
+        OnResolved(&entry->getaddrinfo_request, r, nullptr);
+    }
+}
+
+void DnsCache::Answer(DnsEntry* entry, unsigned int port, DnsResolveCallback callback, void* data) {
+    std::vector<sockaddr_storage> addresses = entry->addresses;
+    for (auto& address : addresses) {
+        if (address.ss_family == AF_INET6) {
+            reinterpret_cast<sockaddr_in6*>(&address)->sin6_port = htons(static_cast<uint16_t>(port));
+        }
+        else {
+            reinterpret_cast<sockaddr_in*>(&address)->sin_port = htons(static_cast<uint16_t>(port));
+        }
+    }
+    callback(addresses, 0, data);
+}
+
+void DnsCache::OnResolved(uv_getaddrinfo_t* request, int status, struct addrinfo* result) {
+    auto entry = static_cast<DnsEntry*>(request->data);
+    auto cache = entry->cache;
+    std::uint64_t now = uv_now(cache->loop_);
+    entry->resolving = false;
+    if (status == 0) {
+        entry->addresses.clear();
+        for (addrinfo* info = result; info != nullptr; info = info->ai_next) {
+            if (info->ai_family != AF_INET && info->ai_family != AF_INET6) {
+                continue;
+            }
+            sockaddr_storage address {};
+            std::memcpy(&address, info->ai_addr, info->ai_addrlen);
+            entry->addresses.push_back(address);
+        }
+        uv_freeaddrinfo(result);
+        entry->expires_at = now + cache->options_.ttl;
+        entry->refresh_at = entry->expires_at - cache->options_.refresh_ahead_time;
+    }
+    else {
+        // The stale addresses, if any, are used until max_stale_time.
+        cache->stats_.failures++;
+        entry->refresh_at = now + cache->options_.retry_interval;
+    }
+
+    std::vector<DnsWaiter> waiters;
+    waiters.swap(entry->waiters);
+    bool usable = cache->IsUsable(entry, now);
+    for (const auto& waiter : waiters) {
+        if (usable) {
+            Answer(entry, waiter.port, waiter.callback, waiter.data);
+        }
+        else {
+            waiter.callback({}, status == 0 ? UV_EAI_NONAME : status, waiter.data);
+        }
+    }
+}
+
+// Resolve the entries that are about to expire, or that failed, again, and
+// remove the entries that are no longer used.
+void DnsCache::Refresh() {
+    std::uint64_t now = uv_now(loop_);
+    for (auto entry_it = entries_.begin(); entry_it != entries_.end();) {
+        auto entry = entry_it->second;
+        if (entry->resolving) {
+            entry_it++;
+            continue;
+        }
+        if (now - entry->last_used >= options_.max_unused_time) {
+            delete entry;
+            entry_it = entries_.erase(entry_it);
+            continue;
+        }
+        if (now >= entry->refresh_at) {
+            StartResolve(entry);
+        }
+        entry_it++;
+    }
+}
+
+void DnsCache::OnTick(uv_timer_t* timer) {
+    static_cast<DnsCache*>(timer->data)->Refresh();
+}
+
+}
@@ -0,0 +1,130 @@
+#ifndef FLASHPOINT_DNS_CACHE_H
+#define FLASHPOINT_DNS_CACHE_H
+
+#include <uv.h>
+#include <sys/socket.h>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace flashpoint {
+
+class DnsCache;
+
+// Called with the addresses, with the requested port and in the order that
+// getaddrinfo sorted them, and status 0, or with no addresses and a libuv
+// error. It is called before Resolve returns when the hostname is cached.
+typedef void (*DnsResolveCallback)(const std::vector<sockaddr_storage>& addresses, int status, void* data);
+
+struct DnsWaiter {
+    unsigned int port;
+    DnsResolveCallback callback;
+    void* data;
+};
+
+struct DnsEntry {
+    DnsCache* cache;
+    std::string hostname;
+
+    // The IPv4 and IPv6 addresses of the hostname, in the order that
+    // getaddrinfo sorted them, i.e. the preferred family first.
+    std::vector<sockaddr_storage> addresses;
+
+    // uv_now when the addresses expire and when they are resolved again.
+    std::uint64_t expires_at;
+    std::uint64_t refresh_at;
+
+    // uv_now of the last lookup, entries that are not used aren't refreshed.
+    std::uint64_t last_used;
+
+    bool resolving;
+    uv_getaddrinfo_t getaddrinfo_request;
+
+    // Lookups that wait for the first resolution of the hostname.
+    std::vector<DnsWaiter> waiters;
+};
+
+struct DnsCacheOptions {
+    // Milliseconds that resolved addresses are used. getaddrinfo doesn't tell
+    // the record's TTL, so it is the same for all hostnames.
+    std::uint64_t ttl;
+
+    // Addresses are resolved again this many milliseconds before they expire.
+    std::uint64_t refresh_ahead_time;
+
+    // Milliseconds after expiry that addresses are still used, when the
+    // resolver fails or hasn't answered yet.
+    std::uint64_t max_stale_time;
+
+    // Milliseconds between the retries of a failed refresh.
+    std::uint64_t retry_interval;
+
+    // Entries that aren't looked up for this many milliseconds are removed.
+    std::uint64_t max_unused_time;
+
+    // Milliseconds between the checks for entries to refresh.
+    std::uint64_t refresh_interval;
+};
+
+const DnsCacheOptions default_dns_cache_options = { 60000, 10000, 300000, 5000, 600000, 1000 };
+
+struct DnsCacheStats {
+    std::size_t hits;
+    std::size_t stale_hits;
+    std::size_t misses;
+    std::size_t resolutions;
+    std::size_t failures;
+};
+
+// Resolved addresses of the backend hostnames of a loop. A hostname is only
+// resolved on the request path the first time it is looked up, after that its
+// addresses are refreshed by a timer before they expire, and stale addresses
+// are used while the resolver fails.
+class DnsCache {
+public:
+    DnsCache(uv_loop_t* loop, const DnsCacheOptions& options = default_dns_cache_options);
+
+    // Start the refresh timer. The timer doesn't keep the loop alive.
+    void Start();
+
+    void Stop();
+
+    // Get the addresses of a hostname.
+    // @param hostname the hostname.
+    // @param port the port of the addresses.
+    // @param callback called with the addresses.
+    // @param data passed to the callback.
+    void Resolve(const char* hostname, unsigned int port, DnsResolveCallback callback, void* data);
+
+    // Resolve a hostname ahead of its first lookup.
+    void Prefetch(const char* hostname);
+
+    // Set the addresses of a hostname as if the resolver had just answered
+    // with them, e.g. to test the fallback between the addresses of a
+    // hostname. They expire and are refreshed like resolved addresses.
+    void Set(const char* hostname, const std::vector<sockaddr_storage>& addresses);
+
+    const DnsCacheStats& Stats() const;
+
+private:
+    uv_loop_t* loop_;
+    DnsCacheOptions options_;
+    DnsCacheStats stats_;
+    uv_timer_t timer_;
+    std::map<std::string, DnsEntry*> entries_;
+
+    DnsEntry* GetEntry(const char* hostname);
+    bool IsUsable(const DnsEntry* entry, std::uint64_t now) const;
+    void StartResolve(DnsEntry* entry);
+    void Refresh();
+
+    static void Answer(DnsEntry* entry, unsigned int port, DnsResolveCallback callback, void* data);
+    static void OnResolved(uv_getaddrinfo_t* request, int status, struct addrinfo* result);
+    static void OnTick(uv_timer_t* timer);
+};
+
+}
+
+#endif //FLASHPOINT_DNS_CACHE_H
@@ -246,6 +246,7 @@ SelectionSet* GraphQlExecutor::parse_selection_set_after_open_brace()
                     }
                     auto inline_fragment = CreateSyntax<InlineFragment>(SyntaxKind::S_InlineFragment);
                     inline_fragment->start = start_position;
+                    inline_fragment->type_condition = name;
                     const auto& object = static_cast<Object*>(it->second->declaration);
                     if (object->kind != SyntaxKind::S_Object) {
                         add_diagnostic(D::The_type_0_is_not_an_object, token_value);
@@ -275,7 +276,20 @@ SelectionSet* GraphQlExecutor::parse_selection_set_after_open_brace()
             }
 
             case GraphQlToken::G_Name: {
-                auto token_value = get_token_value();
+                // An aliased field is looked up by the name after its alias.
+                auto alias = CreateSyntax<Name>(SyntaxKind::S_Name, get_token_value());
+                Name* name = alias;
+                if (scan_optional(GraphQlToken::Colon)) {
+                    name = parse_expected_name();
+                    if (name == nullptr) {
+                        skip_to_next_primary_token();
+                        return nullptr;
+                    }
+                }
+                else {
+                    alias = nullptr;
+                }
+                auto token_value = name->identifier;
                 auto current_object_type = current_object_types.top();
                 auto fields = current_object_type->fields;
                 auto field_definition_it = fields->find(token_value);
@@ -289,14 +303,9 @@ SelectionSet* GraphQlExecutor::parse_selection_set_after_open_brace()
                     continue;
                 }
                 auto field = CreateSyntax<Field>(SyntaxKind::S_Field);
-                auto name = CreateSyntax<Name>(SyntaxKind::S_Name, token_value);
-                if (scan_optional(GraphQlToken::Colon)) {
-                    field->alias = name;
-                    field->name = parse_expected_name();
-                }
-                else {
-                    field->name = name;
-                }
+                field->definition = field_definition_it->second;
+                field->alias = alias;
+                field->name = name;
                 if (scan_optional(GraphQlToken::OpenParen)) {
                     field->arguments = parse_arguments(field_definition_it->second->arguments, field);
                 }
@@ -469,7 +478,7 @@ GraphQlExecutor::parse_value(Type* type)
                     get_type_name(type)
                 );
             }
-            const auto list_value = CreateSyntax<ListValue>(SyntaxKind::S_ObjectValue);
+            const auto list_value = CreateSyntax<ListValue>(SyntaxKind::S_ListValue);
             type->is_list_type = false;
             Value* value = parse_value(type);
             while (value != nullptr) {
@@ -751,6 +760,7 @@ Type*
 GraphQlExecutor::parse_type()
 {
     TypeEnum type;
+    Name* name = nullptr;
     bool is_list_type = scan_optional(GraphQlToken::OpenBracket);
     bool is_non_null_list = false;
     switch (TakeNextToken()) {
@@ -771,13 +781,16 @@ GraphQlExecutor::parse_type()
             break;
         default:
             type = TypeEnum::T_Object;
+            name = CreateSyntax<Name>(SyntaxKind::S_Name, get_token_value());
     }
     bool is_non_null = scan_optional(GraphQlToken::Exclamation);
     if (is_list_type) {
         scan_expected(GraphQlToken::CloseBracket);
         is_non_null_list = scan_optional(GraphQlToken::Exclamation);
     }
-    return CreateSyntax<Type>(SyntaxKind::S_Type, type, is_non_null, is_list_type, is_non_null_list, false);
+    auto type_syntax = CreateSyntax<Type>(SyntaxKind::S_Type, type, is_non_null, is_list_type, is_non_null_list, false);
+    type_syntax->name = name;
+    return type_syntax;
 }
 
 inline
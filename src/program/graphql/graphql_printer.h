@@ -0,0 +1,412 @@
+#ifndef FLASHPOINT_GRAPHQL_PRINTER_H
+#define FLASHPOINT_GRAPHQL_PRINTER_H
+
+#include <program/graphql/graphql_syntaxes.h>
+#include <lib/number_format.h>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace flashpoint::program::graphql {
+
+enum class FragmentPrintMode {
+    // Fragment spreads are printed as inline fragments with the fragment's selections.
+    Inline,
+
+    // Fragment spreads are kept and the fragments they use are printed after the operation.
+    Hoist,
+};
+
+// Counts the size of printed text, e.g. for a Content-Length that is written
+// before the text itself.
+class SizeCounter {
+public:
+    void Write(const char* text, std::size_t size) {
+        size_ += size;
+    }
+
+    std::size_t Size() const {
+        return size_;
+    }
+
+private:
+    std::size_t size_ = 0;
+};
+
+// Collects printed text in a string, e.g. for a key that identifies it.
+class StringWriter {
+public:
+    void Write(const char* text, std::size_t size) {
+        text_.append(text, size);
+    }
+
+    std::string& Text() {
+        return text_;
+    }
+
+private:
+    std::string text_;
+};
+
+// Prints minified GraphQL as the content of a JSON string, i.e. string values
+// are escaped for GraphQL and then for JSON. The writer only needs a
+// Write(const char*, std::size_t), so that the text is printed straight into
+// e.g. an HttpWriter, without building a string first.
+template<typename Writer>
+class GraphQlPrinter {
+public:
+    GraphQlPrinter(Writer& writer, const std::vector<FragmentDefinition*>* fragments, FragmentPrintMode mode):
+        writer_(writer),
+        fragments_(fragments),
+        mode_(mode) { }
+
+    void Write(std::string_view text) {
+        writer_.Write(text.data(), text.size());
+    }
+
+    // Print the operation type, name, variable definitions and directives. An
+    // anonymous query without them is printed in its shorthand form, i.e. as
+    // nothing.
+    void PrintOperationHead(const OperationDefinition* operation) {
+        bool has_variables = operation->variable_definitions != nullptr && !operation->variable_definitions->variable_definitions.empty();
+        if (operation->operation_type == OperationType::Query && operation->name == nullptr && !has_variables && operation->directives.empty()) {
+            return;
+        }
+        switch (operation->operation_type) {
+            case OperationType::Query:
+                Write("query");
+                break;
+            case OperationType::Mutation:
+                Write("mutation");
+                break;
+            case OperationType::Subscription:
+                Write("subscription");
+                break;
+        }
+        if (operation->name != nullptr) {
+            Write(" ");
+            Write(operation->name->identifier.raw());
+        }
+        if (has_variables) {
+            Write("(");
+            bool first = true;
+            for (const auto& variable_definition : operation->variable_definitions->variable_definitions) {
+                if (!first) {
+                    Write(",");
+                }
+                first = false;
+                Write("$");
+                Write(variable_definition->name->identifier.raw());
+                Write(":");
+                PrintType(variable_definition->type);
+                if (variable_definition->default_value != nullptr) {
+                    Write("=");
+                    PrintValue(static_cast<const Value*>(variable_definition->default_value));
+                }
+            }
+            Write(")");
+        }
+        PrintDirectives(operation->directives);
+    }
+
+    // Print the selections of one response key. Their selection sets are
+    // printed as one, the arguments and directives are the first field's.
+    // @param fields the fields, with the same name and arguments.
+    // @param alias the response key.
+    void PrintMergedField(const std::vector<Field*>& fields, std::string_view alias) {
+        const Field* field = fields.front();
+        PrintFieldHead(field, alias);
+        bool has_selection_set = false;
+        for (const auto& merged_field : fields) {
+            has_selection_set = has_selection_set || merged_field->selection_set != nullptr;
+        }
+        if (!has_selection_set) {
+            return;
+        }
+        Write("{");
+        bool first = true;
+        for (const auto& merged_field : fields) {
+            if (merged_field->selection_set != nullptr) {
+                PrintSelections(merged_field->selection_set, first);
+            }
+        }
+        Write("}");
+    }
+
+    void PrintSelectionSet(const SelectionSet* selection_set) {
+        Write("{");
+        bool first = true;
+        PrintSelections(selection_set, first);
+        Write("}");
+    }
+
+    // Print the fragments that the printed selections have spread, and the
+    // fragments they spread in turn. Only needed with FragmentPrintMode::Hoist.
+    void PrintFragments() {
+        for (std::size_t i = 0; i < used_fragments_.size(); i++) {
+            const FragmentDefinition* fragment = used_fragments_[i];
+            Write("fragment ");
+            Write(fragment->name->identifier.raw());
+            Write(" on ");
+            Write(fragment->type->identifier.raw());
+            PrintDirectives(fragment->directives);
+            PrintSelectionSet(fragment->selection_set);
+        }
+    }
+
+private:
+    Writer& writer_;
+    const std::vector<FragmentDefinition*>* fragments_;
+    FragmentPrintMode mode_;
+    std::vector<const FragmentDefinition*> used_fragments_;
+    std::vector<const FragmentDefinition*> inlining_fragments_;
+
+    void PrintSelections(const SelectionSet* selection_set, bool& first) {
+        for (const auto& selection : selection_set->selections) {
+            if (!first) {
+                Write(" ");
+            }
+            first = false;
+            switch (selection->kind) {
+                case SyntaxKind::S_Field: {
+                    auto field = static_cast<const Field*>(selection);
+                    PrintFieldHead(field, field->alias != nullptr ? std::string_view(field->alias->identifier.raw()) : std::string_view());
+                    if (field->selection_set != nullptr) {
+                        PrintSelectionSet(field->selection_set);
+                    }
+                    break;
+                }
+                case SyntaxKind::S_InlineFragment: {
+                    auto inline_fragment = static_cast<const InlineFragment*>(selection);
+                    Write("...");
+                    if (inline_fragment->type_condition != nullptr) {
+                        Write("on ");
+                        Write(inline_fragment->type_condition->identifier.raw());
+                    }
+                    PrintDirectives(inline_fragment->directives);
+                    PrintSelectionSet(inline_fragment->selection_set);
+                    break;
+                }
+                case SyntaxKind::S_FragmentSpread:
+                    PrintFragmentSpread(static_cast<const FragmentSpread*>(selection));
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    void PrintFragmentSpread(const FragmentSpread* fragment_spread) {
+        const FragmentDefinition* fragment = FindFragment(fragment_spread->name->identifier);
+        if (mode_ == FragmentPrintMode::Hoist || fragment == nullptr) {
+            Write("...");
+            Write(fragment_spread->name->identifier.raw());
+            PrintDirectives(fragment_spread->directives);
+            if (fragment != nullptr && !Contains(used_fragments_, fragment)) {
+                used_fragments_.push_back(fragment);
+            }
+            return;
+        }
+
+        // A fragment cycle is invalid, it is inlined only once rather than
+        // without end.
+        if (Contains(inlining_fragments_, fragment)) {
+            return;
+        }
+        inlining_fragments_.push_back(fragment);
+        Write("...on ");
+        Write(fragment->type->identifier.raw());
+        PrintDirectives(fragment_spread->directives);
+        PrintSelectionSet(fragment->selection_set);
+        inlining_fragments_.pop_back();
+    }
+
+    const FragmentDefinition* FindFragment(const Glib::ustring& name) const {
+        if (fragments_ == nullptr) {
+            return nullptr;
+        }
+        for (const auto& fragment : *fragments_) {
+            if (fragment->name->identifier == name) {
+                return fragment;
+            }
+        }
+        return nullptr;
+    }
+
+    static bool Contains(const std::vector<const FragmentDefinition*>& fragments, const FragmentDefinition* fragment) {
+        for (const auto& other : fragments) {
+            if (other == fragment) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void PrintFieldHead(const Field* field, std::string_view alias) {
+        const std::string& name = field->name->identifier.raw();
+        if (!alias.empty() && alias != name) {
+            Write(alias);
+            Write(":");
+        }
+        Write(name);
+        if (field->arguments != nullptr) {
+            PrintArguments(*field->arguments);
+        }
+        PrintDirectives(field->directives);
+    }
+
+    void PrintArguments(const std::map<Glib::ustring, Argument*>& arguments) {
+        if (arguments.empty()) {
+            return;
+        }
+        Write("(");
+        bool first = true;
+        for (const auto& argument : arguments) {
+            if (!first) {
+                Write(",");
+            }
+            first = false;
+            Write(argument.second->name->identifier.raw());
+            Write(":");
+            PrintValue(argument.second->value);
+        }
+        Write(")");
+    }
+
+    void PrintDirectives(const std::map<Glib::ustring, Directive*>& directives) {
+        for (const auto& directive : directives) {
+            Write("@");
+            Write(directive.second->name->identifier.raw());
+            if (directive.second->arguments != nullptr) {
+                PrintArguments(*directive.second->arguments);
+            }
+        }
+    }
+
+    void PrintType(const Type* type) {
+        if (type->is_list_type) {
+            Write("[");
+        }
+        switch (type->type) {
+            case TypeEnum::T_Boolean:
+                Write("Boolean");
+                break;
+            case TypeEnum::T_Int:
+                Write("Int");
+                break;
+            case TypeEnum::T_Float:
+                Write("Float");
+                break;
+            case TypeEnum::T_String:
+                Write("String");
+                break;
+            case TypeEnum::T_ID:
+                Write("ID");
+                break;
+            default:
+                if (type->name != nullptr) {
+                    Write(type->name->identifier.raw());
+                }
+        }
+        if (type->is_non_null) {
+            Write("!");
+        }
+        if (type->is_list_type) {
+            Write("]");
+        }
+        if (type->is_non_null_list) {
+            Write("!");
+        }
+    }
+
+    void PrintValue(const Value* value) {
+        if (value == nullptr) {
+            Write("null");
+            return;
+        }
+        char number[max_double_size];
+        switch (value->kind) {
+            case SyntaxKind::S_NullValue:
+                Write("null");
+                break;
+            case SyntaxKind::S_BooleanValue:
+                Write(static_cast<const BooleanValue*>(value)->value ? "true" : "false");
+                break;
+            case SyntaxKind::S_IntValue:
+                writer_.Write(number, format_i64(static_cast<const IntValue*>(value)->value, number));
+                break;
+            case SyntaxKind::S_FloatValue:
+                writer_.Write(number, format_double(static_cast<const FloatValue*>(value)->value, number));
+                break;
+            case SyntaxKind::S_EnumValue:
+                Write(static_cast<const EnumValue*>(value)->value.raw());
+                break;
+            case SyntaxKind::S_StringValue:
+                PrintString(static_cast<const StringValue*>(value)->value.raw());
+                break;
+            case SyntaxKind::S_ListValue: {
+                Write("[");
+                bool first = true;
+                for (const auto& item : static_cast<const ListValue*>(value)->values) {
+                    if (!first) {
+                        Write(",");
+                    }
+                    first = false;
+                    PrintValue(item);
+                }
+                Write("]");
+                break;
+            }
+            case SyntaxKind::S_ObjectValue: {
+                Write("{");
+                bool first = true;
+                for (const auto& object_field : static_cast<const ObjectValue*>(value)->object_fields) {
+                    if (!first) {
+                        Write(",");
+                    }
+                    first = false;
+                    Write(object_field->name->identifier.raw());
+                    Write(":");
+                    PrintValue(object_field->value);
+                }
+                Write("}");
+                break;
+            }
+            default:
+                Write("null");
+        }
+    }
+
+    // A GraphQL string inside a JSON string. A string value is its GraphQL
+    // token, with its quotes and escapes, which are escaped for JSON, e.g.
+    // "a\"b" becomes \"a\\\"b\" and a line feed of a block string becomes
+    // \u000a.
+    void PrintString(std::string_view text) {
+        static const char hex_digits[] = "0123456789abcdef";
+        std::size_t start = 0;
+        for (std::size_t i = 0; i < text.size(); i++) {
+            unsigned char ch = static_cast<unsigned char>(text[i]);
+            if (ch != '"' && ch != '\\' && ch >= 0x20) {
+                continue;
+            }
+            writer_.Write(text.data() + start, i - start);
+            start = i + 1;
+            if (ch == '"') {
+                Write("\\\"");
+            }
+            else if (ch == '\\') {
+                Write("\\\\");
+            }
+            else {
+                char escape[] = { '\\', 'u', '0', '0', hex_digits[ch >> 4], hex_digits[ch & 0xf] };
+                writer_.Write(escape, sizeof(escape));
+            }
+        }
+        writer_.Write(text.data() + start, text.size() - start);
+    }
+};
+
+}
+
+#endif //FLASHPOINT_GRAPHQL_PRINTER_H
@@ -214,7 +214,7 @@ GraphQlScanner::scan_digit_list()
 
 bool GraphQlScanner::is_digit(char32_t ch)
 {
-    return ch >= Character::_0 && ch <= Character::_9;
+    return is_character_class(ch, CharacterClass::Digit);
 }
 
 void GraphQlScanner::skip_block()
@@ -793,9 +793,7 @@ GraphQlScanner::scan_hexadecimal_escape(const std::size_t& start_position, const
 
 bool
 GraphQlScanner::is_hexadecimal(char32_t ch) {
-    return (ch >= Character::_0 && ch <= Character::_9) ||
-        (ch >= Character::a && ch <= Character::f) ||
-        (ch >= Character::A && ch <= Character::F);
+    return is_character_class(ch, CharacterClass::HexDigit);
 }
 
 GraphQlToken
@@ -817,25 +815,20 @@ GraphQlScanner::scan_ellipses_after_first_dot()
 bool
 GraphQlScanner::is_number(const char32_t &ch) const
 {
-    return ch >= _0 && ch <= _9;
+    return is_character_class(ch, CharacterClass::Digit);
 }
 
 bool
 GraphQlScanner::is_name_start(const char32_t &ch) const
 {
-    return (ch >= A && ch <= Z) ||
-           (ch >= a && ch <= z) ||
-           ch == _;
+    return is_character_class(ch, CharacterClass::NameStart);
 }
 
 
 bool
 GraphQlScanner::is_name_part(const char32_t &ch) const
 {
-    return (ch >= a && ch <= z) ||
-           (ch >= A && ch <= Z) ||
-           (ch >= _0 && ch <= _9) ||
-           ch == _;
+    return is_character_class(ch, CharacterClass::NamePart);
 }
 
 void
@@ -939,7 +932,7 @@ inline
 bool
 GraphQlScanner::is_line_break(const char32_t& ch) const
 {
-    return ch == NewLine || ch == CarriageReturn;
+    return is_character_class(ch, CharacterClass::LineBreak);
 }
 
 
@@ -136,7 +136,7 @@ namespace flashpoint::program::graphql {
 
     struct InputValueDefinition : Declaration {
         Type* type;
-        Syntax* default_value;
+        Syntax* default_value = nullptr;
         std::map<Glib::ustring, Directive*> directives;
 
         D(InputValueDefinition, Declaration)
@@ -508,7 +508,7 @@ namespace flashpoint::program::graphql {
     struct VariableDefinition : Syntax {
         Name* name;
         Type* type;
-        Syntax* default_value;
+        Syntax* default_value = nullptr;
 
         S(VariableDefinition)
         { }new_operator(VariableDefinition)
@@ -553,7 +553,7 @@ namespace flashpoint::program::graphql {
 
     struct Directive : Syntax {
         Name* name;
-        std::map<Glib::ustring, Argument*>* arguments;
+        std::map<Glib::ustring, Argument*>* arguments = nullptr;
         DirectiveDefinition* parent_directive_definition;
         DirectiveLocation location;
 
@@ -577,17 +577,18 @@ namespace flashpoint::program::graphql {
     };
 
     struct Selection : Syntax {
-        SelectionSet* selection_set;
+        SelectionSet* selection_set = nullptr;
 
         S(Selection)
         { }
     };
 
     struct Field : Selection {
-        Name* alias;
+        Name* alias = nullptr;
         Name* name;
-        std::map<Glib::ustring, Argument*>* arguments;
+        std::map<Glib::ustring, Argument*>* arguments = nullptr;
         std::map<Glib::ustring, Directive*> directives;
+        FieldDefinition* definition = nullptr;
 
         D(Field, Selection)
         { }
@@ -610,6 +611,7 @@ namespace flashpoint::program::graphql {
     };
 
     struct InlineFragment : Selection {
+        Name* type_condition = nullptr;
         std::map<Glib::ustring, Directive*> directives;
         D(InlineFragment, Selection)
         { }
@@ -652,8 +654,8 @@ namespace flashpoint::program::graphql {
 
     struct OperationDefinition : Syntax {
         OperationType operation_type;
-        Name* name;
-        VariableDefinitions* variable_definitions;
+        Name* name = nullptr;
+        VariableDefinitions* variable_definitions = nullptr;
         SelectionSet* selection_set;
         std::map<Glib::ustring, Directive*> directives;
 
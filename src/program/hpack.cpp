@@ -0,0 +1,483 @@
+#include <program/hpack.h>
+#include <algorithm>
+
+namespace flashpoint {
+
+// The static table, RFC 7541 Appendix A.
+const HpackHeaderView hpack_static_table[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// The Huffman code of every octet, RFC 7541 Appendix B, without EOS.
+const std::uint32_t hpack_huffman_codes[] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+const std::uint8_t hpack_huffman_code_sizes[] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+const std::size_t hpack_static_table_size = sizeof(hpack_static_table) / sizeof(hpack_static_table[0]);
+
+const std::uint32_t hpack_huffman_eos_code = 0x3fffffff;
+const std::uint8_t hpack_huffman_eos_size = 30;
+
+// The overhead of an entry of a dynamic table, besides its name and value.
+const std::size_t hpack_entry_overhead = 32;
+
+HpackTable::HpackTable(std::size_t max_size):
+    size_(0),
+    max_size_(max_size) { }
+
+void HpackTable::SetMaxSize(std::size_t max_size) {
+    max_size_ = max_size;
+    Evict(max_size);
+}
+
+std::size_t HpackTable::MaxSize() const {
+    return max_size_;
+}
+
+void HpackTable::Add(std::string_view name, std::string_view value) {
+    std::size_t entry_size = name.size() + value.size() + hpack_entry_overhead;
+    if (entry_size > max_size_) {
+        entries_.clear();
+        size_ = 0;
+        return;
+    }
+
+    // The name can be of an entry that is evicted, so it is copied first.
+    HpackHeader entry { std::string(name), std::string(value) };
+    Evict(max_size_ - entry_size);
+    entries_.push_front(std::move(entry));
+    size_ += entry_size;
+}
+
+bool HpackTable::Get(std::size_t index, HpackHeaderView& header) const {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= hpack_static_table_size) {
+        header = hpack_static_table[index - 1];
+        return true;
+    }
+    index -= hpack_static_table_size + 1;
+    if (index >= entries_.size()) {
+        return false;
+    }
+    header = HpackHeaderView { entries_[index].name, entries_[index].value };
+    return true;
+}
+
+std::size_t HpackTable::Find(std::string_view name, std::string_view value, bool& has_value) const {
+    std::size_t name_index = 0;
+    has_value = false;
+    for (std::size_t i = 0; i < hpack_static_table_size; i++) {
+        if (hpack_static_table[i].name != name) {
+            continue;
+        }
+        if (hpack_static_table[i].value == value) {
+            has_value = true;
+            return i + 1;
+        }
+        if (name_index == 0) {
+            name_index = i + 1;
+        }
+    }
+    for (std::size_t i = 0; i < entries_.size(); i++) {
+        if (entries_[i].name != name) {
+            continue;
+        }
+        if (entries_[i].value == value) {
+            has_value = true;
+            return hpack_static_table_size + 1 + i;
+        }
+        if (name_index == 0) {
+            name_index = hpack_static_table_size + 1 + i;
+        }
+    }
+    return name_index;
+}
+
+void HpackTable::Evict(std::size_t max_size) {
+    while (size_ > max_size) {
+        const HpackHeader& entry = entries_.back();
+        size_ -= entry.name.size() + entry.value.size() + hpack_entry_overhead;
+        entries_.pop_back();
+    }
+}
+
+// Encode an integer with an N-bit prefix, see
+// https://tools.ietf.org/html/rfc7541#section-5.1.
+// @param flags the bits of the first octet above the prefix.
+void EncodeHpackInteger(std::string& block, std::uint8_t flags, unsigned int prefix_size, std::size_t value) {
+    std::size_t max_prefix = (1u << prefix_size) - 1;
+    if (value < max_prefix) {
+        block.push_back(static_cast<char>(flags | value));
+        return;
+    }
+    block.push_back(static_cast<char>(flags | max_prefix));
+    value -= max_prefix;
+    while (value >= 128) {
+        block.push_back(static_cast<char>(value % 128 + 128));
+        value /= 128;
+    }
+    block.push_back(static_cast<char>(value));
+}
+
+// Huffman code a string when it is shorter.
+void EncodeHpackString(std::string& block, std::string_view text) {
+    std::size_t huffman_size = GetHuffmanSize(text);
+    if (huffman_size < text.size()) {
+        EncodeHpackInteger(block, 0x80, 7, huffman_size);
+        EncodeHuffman(text, block);
+        return;
+    }
+    EncodeHpackInteger(block, 0, 7, text.size());
+    block.append(text.data(), text.size());
+}
+
+HpackEncoder::HpackEncoder():
+    table_(default_hpack_table_size),
+    has_size_update_(false),
+    min_size_update_(0) { }
+
+void HpackEncoder::SetMaxTableSize(std::size_t max_size) {
+    max_size = std::min(max_size, default_hpack_table_size);
+    if (max_size == table_.MaxSize() && !has_size_update_) {
+        return;
+    }
+    min_size_update_ = has_size_update_ ? std::min(min_size_update_, max_size) : max_size;
+    has_size_update_ = true;
+    table_.SetMaxSize(max_size);
+}
+
+void HpackEncoder::Encode(std::string_view name, std::string_view value, HpackIndexing indexing, std::string& block) {
+    if (has_size_update_) {
+        // The smallest size since the last block is signaled too, see
+        // https://tools.ietf.org/html/rfc7541#section-4.2.
+        if (min_size_update_ < table_.MaxSize()) {
+            EncodeHpackInteger(block, 0x20, 5, min_size_update_);
+        }
+        EncodeHpackInteger(block, 0x20, 5, table_.MaxSize());
+        has_size_update_ = false;
+    }
+    bool has_value;
+    std::size_t index = table_.Find(name, value, has_value);
+    if (has_value && indexing != HpackIndexing::Never) {
+        EncodeHpackInteger(block, 0x80, 7, index);
+        return;
+    }
+    switch (indexing) {
+        case HpackIndexing::Incremental:
+            EncodeHpackInteger(block, 0x40, 6, index);
+            break;
+        case HpackIndexing::None:
+            EncodeHpackInteger(block, 0x00, 4, index);
+            break;
+        case HpackIndexing::Never:
+            EncodeHpackInteger(block, 0x10, 4, index);
+            break;
+    }
+    if (index == 0) {
+        EncodeHpackString(block, name);
+    }
+    EncodeHpackString(block, value);
+    if (indexing == HpackIndexing::Incremental) {
+        table_.Add(name, value);
+    }
+}
+
+bool DecodeHpackInteger(const std::uint8_t*& position, const std::uint8_t* end, unsigned int prefix_size, std::size_t& value) {
+    if (position == end) {
+        return false;
+    }
+    std::size_t max_prefix = (1u << prefix_size) - 1;
+    value = *position++ & max_prefix;
+    if (value < max_prefix) {
+        return true;
+    }
+    unsigned int shift = 0;
+    while (position != end && shift <= 28) {
+        std::uint8_t octet = *position++;
+        value += static_cast<std::size_t>(octet & 127) << shift;
+        shift += 7;
+        if ((octet & 128) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+HpackDecoder::HpackDecoder(std::size_t max_table_size):
+    table_(max_table_size),
+    max_table_size_(max_table_size) { }
+
+bool HpackDecoder::DecodeString(const std::uint8_t*& position, const std::uint8_t* end, std::string& text) {
+    if (position == end) {
+        return false;
+    }
+    bool is_huffman = (*position & 0x80) != 0;
+    std::size_t size;
+    if (!DecodeHpackInteger(position, end, 7, size) || static_cast<std::size_t>(end - position) < size) {
+        return false;
+    }
+    if (is_huffman) {
+        if (!DecodeHuffman(position, size, text)) {
+            return false;
+        }
+    }
+    else {
+        text.assign(reinterpret_cast<const char*>(position), size);
+    }
+    position += size;
+    return true;
+}
+
+bool HpackDecoder::Decode(const char* block, std::size_t size, std::vector<HpackHeader>& headers) {
+    auto position = reinterpret_cast<const std::uint8_t*>(block);
+    const std::uint8_t* end = position + size;
+    bool is_block_start = true;
+    while (position != end) {
+        std::uint8_t octet = *position;
+        if ((octet & 0x80) != 0) {
+            std::size_t index;
+            HpackHeaderView header;
+            if (!DecodeHpackInteger(position, end, 7, index) || !table_.Get(index, header)) {
+                return false;
+            }
+            headers.push_back(HpackHeader { std::string(header.name), std::string(header.value) });
+            is_block_start = false;
+            continue;
+        }
+
+        // Size updates are only allowed at the start of a block.
+        if ((octet & 0xe0) == 0x20) {
+            std::size_t max_size;
+            if (!is_block_start || !DecodeHpackInteger(position, end, 5, max_size) || max_size > max_table_size_) {
+                return false;
+            }
+            table_.SetMaxSize(max_size);
+            continue;
+        }
+        bool is_indexed = (octet & 0x40) != 0;
+        std::size_t index;
+        if (!DecodeHpackInteger(position, end, is_indexed ? 6 : 4, index)) {
+            return false;
+        }
+        HpackHeader header;
+        if (index > 0) {
+            HpackHeaderView name_header;
+            if (!table_.Get(index, name_header)) {
+                return false;
+            }
+            header.name = std::string(name_header.name);
+        }
+        else if (!DecodeString(position, end, header.name)) {
+            return false;
+        }
+        if (!DecodeString(position, end, header.value)) {
+            return false;
+        }
+        if (is_indexed) {
+            table_.Add(header.name, header.value);
+        }
+        headers.push_back(std::move(header));
+        is_block_start = false;
+    }
+    return true;
+}
+
+std::size_t GetHuffmanSize(std::string_view text) {
+    std::size_t bit_count = 0;
+    for (unsigned char ch : text) {
+        bit_count += hpack_huffman_code_sizes[ch];
+    }
+    return (bit_count + 7) / 8;
+}
+
+void EncodeHuffman(std::string_view text, std::string& encoded) {
+    std::uint64_t bits = 0;
+    unsigned int bit_count = 0;
+    for (unsigned char ch : text) {
+        bits = (bits << hpack_huffman_code_sizes[ch]) | hpack_huffman_codes[ch];
+        bit_count += hpack_huffman_code_sizes[ch];
+        while (bit_count >= 8) {
+            bit_count -= 8;
+            encoded.push_back(static_cast<char>(bits >> bit_count));
+        }
+        bits &= (static_cast<std::uint64_t>(1) << bit_count) - 1;
+    }
+
+    // The last octet is padded with the start of EOS, i.e. one bits.
+    if (bit_count > 0) {
+        encoded.push_back(static_cast<char>((bits << (8 - bit_count)) | (0xff >> bit_count)));
+    }
+}
+
+struct HuffmanNode {
+    // The children of the zero and the one bit, 0 for none, since the root is
+    // never a child.
+    std::int16_t children[2];
+
+    // The octet of a leaf, 256 for EOS, -1 for an inner node.
+    std::int16_t symbol;
+};
+
+std::vector<HuffmanNode> BuildHuffmanTree() {
+    std::vector<HuffmanNode> nodes(1, HuffmanNode { { 0, 0 }, -1 });
+    for (std::int16_t symbol = 0; symbol <= 256; symbol++) {
+        std::uint32_t code = symbol < 256 ? hpack_huffman_codes[symbol] : hpack_huffman_eos_code;
+        std::uint8_t code_size = symbol < 256 ? hpack_huffman_code_sizes[symbol] : hpack_huffman_eos_size;
+        std::size_t node = 0;
+        for (std::uint8_t bit = code_size; bit > 0; bit--) {
+            std::size_t branch = (code >> (bit - 1)) & 1;
+            if (nodes[node].children[branch] == 0) {
+                nodes.push_back(HuffmanNode { { 0, 0 }, -1 });
+                nodes[node].children[branch] = static_cast<std::int16_t>(nodes.size() - 1);
+            }
+            node = static_cast<std::size_t>(nodes[node].children[branch]);
+        }
+        nodes[node].symbol = symbol;
+    }
+    return nodes;
+}
+
+// Decoded bit by bit on a tree of the codes, header strings are short.
+bool DecodeHuffman(const std::uint8_t* text, std::size_t size, std::string& decoded) {
+    static const std::vector<HuffmanNode> tree = BuildHuffmanTree();
+    decoded.clear();
+    std::size_t node = 0;
+    unsigned int depth = 0;
+    bool is_all_ones = true;
+    for (std::size_t i = 0; i < size; i++) {
+        for (unsigned int bit = 8; bit > 0; bit--) {
+            std::size_t branch = (text[i] >> (bit - 1)) & 1;
+            std::int16_t next = tree[node].children[branch];
+            if (next == 0) {
+                return false;
+            }
+            node = static_cast<std::size_t>(next);
+            depth++;
+            is_all_ones = is_all_ones && branch == 1;
+            if (tree[node].symbol >= 0) {
+                if (tree[node].symbol == 256) {
+                    return false;
+                }
+                decoded.push_back(static_cast<char>(tree[node].symbol));
+                node = 0;
+                depth = 0;
+                is_all_ones = true;
+            }
+        }
+    }
+    return depth <= 7 && is_all_ones;
+}
+
+}
@@ -0,0 +1,130 @@
+#ifndef FLASHPOINT_HPACK_H
+#define FLASHPOINT_HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace flashpoint {
+
+struct HpackHeader {
+    std::string name;
+    std::string value;
+};
+
+struct HpackHeaderView {
+    std::string_view name;
+    std::string_view value;
+};
+
+// The default size of a dynamic table, and the size that is used at most.
+const std::size_t default_hpack_table_size = 4096;
+
+// How an encoded header is added to the dynamic tables.
+enum class HpackIndexing {
+    // Added, for headers that repeat, e.g. :authority or user-agent.
+    Incremental,
+
+    // Not added, for values that rarely repeat, e.g. content-length.
+    None,
+
+    // Not added, and never by any intermediary, for secrets, e.g. cookie.
+    Never,
+};
+
+// The dynamic table of one direction of a connection, see
+// https://tools.ietf.org/html/rfc7541#section-2.3.2. New entries are at the
+// front and the oldest are evicted from the back when the table is full. The
+// table lives as long as the connection, so the headers of one request make
+// the next request's headers small.
+class HpackTable {
+public:
+    HpackTable(std::size_t max_size = default_hpack_table_size);
+
+    void SetMaxSize(std::size_t max_size);
+
+    std::size_t MaxSize() const;
+
+    void Add(std::string_view name, std::string_view value);
+
+    // Get an entry of the combined index space, the static table from 1 and
+    // the dynamic table after it.
+    // @return false when the index is out of range.
+    bool Get(std::size_t index, HpackHeaderView& header) const;
+
+    // Find a header in the static and dynamic tables.
+    // @param has_value set to whether the entry has the value, or only the
+    // name.
+    // @return the index of the entry, 0 when no entry has the name.
+    std::size_t Find(std::string_view name, std::string_view value, bool& has_value) const;
+
+private:
+    std::deque<HpackHeader> entries_;
+    std::size_t size_;
+    std::size_t max_size_;
+
+    void Evict(std::size_t max_size);
+};
+
+// Encodes the header blocks of a connection's requests.
+class HpackEncoder {
+public:
+    HpackEncoder();
+
+    // Apply the peer's SETTINGS_HEADER_TABLE_SIZE. The table is never larger
+    // than the default, and the change is signaled in the next block.
+    void SetMaxTableSize(std::size_t max_size);
+
+    // Encode a header at the end of a block.
+    // @param name the lowercase name.
+    // @param value the value.
+    // @param indexing whether the header is added to the dynamic tables.
+    // @param block the block.
+    void Encode(std::string_view name, std::string_view value, HpackIndexing indexing, std::string& block);
+
+private:
+    HpackTable table_;
+
+    // Whether the table size changed since the last block, and the smallest
+    // size it had since then.
+    bool has_size_update_;
+    std::size_t min_size_update_;
+};
+
+// Decodes the header blocks of a connection's responses. Every block must be
+// decoded, even of a stream that was cancelled, to keep the table in sync.
+class HpackDecoder {
+public:
+    // @param max_table_size our SETTINGS_HEADER_TABLE_SIZE.
+    HpackDecoder(std::size_t max_table_size = default_hpack_table_size);
+
+    // Decode a complete header block.
+    // @param block the block.
+    // @param size the size of the block.
+    // @param headers the decoded headers.
+    // @return false when the block is invalid, which is a connection error.
+    bool Decode(const char* block, std::size_t size, std::vector<HpackHeader>& headers);
+
+private:
+    HpackTable table_;
+    std::size_t max_table_size_;
+
+    bool DecodeString(const std::uint8_t*& position, const std::uint8_t* end, std::string& text);
+};
+
+// Get the size of a text in the Huffman code of RFC 7541 Appendix B.
+std::size_t GetHuffmanSize(std::string_view text);
+
+void EncodeHuffman(std::string_view text, std::string& encoded);
+
+// Decode a Huffman coded string. The padding must be a prefix of EOS, i.e. at
+// most 7 one bits.
+// @return false when the string is invalid.
+bool DecodeHuffman(const std::uint8_t* text, std::size_t size, std::string& decoded);
+
+}
+
+#endif //FLASHPOINT_HPACK_H
@@ -0,0 +1,63 @@
+#include <program/http_date.h>
+#include <cstring>
+
+namespace flashpoint {
+
+const char* const day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+const char* const month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+HttpDateClock::HttpDateClock(uv_loop_t* loop) {
+    uv_timer_init(loop, &timer_);
+    timer_.data = this;
+    Render(std::time(nullptr), header_);
+}
+
+void HttpDateClock::Start() {
+    Render(std::time(nullptr), header_);
+    uv_timer_start(&timer_, OnTick, 1000, 1000);
+    uv_unref((uv_handle_t*)&timer_);
+}
+
+void HttpDateClock::Stop() {
+    uv_timer_stop(&timer_);
+}
+
+std::string_view HttpDateClock::Header() const {
+    return std::string_view(header_, http_date_header_size);
+}
+
+void HttpDateClock::OnTick(uv_timer_t* timer) {
+    auto clock = static_cast<HttpDateClock*>(timer->data);
+    Render(std::time(nullptr), clock->header_);
+}
+
+// See https://tools.ietf.org/html/rfc7231#section-7.1.1.1. The names are
+// written from tables, since strftime depends on the locale.
+void HttpDateClock::Render(std::time_t time, char* header) {
+    std::tm tm;
+    gmtime_r(&time, &tm);
+    auto write_number = [](char* text, int number) {
+        text[0] = static_cast<char>('0' + number / 10);
+        text[1] = static_cast<char>('0' + number % 10);
+    };
+    std::memcpy(header, "Date: ", 6);
+    std::memcpy(header + 6, day_names[tm.tm_wday], 3);
+    std::memcpy(header + 9, ", ", 2);
+    write_number(header + 11, tm.tm_mday);
+    header[13] = ' ';
+    std::memcpy(header + 14, month_names[tm.tm_mon], 3);
+    header[17] = ' ';
+    int year = tm.tm_year + 1900;
+    write_number(header + 18, year / 100);
+    write_number(header + 20, year % 100);
+    header[22] = ' ';
+    write_number(header + 23, tm.tm_hour);
+    header[25] = ':';
+    write_number(header + 26, tm.tm_min);
+    header[28] = ':';
+    write_number(header + 29, tm.tm_sec);
+    std::memcpy(header + 31, " GMT\r\n", 6);
+}
+
+}
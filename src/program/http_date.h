@@ -0,0 +1,40 @@
+#ifndef FLASHPOINT_HTTP_DATE_H
+#define FLASHPOINT_HTTP_DATE_H
+
+#include <uv.h>
+#include <ctime>
+#include <string_view>
+
+namespace flashpoint {
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+const std::size_t http_date_header_size = 37;
+
+// The Date header of the responses of a loop. It is rendered once a second by
+// a timer, rather than for every response.
+class HttpDateClock {
+public:
+    HttpDateClock(uv_loop_t* loop);
+
+    // Render the header and start the timer. The timer doesn't keep the loop alive.
+    void Start();
+
+    void Stop();
+
+    // Get the rendered header, including the trailing CRLF.
+    std::string_view Header() const;
+
+    // Render an IMF-fixdate header for a time.
+    // @param time the time.
+    // @param header a buffer of at least http_date_header_size bytes.
+    static void Render(std::time_t time, char* header);
+
+private:
+    uv_timer_t timer_;
+    char header_[http_date_header_size];
+    static void OnTick(uv_timer_t* timer);
+};
+
+}
+
+#endif //FLASHPOINT_HTTP_DATE_H
@@ -0,0 +1,164 @@
+#include <program/http_headers.h>
+#include <strings.h>
+
+namespace flashpoint::program {
+
+// Header names in their registered case, indexed by HttpHeader.
+const std::string_view header_names[] = {
+    "",
+    "Accept",
+    "Accept-Charset",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Accept-Post",
+    "Accept-Ranges",
+    "Age",
+    "Allow",
+    "ALPN",
+    "Alt-Svc",
+    "Alt-Used",
+    "Authentication-Info",
+    "Authorization",
+    "Cache-Control",
+    "CalDAV-Timezones",
+    "Connection",
+    "Content-Disposition",
+    "Content-Encoding",
+    "Content-Language",
+    "Content-Length",
+    "Content-Location",
+    "Content-Range",
+    "Content-Type",
+    "Cookie",
+    "DASL",
+    "DAV",
+    "Date",
+    "Depth",
+    "Destination",
+    "ETag",
+    "Expect",
+    "Expires",
+    "Forwarded",
+    "From",
+    "Host",
+    "HTTP2-Settings",
+    "If",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Schedule-Tag-Match",
+    "If-Unmodified-Since",
+    "Last-Modified",
+    "Link",
+    "Location",
+    "Lock-Token",
+    "Max-Forwards",
+    "MIME-Version",
+    "Ordering-Type",
+    "Origin",
+    "Overwrite",
+    "Position",
+    "Pragma",
+    "Prefer",
+    "Preference-Applied",
+    "Proxy-Authenticate",
+    "Proxy-Authentication-Info",
+    "Proxy-Authorization",
+    "Public-Key-Pins",
+    "Public-Key-Pins-Report-Only",
+    "Range",
+    "Referer",
+    "Retry-After",
+    "Schedule-Reply",
+    "Schedule-Tag",
+    "Sec-WebSocket-Accept",
+    "Sec-WebSocket-Extensions",
+    "Sec-WebSocket-Key",
+    "Sec-WebSocket-Protocol",
+    "Sec-WebSocket-Version",
+    "Server",
+    "Set-Cookie",
+    "SLUG",
+    "Strict-Transport-Security",
+    "TE",
+    "Timeout",
+    "Topic",
+    "Trailer",
+    "Transfer-Encoding",
+    "TTL",
+    "Urgency",
+    "Upgrade",
+    "User-Agent",
+    "Vary",
+    "Via",
+    "WWW-Authenticate",
+    "Warning",
+    "X-Content-Type-Options",
+};
+
+static_assert(sizeof(header_names) / sizeof(header_names[0]) == http_header_size);
+
+std::string_view GetHeaderName(HttpHeader header)
+{
+    return header_names[static_cast<std::size_t>(header)];
+}
+
+bool FindHeader(std::string_view name, HttpHeader& header)
+{
+    for (std::size_t i = 1; i < http_header_size; i++) {
+        if (header_names[i].size() == name.size() && strncasecmp(header_names[i].data(), name.data(), name.size()) == 0) {
+            header = static_cast<HttpHeader>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+HttpHeaders::HttpHeaders():
+    positions_ { }
+{ }
+
+HttpHeaders::~HttpHeaders()
+{
+    for (std::size_t i = 0; i < known_size_ && i < INLINE_KNOWN_HEADERS; i++) {
+        delete[] known_headers_[i].value;
+    }
+    for (const auto& known_header : overflow_known_headers_) {
+        delete[] known_header.value;
+    }
+    for (std::size_t i = 0; i < unknown_size_ && i < INLINE_UNKNOWN_HEADERS; i++) {
+        delete[] unknown_headers_[i].name;
+        delete[] unknown_headers_[i].value;
+    }
+    for (const auto& unknown_header : overflow_unknown_headers_) {
+        delete[] unknown_header.name;
+        delete[] unknown_header.value;
+    }
+}
+
+void HttpHeaders::AddUnknown(char* name, char* value)
+{
+    if (unknown_size_ < INLINE_UNKNOWN_HEADERS) {
+        unknown_headers_[unknown_size_] = UnknownHttpHeader { name, value };
+    }
+    else {
+        overflow_unknown_headers_.push_back(UnknownHttpHeader { name, value });
+    }
+    unknown_size_++;
+}
+
+std::size_t HttpHeaders::UnknownSize() const
+{
+    return unknown_size_;
+}
+
+const UnknownHttpHeader& HttpHeaders::GetUnknown(std::size_t index) const
+{
+    if (index < INLINE_UNKNOWN_HEADERS) {
+        return unknown_headers_[index];
+    }
+    return overflow_unknown_headers_[index - INLINE_UNKNOWN_HEADERS];
+}
+
+}
@@ -0,0 +1,190 @@
+#ifndef FLASHPOINT_HTTP_HEADERS_H
+#define FLASHPOINT_HTTP_HEADERS_H
+
+#include <program/http_scanner.h>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#define INLINE_KNOWN_HEADERS 16
+#define INLINE_UNKNOWN_HEADERS 4
+
+namespace flashpoint::program {
+
+const std::size_t http_header_size = static_cast<std::size_t>(HttpHeader::End);
+
+struct UnknownHttpHeader {
+    char* name;
+    char* value;
+};
+
+// The raw bytes of a header field line, including the trailing CRLF.
+struct HttpHeaderField {
+    const char* text;
+    std::size_t size;
+};
+
+const HttpHeaderField no_http_header_field { nullptr, 0 };
+
+// The value and the first raw field line of a known header that was sent.
+struct KnownHttpHeader {
+    char* value;
+    HttpHeaderField field;
+};
+
+// A field line of a known header after its first, e.g. a second Cookie line.
+struct RepeatedHttpHeaderField {
+    HttpHeader header;
+    HttpHeaderField field;
+};
+
+// Get the name of a known header in its registered case, e.g. "Content-Type".
+std::string_view GetHeaderName(HttpHeader header);
+
+// Find a known header by its case-insensitive name.
+// @param name the name.
+// @param header set to the header.
+// @return false when the header isn't known.
+bool FindHeader(std::string_view name, HttpHeader& header);
+
+// Header table of a request. A flat array indexed by HttpHeader holds the
+// position of each known header that was sent, the headers themselves are
+// stored in the order they were sent. Known and unknown headers are stored in
+// small inline vectors that only spill to the heap when a request has more
+// than INLINE_KNOWN_HEADERS or INLINE_UNKNOWN_HEADERS of them.
+// The table owns the values and the unknown header names, so it can't be copied.
+class HttpHeaders final {
+public:
+    HttpHeaders();
+
+    ~HttpHeaders();
+
+    HttpHeaders(const HttpHeaders&) = delete;
+
+    HttpHeaders& operator=(const HttpHeaders&) = delete;
+
+    // Get the value of a header.
+    // @param header the header.
+    // @return the header value or nullptr if the header was not sent.
+    char* Get(HttpHeader header) const;
+
+    bool Has(HttpHeader header) const;
+
+    // Set the value of a known header, which the headers own. A value that it
+    // replaces, e.g. of a repeated header, is freed. Setting an Unknown header
+    // is a no-op, use AddUnknown instead.
+    void Set(HttpHeader header, char* value);
+
+    // Get the first raw field line of a known header. The field points into
+    // the parsed text, so it is only valid for as long as that text is.
+    // @param header the header.
+    // @return the field or a field with a nullptr text if the header was not sent.
+    const HttpHeaderField& GetField(HttpHeader header) const;
+
+    // Add a raw field line of a known header. A header can be sent on several
+    // lines, e.g. Cookie, the lines after its first are kept in order.
+    void AddField(HttpHeader header, const char* text, std::size_t size);
+
+    // Get the field lines of the known headers that were sent more than once,
+    // except for their first lines.
+    const std::vector<RepeatedHttpHeaderField>& GetRepeatedFields() const;
+
+    // Add an unknown header, whose name and value the headers own.
+    void AddUnknown(char* name, char* value);
+
+    std::size_t UnknownSize() const;
+
+    const UnknownHttpHeader& GetUnknown(std::size_t index) const;
+
+private:
+    // One more than the position of each known header, 0 if it wasn't sent.
+    std::uint8_t positions_[http_header_size];
+    KnownHttpHeader known_headers_[INLINE_KNOWN_HEADERS];
+    std::size_t known_size_ = 0;
+    std::vector<KnownHttpHeader> overflow_known_headers_;
+    std::vector<RepeatedHttpHeaderField> repeated_fields_;
+    UnknownHttpHeader unknown_headers_[INLINE_UNKNOWN_HEADERS];
+    std::size_t unknown_size_ = 0;
+    std::vector<UnknownHttpHeader> overflow_unknown_headers_;
+
+    const KnownHttpHeader* FindKnown(HttpHeader header) const;
+
+    // Get the entry of a known header, which is added if the header wasn't sent.
+    KnownHttpHeader& AddKnown(HttpHeader header);
+};
+
+static_assert(http_header_size <= UINT8_MAX);
+
+inline const KnownHttpHeader* HttpHeaders::FindKnown(HttpHeader header) const {
+    std::size_t position = positions_[static_cast<std::size_t>(header)];
+    if (position == 0) {
+        return nullptr;
+    }
+    if (position <= INLINE_KNOWN_HEADERS) {
+        return &known_headers_[position - 1];
+    }
+    return &overflow_known_headers_[position - 1 - INLINE_KNOWN_HEADERS];
+}
+
+inline KnownHttpHeader& HttpHeaders::AddKnown(HttpHeader header) {
+    std::uint8_t& position = positions_[static_cast<std::size_t>(header)];
+    if (position == 0) {
+        if (known_size_ < INLINE_KNOWN_HEADERS) {
+            known_headers_[known_size_] = KnownHttpHeader { nullptr, no_http_header_field };
+        }
+        else {
+            overflow_known_headers_.push_back(KnownHttpHeader { nullptr, no_http_header_field });
+        }
+        known_size_++;
+        position = static_cast<std::uint8_t>(known_size_);
+    }
+    if (position <= INLINE_KNOWN_HEADERS) {
+        return known_headers_[position - 1];
+    }
+    return overflow_known_headers_[position - 1 - INLINE_KNOWN_HEADERS];
+}
+
+inline char* HttpHeaders::Get(HttpHeader header) const {
+    const KnownHttpHeader* known_header = FindKnown(header);
+    return known_header == nullptr ? nullptr : known_header->value;
+}
+
+inline bool HttpHeaders::Has(HttpHeader header) const {
+    return Get(header) != nullptr;
+}
+
+inline void HttpHeaders::Set(HttpHeader header, char* value) {
+    if (header == HttpHeader::Unknown || header == HttpHeader::End) {
+        return;
+    }
+    KnownHttpHeader& known_header = AddKnown(header);
+    if (known_header.value != value) {
+        delete[] known_header.value;
+    }
+    known_header.value = value;
+}
+
+inline const HttpHeaderField& HttpHeaders::GetField(HttpHeader header) const {
+    const KnownHttpHeader* known_header = FindKnown(header);
+    return known_header == nullptr ? no_http_header_field : known_header->field;
+}
+
+inline void HttpHeaders::AddField(HttpHeader header, const char* text, std::size_t size) {
+    if (header == HttpHeader::Unknown || header == HttpHeader::End) {
+        return;
+    }
+    HttpHeaderField& field = AddKnown(header).field;
+    if (field.text != nullptr) {
+        repeated_fields_.push_back(RepeatedHttpHeaderField { header, HttpHeaderField { text, size } });
+        return;
+    }
+    field = HttpHeaderField { text, size };
+}
+
+inline const std::vector<RepeatedHttpHeaderField>& HttpHeaders::GetRepeatedFields() const {
+    return repeated_fields_;
+}
+
+}
+
+#endif //FLASHPOINT_HTTP_HEADERS_H
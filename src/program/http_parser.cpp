@@ -1,5 +1,9 @@
 #include <iostream>
 #include <vector>
+#include <climits>
+#include <string_view>
+#include <cstring>
+#include <strings.h>
 #include <program/http_parser.h>
 #include <lib/character.h>
 
@@ -9,49 +13,327 @@ namespace flashpoint::program {
 
 HttpParser::HttpParser(const char* text,
                        std::size_t size)
-    : scanner(text, size) {
+    : HttpParser(text, size, default_http_parser_limits) {
 }
 
-std::unique_ptr<HttpRequest> HttpParser::Parse() {
+HttpParser::HttpParser(const char* text,
+                       std::size_t size,
+                       const HttpParserLimits& limits)
+    : scanner(text, size),
+      limits(limits),
+      text(text),
+      size(size) {
+}
+
+HttpParseResult HttpParser::Parse() {
+    HttpParseResult result = ParseHead();
+    if (result.error != HttpParseError::None) {
+        return result;
+    }
+    auto& request = result.request;
+    switch (request->body_encoding) {
+        case HttpBodyEncoding::ContentLength:
+            request->body = parse_body(request->content_length);
+            break;
+        case HttpBodyEncoding::Chunked: {
+            std::string body;
+            HttpChunkedBodyState state { ChunkedBodyMode::ChunkSize, 0, 0, limits.max_body_size, false };
+            HttpBodyStatus status = scanner.scan_chunked_body(state, [](void* data, const char* text, std::size_t size) {
+                static_cast<std::string*>(data)->append(text, size);
+            }, &body);
+            if (status == HttpBodyStatus::Incomplete) {
+                scanner.set_error(HttpParseError::UnexpectedEndOfRequest);
+            }
+            request->body = new char[body.size() + 1];
+            std::memcpy(request->body, body.c_str(), body.size() + 1);
+            break;
+        }
+        case HttpBodyEncoding::None:
+        case HttpBodyEncoding::UntilClose:
+            break;
+    }
+    if (scanner.has_error()) {
+        return error_result();
+    }
+    return result;
+}
+
+HttpParseResult HttpParser::ParseHead() {
+    if (exceeds_header_fields_size()) {
+        return HttpParseResult {
+            nullptr,
+            HttpParseError::HeaderFieldsTooLarge,
+            static_cast<long long>(limits.max_header_fields_size),
+            0,
+        };
+    }
+    std::unique_ptr<HttpRequest> request(new HttpRequest {});
     auto [method, path, query] = ParseRequestLine();
-    std::map<HttpHeader, char*> headers = parse_headers();
-    char* body = nullptr;
-    if (method != Get) {
-        const char* header = headers[HttpHeader::ContentLength];
-        if (header != NULL) {
-            body = parse_body(std::atoll(header));
+    if (scanner.has_error()) {
+        return error_result();
+    }
+    request->method = method;
+    request->path = path;
+    request->query = query;
+    parse_headers(request->headers);
+    if (scanner.has_error()) {
+        return error_result();
+    }
+    if (!parse_body_encoding(request.get())) {
+        return error_result();
+    }
+    return HttpParseResult {
+        std::move(request),
+        HttpParseError::None,
+        0,
+        scanner.get_position(),
+    };
+}
+
+// See https://tools.ietf.org/html/rfc7230#section-3.3.3. A request with both
+// Transfer-Encoding and Content-Length is rejected rather than guessed, since
+// disagreeing framing is how requests get smuggled past proxies.
+bool
+HttpParser::parse_body_encoding(HttpRequest* request)
+{
+    const char* transfer_encoding = request->headers.Get(HttpHeader::TransferEncoding);
+    const char* content_length = request->headers.Get(HttpHeader::ContentLength);
+    if (transfer_encoding != nullptr) {
+        if (content_length != nullptr) {
+            scanner.set_error(HttpParseError::InvalidContentLength);
+            return false;
         }
+        if (strcasecmp(transfer_encoding, "chunked") != 0) {
+            scanner.set_error(HttpParseError::UnsupportedTransferEncoding);
+            return false;
+        }
+        request->body_encoding = HttpBodyEncoding::Chunked;
+        return true;
     }
+    if (content_length != nullptr) {
+        long long length;
+        if (!parse_content_length(content_length, length)) {
+            scanner.set_error(HttpParseError::InvalidContentLength);
+            return false;
+        }
+        if (static_cast<unsigned long long>(length) > limits.max_body_size) {
+            scanner.set_error(HttpParseError::PayloadTooLarge);
+            return false;
+        }
+        request->body_encoding = HttpBodyEncoding::ContentLength;
+        request->content_length = length;
+        return true;
+    }
+    request->body_encoding = HttpBodyEncoding::None;
+    return true;
+}
 
-    std::unique_ptr<HttpRequest> request(new HttpRequest {
-        method,
-        path,
-        query,
-        headers,
-        body,
+// Whether a Connection header lists an option, e.g. "close" in
+// "Upgrade, close".
+static bool has_connection_option(const char* value, const char* option)
+{
+    std::size_t option_size = std::strlen(option);
+    const char* ch = value;
+    while (*ch != '\0') {
+        ch += std::strspn(ch, " \t,");
+        std::size_t token_size = std::strcspn(ch, " \t,");
+        if (token_size == option_size && strncasecmp(ch, option, option_size) == 0) {
+            return true;
+        }
+        ch += token_size;
+    }
+    return false;
+}
+
+// See https://tools.ietf.org/html/rfc7230#section-3.3.3. Responses without a
+// body don't need framing, and a response without framing ends when the
+// backend closes the connection.
+HttpResponseParseResult HttpParser::ParseResponseHead() {
+    HttpResponseHead head {};
+    if (exceeds_header_fields_size()) {
+        return HttpResponseParseResult {
+            head,
+            HttpParseError::HeaderFieldsTooLarge,
+            static_cast<long long>(limits.max_header_fields_size),
+            0,
+        };
+    }
+    RequestLineToken version = scanner.scan_http_version();
+    scanner.scan_expected(Character::Space);
+    head.status = scanner.scan_status_code();
+    scanner.scan_rest_of_line();
+    head.keep_alive = version == RequestLineToken::HttpVersion1_1;
+    bool has_content_length = false;
+    bool is_chunked = false;
+    std::size_t header_fields = 0;
+    while (!scanner.has_error()) {
+        HttpHeader header = scanner.scan_header();
+        if (header == HttpHeader::End) {
+            break;
+        }
+        char* value = scanner.get_header_value();
+        if (++header_fields > limits.max_header_fields) {
+            scanner.set_error(HttpParseError::HeaderFieldsTooLarge);
+        }
+        else if (header == HttpHeader::ContentLength) {
+            long long length;
+            if (has_content_length || !parse_content_length(value, length)) {
+                scanner.set_error(HttpParseError::InvalidContentLength);
+            }
+            else {
+                has_content_length = true;
+                head.content_length = static_cast<unsigned long long>(length);
+            }
+        }
+        else if (header == HttpHeader::TransferEncoding) {
+            if (strcasecmp(value, "chunked") != 0) {
+                scanner.set_error(HttpParseError::UnsupportedTransferEncoding);
+            }
+            is_chunked = true;
+        }
+        else if (header == HttpHeader::Connection) {
+            if (has_connection_option(value, "close")) {
+                head.keep_alive = false;
+            }
+            else if (has_connection_option(value, "keep-alive")) {
+                head.keep_alive = true;
+            }
+        }
+        delete[] value;
+    }
+    if (scanner.has_error()) {
+        return HttpResponseParseResult {
+            head,
+            scanner.get_error(),
+            scanner.get_error_position(),
+            0,
+        };
+    }
+    if (head.status < 200 || head.status == 204 || head.status == 304) {
+        head.body_encoding = HttpBodyEncoding::None;
+    }
+    else if (is_chunked) {
+        if (has_content_length) {
+            return HttpResponseParseResult {
+                head,
+                HttpParseError::InvalidContentLength,
+                scanner.get_position(),
+                0,
+            };
+        }
+        head.body_encoding = HttpBodyEncoding::Chunked;
+    }
+    else if (has_content_length) {
+        head.body_encoding = HttpBodyEncoding::ContentLength;
+    }
+    else {
+        head.body_encoding = HttpBodyEncoding::UntilClose;
+        head.keep_alive = false;
+    }
+    return HttpResponseParseResult {
+        head,
+        HttpParseError::None,
+        0,
+        scanner.get_position(),
+    };
+}
+
+HttpParseResult HttpParser::error_result() {
+    return HttpParseResult {
         nullptr,
-    });
-    return request;
+        scanner.get_error(),
+        scanner.get_error_position(),
+        0,
+    };
+}
+
+// Reject oversized header sections up front, so that a hostile request costs a
+// memchr-speed search instead of a full scan of its header fields.
+bool
+HttpParser::exceeds_header_fields_size()
+{
+    if (size <= limits.max_header_fields_size) {
+        return false;
+    }
+    std::string_view header_fields(text, limits.max_header_fields_size);
+    return header_fields.find("\r\n\r\n") == std::string_view::npos;
+}
+
+bool
+HttpParser::parse_content_length(const char* value, long long& length)
+{
+    length = 0;
+    if (*value == '\0') {
+        return false;
+    }
+    for (const char* ch = value; *ch != '\0'; ch++) {
+        if (*ch < Character::_0 || *ch > Character::_9) {
+            return false;
+        }
+        if (length > (LLONG_MAX - 9) / 10) {
+            return false;
+        }
+        length = length * 10 + (*ch - Character::_0);
+    }
+    return true;
+}
+
+// See https://tools.ietf.org/html/rfc7230#section-3.3.3. A repeated
+// Content-Length is only accepted when it repeats the same length, and a
+// repeated Transfer-Encoding never is, since the last line would otherwise
+// silently decide how the body is framed.
+bool
+HttpParser::is_ambiguous_framing(const HttpHeaders& headers, HttpHeader header, const char* value)
+{
+    if (!headers.Has(header)) {
+        return false;
+    }
+    if (header == HttpHeader::ContentLength) {
+        if (std::strcmp(headers.Get(header), value) != 0) {
+            scanner.set_error(HttpParseError::InvalidContentLength);
+            return true;
+        }
+    }
+    else if (header == HttpHeader::TransferEncoding) {
+        scanner.set_error(HttpParseError::UnsupportedTransferEncoding);
+        return true;
+    }
+    return false;
 }
 
 char*
-HttpParser::parse_body(long long length)
+HttpParser::parse_body(std::size_t length)
 {
     return scanner.scan_body(length);
 }
 
-std::map<HttpHeader, char*>
-HttpParser::parse_headers()
+void
+HttpParser::parse_headers(HttpHeaders& headers)
 {
-    std::map<HttpHeader, char*> headers = {};
+    std::size_t header_fields = 0;
     while (true) {
         auto header = scanner.scan_header();
         if (header == HttpHeader::End) {
             break;
         }
-        headers[header] = scanner.get_header_value();
+        if (++header_fields > limits.max_header_fields ||
+            static_cast<std::size_t>(scanner.get_position()) > limits.max_header_fields_size) {
+            scanner.set_error(HttpParseError::HeaderFieldsTooLarge);
+            break;
+        }
+        if (header == HttpHeader::Unknown) {
+            headers.AddUnknown(scanner.get_header_name(), scanner.get_header_value());
+            continue;
+        }
+        char* value = scanner.get_header_value();
+        if (is_ambiguous_framing(headers, header, value)) {
+            delete[] value;
+            break;
+        }
+        headers.Set(header, value);
+        long long field_position = scanner.get_header_field_position();
+        headers.AddField(header, text + field_position, scanner.get_position() - field_position);
     }
-    return headers;
 }
 
 RequestLine HttpParser::ParseRequestLine() {
@@ -71,4 +353,234 @@ RequestLine HttpParser::ParseRequestLine() {
     };
 }
 
-}
\ No newline at end of file
+HttpRequestBodyReader::HttpRequestBodyReader()
+    : encoding_(HttpBodyEncoding::None),
+      remaining_body_size_(0),
+      chunked_body_(),
+      error_(HttpParseError::None),
+      error_position_(0) {
+}
+
+bool HttpRequestBodyReader::Start(const HttpRequest& request, const HttpParserLimits& limits) {
+    encoding_ = request.body_encoding;
+    error_ = HttpParseError::None;
+    error_position_ = 0;
+    switch (encoding_) {
+        case HttpBodyEncoding::ContentLength:
+            remaining_body_size_ = request.content_length;
+            return remaining_body_size_ == 0;
+        case HttpBodyEncoding::Chunked:
+            chunked_body_ = HttpChunkedBodyState { ChunkedBodyMode::ChunkSize, 0, 0, limits.max_body_size, false };
+            return false;
+        case HttpBodyEncoding::None:
+        case HttpBodyEncoding::UntilClose:
+            break;
+    }
+    return true;
+}
+
+HttpBodyStatus HttpRequestBodyReader::Feed(const char* text, std::size_t size, std::size_t& consumed, HttpBodyCallback callback, void* data) {
+    consumed = 0;
+    if (encoding_ == HttpBodyEncoding::Chunked) {
+        HttpScanner scanner(text, size);
+        HttpBodyStatus status = scanner.scan_chunked_body(chunked_body_, callback, data);
+        if (status == HttpBodyStatus::Error) {
+            error_ = scanner.get_error();
+            error_position_ = scanner.get_error_position();
+            return status;
+        }
+        consumed = static_cast<std::size_t>(scanner.get_position());
+        return status;
+    }
+    if (encoding_ != HttpBodyEncoding::ContentLength) {
+        return HttpBodyStatus::Complete;
+    }
+    std::size_t span_size = static_cast<std::size_t>(std::min<unsigned long long>(size, remaining_body_size_));
+    if (span_size > 0) {
+        callback(data, text, span_size);
+    }
+    consumed = span_size;
+    remaining_body_size_ -= span_size;
+    return remaining_body_size_ == 0 ? HttpBodyStatus::Complete : HttpBodyStatus::Incomplete;
+}
+
+HttpParseError HttpRequestBodyReader::Error() const {
+    return error_;
+}
+
+long long HttpRequestBodyReader::ErrorPosition() const {
+    return error_position_;
+}
+
+HttpResponseParser::HttpResponseParser()
+    : HttpResponseParser(default_http_parser_limits) {
+}
+
+HttpResponseParser::HttpResponseParser(const HttpParserLimits& limits)
+    : limits_(limits),
+      status_(HttpResponseStatus::Incomplete),
+      head_(),
+      has_head_(false),
+      error_(HttpParseError::None),
+      remaining_body_size_(0),
+      body_size_(0),
+      chunked_body_() {
+}
+
+HttpResponseStatus HttpResponseParser::Feed(const char* text, std::size_t size, std::size_t& consumed, HttpBodyCallback callback, void* data) {
+    consumed = 0;
+    if (status_ == HttpResponseStatus::Complete || status_ == HttpResponseStatus::Error) {
+        return status_;
+    }
+    if (!has_head_) {
+        while (!has_head_) {
+            std::size_t head_size;
+            bool has_read_head = ReadHead(text + consumed, size - consumed, head_size);
+            consumed += head_size;
+            if (!has_read_head) {
+                return status_;
+            }
+        }
+        bool has_body = head_.body_encoding != HttpBodyEncoding::None &&
+            !(head_.body_encoding == HttpBodyEncoding::ContentLength && head_.content_length == 0);
+        status_ = has_body ? HttpResponseStatus::Head : HttpResponseStatus::Complete;
+        return HttpResponseStatus::Head;
+    }
+    switch (head_.body_encoding) {
+        case HttpBodyEncoding::ContentLength: {
+            std::size_t span_size = static_cast<std::size_t>(std::min<unsigned long long>(size, remaining_body_size_));
+            if (span_size > 0) {
+                callback(data, text, span_size);
+            }
+            consumed = span_size;
+            remaining_body_size_ -= span_size;
+            if (remaining_body_size_ == 0) {
+                status_ = HttpResponseStatus::Complete;
+            }
+            break;
+        }
+        case HttpBodyEncoding::Chunked: {
+            HttpScanner scanner(text, size);
+            HttpBodyStatus body_status = scanner.scan_chunked_body(chunked_body_, callback, data);
+            consumed = static_cast<std::size_t>(scanner.get_position());
+            if (body_status == HttpBodyStatus::Error) {
+                return Fail(scanner.get_error());
+            }
+            if (body_status == HttpBodyStatus::Complete) {
+                status_ = HttpResponseStatus::Complete;
+            }
+            break;
+        }
+        case HttpBodyEncoding::UntilClose:
+            body_size_ += size;
+            if (body_size_ > limits_.max_body_size) {
+                return Fail(HttpParseError::PayloadTooLarge);
+            }
+            if (size > 0) {
+                callback(data, text, size);
+            }
+            consumed = size;
+            break;
+        case HttpBodyEncoding::None:
+            status_ = HttpResponseStatus::Complete;
+            break;
+    }
+    return status_ == HttpResponseStatus::Complete ? HttpResponseStatus::Complete : HttpResponseStatus::Incomplete;
+}
+
+bool HttpResponseParser::End() {
+    if (status_ == HttpResponseStatus::Head && head_.body_encoding == HttpBodyEncoding::UntilClose) {
+        status_ = HttpResponseStatus::Complete;
+    }
+    return status_ == HttpResponseStatus::Complete;
+}
+
+bool HttpResponseParser::HasHead() const {
+    return has_head_;
+}
+
+const HttpResponseHead& HttpResponseParser::Head() const {
+    return head_;
+}
+
+HttpParseError HttpResponseParser::Error() const {
+    return error_;
+}
+
+// Find the end of the head, in the read buffer or in the fragments buffered
+// so far, and parse it.
+// @return whether a head was parsed, which is an interim response when
+// has_head_ is still false.
+bool HttpResponseParser::ReadHead(const char* text, std::size_t size, std::size_t& consumed) {
+    HttpResponseParseResult result;
+    if (buffered_head_.empty()) {
+        std::size_t head_end = std::string_view(text, size).find("\r\n\r\n");
+        if (head_end == std::string_view::npos) {
+            consumed = size;
+            if (size > limits_.max_header_fields_size) {
+                Fail(HttpParseError::HeaderFieldsTooLarge);
+                return false;
+            }
+            buffered_head_.assign(text, size);
+            return false;
+        }
+        consumed = head_end + 4;
+        result = HttpParser(text, consumed, limits_).ParseResponseHead();
+    }
+    else {
+        std::size_t previous_size = buffered_head_.size();
+        buffered_head_.append(text, size);
+        std::size_t head_end = buffered_head_.find("\r\n\r\n", previous_size < 3 ? 0 : previous_size - 3);
+        if (head_end == std::string::npos) {
+            consumed = size;
+            if (buffered_head_.size() > limits_.max_header_fields_size) {
+                Fail(HttpParseError::HeaderFieldsTooLarge);
+            }
+            return false;
+        }
+        consumed = head_end + 4 - previous_size;
+        result = HttpParser(buffered_head_.data(), head_end + 4, limits_).ParseResponseHead();
+        buffered_head_ = std::string();
+    }
+    if (result.error != HttpParseError::None) {
+        Fail(result.error);
+        return false;
+    }
+    return StartBody(result.head);
+}
+
+bool HttpResponseParser::StartBody(const HttpResponseHead& head) {
+    if (head.status < 200) {
+        // The connection is another protocol's after a 101.
+        if (head.status == 101) {
+            Fail(HttpParseError::InvalidStatusCode);
+            return false;
+        }
+        return true;
+    }
+    head_ = head;
+    has_head_ = true;
+    switch (head.body_encoding) {
+        case HttpBodyEncoding::ContentLength:
+            if (head.content_length > limits_.max_body_size) {
+                Fail(HttpParseError::PayloadTooLarge);
+                return false;
+            }
+            remaining_body_size_ = head.content_length;
+            break;
+        case HttpBodyEncoding::Chunked:
+            chunked_body_ = HttpChunkedBodyState { ChunkedBodyMode::ChunkSize, 0, 0, limits_.max_body_size, false };
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+HttpResponseStatus HttpResponseParser::Fail(HttpParseError error) {
+    status_ = HttpResponseStatus::Error;
+    error_ = error;
+    return status_;
+}
+
+}
@@ -2,6 +2,9 @@
 #define FLASH_HTTP_PARSER_H
 
 #include <program/http_scanner.h>
+#include <program/http_headers.h>
+#include <memory>
+#include <string>
 #include <unordered_map>
 #include <types.h>
 #include <uv.h>
@@ -16,35 +19,237 @@ struct RequestLine {
     char* query;
 };
 
+enum class HttpBodyEncoding {
+    None,
+    ContentLength,
+    Chunked,
+
+    // Only responses, the body ends when the connection is closed.
+    UntilClose,
+};
+
 struct HttpRequest {
     HttpMethod method;
     char* path;
     char* query;
-    std::map<HttpHeader, char*> headers;
+    HttpHeaders headers;
+    HttpBodyEncoding body_encoding;
+    unsigned long long content_length;
     char* body;
     uv_stream_t* client_stream;
 };
 
+struct HttpParserLimits {
+    // Request line and header fields, answered with 431 when exceeded.
+    std::size_t max_header_fields_size;
+    std::size_t max_header_fields;
+
+    // Answered with 413 when exceeded.
+    std::size_t max_body_size;
+};
+
+const HttpParserLimits default_http_parser_limits = {
+    1024 * 8,
+    100,
+    1024 * 1024,
+};
+
+struct HttpParseResult {
+    std::unique_ptr<HttpRequest> request;
+    HttpParseError error;
+
+    // Byte offset in the request where the error was detected.
+    long long error_position;
+
+    // Byte offset of the first body byte, set by ParseHead.
+    long long body_position;
+};
+
+// The status line and the framing of a response. The header values are only
+// inspected, so they aren't kept.
+struct HttpResponseHead {
+    unsigned int status;
+    HttpBodyEncoding body_encoding;
+    unsigned long long content_length;
+
+    // Whether the connection can be reused after the response, i.e. it is
+    // HTTP/1.1 without Connection: close, or HTTP/1.0 with keep-alive, and its
+    // body doesn't end with the connection.
+    bool keep_alive;
+};
+
+struct HttpResponseParseResult {
+    HttpResponseHead head;
+    HttpParseError error;
+    long long error_position;
+
+    // Byte offset of the first body byte.
+    long long body_position;
+};
+
 class HttpParser final {
 public:
 
     HttpParser(const char* text, std::size_t length);
 
-    std::unique_ptr<HttpRequest>
+    HttpParser(const char* text, std::size_t length, const HttpParserLimits& limits);
+
+    // Parse a complete request, including its body.
+    HttpParseResult
     Parse();
 
+    // Parse the request line and header fields and determine how the body is
+    // framed. The body itself is left for the caller to stream, see
+    // HttpScanner::scan_chunked_body.
+    HttpParseResult
+    ParseHead();
+
+    // Parse the status line and header fields of a response, which must be
+    // complete, and determine how its body is framed.
+    HttpResponseParseResult
+    ParseResponseHead();
+
     RequestLine
     ParseRequestLine();
 
-    std::map<HttpHeader, char*>
-    parse_headers();
+    void
+    parse_headers(HttpHeaders& headers);
 
     char*
-    parse_body(long long length);
+    parse_body(std::size_t length);
 
 private:
     HttpScanner scanner;
-    unsigned int length;
+    HttpParserLimits limits;
+    const char* text;
+    std::size_t size;
+
+    bool
+    exceeds_header_fields_size();
+
+    bool
+    parse_content_length(const char* value, long long& length);
+
+    bool
+    parse_body_encoding(HttpRequest* request);
+
+    bool
+    is_ambiguous_framing(const HttpHeaders& headers, HttpHeader header, const char* value);
+
+    HttpParseResult
+    error_result();
+};
+
+// Reads the body of a request as it arrives, with the framing that
+// HttpParser::ParseHead determined. The body is decoded with one scanner per
+// read buffer, and its bytes are passed on without copying.
+class HttpRequestBodyReader final {
+public:
+    HttpRequestBodyReader();
+
+    // Start reading the body of a request.
+    // @param request the request, whose head has been parsed.
+    // @param limits the limits, of which the chunked body is capped by the
+    // max body size.
+    // @return whether the body is already complete, i.e. the request has no
+    // body or an empty one.
+    bool
+    Start(const HttpRequest& request, const HttpParserLimits& limits);
+
+    // Read the next bytes of the body.
+    // @param text the bytes.
+    // @param size the size of the bytes.
+    // @param consumed set to the bytes that were read, the bytes after the end
+    // of the body are not.
+    // @param callback receives the decoded body bytes.
+    // @param data the data of the callback.
+    HttpBodyStatus
+    Feed(const char* text, std::size_t size, std::size_t& consumed, HttpBodyCallback callback, void* data);
+
+    HttpParseError
+    Error() const;
+
+    // Byte offset of the error in the bytes of the last Feed.
+    long long
+    ErrorPosition() const;
+
+private:
+    HttpBodyEncoding encoding_;
+    unsigned long long remaining_body_size_;
+    HttpChunkedBodyState chunked_body_;
+    HttpParseError error_;
+    long long error_position_;
+};
+
+enum class HttpResponseStatus {
+    Incomplete,
+
+    // The head has been read, the body follows.
+    Head,
+
+    // The response has been read to its end.
+    Complete,
+    Error,
+};
+
+// Reads a response as it arrives, e.g. from a backend connection. The head is
+// parsed straight from the read buffer when it arrives in one read, and is
+// only buffered when it is fragmented across reads. The body is decoded with
+// one scanner per read buffer, and its bytes are passed on without copying.
+class HttpResponseParser final {
+public:
+    HttpResponseParser();
+
+    HttpResponseParser(const HttpParserLimits& limits);
+
+    // Read the next bytes of the response. Reading stops after the head, so
+    // that it can be acted on before the body is passed on. Interim 1xx
+    // responses are skipped.
+    // @param text the bytes.
+    // @param size the size of the bytes.
+    // @param consumed set to the bytes that were read, the bytes after the end
+    // of the response are not.
+    // @param callback receives the decoded body bytes.
+    // @param data the data of the callback.
+    HttpResponseStatus
+    Feed(const char* text, std::size_t size, std::size_t& consumed, HttpBodyCallback callback, void* data);
+
+    // The connection has been closed.
+    // @return whether the response is complete, i.e. its body ends with the
+    // connection.
+    bool
+    End();
+
+    bool
+    HasHead() const;
+
+    const HttpResponseHead&
+    Head() const;
+
+    HttpParseError
+    Error() const;
+
+private:
+    HttpParserLimits limits_;
+    HttpResponseStatus status_;
+    HttpResponseHead head_;
+    bool has_head_;
+    HttpParseError error_;
+
+    // The head so far, when it is fragmented across reads.
+    std::string buffered_head_;
+    unsigned long long remaining_body_size_;
+    unsigned long long body_size_;
+    HttpChunkedBodyState chunked_body_;
+
+    bool
+    ReadHead(const char* text, std::size_t size, std::size_t& consumed);
+
+    bool
+    StartBody(const HttpResponseHead& head);
+
+    HttpResponseStatus
+    Fail(HttpParseError error);
 };
 
 }
@@ -1,118 +1,515 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <openssl/ssl.h>
 #include "http_scanner.h"
 #include "http_response.h"
+#include <lib/number_format.h>
+
+#define STATUS_LINE(status) "HTTP/1.1 " status "\r\n"
+
+#define JSON_RESPONSE_HEAD(status) STATUS_LINE(status) "Server: flash\r\nContent-Type: application/json\r\n"
+
+#define STATUS_TABLE(F) { \
+    F("200 OK"), \
+    F("400 Bad Request"), \
+    F("404 Not Found"), \
+    F("405 Method Not Allowed"), \
+    F("413 Payload Too Large"), \
+    F("431 Request Header Fields Too Large"), \
+    F("500 Internal Server Error"), \
+    F("502 Bad Gateway"), \
+    F("503 Service Unavailable"), \
+    F("504 Gateway Timeout"), \
+}
+
+using namespace std::literals::string_view_literals;
 
 namespace flashpoint {
 
+const PrerenderedResponse bad_request_response = {
+    HttpStatus::BadRequest,
+    "Server: flash\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 38\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "{\"errors\":[{\"message\":\"Bad Request\"}]}"sv,
+};
+
+const PrerenderedResponse payload_too_large_response = {
+    HttpStatus::PayloadTooLarge,
+    "Server: flash\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 44\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "{\"errors\":[{\"message\":\"Payload Too Large\"}]}"sv,
+};
+
+const PrerenderedResponse request_header_fields_too_large_response = {
+    HttpStatus::RequestHeaderFieldsTooLarge,
+    "Server: flash\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 58\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "{\"errors\":[{\"message\":\"Request Header Fields Too Large\"}]}"sv,
+};
+
+const std::string_view status_lines[] = STATUS_TABLE(STATUS_LINE);
+
+const std::string_view json_response_heads[] = STATUS_TABLE(JSON_RESPONSE_HEAD);
+
+static_assert(sizeof(status_lines) / sizeof(status_lines[0]) == static_cast<std::size_t>(HttpStatus::End));
+
+std::string_view GetStatusLine(HttpStatus status) {
+    return status_lines[static_cast<std::size_t>(status)];
+}
+
+std::string_view GetJsonResponseHead(HttpStatus status) {
+    return json_response_heads[static_cast<std::size_t>(status)];
+}
+
+const PrerenderedResponse& GetParseErrorResponse(HttpParseError error) {
+    switch (error) {
+        case HttpParseError::PayloadTooLarge:
+            return payload_too_large_response;
+        case HttpParseError::HeaderFieldsTooLarge:
+            return request_header_fields_too_large_response;
+        default:
+            return bad_request_response;
+    }
+}
+
 namespace HttpWriterHelperMethods {
 
-void OnWriteEnd(uv_write_t *write_request, int status) {
-    if (status == -1) {
-        fprintf(stderr, "error on_write_end");
+void ReleaseWriteRequest(HttpWriteRequest *write_request) {
+    if (write_request->pool != nullptr) {
+        write_request->pool->ReturnWriteRequest(write_request);
         return;
     }
-
+    for (const HttpWriteBuffer& buffer : write_request->buffers) {
+        delete[] buffer.base;
+    }
     delete write_request;
 }
 
+void OnWriteEnd(uv_write_t *write_request, int status) {
+    if (status < 0) {
+        fprintf(stderr, "error on_write_end: %s\n", uv_strerror(status));
+    }
+    ReleaseWriteRequest(static_cast<HttpWriteRequest*>(write_request->data));
 }
 
-HttpWriter::HttpWriter(uv_stream_t* tcp_handle)
-    : tcp_handle(tcp_handle),
-      use_ssl_(false) {
+}
+
+HttpWriterPool::HttpWriterPool(MemoryPool* memory_pool)
+    : memory_pool_(memory_pool) { }
+
+HttpWriterPool::~HttpWriterPool() {
+    for (HttpWriteRequest* write_request : free_write_requests_) {
+        delete write_request;
+    }
+}
+
+HttpWriteRequest* HttpWriterPool::TakeWriteRequest() {
+    stats_.write_requests_taken++;
+    if (free_write_requests_.empty()) {
+        stats_.write_request_allocations++;
+        auto write_request = new HttpWriteRequest;
+        write_request->pool = this;
+        return write_request;
+    }
+    HttpWriteRequest* write_request = free_write_requests_.back();
+    free_write_requests_.pop_back();
+    return write_request;
+}
+
+void HttpWriterPool::ReturnWriteRequest(HttpWriteRequest* write_request) {
+    for (const HttpWriteBuffer& buffer : write_request->buffers) {
+        if (buffer.pooled) {
+            memory_pool_->ReturnBlock(buffer.base);
+        }
+        else {
+            delete[] buffer.base;
+        }
+    }
+    write_request->buffers.clear();
+    write_request->segments.clear();
+    write_request->owners.clear();
+    free_write_requests_.push_back(write_request);
+}
 
-    write_buffer_ = new char[buffer_size_];
+HttpWriteBuffer HttpWriterPool::TakeBuffer() {
+    stats_.buffers_taken++;
+    char* block = memory_pool_->TakeBlock();
+    if (block != nullptr) {
+        return HttpWriteBuffer { block, true };
+    }
+    stats_.buffer_allocations++;
+    return HttpWriteBuffer { new char[BufferSize()], false };
 }
 
+std::size_t HttpWriterPool::BufferSize() const {
+    return memory_pool_->BlockSize();
+}
+
+const HttpWriterPoolStats& HttpWriterPool::Stats() const {
+    return stats_;
+}
+
+HttpWriterPoolStats& HttpWriterPool::Stats() {
+    return stats_;
+}
+
+HttpWriter::HttpWriter(uv_stream_t* tcp_handle)
+    : HttpWriter(tcp_handle, nullptr, nullptr) { }
+
 HttpWriter::HttpWriter(uv_stream_t *tcp_handle, SSL *ssl_handle)
-    : tcp_handle(tcp_handle),
-      ssl_handle(ssl_handle),
-      use_ssl_(true) {
+    : HttpWriter(tcp_handle, ssl_handle, nullptr) { }
+
+HttpWriter::HttpWriter(uv_stream_t* tcp_handle, HttpWriterPool* pool)
+    : HttpWriter(tcp_handle, nullptr, pool) { }
+
+HttpWriter::HttpWriter(uv_stream_t *tcp_handle, SSL *ssl_handle, HttpWriterPool* pool)
+    : ssl_handle(ssl_handle),
+      tcp_handle(tcp_handle),
+      use_ssl_(ssl_handle != nullptr),
+      pool_(pool),
+      write_request_(nullptr) {
+    if (pool_ != nullptr) {
+        buffer_size_ = pool_->BufferSize();
+    }
+    position_ = buffer_size_;
+    segment_start_ = buffer_size_;
+    write_request_ = TakeWriteRequest();
+}
+
+HttpWriter::~HttpWriter() {
+    if (write_request_ != nullptr) {
+        HttpWriterHelperMethods::ReleaseWriteRequest(write_request_);
+    }
+}
 
-    write_buffer_ = new char[buffer_size_];
+HttpWriteRequest* HttpWriter::TakeWriteRequest() {
+    if (pool_ != nullptr) {
+        return pool_->TakeWriteRequest();
+    }
+    auto write_request = new HttpWriteRequest;
+    write_request->pool = nullptr;
+    return write_request;
+}
+
+HttpWriteBuffer HttpWriter::TakeBuffer() {
+    if (pool_ != nullptr) {
+        return pool_->TakeBuffer();
+    }
+    return HttpWriteBuffer { new char[buffer_size_], false };
 }
 
 void HttpWriter::WriteRequest(HttpMethod method,
                               const char *path) {
     switch (method) {
         case HttpMethod::Get:
-            Write("GET ");
+            Write("GET "sv);
             break;
         case HttpMethod::Post:
-            Write("POST ");
+            Write("POST "sv);
             break;
         case HttpMethod::Patch:
-            Write("PATCH ");
+            Write("PATCH "sv);
             break;
         case HttpMethod::Head:
-            Write("HEAD ");
+            Write("HEAD "sv);
             break;
         default:;
     }
     Write(path);
-    Write(" HTTP/1.1\r\n");
+    Write(" HTTP/1.1\r\n"sv);
 }
 
 void HttpWriter::Write(const char *text) {
+    Write(text, std::strlen(text));
+}
+
+void HttpWriter::Write(std::string_view text) {
+    Write(text.data(), text.size());
+}
 
-    for (std::size_t i = 0; i < strlen(text); i++) {
+void HttpWriter::Write(const char *text, std::size_t size) {
+    size_ += size;
+    while (size > 0) {
         if (position_ == buffer_size_) {
-            FlushBuffer();
+            NextBuffer();
         }
-        write_buffer_[position_] = text[i];
-        position_++;
+        std::size_t copy_size = std::min(size, buffer_size_ - position_);
+        std::memcpy(write_buffer_ + position_, text, copy_size);
+        position_ += copy_size;
+        text += copy_size;
+        size -= copy_size;
     }
 }
 
+// Get space for a number of bytes in the current buffer, so that a number can
+// be formatted in place. The size is at most a few bytes, far below the
+// buffer size.
+char* HttpWriter::Reserve(std::size_t size) {
+    if (buffer_size_ - position_ < size) {
+        NextBuffer();
+    }
+    return write_buffer_ + position_;
+}
+
+void HttpWriter::WriteUnsigned(std::uint64_t value) {
+    char* text = Reserve(max_u64_size);
+    std::size_t size = format_u64(value, text);
+    position_ += size;
+    size_ += size;
+}
+
+void HttpWriter::WriteSigned(std::int64_t value) {
+    char* text = Reserve(max_i64_size);
+    std::size_t size = format_i64(value, text);
+    position_ += size;
+    size_ += size;
+}
+
+void HttpWriter::WriteDouble(double value) {
+    char* text = Reserve(max_double_size);
+    std::size_t size = format_double(value, text);
+    position_ += size;
+    size_ += size;
+}
+
+void HttpWriter::WriteReference(const char *text, std::size_t size) {
+    if (size < min_reference_size) {
+        Write(text, size);
+        return;
+    }
+    EndSegment();
+    write_request_->segments.push_back(uv_buf_init(const_cast<char*>(text), (unsigned int)size));
+    size_ += size;
+}
+
 void HttpWriter::WriteLine() {
-    Write("\r\n");
+    Write("\r\n"sv);
 }
 
 void HttpWriter::WriteLine(const char *text) {
-
     Write(text);
-    Write("\r\n");
+    Write("\r\n"sv);
 }
 
-void HttpWriter::FlushBuffer() {
-    if (position_ == 0) {
-        return;
+void HttpWriter::WriteJsonResponseHead(HttpStatus status, const HttpDateClock& date, bool keep_alive) {
+    Write(GetJsonResponseHead(status));
+    Write(date.Header());
+    Write(keep_alive ? connection_keep_alive_header : connection_close_header);
+}
+
+std::size_t HttpWriter::Size() const {
+    return size_;
+}
+
+void HttpWriter::EndSegment() {
+    if (position_ > segment_start_) {
+        write_request_->segments.push_back(uv_buf_init(write_buffer_ + segment_start_, (unsigned int)(position_ - segment_start_)));
     }
-    if (use_ssl_) {
-        SSL_write(ssl_handle, write_buffer_, (int)position_);
-        char buf[1024 * 16];
-        int bytes_read = 0;
-        while ((bytes_read = BIO_read(ssl_handle->wbio, buf, sizeof(buf))) > 0) {
-            auto write_request = (uv_write_t*)malloc(sizeof(uv_write_t));
-            write_request->data = this;
-            uv_buf_t buffer = uv_buf_init(buf, (unsigned int)bytes_read);
-            int r = uv_write(write_request, tcp_handle, &buffer, 1, HttpWriterHelperMethods::OnWriteEnd);
-            if(r < 0) {
-                printf("ERROR: WriteToSocket erro");
-                return;
+    segment_start_ = position_;
+}
+
+void HttpWriter::NextBuffer() {
+    EndSegment();
+    HttpWriteBuffer buffer = TakeBuffer();
+    write_request_->buffers.push_back(buffer);
+    write_buffer_ = buffer.base;
+    position_ = 0;
+    segment_start_ = 0;
+}
+
+void HttpWriter::Retain(std::shared_ptr<const void> owner) {
+    write_request_->owners.push_back(std::move(owner));
+}
+
+// Segments are gathered into full sized records before they are encrypted,
+// since SSL_write makes at least one record per call. SSL_write copies the
+// plaintext, so one record buffer per thread is enough.
+void HttpWriter::WriteToSsl() {
+    static thread_local char record[max_ssl_record_size];
+    HttpWriteRequest* write_request = write_request_;
+    write_request_ = nullptr;
+    std::size_t record_size = 0;
+    std::size_t ssl_writes = 0;
+    for (const uv_buf_t& segment : write_request->segments) {
+        const char* text = segment.base;
+        std::size_t size = segment.len;
+        while (size > 0) {
+            if (record_size == 0 && size >= max_ssl_record_size) {
+                SSL_write(ssl_handle, text, (int)max_ssl_record_size);
+                ssl_writes++;
+                text += max_ssl_record_size;
+                size -= max_ssl_record_size;
+                continue;
+            }
+            std::size_t copy_size = std::min(size, max_ssl_record_size - record_size);
+            std::memcpy(record + record_size, text, copy_size);
+            record_size += copy_size;
+            text += copy_size;
+            size -= copy_size;
+            if (record_size == max_ssl_record_size) {
+                SSL_write(ssl_handle, record, (int)record_size);
+                ssl_writes++;
+                record_size = 0;
             }
         }
     }
-    else {
-        WriteToSocket();
+    if (record_size > 0) {
+        SSL_write(ssl_handle, record, (int)record_size);
+        ssl_writes++;
     }
-    position_ = 0;
+    if (pool_ != nullptr) {
+        pool_->Stats().ssl_writes += ssl_writes;
+    }
+    write_request->segments.clear();
+    write_request->owners.clear();
+
+    BIO* write_bio = SSL_get_wbio(ssl_handle);
+    std::size_t buffer_index = 0;
+    while (BIO_pending(write_bio) > 0) {
+        if (buffer_index == write_request->buffers.size()) {
+            write_request->buffers.push_back(TakeBuffer());
+        }
+        char* buffer = write_request->buffers[buffer_index++].base;
+        int bytes_read = BIO_read(write_bio, buffer, (int)buffer_size_);
+        if (bytes_read <= 0) {
+            break;
+        }
+        write_request->segments.push_back(uv_buf_init(buffer, (unsigned int)bytes_read));
+    }
+    write_request_ = write_request;
+    WriteToSocket();
 }
 
 void HttpWriter::WriteToSocket() {
-    uv_write_t *write_request = (uv_write_t*)malloc(sizeof(uv_write_t));
-    write_request->data = this;
-    uv_buf_t buffer = uv_buf_init(write_buffer_, (int)position_);
-    int r = uv_write(write_request, tcp_handle, &buffer, 1, HttpWriterHelperMethods::OnWriteEnd);
-    if(r < 0) {
-        printf("ERROR: WriteToSocket erro");
+    HttpWriteRequest* write_request = write_request_;
+    write_request_ = nullptr;
+    if (write_request->segments.empty()) {
+        HttpWriterHelperMethods::ReleaseWriteRequest(write_request);
+        return;
+    }
+    write_request->write_request.data = write_request;
+    if (pool_ != nullptr) {
+        pool_->Stats().socket_writes++;
+    }
+    int r = uv_write(&write_request->write_request,
+                     tcp_handle,
+                     write_request->segments.data(),
+                     (unsigned int)write_request->segments.size(),
+                     HttpWriterHelperMethods::OnWriteEnd);
+    if (r < 0) {
+        fprintf(stderr, "ERROR: WriteToSocket error: %s\n", uv_strerror(r));
+        HttpWriterHelperMethods::ReleaseWriteRequest(write_request);
     }
 }
 
 void HttpWriter::End() {
-    FlushBuffer();
+    if (is_end) {
+        return;
+    }
+    EndSegment();
+    if (use_ssl_) {
+        WriteToSsl();
+    }
+    else {
+        WriteToSocket();
+    }
     is_end = true;
 }
 
+HttpResponse::HttpResponse(HttpStatus status)
+    : status_(status) { }
+
+void HttpResponse::SetStatus(HttpStatus status) {
+    status_ = status;
+}
+
+void HttpResponse::SetHeader(HttpHeader header, std::string_view value) {
+    switch (header) {
+        case HttpHeader::Unknown:
+        case HttpHeader::Server:
+        case HttpHeader::Date:
+        case HttpHeader::ContentLength:
+        case HttpHeader::Connection:
+        case HttpHeader::TransferEncoding:
+        case HttpHeader::End:
+            return;
+        default:
+            headers_[static_cast<std::size_t>(header)] = value;
+    }
+}
+
+void HttpResponse::AddCustomHeader(std::string_view name, std::string_view value) {
+    custom_headers_.push_back(CustomHttpHeader { name, value });
+}
+
+void HttpResponse::SetKeepAlive(bool keep_alive) {
+    keep_alive_ = keep_alive;
+}
+
+bool HttpResponse::KeepAlive() const {
+    return keep_alive_;
+}
+
+void HttpResponse::Write(std::string_view text) {
+    body_.append(text.data(), text.size());
+}
+
+void HttpResponse::WriteReference(std::string_view text) {
+    body_references_.push_back(BodyReference { body_.size(), text });
+    reference_size_ += text.size();
+}
+
+std::size_t HttpResponse::ContentLength() const {
+    return body_.size() + reference_size_;
+}
+
+void HttpResponse::WriteTo(HttpWriter& writer, const HttpDateClock& date) const {
+    if (headers_[static_cast<std::size_t>(HttpHeader::ContentType)].empty()) {
+        writer.Write(GetJsonResponseHead(status_));
+    }
+    else {
+        writer.Write(GetStatusLine(status_));
+        writer.Write(server_header);
+    }
+    writer.Write(date.Header());
+    for (std::size_t i = 0; i < http_header_size; i++) {
+        if (headers_[i].empty()) {
+            continue;
+        }
+        writer.Write(GetHeaderName(static_cast<HttpHeader>(i)));
+        writer.Write(": "sv);
+        writer.Write(headers_[i]);
+        writer.Write("\r\n"sv);
+    }
+    for (const CustomHttpHeader& header : custom_headers_) {
+        writer.Write(header.name);
+        writer.Write(": "sv);
+        writer.Write(header.value);
+        writer.Write("\r\n"sv);
+    }
+    writer.Write("Content-Length: "sv);
+    writer.WriteUnsigned(ContentLength());
+    writer.Write("\r\n"sv);
+    writer.Write(keep_alive_ ? connection_keep_alive_header : connection_close_header);
+    writer.Write("\r\n"sv);
+
+    std::size_t position = 0;
+    for (const BodyReference& reference : body_references_) {
+        writer.Write(std::string_view(body_).substr(position, reference.position - position));
+        writer.WriteReference(reference.text.data(), reference.text.size());
+        position = reference.position;
+    }
+    writer.Write(std::string_view(body_).substr(position));
+}
+
 } // flashpoint
@@ -4,7 +4,13 @@
 #include <program/http_parser.h>
 #include <program/http_scanner.h>
 #include <program/http_server.h>
+#include <program/http_date.h>
+#include <lib/memory_pool.h>
+#include <string>
+#include <string_view>
+#include <memory>
 #include <unordered_map>
+#include <vector>
 #include <openssl/ssl.h>
 #include <uv.h>
 
@@ -52,59 +58,276 @@ public:
     ~mmap_allocator() throw() { }
 };
 
+enum class HttpStatus {
+    Ok,
+    BadRequest,
+    NotFound,
+    MethodNotAllowed,
+    PayloadTooLarge,
+    RequestHeaderFieldsTooLarge,
+    InternalServerError,
+    BadGateway,
+    ServiceUnavailable,
+    GatewayTimeout,
+    End,
+};
+
+constexpr std::string_view server_header = "Server: flash\r\n";
+constexpr std::string_view content_type_json_header = "Content-Type: application/json\r\n";
+constexpr std::string_view connection_keep_alive_header = "Connection: keep-alive\r\n";
+constexpr std::string_view connection_close_header = "Connection: close\r\n";
+
+// Get the pre-rendered status line of a status, including the trailing CRLF.
+std::string_view GetStatusLine(HttpStatus status);
+
+// Get the pre-rendered status line of a status followed by the Server and
+// the JSON Content-Type header, which every GraphQL response starts with.
+std::string_view GetJsonResponseHead(HttpStatus status);
+
+// A response whose bytes are all pre-rendered, except for the Date header
+// that follows its status line.
+struct PrerenderedResponse {
+    HttpStatus status;
+
+    // The headers after the Date header, and the body.
+    std::string_view tail;
+};
+
+// Get the pre-rendered 400, 413 or 431 response for a request that failed to
+// parse. They all close the connection, since the rest of the stream can't be
+// trusted after a parse error.
+const PrerenderedResponse& GetParseErrorResponse(HttpParseError error);
+
 class HttpHeaderWriter {
 public:
     HttpHeaderWriter(char* header);
 };
 
+// The buffers and segments of one write. It is owned by the writer until the
+// writer ends, and then by the uv write request until the write completes.
+struct HttpWriteBuffer {
+    char* base;
+    bool pooled;
+};
+
+class HttpWriterPool;
+
+struct HttpWriteRequest {
+    uv_write_t write_request;
+    HttpWriterPool* pool;
+    std::vector<HttpWriteBuffer> buffers;
+    std::vector<uv_buf_t> segments;
+    std::vector<std::shared_ptr<const void>> owners;
+};
+
+// Counters of a writer pool. Once a loop is warmed up, the allocation
+// counters should stay flat while the taken counters keep growing.
+struct HttpWriterPoolStats {
+    std::size_t write_requests_taken;
+    std::size_t write_request_allocations;
+    std::size_t buffers_taken;
+    std::size_t buffer_allocations;
+    std::size_t ssl_writes;
+    std::size_t socket_writes;
+};
+
+// Pool of the write requests and buffers of the writers of a loop. Buffers
+// are blocks of the loop's memory pool, and are only allocated on the heap
+// when the memory pool is exhausted. Everything is returned to the pool when
+// the uv write completes.
+class HttpWriterPool {
+public:
+    HttpWriterPool(MemoryPool* memory_pool);
+
+    ~HttpWriterPool();
+
+    HttpWriteRequest* TakeWriteRequest();
+
+    // Return a write request together with its buffers.
+    void ReturnWriteRequest(HttpWriteRequest* write_request);
+
+    HttpWriteBuffer TakeBuffer();
+
+    std::size_t BufferSize() const;
+
+    const HttpWriterPoolStats& Stats() const;
+
+    HttpWriterPoolStats& Stats();
+
+private:
+    MemoryPool* memory_pool_;
+    std::vector<HttpWriteRequest*> free_write_requests_;
+    HttpWriterPoolStats stats_ { };
+};
+
+// The largest TLS record plaintext.
+const std::size_t max_ssl_record_size = 16384;
+
+// Assembles a message as a list of segments. Small writes are copied into
+// 4KB buffers, large payloads are referenced as they are, so the whole message
+// is written with one vectored write when the writer ends. The writer is
+// corked until it ends: with TLS, the message is encrypted in as few full
+// sized records as possible and the records are written together.
 class HttpWriter {
 public:
     HttpWriter(uv_stream_t *tcp_handle);
+
     HttpWriter(uv_stream_t *tcp_handle, SSL *ssl_handle);
 
+    HttpWriter(uv_stream_t *tcp_handle, HttpWriterPool* pool);
+
+    HttpWriter(uv_stream_t *tcp_handle, SSL *ssl_handle, HttpWriterPool* pool);
+
+    // A writer owns its write request, which a copy would free twice.
+    HttpWriter(const HttpWriter&) = delete;
+
+    HttpWriter& operator=(const HttpWriter&) = delete;
+
+    ~HttpWriter();
+
     // Write text to buffer
-    // @param text the text
-    // @param text the size of the text
+    // @param text the null terminated text
     void Write(const char *text);
 
+    // Write text to buffer
+    // @param text the text
+    // @param size the size of the text
+    void Write(const char *text, std::size_t size);
+
+    void Write(std::string_view text);
+
     template<typename ...Args>
     void Write(const char*, Args ...args);
 
+    // Write the decimal representation of a number to buffer.
+    // @param value the number
+    void WriteUnsigned(std::uint64_t value);
+
+    void WriteSigned(std::int64_t value);
+
+    void WriteDouble(double value);
+
+    // Append text without copying it. Text that is smaller than
+    // min_reference_size is copied, since a segment costs more than the copy.
+    // @param text the text, which must stay alive until the write has completed.
+    // @param size the size of the text
+    void WriteReference(const char *text, std::size_t size);
+
+    // Keep the owner of referenced text alive until the write has completed.
+    void Retain(std::shared_ptr<const void> owner);
+
     // Write text with newline in the end to buffer
     // @param text the text
-    // @param text the size of the text
     void WriteLine();
+
     void WriteLine(const char *text);
+
     template<typename ...Args>
     void WriteLine(const char*, Args ...args);
 
+    // Write the head of a JSON response, except for the headers that frame
+    // the body, as a few copies of pre-rendered blocks.
+    // @param status the status.
+    // @param date the cached Date header of the loop.
+    // @param keep_alive whether the connection is kept alive after the response.
+    void WriteJsonResponseHead(HttpStatus status, const HttpDateClock& date, bool keep_alive);
+
     // Write HTTP request line to buffer
     // @param method the HTTP method.
     // @param path the HTTP path.
-    // @param path_size the HTTP path size in bytes.
     void WriteRequest(HttpMethod method,
                       const char *path);
 
-    // End the writer. It also flushes the buffer.
+    // End the writer. It writes all segments to the socket.
     void End();
 
+    // The size of the message that has been written so far.
+    std::size_t Size() const;
+
     void(*Read)(uv_stream_t* tcp_handle, ssize_t nread, const uv_buf_t* buf);
 
     bool is_end = false;
+
     SSL* ssl_handle;
+
     uv_stream_t *tcp_handle;
 
+    static const std::size_t min_reference_size = 1024;
+
 private:
     bool use_ssl_;
-    char* write_buffer_;
+    HttpWriterPool* pool_;
+    HttpWriteRequest* write_request_;
+    char* write_buffer_ = nullptr;
     std::size_t buffer_size_ = 4096;
-    std::size_t position_ = 0;
-    std::map<HttpHeader, const char*> headers;
-    std::map<const char*, const char*> custom_headers;
+    std::size_t position_ = 4096;
+    std::size_t segment_start_ = 4096;
+    std::size_t size_ = 0;
+    void NextBuffer();
+    char* Reserve(std::size_t size);
+    HttpWriteRequest* TakeWriteRequest();
+    HttpWriteBuffer TakeBuffer();
+    void EndSegment();
+    void WriteToSocket();
+    void WriteToSsl();
+};
 
-    void FlushBuffer();
+struct CustomHttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
 
-    void WriteToSocket();
+// A response to a client. The status, the headers and the body are gathered
+// first and written in one go, so Content-Length is computed once and the
+// whole response ends up in one vectored write.
+class HttpResponse {
+public:
+    HttpResponse(HttpStatus status);
+
+    void SetStatus(HttpStatus status);
+
+    // Set a known header. Server, Date, Content-Length, Connection and
+    // Transfer-Encoding are written by the response itself and can't be set.
+    // @param header the header.
+    // @param value the value, which must stay alive until the response is written.
+    void SetHeader(HttpHeader header, std::string_view value);
+
+    // Add a header that has no HttpHeader.
+    // @param name the name, which must stay alive until the response is written.
+    // @param value the value, which must stay alive until the response is written.
+    void AddCustomHeader(std::string_view name, std::string_view value);
+
+    void SetKeepAlive(bool keep_alive);
+
+    bool KeepAlive() const;
+
+    // Append text to the body.
+    // @param text the text, which is copied.
+    void Write(std::string_view text);
+
+    // Append text to the body without copying it.
+    // @param text the text, which must stay alive until the write has completed.
+    void WriteReference(std::string_view text);
+
+    std::size_t ContentLength() const;
+
+    // Write the response.
+    // @param writer the writer, which is not ended.
+    // @param date the cached Date header of the loop.
+    void WriteTo(HttpWriter& writer, const HttpDateClock& date) const;
+
+private:
+    struct BodyReference {
+        std::size_t position;
+        std::string_view text;
+    };
+    HttpStatus status_;
+    bool keep_alive_ = true;
+    std::string_view headers_[http_header_size];
+    std::vector<CustomHttpHeader> custom_headers_;
+    std::string body_;
+    std::vector<BodyReference> body_references_;
+    std::size_t reference_size_ = 0;
 };
 
 template<typename ...Args>
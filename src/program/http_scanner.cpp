@@ -1,8 +1,8 @@
 #include <iostream>
+#include <algorithm>
 #include <tuple>
 #include <lib/utils.h>
 #include <lib/character.h>
-#include <ctype.h>
 #include "http_scanner.h"
 
 using namespace flashpoint::lib;
@@ -18,86 +18,270 @@ HttpScanner::HttpScanner(const char* text, std::size_t size):
 
 char HttpScanner::current_char()
 {
+    if (position >= size) {
+        return Character::NullCharacter;
+    }
     return text[position];
 }
 
+bool HttpScanner::has_error() const
+{
+    return error != HttpParseError::None;
+}
+
+HttpParseError HttpScanner::get_error() const
+{
+    return error;
+}
+
+long long HttpScanner::get_error_position() const
+{
+    return error_position;
+}
+
+long long HttpScanner::get_position() const
+{
+    return position;
+}
+
+void HttpScanner::set_error(HttpParseError error)
+{
+    if (this->error != HttpParseError::None) {
+        return;
+    }
+    this->error = error;
+    error_position = position;
+}
+
 HttpMethod HttpScanner::scan_method()
 {
+    if (has_error()) {
+        return HttpMethod::None;
+    }
+    const char* name = nullptr;
     HttpMethod token = HttpMethod::None;
     switch (current_char()) {
         case Character::C:
-            position += 7;
+            name = "CONNECT";
             token = HttpMethod::Connect;
             break;
         case Character::D:
-            position += 6;
+            name = "DELETE";
             token = HttpMethod::Delete;
             break;
         case Character::G:
-            position += 3;
+            name = "GET";
             token = HttpMethod::Get;
             break;
         case Character::H:
-            position += 4;
+            name = "HEAD";
             token = HttpMethod::Head;
             break;
         case Character::O:
-            position += 7;
+            name = "OPTIONS";
             token = HttpMethod::Options;
             break;
         case Character::P:
-            increment_position();
-            switch (current_char()) {
+            if (position + 1 >= size) {
+                set_error(HttpParseError::UnexpectedEndOfRequest);
+                return HttpMethod::None;
+            }
+            switch (text[position + 1]) {
                 case Character::A:
-                    position += 4;
+                    name = "PATCH";
                     token = HttpMethod::Patch;
                     break;
                 case Character::O:
-                    position += 3;
+                    name = "POST";
                     token = HttpMethod::Post;
                     break;
                 case Character::U:
-                    position += 2;
+                    name = "PUT";
                     token = HttpMethod::Put;
                     break;
             }
             break;
         case Character::T:
-            position += 5;
+            name = "TRACE";
             token = HttpMethod::Trace;
             break;
     }
-    if (position >= size) {
-        throw std::logic_error("Invalid request.");
+    if (name == nullptr) {
+        set_error(HttpParseError::InvalidMethod);
+        return HttpMethod::None;
+    }
+    std::size_t name_size = std::strlen(name);
+    if (position + static_cast<long long>(name_size) >= size) {
+        set_error(HttpParseError::UnexpectedEndOfRequest);
+        return HttpMethod::None;
+    }
+    if (std::memcmp(text + position, name, name_size) != 0) {
+        set_error(HttpParseError::InvalidMethod);
+        return HttpMethod::None;
     }
+    position += name_size;
     return token;
 }
 
-char* HttpScanner::scan_body(unsigned int length)
+char* HttpScanner::scan_body(std::size_t length)
 {
-    unsigned long long i = 0;
-    set_token_start_position();
-    while (position < size && i < length) {
-        increment_position();
-        i++;
+    if (has_error()) {
+        return nullptr;
+    }
+    if (static_cast<std::size_t>(size - position) < length) {
+        position = size;
+        set_error(HttpParseError::UnexpectedEndOfRequest);
+        return nullptr;
     }
+    set_token_start_position();
+    position += static_cast<long long>(length);
     return get_token_value();
 }
 
+HttpBodyStatus HttpScanner::scan_chunked_body(HttpChunkedBodyState& state, HttpBodyCallback callback, void* data)
+{
+    if (has_error()) {
+        return HttpBodyStatus::Error;
+    }
+    while (position < size) {
+        char ch = text[position];
+        switch (state.mode) {
+            case ChunkedBodyMode::ChunkSize: {
+                int digit;
+                if (ch >= Character::_0 && ch <= Character::_9) {
+                    digit = ch - Character::_0;
+                }
+                else if (ch >= Character::a && ch <= Character::f) {
+                    digit = ch - Character::a + 10;
+                }
+                else if (ch >= Character::A && ch <= Character::F) {
+                    digit = ch - Character::A + 10;
+                }
+                else if (state.has_chunk_size_digit && (ch == Character::Semicolon || ch == Character::Space || ch == Character::HorizontalTab)) {
+                    state.mode = ChunkedBodyMode::ChunkExtension;
+                    break;
+                }
+                else if (state.has_chunk_size_digit && ch == Character::CarriageReturn) {
+                    state.mode = ChunkedBodyMode::ChunkSizeLineFeed;
+                    break;
+                }
+                else {
+                    set_error(HttpParseError::InvalidChunkedBody);
+                    return HttpBodyStatus::Error;
+                }
+                if (state.chunk_size > (state.max_body_size >> 4)) {
+                    set_error(HttpParseError::PayloadTooLarge);
+                    return HttpBodyStatus::Error;
+                }
+                state.chunk_size = (state.chunk_size << 4) | digit;
+                state.has_chunk_size_digit = true;
+                break;
+            }
+            case ChunkedBodyMode::ChunkExtension:
+                if (ch == Character::CarriageReturn) {
+                    state.mode = ChunkedBodyMode::ChunkSizeLineFeed;
+                }
+                break;
+            case ChunkedBodyMode::ChunkSizeLineFeed:
+                if (ch != Character::NewLine) {
+                    set_error(HttpParseError::InvalidChunkedBody);
+                    return HttpBodyStatus::Error;
+                }
+                if (state.chunk_size == 0) {
+                    state.mode = ChunkedBodyMode::TrailerLineStart;
+                    break;
+                }
+                state.body_size += state.chunk_size;
+                if (state.body_size > state.max_body_size) {
+                    set_error(HttpParseError::PayloadTooLarge);
+                    return HttpBodyStatus::Error;
+                }
+                state.mode = ChunkedBodyMode::ChunkData;
+                break;
+            case ChunkedBodyMode::ChunkData: {
+                unsigned long long available = static_cast<unsigned long long>(size - position);
+                std::size_t span_size = static_cast<std::size_t>(std::min(available, state.chunk_size));
+                callback(data, text + position, span_size);
+                position += span_size;
+                state.chunk_size -= span_size;
+                if (state.chunk_size == 0) {
+                    state.mode = ChunkedBodyMode::ChunkDataCarriageReturn;
+                }
+                continue;
+            }
+            case ChunkedBodyMode::ChunkDataCarriageReturn:
+                if (ch != Character::CarriageReturn) {
+                    set_error(HttpParseError::InvalidChunkedBody);
+                    return HttpBodyStatus::Error;
+                }
+                state.mode = ChunkedBodyMode::ChunkDataLineFeed;
+                break;
+            case ChunkedBodyMode::ChunkDataLineFeed:
+                if (ch != Character::NewLine) {
+                    set_error(HttpParseError::InvalidChunkedBody);
+                    return HttpBodyStatus::Error;
+                }
+                state.has_chunk_size_digit = false;
+                state.mode = ChunkedBodyMode::ChunkSize;
+                break;
+            case ChunkedBodyMode::TrailerLineStart:
+                state.mode = ch == Character::CarriageReturn ? ChunkedBodyMode::FinalLineFeed : ChunkedBodyMode::TrailerLine;
+                break;
+            case ChunkedBodyMode::TrailerLine:
+                if (ch == Character::CarriageReturn) {
+                    state.mode = ChunkedBodyMode::TrailerLineFeed;
+                }
+                break;
+            case ChunkedBodyMode::TrailerLineFeed:
+                if (ch != Character::NewLine) {
+                    set_error(HttpParseError::InvalidChunkedBody);
+                    return HttpBodyStatus::Error;
+                }
+                state.mode = ChunkedBodyMode::TrailerLineStart;
+                break;
+            case ChunkedBodyMode::FinalLineFeed:
+                if (ch != Character::NewLine) {
+                    set_error(HttpParseError::InvalidChunkedBody);
+                    return HttpBodyStatus::Error;
+                }
+                position++;
+                state.mode = ChunkedBodyMode::Done;
+                return HttpBodyStatus::Complete;
+            case ChunkedBodyMode::Done:
+                return HttpBodyStatus::Complete;
+        }
+        position++;
+    }
+    return state.mode == ChunkedBodyMode::Done ? HttpBodyStatus::Complete : HttpBodyStatus::Incomplete;
+}
+
 char* HttpScanner::scan_absolute_path()
 {
+    if (has_error()) {
+        return nullptr;
+    }
     set_token_start_position();
-    scan_expected(Character::Slash);
+    if (current_char() != Character::Slash) {
+        set_error(HttpParseError::InvalidRequestTarget);
+        return nullptr;
+    }
+    increment_position();
     char ch = current_char();
     while (position < size && (is_pchar(ch) || ch == Character::Slash)) {
         increment_position();
         ch = current_char();
     }
+    if (has_error()) {
+        return nullptr;
+    }
     return get_token_value();
 }
 
 char* HttpScanner::scan_query()
 {
+    if (has_error()) {
+        return nullptr;
+    }
     set_token_start_position();
     if (next_char_is(Character::Question)) {
         char ch = current_char();
@@ -106,39 +290,96 @@ char* HttpScanner::scan_query()
             ch = current_char();
         }
     }
+    if (has_error()) {
+        return nullptr;
+    }
     return get_token_value();
 }
 
 RequestLineToken HttpScanner::scan_http_version()
 {
-    scan_expected(Character::H);
-    position += 7;
-    char ch = text[position];
-    return RequestLineToken::HttpVersion1_1;
+    if (has_error()) {
+        return RequestLineToken::None;
+    }
+    const std::size_t version_size = 8;
+    if (position + static_cast<long long>(version_size) > size) {
+        set_error(HttpParseError::UnexpectedEndOfRequest);
+        return RequestLineToken::None;
+    }
+    if (std::memcmp(text + position, "HTTP/1.1", version_size) == 0) {
+        position += version_size;
+        return RequestLineToken::HttpVersion1_1;
+    }
+    if (std::memcmp(text + position, "HTTP/1.0", version_size) == 0) {
+        position += version_size;
+        return RequestLineToken::HttpVersion1_0;
+    }
+    set_error(HttpParseError::InvalidHttpVersion);
+    return RequestLineToken::None;
+}
+
+unsigned int HttpScanner::scan_status_code()
+{
+    if (has_error()) {
+        return 0;
+    }
+    const std::size_t status_code_size = 3;
+    if (position + static_cast<long long>(status_code_size) > size) {
+        set_error(HttpParseError::UnexpectedEndOfRequest);
+        return 0;
+    }
+    unsigned int status_code = 0;
+    for (std::size_t i = 0; i < status_code_size; i++) {
+        char ch = text[position + i];
+        if (ch < Character::_0 || ch > Character::_9) {
+            set_error(HttpParseError::InvalidStatusCode);
+            return 0;
+        }
+        status_code = status_code * 10 + (ch - Character::_0);
+    }
+    if (status_code < 100) {
+        set_error(HttpParseError::InvalidStatusCode);
+        return 0;
+    }
+    position += status_code_size;
+    return status_code;
 }
 
 HttpHeader HttpScanner::scan_header()
 {
+    if (has_error()) {
+        return HttpHeader::End;
+    }
     set_token_start_position();
     if (!is_header_field_start(current_char())) {
         if (scan_optional(Character::CarriageReturn)) {
             scan_expected(Character::NewLine);
             return HttpHeader::End;
         }
-        throw std::logic_error("Parse error in the header");
+        set_error(position >= size ? HttpParseError::UnexpectedEndOfRequest : HttpParseError::InvalidHeader);
+        return HttpHeader::End;
     }
     while (position < size && is_header_field_part(current_char())) {
         increment_position();
     }
-    HttpHeader header = get_header(get_lower_cased_value());
+    header_name_start_position = start_position;
+    header_name_end_position = position;
+    HttpHeader header = get_header(start_position, position);
     scan_expected(Character::Colon);
     scan_optional(Character::Space);
     set_token_start_position();
     scan_header_value();
     current_header = get_token_value();
-    scan_optional(Character::Space);
+    while (position < size && is_character_class(current_char(), CharacterClass::Whitespace)) {
+        increment_position();
+    }
     scan_expected(Character::CarriageReturn);
     scan_expected(Character::NewLine);
+    if (has_error()) {
+        delete[] current_header;
+        current_header = nullptr;
+        return HttpHeader::End;
+    }
     return header;
 }
 
@@ -147,9 +388,32 @@ char* HttpScanner::get_header_value()
     return current_header;
 }
 
-HttpHeader HttpScanner::get_header(char *ch)
+char* HttpScanner::get_header_name() const
+{
+    long long size = header_name_end_position - header_name_start_position;
+    auto* str = new char[size + 1];
+    std::memcpy(str, text + header_name_start_position, size);
+    str[size] = '\0';
+    return str;
+}
+
+long long HttpScanner::get_header_field_position() const
+{
+    return header_name_start_position;
+}
+
+HttpHeader HttpScanner::get_header(long long start, long long end) const
 {
-    auto it = string_to_token.find(ch);
+    std::size_t size = end - start;
+    if (size > max_known_header_name_size) {
+        return HttpHeader::Unknown;
+    }
+    char name[max_known_header_name_size + 1];
+    for (std::size_t i = 0; i < size; i++) {
+        name[i] = to_lower(text[start + i]);
+    }
+    name[size] = '\0';
+    auto it = string_to_token.find(name);
     if (it != string_to_token.end())
     {
         return it->second;
@@ -160,20 +424,17 @@ HttpHeader HttpScanner::get_header(char *ch)
 
 bool HttpScanner::is_header_field_start(char ch)
 {
-    return (ch >= Character::a && ch <= Character::z) ||
-       (ch >= Character::A && ch <= Character::Z);
+    return is_character_class(ch, CharacterClass::HeaderFieldPart);
 }
 
 bool HttpScanner::is_header_field_part(char ch)
 {
-    return (ch >= Character::a && ch <= Character::z) ||
-       (ch >= Character::A && ch <= Character::Z) ||
-       ch == Character::Dash;
+    return is_character_class(ch, CharacterClass::HeaderFieldPart);
 }
 
 bool HttpScanner::is_method_part(char ch)
 {
-    return (ch >= Character::A && ch <= Character::Z);
+    return is_character_class(ch, CharacterClass::Upper);
 }
 
 void HttpScanner::scan_request_target()
@@ -196,38 +457,28 @@ void HttpScanner::scan_request_target()
             return;
         }
     }
-
-    throw std::logic_error("Should not reach here.");
+    set_error(HttpParseError::UnexpectedEndOfRequest);
 }
 
+// field-content = field-vchar [ 1*( SP / HTAB ) field-vchar ]. Whitespace that
+// is not followed by a field-vchar is left for the trailing OWS of the field.
 bool HttpScanner::scan_field_content()
 {
-    save();
     char ch = current_char();
-    if (is_vchar(ch) || is_obs_text(ch)) {
-        increment_position();
-    }
-    else {
-        revert();
+    if (position >= size || !(is_vchar(ch) || is_obs_text(ch))) {
         return false;
     }
-    ch = current_char();
-    if (ch == Space || ch == HorizontalTab) {
+    increment_position();
+    long long field_vchar_end = position;
+    while (position < size && is_character_class(current_char(), CharacterClass::Whitespace)) {
         increment_position();
-        ch = current_char();
-        while (position < size && (ch == Space || ch == HorizontalTab)) {
-            increment_position();
-            ch = current_char();
-        }
     }
-    else {
+    ch = current_char();
+    if (position < size && field_vchar_end != position && (is_vchar(ch) || is_obs_text(ch))) {
+        increment_position();
         return true;
     }
-    if (!is_vchar(current_char())) {
-        revert();
-        return false;
-    }
-    increment_position();
+    position = field_vchar_end;
     return true;
 }
 
@@ -247,26 +498,19 @@ void HttpScanner::scan_header_value()
 
 bool HttpScanner::is_pchar(char ch)
 {
-    if (is_unreserverd_char(ch)) {
-        return true;
-    }
-    if (is_sub_delimiter(ch)) {
-        return true;
-    }
-    if (ch == Colon) {
-        return true;
-    }
-    if (ch == At) {
+    if (is_character_class(ch, CharacterClass::PathCharacter)) {
         return true;
     }
     if (ch == Percent) {
         increment_position();
-        if (!isxdigit(current_char())) {
-            throw std::logic_error("Expected hex number.");
+        if (!is_character_class(current_char(), CharacterClass::HexDigit)) {
+            set_error(HttpParseError::InvalidRequestTarget);
+            return false;
         }
         increment_position();
-        if (!isxdigit(current_char())) {
-            throw std::logic_error("Expected hex number.");
+        if (!is_character_class(current_char(), CharacterClass::HexDigit)) {
+            set_error(HttpParseError::InvalidRequestTarget);
+            return false;
         }
         return true;
     }
@@ -275,68 +519,39 @@ bool HttpScanner::is_pchar(char ch)
 
 bool HttpScanner::is_unreserverd_char(char ch)
 {
-    if (isalnum(ch)) {
-        return true;
-    }
-
-    switch (ch) {
-        case Minus:
-        case Dot:
-        case Underscore:
-        case Tilde:
-            return true;
-    }
-    return false;
+    return is_character_class(ch, CharacterClass::Unreserved);
 }
 
 bool HttpScanner::is_sub_delimiter(char ch)
 {
-    switch (ch) {
-        case Exclamation:
-        case Dollar:
-        case Ampersand:
-        case SingleQuote:
-        case OpenParen:
-        case CloseParen:
-        case Asterisk:
-        case Plus:
-        case Comma:
-        case Semicolon:
-        case Equal:
-            return true;
-    }
-    return false;
+    return is_character_class(ch, CharacterClass::SubDelimiter);
 }
 
 bool HttpScanner::is_vchar(char ch)
 {
-    if (ch >= Exclamation && ch <= Tilde) {
-        return true;
-    }
-    return false;
+    return is_character_class(ch, CharacterClass::VisibleCharacter);
 }
 
 bool HttpScanner::is_obs_text(char ch)
 {
-    return  (ch >= 0x80 && ch <= 0xff);
+    return is_character_class(ch, CharacterClass::ObsText);
 }
 
 void HttpScanner::increment_position()
 {
     if (position >= size) {
-        throw std::logic_error("You cannot increment more than max size.");
+        set_error(HttpParseError::UnexpectedEndOfRequest);
+        return;
     }
     position++;
 }
 
 bool HttpScanner::scan_optional(char ch)
 {
-    save();
-    if (current_char() == ch) {
+    if (position < size && current_char() == ch) {
         increment_position();
         return true;
     }
-    revert();
     return false;
 }
 
@@ -346,28 +561,23 @@ bool HttpScanner::next_char_is(char ch) {
 
 void HttpScanner::scan_expected(char ch)
 {
-    if (current_char() == ch) {
-        increment_position();
+    if (has_error()) {
         return;
     }
-    if (ch == Character::CarriageReturn) {
-        throw std::logic_error(std::string("Expected character '") + "\\r'.");
-    }
-    if (ch == Character::NewLine) {
-        throw std::logic_error(std::string("Expected character '") + "\\n'.");
+    if (position < size && current_char() == ch) {
+        increment_position();
+        return;
     }
-    throw std::logic_error(std::string("Expected character '") + ch + "'");
+    set_error(position >= size ? HttpParseError::UnexpectedEndOfRequest : HttpParseError::ExpectedCharacter);
 }
 
 
 char HttpScanner::peek_next_char()
 {
-    char ch;
-    save();
-    increment_position();
-    ch = current_char();
-    revert();
-    return ch;
+    if (position + 1 >= size) {
+        return Character::NullCharacter;
+    }
+    return text[position + 1];
 }
 
 void HttpScanner::save()
@@ -409,7 +619,7 @@ char* HttpScanner::get_lower_cased_value() const
     long long size = position - start_position + 1;
     auto* str = new char[size];
     for (int i = 0; i < size; i++) {
-        str[i] = static_cast<char>(tolower(text[start_position + i]));
+        str[i] = to_lower(text[start_position + i]);
     }
     str[size - 1] = '\0';
     return str;
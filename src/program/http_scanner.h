@@ -30,6 +30,7 @@ namespace flashpoint::program {
         Protocol,
         AbsolutePath,
         Query,
+        HttpVersion1_0,
         HttpVersion1_1,
 
         EndOfRequestTarget,
@@ -231,6 +232,59 @@ namespace flashpoint::program {
         { "x-content-type-options", HttpHeader::XContentTypeOptions },
     };
 
+    // The longest registered header name is "public-key-pins-report-only".
+    const std::size_t max_known_header_name_size = 27;
+
+    enum class HttpParseError {
+        None,
+        UnexpectedEndOfRequest,
+        InvalidMethod,
+        InvalidRequestTarget,
+        InvalidHttpVersion,
+        InvalidHeader,
+        InvalidContentLength,
+        ExpectedCharacter,
+        HeaderFieldsTooLarge,
+        PayloadTooLarge,
+        InvalidChunkedBody,
+        UnsupportedTransferEncoding,
+        InvalidStatusCode,
+    };
+
+    enum class ChunkedBodyMode {
+        ChunkSize,
+        ChunkExtension,
+        ChunkSizeLineFeed,
+        ChunkData,
+        ChunkDataCarriageReturn,
+        ChunkDataLineFeed,
+        TrailerLineStart,
+        TrailerLine,
+        TrailerLineFeed,
+        FinalLineFeed,
+        Done,
+    };
+
+    // Decoding state of a chunked body. It outlives the scanner, so that a body
+    // can be decoded incrementally with one scanner per read buffer.
+    struct HttpChunkedBodyState {
+        ChunkedBodyMode mode;
+        unsigned long long chunk_size;
+        unsigned long long body_size;
+        unsigned long long max_body_size;
+        bool has_chunk_size_digit;
+    };
+
+    enum class HttpBodyStatus {
+        Incomplete,
+        Complete,
+        Error,
+    };
+
+    // Receives decoded body bytes. The bytes point into the scanned text and are
+    // only valid during the call.
+    typedef void (*HttpBodyCallback)(void* data, const char* text, std::size_t size);
+
     struct SavedTextCursor {
         long long position;
         long long start_position;
@@ -253,22 +307,46 @@ namespace flashpoint::program {
         HttpHeader scan_header();
         char* scan_absolute_path();
         char* scan_query();
-        char* scan_body(unsigned int length);
+        char* scan_body(std::size_t length);
+
+        // Decode as much of a chunked body as the text holds, starting at the
+        // current position, and pass each decoded span to the callback.
+        HttpBodyStatus scan_chunked_body(HttpChunkedBodyState& state, HttpBodyCallback callback, void* data);
         RequestLineToken scan_http_version();
+
+        // Scan the three digits of a response's status code.
+        // @return the status code, 0 on error.
+        unsigned int scan_status_code();
         HttpMethod scan_method();
         char* get_lower_cased_value() const;
         char* get_token_value() const;
+        char* get_header_name() const;
+        // Position of the first byte of the last scanned header field line.
+        long long get_header_field_position() const;
         char* get_header_value();
         bool scan_optional(char ch);
         void scan_expected(char ch);
 
         bool next_char_is(char ch);
         void scan_rest_of_line();
+
+        // The scanner never throws. The first error it encounters is recorded
+        // together with the byte offset it occurred at, and every subsequent
+        // scan is a no-op until the scanner is discarded.
+        bool has_error() const;
+        HttpParseError get_error() const;
+        long long get_error_position() const;
+        long long get_position() const;
+        void set_error(HttpParseError error);
     private:
+        HttpParseError error = HttpParseError::None;
+        long long error_position = 0;
         long long position;
         long long start_position;
         long long end_position;
         char* current_header;
+        long long header_name_start_position;
+        long long header_name_end_position;
         ParserMode parser_mode;
         std::stack<SavedTextCursor> saved_text_cursors;
         const char* text;
@@ -289,7 +367,7 @@ namespace flashpoint::program {
         void increment_position();
         void set_token_start_position();
         char current_char();
-        HttpHeader get_header(char *ch);
+        HttpHeader get_header(long long start, long long end) const;
         const std::map<HttpHeader, const char*> header_enum_to_string;
         const std::map<const char*, HttpHeader, char_compare> header_to_token_enum;
     };
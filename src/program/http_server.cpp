@@ -1,6 +1,13 @@
 #include <program/http_server.h>
 #include <program/http_parser.h>
 #include <program/http_response.h>
+#include <program/query_planner.h>
+#include <program/response_merge.h>
+#include <program/singleflight.h>
+#include <program/response_cache.h>
+#include <program/replica_balancer.h>
+#include <program/subquery_batcher.h>
+#include <program/upstream_http2.h>
 #include <program/graphql/graphql_schema.h>
 #include <program/graphql/graphql_executor.h>
 #include <lib/memory_pool.h>
@@ -12,7 +19,11 @@
 #include <openssl/dh.h>
 #include <json/json.h>
 #include <uv.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -20,45 +31,90 @@ using namespace boost::filesystem;
 
 namespace flashpoint {
 
-ExecutableDefinition* ParseRequest(GatewayClient *client, const char *read_buffer, std::size_t size);
-void ForwardRequest(ClientRequest* client_request, Field* field);
+ExecutableDefinition* ParseRequest(GatewayClient *client, const char *read_buffer, std::size_t size, QueryPlan& plan);
+void ReadDecrypted(GatewayClient *client);
 
 void AllocateBuffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
     buf->base = new char[suggested_size];
     buf->len = suggested_size;
 }
 
-void on_close(uv_handle_t *handle) {
-    printf("closed forward request.");
+// Write the pending TLS records of a client, with buffers of the loop's writer pool.
+void FlushWriteBio(GatewayClient *client) {
+    HttpWriter http_writer((uv_stream_t*)client->tcp_handle, client->ssl_handle, client->server->writer_pool);
+    http_writer.End();
 }
 
-void OnWriteEnd(uv_write_t *write_request, int status) {
-    if (status < 0) {
-        std::cerr << uv_err_name(status) << std::endl;
-    }
-    delete write_request;
+void OnClientClose(uv_handle_t *handle) {
+    auto gateway_client = static_cast<GatewayClient*>(handle->data);
+    SSL_free(gateway_client->ssl_handle);
+    gateway_client->ssl_handle = nullptr;
+    gateway_client->tcp_handle = nullptr;
+    delete[] gateway_client->read_buffer;
+    gateway_client->read_buffer = nullptr;
+    gateway_client->request = nullptr;
+    gateway_client->body.buffer = std::vector<char>();
+    free(handle);
+
+    // The requests that are being forwarded and the merge of their response
+    // may still reference the client, the last of them frees it.
+    gateway_client->merge = nullptr;
+    std::shared_ptr<GatewayClient> handle_reference = std::move(gateway_client->handle_reference);
 }
 
-void WriteToSocket(GatewayClient *client, char *buf, size_t len) {
-    if(len <= 0) {
-        return;
-    }
-    uv_buf_t uvbuf = uv_buf_init(buf, len);
-    auto write_request = (uv_write_t*)malloc(sizeof(uv_write_t));
-    int r = uv_write(write_request, (uv_stream_t *) client->tcp_handle, &uvbuf, 1, OnWriteEnd);
-    if(r < 0) {
-        printf("ERROR: WriteToSocket erro");
+void OnClientShutdown(uv_shutdown_t* shutdown_request, int status) {
+    uv_close((uv_handle_t*)shutdown_request->handle, OnClientClose);
+    delete shutdown_request;
+}
+
+// Close the client connection once all queued writes have been flushed.
+void ShutdownClient(GatewayClient *client) {
+    auto stream = (uv_stream_t*)client->tcp_handle;
+    uv_read_stop(stream);
+    auto shutdown_request = new uv_shutdown_t;
+    if (uv_shutdown(shutdown_request, stream, OnClientShutdown) != 0) {
+        delete shutdown_request;
+        uv_close((uv_handle_t*)stream, OnClientClose);
     }
 }
 
-void FlushWriteBio(GatewayClient *client) {
-    char buf[1024 * 16];
-    int bytes_read = 0;
-    while((bytes_read = BIO_read(client->ssl_handle->wbio, buf, sizeof(buf))) > 0) {
-        WriteToSocket(client, buf, bytes_read);
+void RespondWithParseError(GatewayClient *client, const HttpParseResult& result) {
+#ifdef _DEBUG
+    std::cerr << "Parse error " << static_cast<int>(result.error) << " at position " << result.error_position << std::endl;
+#endif
+    const PrerenderedResponse& response = GetParseErrorResponse(result.error);
+    HttpWriter http_writer((uv_stream_t*)client->tcp_handle, client->ssl_handle, client->server->writer_pool);
+    http_writer.Write(GetStatusLine(response.status));
+    http_writer.Write(client->server->date_clock->Header());
+    http_writer.WriteReference(response.tail.data(), response.tail.size());
+    http_writer.End();
+    ShutdownClient(client);
+}
+
+bool IsKeepAlive(const HttpRequest& request) {
+    const char* connection = request.headers.Get(HttpHeader::Connection);
+    return connection == nullptr || strcasecmp(connection, "close") != 0;
+}
+
+void Respond(GatewayClient *client, const HttpResponse& response) {
+    HttpWriter http_writer((uv_stream_t*)client->tcp_handle, client->ssl_handle, client->server->writer_pool);
+    response.WriteTo(http_writer, *client->server->date_clock);
+    http_writer.End();
+    if (!response.KeepAlive()) {
+        client->read_state = RequestReadState::Closed;
+        ShutdownClient(client);
     }
 }
 
+void RespondWithError(GatewayClient *client, HttpStatus status, std::string_view message) {
+    HttpResponse response(status);
+    response.SetKeepAlive(client->request == nullptr || IsKeepAlive(*client->request));
+    response.Write("{\"errors\":[{\"message\":\"");
+    response.Write(message);
+    response.Write("\"}]}");
+    Respond(client, response);
+}
+
 void handle_error(GatewayClient* client, int status) {
     printf("ERROR: %s\n", uv_strerror(status));
 }
@@ -71,171 +127,1076 @@ char* mystrcat(char* dest, const char* src) {
     return --dest;
 }
 
-void OnForwardRequestRead(uv_stream_t *tcp, ssize_t length, const uv_buf_t *buf) {
-    if (length >= 0) {
-        printf("read: %s\n", buf->base);
+void WriteChunkSize(HttpWriter& http_writer, std::size_t size) {
+    static const char hex_digits[] = "0123456789abcdef";
+    char text[sizeof(std::size_t) * 2];
+    std::size_t position = sizeof(text);
+    do {
+        text[--position] = hex_digits[size & 0xf];
+        size >>= 4;
+    }
+    while (size != 0);
+    http_writer.Write(text + position, sizeof(text) - position);
+}
+
+// Writes a merged response to its client with chunked transfer encoding, one
+// chunk per flush, so the response is sent while the backends are still
+// responding.
+class ClientResponseOutput : public ResponseMergeOutput {
+public:
+    ClientResponseOutput(std::shared_ptr<GatewayClient> client, bool keep_alive):
+        client_(std::move(client)),
+        keep_alive_(keep_alive),
+        head_written_(false) { }
+
+    void Write(const char* text, std::size_t size) override {
+        chunk_.append(text, size);
+    }
+
+    void Flush() override {
+        if (IsClosed()) {
+            chunk_.clear();
+            return;
+        }
+        if (head_written_ && chunk_.empty()) {
+            return;
+        }
+        HttpWriter http_writer((uv_stream_t*)client_->tcp_handle, client_->ssl_handle, client_->server->writer_pool);
+        if (!head_written_) {
+            http_writer.WriteJsonResponseHead(HttpStatus::Ok, *client_->server->date_clock, keep_alive_);
+            http_writer.WriteLine("Transfer-Encoding: chunked");
+            http_writer.WriteLine();
+            head_written_ = true;
+        }
+        if (!chunk_.empty()) {
+            auto chunk = std::make_shared<std::string>(std::move(chunk_));
+            chunk_.clear();
+            WriteChunkSize(http_writer, chunk->size());
+            http_writer.WriteLine();
+            http_writer.WriteReference(chunk->data(), chunk->size());
+            http_writer.Retain(chunk);
+            http_writer.WriteLine();
+        }
+        http_writer.End();
+    }
+
+    // Write the last chunk and continue with the client's next request. The
+    // merge is still referenced by the request that ended it.
+    void End() override {
+        client_->merge = nullptr;
+        if (IsClosed()) {
+            return;
+        }
+        HttpWriter http_writer((uv_stream_t*)client_->tcp_handle, client_->ssl_handle, client_->server->writer_pool);
+        http_writer.Write("0\r\n\r\n");
+        http_writer.End();
+        if (!keep_alive_) {
+            client_->read_state = RequestReadState::Closed;
+            ShutdownClient(client_.get());
+            return;
+        }
+        uv_read_start((uv_stream_t*)client_->tcp_handle, AllocateBuffer, on_read);
+        ReadDecrypted(client_.get());
+    }
+
+private:
+    std::shared_ptr<GatewayClient> client_;
+    bool keep_alive_;
+    bool head_written_;
+    std::string chunk_;
+
+    bool IsClosed() const {
+        return client_->tcp_handle == nullptr || client_->read_state == RequestReadState::Closed;
+    }
+};
+
+enum class BackendReadResult {
+    Incomplete,
+    Complete,
+    Failed,
+};
+
+void StartAttempt(ClientRequest* client_request, const BackendReplica* replica);
+
+// Stop reading an attempt's response. A stream only stops giving its window
+// back, so that the other streams of its session keep being read.
+void PauseAttempt(UpstreamAttempt* attempt) {
+    if (attempt->stream != nullptr) {
+        attempt->client_request->gateway_client->server->http2_pool->Pause(attempt->stream);
+        return;
+    }
+    uv_read_stop((uv_stream_t*)&attempt->connection->tcp_handle);
+}
+
+// Stream body bytes into the merges of a flight. Reading is paused when any of
+// them has buffered enough, until all of them have resumed. The response of a
+// batch is buffered instead.
+void FeedFlight(ClientRequest* client_request, const char* text, std::size_t size) {
+    if (client_request->batch != nullptr) {
+        client_request->batch->response.append(text, size);
+        return;
+    }
+    SubqueryFlight* flight = client_request->flight.get();
+    auto singleflight = client_request->gateway_client->server->singleflight;
+    if (singleflight != nullptr) {
+        singleflight->Close(flight);
+    }
+    for (const auto& member : flight->members) {
+        if (!member.merge->Feed(member.index, text, size)) {
+            client_request->paused_merges++;
+        }
+    }
+    if (client_request->paused_merges > 0) {
+        PauseAttempt(client_request->winner);
+    }
+}
+
+// End the merges of a flight. The data of a cacheable response is cached when
+// it had no errors.
+void EndSubqueryFlight(HttpServer* server, SubqueryFlight* flight, std::uint64_t cache_ttl) {
+    if (server->singleflight != nullptr) {
+        server->singleflight->Close(flight);
+    }
+    for (const auto& member : flight->members) {
+        member.merge->End(member.index);
+    }
+    const FlightMember& leader = flight->members.front();
+    std::string data;
+    if (cache_ttl > 0 && leader.merge->TakeCapture(leader.index, data)) {
+        server->response_cache->Put(flight->key, std::move(data), cache_ttl);
+    }
+}
+
+void FailSubqueryFlight(HttpServer* server, SubqueryFlight* flight, std::string_view message) {
+    if (server->singleflight != nullptr) {
+        server->singleflight->Close(flight);
+    }
+    for (const auto& member : flight->members) {
+        member.merge->Fail(member.index, message);
+    }
+}
+
+void FailFlight(ClientRequest* client_request, std::string_view message) {
+    HttpServer* server = client_request->gateway_client->server;
+    if (client_request->batch == nullptr) {
+        FailSubqueryFlight(server, client_request->flight.get(), message);
+        return;
+    }
+    for (const auto& batched_subquery : client_request->batch->subqueries) {
+        FailSubqueryFlight(server, batched_subquery.flight.get(), message);
+    }
+}
+
+// Merge the complete response of a batch into the flights of its subqueries,
+// as if each of them had got its own response.
+void EndBatch(ClientRequest* client_request) {
+    HttpServer* server = client_request->gateway_client->server;
+    SubqueryBatch* batch = client_request->batch.get();
+    std::vector<std::string> responses;
+    if (!SplitBatchResponse(*batch, responses)) {
+        FailFlight(client_request, "Invalid backend response");
+        return;
+    }
+    for (std::size_t i = 0; i < batch->subqueries.size(); i++) {
+        SubqueryFlight* flight = batch->subqueries[i].flight.get();
+        if (server->singleflight != nullptr) {
+            server->singleflight->Close(flight);
+        }
+        for (const auto& member : flight->members) {
+            member.merge->Feed(member.index, responses[i].data(), responses[i].size());
+        }
+        EndSubqueryFlight(server, flight, batch->subqueries[i].cache_ttl);
+    }
+}
+
+void EndFlight(ClientRequest* client_request) {
+    if (client_request->batch != nullptr) {
+        EndBatch(client_request);
+        return;
+    }
+    EndSubqueryFlight(client_request->gateway_client->server, client_request->flight.get(), client_request->cache_ttl);
+}
+
+void OnForwardRequestClose(uv_handle_t* handle) {
+    delete static_cast<ClientRequest*>(handle->data);
+}
+
+// Record the result of an attempt's replica in the balancer.
+void RecordAttempt(UpstreamAttempt* attempt, bool success) {
+    if (attempt->replica == nullptr) {
+        return;
+    }
+    ClientRequest* client_request = attempt->client_request;
+    HttpServer* server = client_request->gateway_client->server;
+    std::uint64_t latency = uv_now(server->loop) - attempt->start;
+    server->balancer->End(*client_request->subquery->endpoint, attempt->replica, success, latency);
+    attempt->replica = nullptr;
+}
+
+// Remove an attempt from its request. Its connection is reused when it has read
+// a complete response, and closed otherwise. An attempt that is still waiting
+// for a connection is only detached, it is deleted when it gets one. The stream
+// of an HTTP/2 attempt is cancelled unless it has ended. An attempt without a
+// result doesn't count for or against its replica.
+void EndAttempt(UpstreamAttempt* attempt, bool reusable) {
+    ClientRequest* client_request = attempt->client_request;
+    auto& attempts = client_request->attempts;
+    attempts.erase(std::find(attempts.begin(), attempts.end(), attempt));
+    if (attempt->replica != nullptr) {
+        client_request->gateway_client->server->balancer->Abandon(attempt->replica);
+        attempt->replica = nullptr;
+    }
+    if (attempt->stream != nullptr) {
+        client_request->gateway_client->server->http2_pool->Cancel(attempt->stream);
+        delete attempt;
+        return;
+    }
+    if (attempt->connection == nullptr) {
+        attempt->client_request = nullptr;
+        return;
+    }
+    auto upstream_pool = client_request->gateway_client->server->upstream_pool;
+    if (reusable) {
+        upstream_pool->Release(attempt->connection);
     }
     else {
-        uv_close((uv_handle_t*)tcp, on_close);
+        upstream_pool->Discard(attempt->connection);
+    }
+    delete attempt;
+}
+
+// End a request after its merges have been ended. The remaining attempts are
+// abandoned, and the request is deleted once its timer has closed.
+void FinishForwardRequest(ClientRequest* client_request) {
+    client_request->finished = true;
+    while (!client_request->attempts.empty()) {
+        EndAttempt(client_request->attempts.back(), false);
+    }
+    uv_close((uv_handle_t*)&client_request->timer, OnForwardRequestClose);
+}
+
+void FailForwardRequest(ClientRequest* client_request, std::string_view message) {
+    FailFlight(client_request, message);
+    FinishForwardRequest(client_request);
+}
+
+// An attempt failed. The request only fails with its last attempt, or with the
+// attempt that is streaming the response.
+void FailAttempt(UpstreamAttempt* attempt, std::string_view message) {
+    ClientRequest* client_request = attempt->client_request;
+    bool is_winner = client_request->winner == attempt;
+    RecordAttempt(attempt, false);
+    EndAttempt(attempt, false);
+    if (is_winner || client_request->attempts.empty()) {
+        client_request->winner = nullptr;
+        FailForwardRequest(client_request, message);
+    }
+}
+
+// The first attempt whose response head arrives wins, the other attempts are
+// abandoned. Its latency is recorded for its replica's hedging delay, and a
+// server error counts against the replica.
+void WinAttempt(UpstreamAttempt* attempt, bool server_error) {
+    ClientRequest* client_request = attempt->client_request;
+    client_request->winner = attempt;
+    for (std::size_t i = client_request->attempts.size(); i > 0; i--) {
+        if (client_request->attempts[i - 1] != attempt) {
+            EndAttempt(client_request->attempts[i - 1], false);
+        }
+    }
+    HttpServer* server = client_request->gateway_client->server;
+    attempt->endpoint->latency.Record(uv_now(server->loop) - attempt->start);
+    RecordAttempt(attempt, !server_error);
+}
+
+void OnBackendResponseBody(void* data, const char* text, std::size_t size) {
+    FeedFlight(static_cast<ClientRequest*>(data), text, size);
+}
+
+// Read the next bytes of a backend response. The attempt wins when its head
+// arrives, the decoded body is streamed into the merges of the request's
+// flight. The connection is reused after a response that is framed by its
+// Content-Length or chunks, unless the backend closes it.
+BackendReadResult ReadBackendResponse(UpstreamAttempt* attempt, const char* text, std::size_t size) {
+    HttpResponseParser& parser = attempt->response_parser;
+    while (true) {
+        std::size_t consumed;
+        HttpResponseStatus status = parser.Feed(text, size, consumed, OnBackendResponseBody, attempt->client_request);
+        text += consumed;
+        size -= consumed;
+        switch (status) {
+            case HttpResponseStatus::Incomplete:
+                return BackendReadResult::Incomplete;
+            case HttpResponseStatus::Head:
+                attempt->close = !parser.Head().keep_alive;
+                WinAttempt(attempt, parser.Head().status >= 500);
+                break;
+            case HttpResponseStatus::Complete:
+                // Nothing was requested after the response, so the connection
+                // is out of sync.
+                if (size > 0) {
+                    attempt->close = true;
+                }
+                return BackendReadResult::Complete;
+            case HttpResponseStatus::Error:
+                return BackendReadResult::Failed;
+        }
+    }
+}
+
+// Decrypt the bytes of a backend response on a TLS connection, and read them.
+// All received records are decrypted, even when the merges pause the reading,
+// since the socket won't signal them again.
+BackendReadResult ReadBackendTlsResponse(UpstreamAttempt* attempt, const char* text, std::size_t size) {
+    thread_local char plaintext[max_ssl_record_size];
+    UpstreamConnection* connection = attempt->connection;
+    ReceiveUpstreamTls(connection, text, size);
+    while (true) {
+        std::size_t plaintext_size;
+        switch (ReadUpstreamTls(connection, plaintext, sizeof(plaintext), plaintext_size)) {
+            case UpstreamTlsStatus::Done: {
+                BackendReadResult result = ReadBackendResponse(attempt, plaintext, plaintext_size);
+                if (result == BackendReadResult::Complete && HasPendingUpstreamTls(connection)) {
+                    attempt->close = true;
+                }
+                if (result != BackendReadResult::Incomplete) {
+                    return result;
+                }
+                break;
+            }
+            case UpstreamTlsStatus::WantRead:
+                return BackendReadResult::Incomplete;
+            case UpstreamTlsStatus::Closed:
+                attempt->close = true;
+                return attempt->response_parser.End() ? BackendReadResult::Complete : BackendReadResult::Failed;
+            default:
+                return BackendReadResult::Failed;
+        }
+    }
+}
+
+void CompleteForwardRequest(UpstreamAttempt* attempt) {
+    ClientRequest* client_request = attempt->client_request;
+    EndFlight(client_request);
+    client_request->winner = nullptr;
+    EndAttempt(attempt, !attempt->close);
+    FinishForwardRequest(client_request);
+}
+
+void OnForwardRequestRead(uv_stream_t *tcp, ssize_t length, const uv_buf_t *buf) {
+    auto connection = static_cast<UpstreamConnection*>(tcp->data);
+    auto attempt = static_cast<UpstreamAttempt*>(connection->data);
+    if (length <= 0) {
+        delete[] buf->base;
+        if (length == 0) {
+            return;
+        }
+        if (length == UV_EOF && attempt->response_parser.End()) {
+            attempt->close = true;
+            CompleteForwardRequest(attempt);
+        }
+        else {
+            std::fprintf(stderr, "Error at backend read: %s.\n", uv_strerror((int)length));
+            FailAttempt(attempt, "Backend connection failed");
+        }
+        return;
+    }
+    BackendReadResult result = connection->ssl_handle != nullptr ?
+        ReadBackendTlsResponse(attempt, buf->base, (std::size_t)length) :
+        ReadBackendResponse(attempt, buf->base, (std::size_t)length);
+    delete[] buf->base;
+    switch (result) {
+        case BackendReadResult::Incomplete:
+            break;
+        case BackendReadResult::Complete:
+            CompleteForwardRequest(attempt);
+            break;
+        case BackendReadResult::Failed:
+            FailAttempt(attempt, "Invalid backend response");
+            break;
     }
-    free(buf->base);
 }
 
-void OnClientConnect(uv_connect_t *connection, int status) {
-    if (status == -1) {
-        std::cerr << "error on write_end" << std::endl;
+void OnForwardRequestResume(void* data) {
+    auto client_request = static_cast<ClientRequest*>(data);
+    if (--client_request->paused_merges > 0 || client_request->winner == nullptr) {
+        return;
+    }
+    UpstreamAttempt* winner = client_request->winner;
+    if (winner->stream != nullptr) {
+        client_request->gateway_client->server->http2_pool->Resume(winner->stream);
+        return;
     }
-    auto client_request = static_cast<ClientRequest*>(connection->data);
-    auto gateway_client = client_request->gateway_client;
-    uv_stream_t *stream = connection->handle;
-    uv_read_start(stream, AllocateBuffer, OnForwardRequestRead);
-    for (const auto& field : gateway_client->fields) {
-        auto http_writer = HttpWriter((uv_stream_t*)client_request->tcp_handle);
-        http_writer.WriteRequest(HttpMethod::Post, client_request->path);
-        http_writer.WriteLine("Host: ", client_request->host);
+    uv_read_start((uv_stream_t*)&winner->connection->tcp_handle, AllocateBuffer, OnForwardRequestRead);
+}
+
+// The request's deadline has passed, or its hedging delay. A hedged request is
+// sent again when no attempt has got a response head yet and the endpoint's
+// retry budget allows it.
+bool IsHedgedRequest(const UpstreamRequestOptions& options, const LatencyHistogram& latency, bool hedgeable) {
+    return options.hedging && hedgeable && latency.Count() >= options.min_hedge_samples;
+}
+
+std::uint64_t GetForwardRequestTimeout(const UpstreamRequestOptions& options, const LatencyHistogram& latency, std::uint64_t now, std::uint64_t deadline, bool hedged) {
+    std::uint64_t timeout = deadline > now ? deadline - now : 0;
+    if (hedged) {
+        timeout = std::min(timeout, latency.Percentile(options.hedge_percentile));
+    }
+    return timeout;
+}
+
+ForwardTimerAction GetForwardTimerAction(std::uint64_t now, std::uint64_t deadline, bool has_winner, RetryBudget& retry_budget) {
+    if (now >= deadline) {
+        return ForwardTimerAction::Fail;
+    }
+    if (!has_winner && retry_budget.Withdraw(now)) {
+        return ForwardTimerAction::Hedge;
+    }
+    return ForwardTimerAction::Wait;
+}
+
+bool CanFailOver(const BackendReplica* replica, std::uint64_t now, std::uint64_t deadline) {
+    return replica != nullptr && now < deadline;
+}
+
+void OnForwardRequestTimer(uv_timer_t* timer) {
+    auto client_request = static_cast<ClientRequest*>(timer->data);
+    HttpServer* server = client_request->gateway_client->server;
+    std::uint64_t now = uv_now(server->loop);
+    const BackendReplica* first_replica = client_request->tried_replicas.front();
+    UpstreamEndpointPool* endpoint = server->upstream_pool->Endpoint(first_replica->hostname.c_str(), first_replica->port);
+    switch (GetForwardTimerAction(now, client_request->deadline, client_request->winner != nullptr, endpoint->retry_budget)) {
+        case ForwardTimerAction::Fail:
+            for (const auto& attempt : client_request->attempts) {
+                RecordAttempt(attempt, false);
+            }
+            FailForwardRequest(client_request, "Backend timed out");
+            return;
+        case ForwardTimerAction::Hedge: {
+            // The hedge goes to another replica when there is one.
+            const BackendEndpoint& backend_endpoint = *client_request->subquery->endpoint;
+            const BackendReplica* replica = server->balancer->Pick(backend_endpoint, client_request->tried_replicas);
+            if (replica == nullptr) {
+                replica = server->balancer->Pick(backend_endpoint, {});
+            }
+            StartAttempt(client_request, replica);
+            if (client_request->finished) {
+                return;
+            }
+            break;
+        }
+        case ForwardTimerAction::Wait:
+            break;
+    }
+    uv_timer_start(timer, OnForwardRequestTimer, client_request->deadline - now, 0);
+}
+
+void WriteForwardRequest(UpstreamAttempt* attempt) {
+    auto client_request = attempt->client_request;
+    GatewayClient* gateway_client = client_request->gateway_client.get();
+    UpstreamConnection* connection = attempt->connection;
+    HttpWriter http_writer((uv_stream_t*)&connection->tcp_handle, connection->ssl_handle, gateway_client->server->writer_pool);
+    http_writer.WriteRequest(HttpMethod::Post, client_request->subquery->endpoint->path.c_str());
+    http_writer.WriteLine("Host: ", attempt->replica->host.c_str());
+    const ForwardedHeaders* forwarded_headers = gateway_client->forwarded_headers.get();
+    if (forwarded_headers == nullptr || !forwarded_headers->headers.test(static_cast<std::size_t>(HttpHeader::UserAgent))) {
         http_writer.WriteLine("User-Agent: flash");
-        http_writer.WriteLine("Accept: */*");
-        http_writer.WriteLine("Content-Type: application/json; charset=utf-8");
-        http_writer.WriteLine("Content-Length: 24");
-        http_writer.WriteLine();
-        http_writer.Write("{ \"query\": \"{ field }\" }");
-        http_writer.End();
     }
+    if (forwarded_headers != nullptr) {
+        http_writer.WriteReference(forwarded_headers->fields.data(), forwarded_headers->fields.size());
+        http_writer.Retain(gateway_client->forwarded_headers);
+    }
+    http_writer.WriteLine("Content-Type: application/json; charset=utf-8");
+
+    // The subquery is printed twice, once to count its size for the
+    // Content-Length, so that it is printed straight into the writer's buffers.
+    SizeCounter size_counter;
+    if (client_request->batch != nullptr) {
+        PrintSubqueryBatch(size_counter, *client_request->batch);
+    }
+    else {
+        PrintSubquery(size_counter, *client_request->plan, *client_request->subquery, FragmentPrintMode::Hoist);
+    }
+    http_writer.Write("Content-Length: ");
+    http_writer.WriteUnsigned(size_counter.Size());
+    http_writer.WriteLine();
+    http_writer.WriteLine();
+    if (client_request->batch != nullptr) {
+        PrintSubqueryBatch(http_writer, *client_request->batch);
+    }
+    else {
+        PrintSubquery(http_writer, *client_request->plan, *client_request->subquery, FragmentPrintMode::Hoist);
+    }
+    http_writer.End();
 }
 
-void OnResolvedIpv4(uv_getaddrinfo_t *handle, int status, struct addrinfo *res) {
-    char ip_addr[17] = { '\0' };
-    int r = uv_ip4_name((sockaddr_in*)(res->ai_addr), ip_addr, 16);
-    if (r) {
-        printf("Error getting ipv4 address: %s.\n", uv_strerror(r));
+// An attempt failed before its replica processed the request, e.g. its connect
+// failed or its stream was refused. Once all attempts have failed, the request
+// goes to another replica, even a mutation, e.g. when its replica has gone down
+// in a rolling deploy.
+void FailOverAttempt(UpstreamAttempt* attempt) {
+    ClientRequest* client_request = attempt->client_request;
+    RecordAttempt(attempt, false);
+    auto& attempts = client_request->attempts;
+    attempts.erase(std::find(attempts.begin(), attempts.end(), attempt));
+    delete attempt;
+    if (!attempts.empty()) {
         return;
     }
-    auto request_address = (sockaddr_in*)malloc(sizeof(sockaddr_in));
-    auto client_request = (ClientRequest*)handle->data;
-    r = uv_ip4_addr(ip_addr, client_request->port, request_address);
-    if (r) {
-        printf("Error getting ipv4 address: %s.\n", uv_strerror(r));
+    HttpServer* server = client_request->gateway_client->server;
+    const BackendReplica* replica = server->balancer->Pick(*client_request->subquery->endpoint, client_request->tried_replicas);
+    if (!CanFailOver(replica, uv_now(server->loop), client_request->deadline)) {
+        FailForwardRequest(client_request, "Backend unavailable");
         return;
     }
-    auto connect_request = (uv_connect_t*)malloc(sizeof(uv_connect_t));
-    connect_request->data = handle->data;
-    client_request->tcp_handle = (uv_tcp_t*)malloc(sizeof(uv_tcp_t));
-    uv_tcp_init(handle->loop, client_request->tcp_handle);
-    uv_tcp_keepalive(client_request->tcp_handle, 1, 60);
-    uv_tcp_connect(connect_request, client_request->tcp_handle, (sockaddr*)request_address, OnClientConnect);
+    StartAttempt(client_request, replica);
+}
 
-    uv_freeaddrinfo(res);
+void OnUpstreamAcquired(UpstreamConnection* connection, int status, void* data) {
+    auto attempt = static_cast<UpstreamAttempt*>(data);
+    attempt->connection = connection;
+    if (attempt->client_request == nullptr) {
+        if (connection != nullptr) {
+            connection->endpoint->pool->Release(connection);
+        }
+        delete attempt;
+        return;
+    }
+    if (connection == nullptr) {
+        std::fprintf(stderr, "Error at backend connect: %s.\n", uv_strerror(status));
+        FailOverAttempt(attempt);
+        return;
+    }
+    connection->data = attempt;
+    WriteForwardRequest(attempt);
+    uv_read_start((uv_stream_t*)&connection->tcp_handle, AllocateBuffer, OnForwardRequestRead);
 }
 
-std::map<const char*, BackendEndpoint, cmp_str> field_to_endpoint = {
-    { "field", { "http://localhost:4000/graphql", "localhost:4000", "localhost", 4000, "/graphql"} }
+// Split the raw field lines of forwarded headers into the lowercase names and
+// values of HTTP/2. A session is shared by many clients, so credentials are
+// never indexed, otherwise a client could guess another client's credentials
+// from the size of its own compressed headers.
+void AddForwardedHttp2Headers(const std::vector<char>& fields, std::vector<Http2Header>& headers) {
+    const char* position = fields.data();
+    const char* end = position + fields.size();
+    while (position < end) {
+        const char* line_end = std::find(position, end, '\n');
+        const char* colon = std::find(position, line_end, ':');
+        if (colon != line_end) {
+            std::string name(position, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            const char* value = colon + 1;
+            const char* value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            bool is_credential = name == "authorization" || name == "cookie";
+            headers.push_back({ std::move(name), std::string(value, value_end), is_credential ? HpackIndexing::Never : HpackIndexing::Incremental });
+        }
+        position = line_end == end ? end : line_end + 1;
+    }
+}
+
+// The request of an attempt to a backend that speaks HTTP/2. The headers that
+// repeat are indexed, so after a session's first request they take a byte
+// each.
+Http2Request CreateHttp2Request(const UpstreamAttempt* attempt) {
+    const ClientRequest* client_request = attempt->client_request;
+    const BackendEndpoint* endpoint = client_request->subquery->endpoint;
+    Http2Request request;
+    request.headers.push_back({ ":method", "POST", HpackIndexing::Incremental });
+    request.headers.push_back({ ":scheme", endpoint->tls != nullptr ? "https" : "http", HpackIndexing::Incremental });
+    request.headers.push_back({ ":authority", attempt->replica->host, HpackIndexing::Incremental });
+    request.headers.push_back({ ":path", endpoint->path, HpackIndexing::Incremental });
+    const ForwardedHeaders* forwarded_headers = client_request->gateway_client->forwarded_headers.get();
+    if (forwarded_headers == nullptr || !forwarded_headers->headers.test(static_cast<std::size_t>(HttpHeader::UserAgent))) {
+        request.headers.push_back({ "user-agent", "flash", HpackIndexing::Incremental });
+    }
+    if (forwarded_headers != nullptr) {
+        AddForwardedHttp2Headers(forwarded_headers->fields, request.headers);
+    }
+    request.headers.push_back({ "content-type", "application/json; charset=utf-8", HpackIndexing::Incremental });
+    StringWriter writer;
+    if (client_request->batch != nullptr) {
+        PrintSubqueryBatch(writer, *client_request->batch);
+    }
+    else {
+        PrintSubquery(writer, *client_request->plan, *client_request->subquery, FragmentPrintMode::Hoist);
+    }
+    request.body = std::move(writer.Text());
+    request.headers.push_back({ "content-length", std::to_string(request.body.size()), HpackIndexing::None });
+    return request;
+}
+
+void OnHttp2ResponseHead(void* data, unsigned int status) {
+    WinAttempt(static_cast<UpstreamAttempt*>(data), status >= 500);
+}
+
+// The response of a batch is buffered up to its maximum size, like the body
+// limit of an HTTP/1 response.
+void OnHttp2ResponseBody(void* data, const char* text, std::size_t size) {
+    auto attempt = static_cast<UpstreamAttempt*>(data);
+    ClientRequest* client_request = attempt->client_request;
+    const SubqueryBatch* batch = client_request->batch.get();
+    if (batch != nullptr && batch->response.size() + size > batch->max_response_size) {
+        FailAttempt(attempt, "Invalid backend response");
+        return;
+    }
+    FeedFlight(client_request, text, size);
+}
+
+void OnHttp2ResponseEnd(void* data) {
+    CompleteForwardRequest(static_cast<UpstreamAttempt*>(data));
+}
+
+// A stream that the backend didn't process fails over like a failed connect.
+void OnHttp2ResponseError(void* data, const char* message, bool retryable) {
+    auto attempt = static_cast<UpstreamAttempt*>(data);
+    std::fprintf(stderr, "Error at backend stream: %s.\n", message);
+    if (retryable) {
+        FailOverAttempt(attempt);
+        return;
+    }
+    FailAttempt(attempt, "Backend connection failed");
+}
+
+const Http2StreamCallbacks http2_attempt_callbacks = {
+    OnHttp2ResponseHead,
+    OnHttp2ResponseBody,
+    OnHttp2ResponseEnd,
+    OnHttp2ResponseError,
 };
 
-void on_read(uv_stream_t *client_stream, ssize_t length, const uv_buf_t *buf) {
-    if (length == 0) {
-        free(buf->base);
-        uv_close((uv_handle_t *) client_stream, on_close);
+// The limits of a backend response. The body of a batch's response is
+// buffered until it is complete, other bodies are streamed and unlimited.
+HttpParserLimits GetBackendResponseLimits(const ClientRequest* client_request) {
+    HttpParserLimits limits = client_request->gateway_client->server->limits;
+    if (client_request->batch != nullptr) {
+        limits.max_body_size = client_request->batch->max_response_size;
+    }
+    else {
+        limits.max_body_size = std::numeric_limits<std::size_t>::max();
+    }
+    return limits;
+}
+
+// Send a request to a replica of its backend, on an idle connection of the
+// loop's upstream pool when there is one, or on a stream of one of the
+// replica's sessions when the backend speaks HTTP/2.
+void StartAttempt(ClientRequest* client_request, const BackendReplica* replica) {
+    HttpServer* server = client_request->gateway_client->server;
+    auto attempt = new UpstreamAttempt {};
+    attempt->client_request = client_request;
+    attempt->replica = replica;
+    attempt->endpoint = server->upstream_pool->Endpoint(replica->hostname.c_str(), replica->port);
+    attempt->start = uv_now(server->loop);
+    attempt->response_parser = HttpResponseParser(GetBackendResponseLimits(client_request));
+    client_request->attempts.push_back(attempt);
+    client_request->tried_replicas.push_back(replica);
+    server->balancer->Begin(replica);
+    if (client_request->subquery->endpoint->http2) {
+        server->http2_pool->Open(replica->hostname.c_str(), replica->port, CreateHttp2Request(attempt), &http2_attempt_callbacks, attempt, attempt->stream);
         return;
     }
-    auto gateway_client = static_cast<GatewayClient*>(client_stream->data);
-    if (!SSL_is_init_finished(gateway_client->ssl_handle)) {
-        BIO_write(gateway_client->ssl_handle->rbio, buf->base, length);
-        SSL_accept(gateway_client->ssl_handle);
-        FlushWriteBio(gateway_client);
+    server->upstream_pool->Acquire(replica->hostname.c_str(), replica->port, OnUpstreamAcquired, attempt);
+}
+
+// Forward a request with its client request's deadline. A hedged request is
+// sent again after its replica's hedging percentile of latencies, once the
+// replica has enough of them.
+void ForwardRequest(ClientRequest* client_request) {
+    HttpServer* server = client_request->gateway_client->server;
+    const UpstreamRequestOptions& options = server->upstream_request_options;
+    std::uint64_t now = uv_now(server->loop);
+    uv_timer_init(server->loop, &client_request->timer);
+    client_request->timer.data = client_request;
+    const BackendReplica* replica = server->balancer->Pick(*client_request->subquery->endpoint, client_request->tried_replicas);
+    if (replica == nullptr) {
+        FailForwardRequest(client_request, "Backend unavailable");
         return;
     }
-    char read_buffer[1024 * 10];
-    BIO_write(gateway_client->ssl_handle->rbio, buf->base, length);
-    int read_size = SSL_read(gateway_client->ssl_handle, read_buffer, sizeof(read_buffer));
-    if (read_size < 0) {
-        handle_error(gateway_client, read_size);
+    UpstreamEndpointPool* endpoint = server->upstream_pool->Endpoint(replica->hostname.c_str(), replica->port);
+    bool hedged = IsHedgedRequest(options, endpoint->latency, client_request->hedgeable);
+    if (hedged) {
+        endpoint->retry_budget.Deposit();
+    }
+    uv_timer_start(&client_request->timer, OnForwardRequestTimer, GetForwardRequestTimeout(options, endpoint->latency, now, client_request->deadline, hedged), 0);
+    StartAttempt(client_request, replica);
+}
+
+// Resume the request when the merges of its flight's members resume.
+void SetFlightResumeCallback(ClientRequest* client_request) {
+    SubqueryFlight* flight = client_request->flight.get();
+    flight->resume_callback = OnForwardRequestResume;
+    flight->resume_data = client_request;
+    for (const auto& member : flight->members) {
+        member.merge->SetResumeCallback(member.index, OnForwardRequestResume, client_request);
+    }
+}
+
+// Forward a batch as one request. A batch of one subquery is forwarded as the
+// subquery's own request, so that its response is streamed.
+void ForwardBatch(std::unique_ptr<SubqueryBatch> batch, void* data) {
+    auto server = static_cast<HttpServer*>(data);
+    BatchedSubquery& first = batch->subqueries.front();
+    auto client_request = new ClientRequest {};
+    client_request->plan = first.plan;
+    client_request->subquery = first.subquery;
+    client_request->gateway_client = batch->gateway_client;
+    client_request->deadline = batch->deadline;
+    client_request->hedgeable = server->upstream_request_options.hedging;
+    if (batch->subqueries.size() == 1) {
+        client_request->flight = std::move(first.flight);
+        client_request->cache_ttl = first.cache_ttl;
+        SetFlightResumeCallback(client_request);
+    }
+    else {
+        client_request->batch = std::move(batch);
+    }
+    ForwardRequest(client_request);
+}
+
+// The key of a subquery in flight and in the cache: the backend, the forwarded
+// headers that scope its response and the printed subquery with the client's
+// variables.
+std::string GetSubqueryKey(GatewayClient *gateway_client, const QueryPlan& plan, const Subquery& subquery) {
+    StringWriter writer;
+    writer.Write(subquery.endpoint->origin.data(), subquery.endpoint->origin.size());
+    writer.Write("\n", 1);
+    const ForwardedHeaders* forwarded_headers = gateway_client->forwarded_headers.get();
+    if (forwarded_headers != nullptr) {
+        writer.Write(forwarded_headers->scope.data(), forwarded_headers->scope.size());
+    }
+    writer.Write("\n", 1);
+    PrintSubquery(writer, plan, subquery, FragmentPrintMode::Hoist);
+    return std::move(writer.Text());
+}
+
+void ExecuteRequest(GatewayClient *gateway_client, const char *body, std::size_t size) {
+    // The plan owns the ticket that the document is parsed into, so the
+    // ticket is returned on every path that drops the plan.
+    auto plan = std::make_shared<QueryPlan>();
+    plan->memory_pool = gateway_client->server->memory_pool;
+    plan->ticket = plan->memory_pool->TakeTicket();
+    if (plan->ticket == nullptr) {
+        RespondWithError(gateway_client, HttpStatus::ServiceUnavailable, "Out of memory for GraphQL requests");
         return;
     }
-    else if (read_size > 0) {
-        auto executable_definition = ParseRequest(gateway_client, read_buffer, read_size);
-        if (executable_definition == nullptr) {
+    ExecutableDefinition* executable_definition;
+    try {
+        executable_definition = ParseRequest(gateway_client, body, size, *plan);
+    }
+    catch (const std::logic_error&) {
+        RespondWithError(gateway_client, HttpStatus::ServiceUnavailable, "Out of memory for GraphQL requests");
+        return;
+    }
+    if (executable_definition == nullptr) {
+        RespondWithError(gateway_client, HttpStatus::BadRequest, "Invalid GraphQL request");
+        return;
+    }
+    OperationDefinition* operation_definition;
+    if (executable_definition->operation_definitions.size() == 1) {
+        operation_definition = executable_definition->operation_definitions.at(0);
+    }
+    else {
+        Glib::ustring name = "default_operation";
+        auto operation_definitions = executable_definition->operation_definitions;
+        auto operation_definition_it = std::find_if(operation_definitions.begin(), operation_definitions.end(), [&](OperationDefinition* operation_definition) -> bool {
+            return operation_definition->name != nullptr && operation_definition->name->identifier == name;
+        });
+        if (operation_definition_it == operation_definitions.end()) {
+            RespondWithError(gateway_client, HttpStatus::BadRequest, "Unknown operation");
             return;
         }
-        OperationDefinition* operation_definition;
-        if (executable_definition->operation_definitions.size() == 1) {
-            operation_definition = executable_definition->operation_definitions.at(0);
+        operation_definition = *operation_definition_it;
+    }
+    QueryPlanError error = PlanQuery(operation_definition, &executable_definition->fragment_definitions, gateway_client->server->Routes(), *plan);
+    if (error != QueryPlanError::None) {
+        RespondWithError(gateway_client, HttpStatus::BadRequest, GetQueryPlanErrorMessage(error));
+        return;
+    }
+#ifdef _DEBUG
+    std::cerr << DescribeQueryPlan(*plan);
+#endif
+    auto output = std::make_unique<ClientResponseOutput>(gateway_client->shared_from_this(), IsKeepAlive(*gateway_client->request));
+    auto merge = std::make_shared<ResponseMerge>(plan, std::move(output));
+    gateway_client->merge = merge;
+    uv_read_stop((uv_stream_t*)gateway_client->tcp_handle);
+    merge->Start();
+    // Mutations have side effects, so only queries are coalesced and hedged.
+    // Subqueries whose data is cached don't go to their backend at all.
+    auto singleflight = gateway_client->server->singleflight;
+    auto response_cache = gateway_client->server->response_cache;
+    auto batcher = gateway_client->server->batcher;
+    bool coalesce = singleflight != nullptr && operation_definition->operation_type == OperationType::Query;
+
+    // The deadline of the client request applies to all of its subqueries.
+    const UpstreamRequestOptions& request_options = gateway_client->server->upstream_request_options;
+    std::uint64_t deadline = uv_now(gateway_client->server->loop) + request_options.timeout;
+    bool hedging = request_options.hedging && operation_definition->operation_type == OperationType::Query;
+    for (std::size_t i = 0; i < plan->subqueries.size(); i++) {
+        const Subquery& subquery = plan->subqueries[i];
+        bool cacheable = response_cache != nullptr && subquery.cache_ttl > 0;
+        std::string key;
+        if (coalesce || cacheable) {
+            key = GetSubqueryKey(gateway_client, *plan, subquery);
         }
-        else {
-            Glib::ustring name = "default_operation";
-            auto operation_definitions = executable_definition->operation_definitions;
-            auto operation_definition_it = std::find_if(operation_definitions.begin(), operation_definitions.end(), [&](OperationDefinition* operation_definition) -> bool {
-                return operation_definition->name->identifier == name;
-            });
-            if (operation_definition_it == operation_definitions.end()) {
-                return;
+        if (cacheable) {
+            const std::string* data = response_cache->Get(key);
+            if (data != nullptr) {
+                merge->Complete(i, *data);
+                continue;
             }
-            operation_definition = *operation_definition_it;
         }
-        for (const auto& selection : operation_definition->selection_set->selections) {
-            if (selection->kind !=SyntaxKind::S_Field) {
+        if (coalesce && singleflight->Join(key, { merge, i })) {
+            continue;
+        }
+        auto flight = std::make_unique<SubqueryFlight>();
+        flight->key = std::move(key);
+        flight->members.push_back({ merge, i });
+        if (cacheable) {
+            merge->Capture(i, response_cache->MaxEntrySize() - std::min(flight->key.size(), response_cache->MaxEntrySize()));
+        }
+        if (coalesce) {
+            singleflight->Lead(flight.get());
+        }
+        std::uint64_t cache_ttl = cacheable ? subquery.cache_ttl : 0;
+        if (batcher != nullptr && subquery.batch_window > 0) {
+            batcher->Add(gateway_client, { plan, &subquery, std::move(flight), cache_ttl }, deadline);
+            continue;
+        }
+        auto client_request = new ClientRequest {};
+        client_request->plan = plan;
+        client_request->subquery = &subquery;
+        client_request->gateway_client = gateway_client->shared_from_this();
+        client_request->flight = std::move(flight);
+        client_request->cache_ttl = cache_ttl;
+        client_request->deadline = deadline;
+        client_request->hedgeable = hedging;
+        SetFlightResumeCallback(client_request);
+        ForwardRequest(client_request);
+    }
+}
+
+// Copy the raw field lines of the forwarded headers out of the read buffer,
+// since the read buffer is reused before the backend requests are written. A
+// header that was sent on several lines, e.g. Cookie, is forwarded with all of
+// them.
+void CopyForwardedHeaders(GatewayClient *client, const HttpRequest& request) {
+    HttpHeaderSet forwarded_headers = client->server->Routes()->ForwardedHeaderSet();
+    auto headers = std::make_shared<ForwardedHeaders>();
+    auto copy_field = [&](HttpHeader header, const HttpHeaderField& field) {
+        headers->headers.set(static_cast<std::size_t>(header));
+        headers->fields.insert(headers->fields.end(), field.text, field.text + field.size);
+        if (header != HttpHeader::UserAgent) {
+            headers->scope.append(field.text, field.size);
+        }
+    };
+    for (std::size_t i = 0; i < http_header_size; i++) {
+        auto header = static_cast<HttpHeader>(i);
+        if (!forwarded_headers.test(i) || !IsForwardableHeader(header)) {
+            continue;
+        }
+        const HttpHeaderField& field = request.headers.GetField(header);
+        if (field.text != nullptr) {
+            copy_field(header, field);
+        }
+    }
+    for (const auto& repeated_field : request.headers.GetRepeatedFields()) {
+        auto i = static_cast<std::size_t>(repeated_field.header);
+        if (forwarded_headers.test(i) && IsForwardableHeader(repeated_field.header)) {
+            copy_field(repeated_field.header, repeated_field.field);
+        }
+    }
+    client->forwarded_headers = std::move(headers);
+}
+
+void OnRequestBodyData(void* data, const char* text, std::size_t size) {
+    auto body = static_cast<RequestBody*>(data);
+    if (body->span == nullptr && body->buffer.empty()) {
+        body->span = text;
+        body->span_size = size;
+        return;
+    }
+    if (body->span != nullptr) {
+        body->buffer.insert(body->buffer.end(), body->span, body->span + body->span_size);
+        body->span = nullptr;
+    }
+    body->buffer.insert(body->buffer.end(), text, text + size);
+}
+
+void OnRequestComplete(GatewayClient *client) {
+    RequestBody& body = client->body;
+    if (body.span != nullptr) {
+        ExecuteRequest(client, body.span, body.span_size);
+    }
+    else {
+        ExecuteRequest(client, body.buffer.data(), body.buffer.size());
+    }
+    if (client->read_state == RequestReadState::Closed) {
+        return;
+    }
+    client->read_state = RequestReadState::Head;
+    client->request = nullptr;
+    body.span = nullptr;
+    body.buffer.clear();
+}
+
+void FailRequest(GatewayClient *client, const HttpParseResult& result) {
+    client->read_state = RequestReadState::Closed;
+    RespondWithParseError(client, result);
+}
+
+// Parse requests out of the client's read buffer. Bodies are streamed into the
+// request body as they arrive, so the read buffer only ever has to hold one
+// request head and one TLS record.
+void ProcessReadBuffer(GatewayClient *client) {
+    std::size_t consumed = 0;
+    while (consumed < client->read_size) {
+        const char* text = client->read_buffer + consumed;
+        std::size_t size = client->read_size - consumed;
+        if (client->read_state == RequestReadState::Head) {
+            if (client->merge != nullptr) {
+                break;
+            }
+            if (std::string_view(text, size).find("\r\n\r\n") == std::string_view::npos) {
+                if (size >= client->server->limits.max_header_fields_size) {
+                    FailRequest(client, HttpParseResult {
+                        nullptr,
+                        HttpParseError::HeaderFieldsTooLarge,
+                        static_cast<long long>(consumed + size),
+                        0,
+                    });
+                    return;
+                }
+                break;
+            }
+            HttpParser http_parser(text, size, client->server->limits);
+            HttpParseResult result = http_parser.ParseHead();
+            if (result.error != HttpParseError::None) {
+                FailRequest(client, result);
                 return;
             }
-            auto field = static_cast<Field*>(selection);
-            auto name = static_cast<Field*>(selection)->name->identifier;
-            auto endpoint_it = field_to_endpoint.find(name.c_str());
-            if (endpoint_it != field_to_endpoint.end()) {
-                auto backend_endpoint = endpoint_it->second;
-                gateway_client->fields.emplace(endpoint_it->first, field);
-                gateway_client->fragments = &executable_definition->fragment_definitions;
-                auto client_request = new ClientRequest {
-                    backend_endpoint.hostname,
-                    backend_endpoint.port,
-                    backend_endpoint.host,
-                    backend_endpoint.path,
-                    nullptr,
-                    gateway_client,
-                };
-                ForwardRequest(client_request, field);
+            consumed += result.body_position;
+            client->request = std::move(result.request);
+            CopyForwardedHeaders(client, *client->request);
+            if (client->body_reader.Start(*client->request, client->server->limits)) {
+                OnRequestComplete(client);
             }
             else {
+                client->read_state = RequestReadState::Body;
+            }
+        }
+        else if (client->read_state == RequestReadState::Body) {
+            std::size_t body_consumed;
+            HttpBodyStatus status = client->body_reader.Feed(text, size, body_consumed, OnRequestBodyData, &client->body);
+            if (status == HttpBodyStatus::Error) {
+                FailRequest(client, HttpParseResult {
+                    nullptr,
+                    client->body_reader.Error(),
+                    static_cast<long long>(consumed) + client->body_reader.ErrorPosition(),
+                    0,
+                });
                 return;
             }
+            consumed += body_consumed;
+            if (status == HttpBodyStatus::Complete) {
+                OnRequestComplete(client);
+            }
+        }
+        if (client->read_state == RequestReadState::Closed) {
+            return;
         }
     }
 
-    if (buf->base) {
-        free(buf->base);
+    // The unconsumed bytes are moved to the front of the read buffer, so a body
+    // span that still references them has to be copied out first.
+    RequestBody& body = client->body;
+    if (body.span != nullptr) {
+        body.buffer.insert(body.buffer.end(), body.span, body.span + body.span_size);
+        body.span = nullptr;
+    }
+    client->read_size -= consumed;
+    std::memmove(client->read_buffer, client->read_buffer + consumed, client->read_size);
+}
+
+void on_read(uv_stream_t *client_stream, ssize_t length, const uv_buf_t *buf) {
+    auto gateway_client = static_cast<GatewayClient*>(client_stream->data);
+    if (length < 0) {
+        delete[] buf->base;
+        if (gateway_client->read_state != RequestReadState::Closed) {
+            gateway_client->read_state = RequestReadState::Closed;
+            uv_close((uv_handle_t *) client_stream, OnClientClose);
+        }
+        return;
+    }
+    if (length == 0 || gateway_client->read_state == RequestReadState::Closed) {
+        delete[] buf->base;
+        return;
+    }
+    BIO_write(SSL_get_rbio(gateway_client->ssl_handle), buf->base, length);
+    delete[] buf->base;
+    if (!SSL_is_init_finished(gateway_client->ssl_handle)) {
+        SSL_accept(gateway_client->ssl_handle);
+        FlushWriteBio(gateway_client);
+        return;
     }
+    ReadDecrypted(gateway_client);
 }
 
-ExecutableDefinition* ParseRequest(GatewayClient *client, const char *read_buffer, std::size_t size) {
-    HttpParser http_parser(read_buffer, size);
-    std::unique_ptr<HttpRequest> request = http_parser.Parse();
-    if (request == nullptr) {
-        uv_close((uv_handle_t*)client->tcp_handle, nullptr);
+// Process the client's read buffer and decrypt the records that have been read
+// into it. While a response is being merged, the decrypted bytes are only
+// buffered, until the read buffer is full.
+void ReadDecrypted(GatewayClient *client) {
+    if (client->processing || client->read_state == RequestReadState::Closed) {
+        return;
+    }
+    client->processing = true;
+    ProcessReadBuffer(client);
+    while (client->read_state != RequestReadState::Closed && client->read_size < client->read_capacity) {
+        std::size_t free_size = client->read_capacity - client->read_size;
+        int read_size = SSL_read(client->ssl_handle, client->read_buffer + client->read_size, (int)free_size);
+        if (read_size <= 0) {
+            int error = SSL_get_error(client->ssl_handle, read_size);
+            if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_ZERO_RETURN) {
+                handle_error(client, read_size);
+            }
+            break;
+        }
+        client->read_size += read_size;
+        ProcessReadBuffer(client);
+    }
+    client->processing = false;
+}
+
+// Parse the document of a request into the plan's ticket, and the variables
+// into the plan.
+// @throw std::logic_error when the memory pool runs out of blocks.
+ExecutableDefinition* ParseRequest(GatewayClient *client, const char *body, std::size_t size, QueryPlan& plan) {
+    if (size == 0) {
         return nullptr;
     }
-    auto memory_pool = client->server->memory_pool;
-    auto ticket = memory_pool->TakeTicket();
-    GraphQlSchema schema("type Query { field: Int }", memory_pool, ticket);
-    GraphQlExecutor graphql_executor(memory_pool, ticket);
+    GraphQlSchema schema("type Query { field: Int }", plan.memory_pool, plan.ticket);
+    GraphQlExecutor graphql_executor(plan.memory_pool, plan.ticket);
     graphql_executor.add_schema(schema);
     Json::Reader json_reader;
     Json::Value request_body;
-    if (request->body != nullptr) {
-        json_reader.parse(request->body, request_body);
-        std::string graphql_query = request_body["query"].asString();
-        return graphql_executor.Execute(graphql_query);
+    if (!json_reader.parse(body, body + size, request_body)) {
+        return nullptr;
     }
-    return nullptr;
-}
-
-void ForwardRequest(ClientRequest* client_request, Field* field) {
-    auto addrinfo = (uv_getaddrinfo_t*)malloc(sizeof(uv_getaddrinfo_t));
-    addrinfo->data = client_request;
-    auto gateway_client = client_request->gateway_client;
-    auto loop = gateway_client->server->loop;
-    int r = uv_getaddrinfo(loop, addrinfo, OnResolvedIpv4, client_request->hostname, "80", NULL);
-    if (r) {
-        printf("Error at dns request: %s.\n", uv_strerror(r));
-        uv_close((uv_handle_t*)gateway_client->tcp_handle, nullptr);
-        return;
+    const Json::Value& request_variables = request_body["variables"];
+    if (request_variables.isObject() && !request_variables.empty()) {
+        Json::FastWriter json_writer;
+        plan.variables = json_writer.write(request_variables);
+        if (!plan.variables.empty() && plan.variables.back() == '\n') {
+            plan.variables.pop_back();
+        }
     }
+    std::string graphql_query = request_body["query"].asString();
+    return graphql_executor.Execute(graphql_query);
 }
 
 void OnNewConnection(uv_stream_t *server, int status) {
@@ -243,7 +1204,14 @@ void OnNewConnection(uv_stream_t *server, int status) {
         std::fprintf(stderr, "New connection error %s\n", uv_strerror(status));
     }
     auto tcp_handle = (uv_tcp_t*)malloc(sizeof(uv_tcp_t));
-    auto gateway_client = static_cast<GatewayClient*>(server->data);
+    auto http_server = static_cast<HttpServer*>(server->data);
+    auto client_reference = std::make_shared<GatewayClient>();
+    auto gateway_client = client_reference.get();
+    gateway_client->handle_reference = std::move(client_reference);
+    gateway_client->server = http_server;
+    gateway_client->read_capacity = http_server->limits.max_header_fields_size + 1024 * 16;
+    gateway_client->read_buffer = new char[gateway_client->read_capacity];
+    gateway_client->read_state = RequestReadState::Head;
     gateway_client->ssl_handle = SSL_new(gateway_client->server->ssl_ctx);
     gateway_client->read_bio = BIO_new(BIO_s_mem());
     gateway_client->write_bio = BIO_new(BIO_s_mem());
@@ -259,7 +1227,8 @@ void OnNewConnection(uv_stream_t *server, int status) {
         }
     }
     else {
-        uv_close((uv_handle_t*)tcp_handle, NULL);
+        gateway_client->read_state = RequestReadState::Closed;
+        uv_close((uv_handle_t*)tcp_handle, OnClientClose);
     }
 }
 
@@ -268,6 +1237,35 @@ void HandleSignal(uv_signal_t *signal, int signum) {
     uv_loop_close(signal->loop);
 }
 
+void HandleReloadSignal(uv_signal_t *signal, int signum) {
+    static_cast<HttpServer*>(signal->data)->ReloadRoutes();
+}
+
+// Resolve the replicas of the routes ahead of their first request, and set
+// the TLS of their connections and whether they carry HTTP/2 sessions.
+void PrepareReplicas(HttpServer* server, const RouteTable& routes) {
+    for (const auto& endpoint : routes.Endpoints()) {
+        for (const auto& replica : endpoint->replicas) {
+            server->dns_cache->Prefetch(replica.hostname.c_str());
+            server->upstream_pool->ConfigureTls(replica.hostname.c_str(), replica.port, endpoint->tls);
+            server->upstream_pool->SetMultiplexed(replica.hostname.c_str(), replica.port, endpoint->http2);
+        }
+    }
+}
+
+struct RoutesReload {
+    uv_work_t request;
+    HttpServer* server;
+    std::string file;
+    std::shared_ptr<const RouteTable> table;
+    std::string error;
+};
+
+void LoadRoutes(uv_work_t* request) {
+    auto reload = static_cast<RoutesReload*>(request->data);
+    LoadRouteTable(reload->file, reload->table, reload->error);
+}
+
 void OnInterval(uv_timer_t *handle) {
     auto http_server = static_cast<HttpServer*>(handle->data);
 
@@ -278,7 +1276,17 @@ void OnInterval(uv_timer_t *handle) {
 }
 
 HttpServer::HttpServer(uv_loop_t* loop)
-    : loop(loop) {
+    : loop(loop),
+      date_clock(nullptr),
+      writer_memory_pool(nullptr),
+      writer_pool(nullptr),
+      dns_cache(nullptr),
+      upstream_pool(nullptr),
+      http2_pool(nullptr),
+      singleflight(nullptr),
+      response_cache(nullptr),
+      balancer(nullptr),
+      batcher(nullptr) {
 }
 
 void HttpServer::Listen(const char *host, unsigned int port) {
@@ -286,23 +1294,49 @@ void HttpServer::Listen(const char *host, unsigned int port) {
     SSL_load_error_strings();
 
     parent_pid = getppid();
-    GatewayClient* client = new GatewayClient;
-    client->server = this;
     SetSecurityContext();
     memory_pool = new MemoryPool(1024 * 4 * 10000, 1024 * 4);
+    writer_memory_pool = new MemoryPool(1024 * 4 * 10000, 1024 * 4);
+    date_clock = new HttpDateClock(loop);
+    writer_pool = new HttpWriterPool(writer_memory_pool);
+    dns_cache = new DnsCache(loop);
+    upstream_pool = new UpstreamPool(loop, dns_cache);
+    http2_pool = new Http2SessionPool(loop, upstream_pool);
+    singleflight = new SingleflightGroup();
+    response_cache = new ResponseCache(loop);
+    balancer = new ReplicaBalancer(loop, upstream_pool);
+    batcher = new SubqueryBatcher(loop, ForwardBatch, this);
+    date_clock->Start();
+    dns_cache->Start();
+    upstream_pool->Start();
+    http2_pool->Start();
+    balancer->Start();
+    if (routes_file.empty()) {
+        routes_file = resolve_paths(root_dir(), "routes.json").string();
+    }
+    std::string error;
+    if (!LoadRouteTable(routes_file, routes_, error)) {
+        std::fprintf(stderr, "Routes error %s\n", error.c_str());
+        routes_ = std::make_shared<RouteTable>(std::vector<std::unique_ptr<BackendEndpoint>>(), std::vector<Route>());
+    }
+    PrepareReplicas(this, *routes_);
 
     uv_signal_t* signal = (uv_signal_t*)malloc(sizeof(uv_signal_t));
     uv_signal_init(loop, signal);
     uv_signal_start(signal, HandleSignal, SIGTERM);
     uv_signal_start(signal, HandleSignal, SIGINT);
-    uv_signal_start(signal, HandleSignal, SIGHUP);
+    uv_signal_t* reload_signal = (uv_signal_t*)malloc(sizeof(uv_signal_t));
+    uv_signal_init(loop, reload_signal);
+    reload_signal->data = this;
+    uv_signal_start(reload_signal, HandleReloadSignal, SIGHUP);
+    uv_unref((uv_handle_t*)reload_signal);
     uv_timer_t* timer_request = (uv_timer_t*)malloc(sizeof(uv_timer_t));
     uv_timer_init(loop, timer_request);
     timer_request->data = this;
     uv_timer_start(timer_request, OnInterval, 0, 0);
     uv_tcp_t* server = (uv_tcp_t*)malloc(sizeof(uv_tcp_t));
     uv_tcp_init(loop, server);
-    server->data = client;
+    server->data = this;
     sockaddr_in addr;
     uv_ip4_addr(host, port, &addr);
     uv_tcp_bind(server, (sockaddr*)&addr, 0);
@@ -312,7 +1346,55 @@ void HttpServer::Listen(const char *host, unsigned int port) {
     }
 }
 
+std::shared_ptr<const RouteTable> HttpServer::Routes() const {
+    return std::atomic_load(&routes_);
+}
+
+void HttpServer::ReloadRoutes() {
+    auto reload = new RoutesReload {};
+    reload->request.data = reload;
+    reload->server = this;
+    reload->file = routes_file;
+    uv_queue_work(loop, &reload->request, LoadRoutes, OnRoutesLoaded);
+}
+
+// The plans that are made from now on use the new table, the requests in
+// flight keep the old one until they end.
+void HttpServer::OnRoutesLoaded(uv_work_t* request, int status) {
+    auto reload = static_cast<RoutesReload*>(request->data);
+    HttpServer* server = reload->server;
+    if (status != 0 || reload->table == nullptr) {
+        std::fprintf(stderr, "Routes error %s\n", status != 0 ? uv_strerror(status) : reload->error.c_str());
+    }
+    else {
+        PrepareReplicas(server, *reload->table);
+        std::atomic_store(&server->routes_, std::move(reload->table));
+#ifdef _DEBUG
+        std::cerr << "Reloaded " << server->Routes()->Size() << " routes." << std::endl;
+#endif
+    }
+    delete reload;
+}
+
 void HttpServer::Close() {
+    if (date_clock != nullptr) {
+        date_clock->Stop();
+    }
+    if (dns_cache != nullptr) {
+        dns_cache->Stop();
+    }
+    if (upstream_pool != nullptr) {
+        upstream_pool->Stop();
+    }
+    if (http2_pool != nullptr) {
+        http2_pool->Stop();
+    }
+    if (balancer != nullptr) {
+        balancer->Stop();
+    }
+    if (batcher != nullptr) {
+        batcher->Stop();
+    }
     uv_loop_close(loop);
 }
 
@@ -4,62 +4,267 @@
 #include <uv.h>
 #include <openssl/ssl.h>
 #include <program/http_parser.h>
+#include <program/http_date.h>
+#include <program/upstream_pool.h>
+#include <program/route_table.h>
 #include <lib/memory_pool.h>
 #include <glibmm/ustring.h>
 #include <program/graphql/graphql_syntaxes.h>
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <vector>
 
+using namespace flashpoint::program;
 using namespace flashpoint::program::graphql;
 
 namespace flashpoint {
 
+class HttpWriterPool;
+class Http2SessionPool;
+class ResponseMerge;
+class ResponseCache;
+class ReplicaBalancer;
+class SubqueryBatcher;
+class SingleflightGroup;
+struct Http2Stream;
+struct QueryPlan;
+struct Subquery;
+struct SubqueryFlight;
+struct SubqueryBatch;
+
+struct UpstreamRequestOptions {
+    // Milliseconds from a client request until the requests of its
+    // subqueries fail.
+    std::uint64_t timeout;
+
+    // Whether queries are sent again when they haven't got a response head
+    // after this percentile of their endpoint's latencies.
+    bool hedging;
+    double hedge_percentile;
+
+    // The latencies that an endpoint needs before its requests are hedged.
+    std::size_t min_hedge_samples;
+};
+
+const UpstreamRequestOptions default_upstream_request_options = { 10000, true, 0.95, 32 };
+
+// Whether a request that may be sent twice is hedged, i.e. its endpoint has
+// enough latencies for a hedging delay.
+bool IsHedgedRequest(const UpstreamRequestOptions& options, const LatencyHistogram& latency, bool hedgeable);
+
+// Get the milliseconds until the timer of a forwarded request fires, which is
+// at its hedging delay when it is hedged and at its deadline otherwise.
+// @param now uv_now.
+// @param deadline the deadline of the client request.
+// @param hedged whether the request is hedged.
+std::uint64_t GetForwardRequestTimeout(const UpstreamRequestOptions& options, const LatencyHistogram& latency, std::uint64_t now, std::uint64_t deadline, bool hedged);
+
+enum class ForwardTimerAction {
+    // The deadline has passed, the request fails.
+    Fail,
+
+    // Send another attempt, then wait for the deadline.
+    Hedge,
+    Wait,
+};
+
+// Get what a forwarded request does when its timer fires. A request is hedged
+// when no attempt has got a response head yet, and the hedge is taken from its
+// endpoint's retry budget.
+// @param has_winner whether an attempt has got a response head.
+ForwardTimerAction GetForwardTimerAction(std::uint64_t now, std::uint64_t deadline, bool has_winner, RetryBudget& retry_budget);
+
+// Whether a request whose attempts have all failed is sent to another replica.
+// @param replica the replica that hasn't been tried, nullptr when there is none.
+bool CanFailOver(const BackendReplica* replica, std::uint64_t now, std::uint64_t deadline);
+
 class HttpServer {
 public:
     HttpServer(uv_loop_t* loop);
     void Listen(const char *host, unsigned int port);
     void Close();
 
+    // The current routes. A request keeps the table it has planned with, so
+    // that a reload doesn't change its backends.
+    std::shared_ptr<const RouteTable> Routes() const;
+
+    // Load the routes file on the loop's thread pool and swap its table in
+    // when it is valid. Requests keep being planned with the old table until
+    // then.
+    void ReloadRoutes();
+
     uv_loop_t* loop;
     SSL_CTX* ssl_ctx;
+    // The blocks of the GraphQL documents of the requests in flight, one
+    // ticket per request.
     MemoryPool* memory_pool;
+    HttpDateClock* date_clock;
+
+    // The buffers of the writers have their own blocks, so that requests in
+    // flight can't use up the buffers of their responses.
+    MemoryPool* writer_memory_pool;
+    HttpWriterPool* writer_pool;
+    DnsCache* dns_cache;
+    UpstreamPool* upstream_pool;
+
+    // Multiplexes the requests to the backends that speak HTTP/2.
+    Http2SessionPool* http2_pool;
+
+    // The route config, root_dir()/routes.json when empty. It is reloaded on
+    // SIGHUP.
+    std::string routes_file;
+
+    // Coalesces identical queries to a backend, nullptr to send every one.
+    SingleflightGroup* singleflight;
+
+    // Caches the data of queries with a TTL, nullptr to cache nothing.
+    ResponseCache* response_cache;
+
+    // Picks the replica of a backend that a request is sent to.
+    ReplicaBalancer* balancer;
+
+    // Batches the queries of routes with a batch window, nullptr to send
+    // every one.
+    SubqueryBatcher* batcher;
+    HttpParserLimits limits = default_http_parser_limits;
+    UpstreamRequestOptions upstream_request_options = default_upstream_request_options;
     int parent_pid;
 private:
+    std::shared_ptr<const RouteTable> routes_;
+
     void SetSecurityContext();
+    static void OnRoutesLoaded(uv_work_t* request, int status);
 };
 
-struct GatewayClient {
+enum class RequestReadState {
+    Head,
+    Body,
+    Closed,
+};
+
+// Body of the current request. A body that is delivered as one span is parsed
+// straight from the read buffer, only bodies that are fragmented across chunks
+// or reads are copied together.
+struct RequestBody {
+    const char* span;
+    std::size_t span_size;
+    std::vector<char> buffer;
+};
+
+// Raw field lines of the headers that are forwarded from a client request. It
+// is shared by all backend requests of the client request, since they are
+// written after the client's read buffer has been reused.
+struct ForwardedHeaders {
+    HttpHeaderSet headers;
+    std::vector<char> fields;
+
+    // The forwarded field lines that can change a backend's response, i.e.
+    // all but User-Agent. Only requests with the same scope are coalesced.
+    std::string scope;
+};
+
+// A client connection. It is shared by the connection's handle and by the
+// requests, batches and response outputs of its requests, and is freed once
+// the handle has closed and the last of them has released it.
+struct GatewayClient : std::enable_shared_from_this<GatewayClient> {
     uv_tcp_t* tcp_handle;
     HttpServer* server;
-    std::map<const char*, Field*> fields;
-    std::vector<FragmentDefinition*>* fragments;
     SSL* ssl_handle;
     BIO* read_bio;
     BIO* write_bio;
-};
 
-struct BackendEndpoint {
-    const char* origin;
-    const char* host;
-    const char* hostname;
-    unsigned int port;
-    const char* path;
-};
+    // Decrypted bytes that are not yet consumed by the request parser.
+    char* read_buffer;
+    std::size_t read_size;
+    std::size_t read_capacity;
+
+    RequestReadState read_state;
+    std::unique_ptr<HttpRequest> request;
+    HttpRequestBodyReader body_reader;
+    RequestBody body;
+    std::shared_ptr<ForwardedHeaders> forwarded_headers;
 
-struct cmp_str {
-    bool operator()(const char *a, const char *b) const {
-        return std::strcmp(a, b) < 0;
-    }
+    // The merge of the response that is being sent. Reading is paused until
+    // it has ended, so pipelined requests are answered in order.
+    std::shared_ptr<ResponseMerge> merge;
+
+    // Set while the read buffer is processed, so that a response that ends
+    // during it, e.g. because its backends are unavailable, doesn't process
+    // it again.
+    bool processing;
+
+    // The reference of the handle, released when the handle has closed.
+    std::shared_ptr<GatewayClient> handle_reference;
 };
 
-extern std::map<const char*, BackendEndpoint, cmp_str> field_to_endpoint;
+struct ClientRequest;
+
+// A request of a subquery to its backend, on one connection. A hedged request
+// has several attempts, the first one whose response head arrives wins.
+struct UpstreamAttempt {
+    // The request, nullptr once the request has ended while the attempt was
+    // still waiting for a connection.
+    ClientRequest* client_request;
+    UpstreamConnection* connection;
+    HttpResponseParser response_parser;
+
+    // The stream of an attempt to a backend that speaks HTTP/2, which has no
+    // connection of its own. It is freed once the stream's end or error
+    // callback returns, after which the attempt is deleted.
+    Http2Stream* stream;
+
+    // The pool of the replica's endpoint, for its latencies.
+    UpstreamEndpointPool* endpoint;
+
+    // The replica that the attempt is sent to, nullptr once its result has
+    // been recorded in the balancer.
+    const BackendReplica* replica;
+
+    // uv_now when the attempt was started.
+    std::uint64_t start;
+
+    // Whether the connection can't be reused after the response, e.g. the
+    // backend sent Connection: close or bytes after the response.
+    bool close;
+};
 
 struct ClientRequest {
-    const char* hostname;
-    unsigned int port;
-    const char* host;
-    const char* path;
-    uv_tcp_t *tcp_handle;
-    GatewayClient* gateway_client;
+    std::shared_ptr<QueryPlan> plan;
+    const Subquery* subquery;
+    std::shared_ptr<GatewayClient> gateway_client;
+
+    // The members whose merges the response body is streamed into, the
+    // request's own subquery first.
+    std::unique_ptr<SubqueryFlight> flight;
+
+    // The subqueries that the request is sent for instead, when it is a batch.
+    // Its response is split into their flights once it is complete.
+    std::unique_ptr<SubqueryBatch> batch;
+
+    // The members whose merges have paused the reading of the response.
+    std::size_t paused_merges;
+
+    // Milliseconds that the response's data is cached, 0 when it isn't.
+    std::uint64_t cache_ttl;
+
+    // uv_now when the client request's deadline passes.
+    std::uint64_t deadline;
+
+    // Fires at the hedging delay and at the deadline.
+    uv_timer_t timer;
+    std::vector<UpstreamAttempt*> attempts;
+
+    // The replicas that attempts have been sent to, the first attempt's first.
+    std::vector<const BackendReplica*> tried_replicas;
+
+    // The attempt whose response is merged.
+    UpstreamAttempt* winner;
+
+    // Whether the request may be sent twice, i.e. it is a query.
+    bool hedgeable;
+    bool finished;
 };
 
 void on_read(uv_stream_t *client_stream, ssize_t length, const uv_buf_t *buf);
@@ -0,0 +1,226 @@
+#include <program/query_planner.h>
+#include <algorithm>
+
+namespace flashpoint {
+
+class QueryPlanner {
+public:
+    QueryPlanner(std::vector<FragmentDefinition*>* fragments, const RouteTable& routes, QueryPlan& plan):
+        fragments_(fragments),
+        routes_(routes),
+        plan_(plan) { }
+
+    QueryPlanError AddSelections(const SelectionSet* selection_set) {
+        for (const auto& selection : selection_set->selections) {
+            QueryPlanError error;
+            bool included;
+            switch (selection->kind) {
+                case SyntaxKind::S_Field:
+                    error = AddField(static_cast<Field*>(selection));
+                    break;
+                case SyntaxKind::S_FragmentSpread: {
+                    auto fragment_spread = static_cast<FragmentSpread*>(selection);
+                    error = IsIncluded(fragment_spread->directives, included);
+                    if (error == QueryPlanError::None && included) {
+                        error = AddFragmentSpread(fragment_spread);
+                    }
+                    break;
+                }
+                case SyntaxKind::S_InlineFragment:
+                    error = IsIncluded(static_cast<InlineFragment*>(selection)->directives, included);
+                    if (error == QueryPlanError::None && included) {
+                        error = AddSelections(selection->selection_set);
+                    }
+                    break;
+                default:
+                    error = QueryPlanError::UnsupportedRootSelection;
+            }
+            if (error != QueryPlanError::None) {
+                return error;
+            }
+        }
+        return QueryPlanError::None;
+    }
+
+private:
+    std::vector<FragmentDefinition*>* fragments_;
+    const RouteTable& routes_;
+    QueryPlan& plan_;
+
+    // The fragments that are being expanded, so that a fragment cycle is
+    // expanded only once.
+    std::vector<const FragmentDefinition*> expanding_fragments_;
+
+    // Apply the @skip(if:) and @include(if:) directives of a root fragment,
+    // since its selections are sent without it. Only literal arguments are
+    // known when the query is planned, a variable or any other directive makes
+    // the selection unsupported.
+    // @param directives the directives of the fragment.
+    // @param included set to whether the fragment's selections are added.
+    static QueryPlanError IsIncluded(const std::map<Glib::ustring, Directive*>& directives, bool& included) {
+        included = true;
+        for (const auto& directive_entry : directives) {
+            bool is_skip = directive_entry.first == "skip";
+            if (!is_skip && directive_entry.first != "include") {
+                return QueryPlanError::UnsupportedRootSelection;
+            }
+            const Directive* directive = directive_entry.second;
+            if (directive->arguments == nullptr) {
+                return QueryPlanError::UnsupportedRootSelection;
+            }
+            auto argument_it = directive->arguments->find("if");
+            if (argument_it == directive->arguments->end()) {
+                return QueryPlanError::UnsupportedRootSelection;
+            }
+            const Value* condition = argument_it->second->value;
+            if (condition == nullptr || condition->kind != SyntaxKind::S_BooleanValue) {
+                return QueryPlanError::UnsupportedRootSelection;
+            }
+            if (static_cast<const BooleanValue*>(condition)->value == is_skip) {
+                included = false;
+            }
+        }
+        return QueryPlanError::None;
+    }
+
+    QueryPlanError AddField(Field* field) {
+        OperationType operation_type = plan_.operation->operation_type;
+        const Route* route = routes_.Find(operation_type, field->name->identifier.raw());
+        if (route == nullptr) {
+            return QueryPlanError::UnknownField;
+        }
+        const BackendEndpoint* endpoint = route->endpoint;
+        std::uint64_t cache_ttl = operation_type == OperationType::Query ? GetFieldCacheTtl(field, route) : 0;
+        std::uint64_t batch_window = IsBatchable(plan_.operation) ? route->batch_window : 0;
+        Subquery* subquery = nullptr;
+        for (auto& planned_subquery : plan_.subqueries) {
+            if (planned_subquery.endpoint == endpoint) {
+                subquery = &planned_subquery;
+                break;
+            }
+        }
+        if (subquery == nullptr) {
+            plan_.subqueries.push_back({ endpoint, {}, cache_ttl, batch_window });
+            subquery = &plan_.subqueries.back();
+        }
+        subquery->cache_ttl = std::min(subquery->cache_ttl, cache_ttl);
+        subquery->batch_window = std::min(subquery->batch_window, batch_window);
+        const Glib::ustring& response_key = field->alias != nullptr ? field->alias->identifier : field->name->identifier;
+        for (auto& planned_field : subquery->fields) {
+            if (planned_field.response_key == response_key.raw()) {
+                planned_field.fields.push_back(field);
+                return QueryPlanError::None;
+            }
+        }
+        subquery->fields.push_back({ response_key.raw(), { field } });
+        return QueryPlanError::None;
+    }
+
+    // A batch is one anonymous query, so only the root fields of queries
+    // without variables and directives can be part of one.
+    static bool IsBatchable(const OperationDefinition* operation) {
+        bool has_variables = operation->variable_definitions != nullptr && !operation->variable_definitions->variable_definitions.empty();
+        return operation->operation_type == OperationType::Query && !has_variables && operation->directives.empty();
+    }
+
+    QueryPlanError AddFragmentSpread(const FragmentSpread* fragment_spread) {
+        if (fragments_ == nullptr) {
+            return QueryPlanError::UnknownFragment;
+        }
+        for (const auto& fragment : *fragments_) {
+            if (fragment->name->identifier != fragment_spread->name->identifier) {
+                continue;
+            }
+            for (const auto& expanding_fragment : expanding_fragments_) {
+                if (expanding_fragment == fragment) {
+                    return QueryPlanError::None;
+                }
+            }
+            expanding_fragments_.push_back(fragment);
+            QueryPlanError error = AddSelections(fragment->selection_set);
+            expanding_fragments_.pop_back();
+            return error;
+        }
+        return QueryPlanError::UnknownFragment;
+    }
+};
+
+QueryPlan::~QueryPlan() {
+    if (ticket != nullptr) {
+        memory_pool->ReturnTicket(ticket);
+    }
+}
+
+QueryPlanError PlanQuery(OperationDefinition* operation, std::vector<FragmentDefinition*>* fragments, std::shared_ptr<const RouteTable> routes, QueryPlan& plan) {
+    plan.routes = std::move(routes);
+    plan.operation = operation;
+    plan.fragments = fragments;
+    plan.subqueries.clear();
+    QueryPlanner planner(fragments, *plan.routes, plan);
+    return planner.AddSelections(operation->selection_set);
+}
+
+std::uint64_t GetFieldCacheTtl(const Field* field, const Route* route) {
+    if (route->cache_ttl > 0) {
+        return route->cache_ttl;
+    }
+    if (field->definition == nullptr) {
+        return 0;
+    }
+    auto directive_it = field->definition->directives.find("cacheControl");
+    if (directive_it == field->definition->directives.end() || directive_it->second->arguments == nullptr) {
+        return 0;
+    }
+    auto argument_it = directive_it->second->arguments->find("maxAge");
+    if (argument_it == directive_it->second->arguments->end()) {
+        return 0;
+    }
+    const Value* max_age = argument_it->second->value;
+    if (max_age == nullptr || max_age->kind != SyntaxKind::S_IntValue || static_cast<const IntValue*>(max_age)->value <= 0) {
+        return 0;
+    }
+    return static_cast<std::uint64_t>(static_cast<const IntValue*>(max_age)->value) * 1000;
+}
+
+const char* GetQueryPlanErrorMessage(QueryPlanError error) {
+    switch (error) {
+        case QueryPlanError::UnsupportedRootSelection:
+            return "Unsupported root selection";
+        case QueryPlanError::UnknownField:
+            return "Cannot query unknown field";
+        case QueryPlanError::UnknownFragment:
+            return "Unknown fragment";
+        default:
+            return "";
+    }
+}
+
+std::string DescribeQueryPlan(const QueryPlan& plan) {
+    std::string text = "Query plan, " + std::to_string(plan.subqueries.size()) + " subqueries:\n";
+    for (const auto& subquery : plan.subqueries) {
+        text += "  ";
+        text += subquery.endpoint->origin;
+        text += ":";
+        for (const auto& planned_field : subquery.fields) {
+            text += " ";
+            const Glib::ustring& name = planned_field.fields.front()->name->identifier;
+            if (planned_field.response_key != name.raw()) {
+                text += planned_field.response_key + ":";
+            }
+            text += name.raw();
+            if (planned_field.fields.size() > 1) {
+                text += " (" + std::to_string(planned_field.fields.size()) + " selections)";
+            }
+        }
+        if (subquery.cache_ttl > 0) {
+            text += " (cached for " + std::to_string(subquery.cache_ttl) + "ms)";
+        }
+        if (subquery.batch_window > 0) {
+            text += " (batched within " + std::to_string(subquery.batch_window) + "us)";
+        }
+        text += "\n";
+    }
+    return text;
+}
+
+}
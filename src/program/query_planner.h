@@ -0,0 +1,129 @@
+#ifndef FLASHPOINT_QUERY_PLANNER_H
+#define FLASHPOINT_QUERY_PLANNER_H
+
+#include <program/http_server.h>
+#include <program/graphql/graphql_syntaxes.h>
+#include <program/graphql/graphql_printer.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace flashpoint {
+
+// A root field of a subquery. Selections with the same response key are one
+// field of the response, so their selection sets are selected together.
+struct PlannedField {
+    // The key of the field in the client response, and its alias in the
+    // subquery when it differs from the field's name.
+    std::string response_key;
+    std::vector<Field*> fields;
+};
+
+// The root fields of an operation that are resolved by one backend, in the
+// order of their first selection.
+struct Subquery {
+    const BackendEndpoint* endpoint;
+    std::vector<PlannedField> fields;
+
+    // Milliseconds that the subquery's data is cached, the smallest TTL of its
+    // root fields. 0 when it isn't cached.
+    std::uint64_t cache_ttl;
+
+    // Microseconds that the subquery waits to be batched, the smallest window
+    // of its root fields. 0 when it isn't batched.
+    std::uint64_t batch_window;
+};
+
+// The subqueries of an operation, one per backend, in the order of the
+// backend's first root field.
+struct QueryPlan {
+    // The routes that the plan was made with, kept alive for the subqueries'
+    // endpoints when the routes are reloaded.
+    std::shared_ptr<const RouteTable> routes;
+
+    // The operation and fragments are in the blocks of the plan's ticket,
+    // which the plan returns to the pool when it is freed.
+    OperationDefinition* operation = nullptr;
+    std::vector<FragmentDefinition*>* fragments = nullptr;
+    MemoryPool* memory_pool = nullptr;
+    MemoryPoolTicket* ticket = nullptr;
+    std::vector<Subquery> subqueries;
+
+    // The client's variables as minified JSON, sent with every subquery. Empty
+    // when the client sent none.
+    std::string variables;
+
+    QueryPlan() = default;
+
+    QueryPlan(const QueryPlan&) = delete;
+
+    QueryPlan& operator=(const QueryPlan&) = delete;
+
+    ~QueryPlan();
+};
+
+enum class QueryPlanError {
+    None,
+    UnsupportedRootSelection,
+    UnknownField,
+    UnknownFragment,
+};
+
+// Group the root fields of an operation by their backend. Fragment spreads and
+// inline fragments of the root selection set are expanded, or left out by
+// their @skip and @include directives with literal arguments. The data of a
+// query's subquery is cached for the TTL of its fields, from their route or
+// their @cacheControl(maxAge:) directive in the schema. A query without
+// variables and directives is batched when all of its fields' routes have a
+// batch window.
+// @param operation the operation.
+// @param fragments the fragment definitions of the operation's document.
+// @param routes the backend of every root field.
+// @param plan the plan to fill.
+QueryPlanError PlanQuery(OperationDefinition* operation, std::vector<FragmentDefinition*>* fragments, std::shared_ptr<const RouteTable> routes, QueryPlan& plan);
+
+// Get the TTL of a root field's data in milliseconds, 0 when it isn't cached.
+// @param field the field.
+// @param route the route of the field.
+std::uint64_t GetFieldCacheTtl(const Field* field, const Route* route);
+
+// Get the message of a plan error, for the client response.
+const char* GetQueryPlanErrorMessage(QueryPlanError error);
+
+// Print the JSON request body of a subquery, i.e. its query and the client's
+// variables.
+// @param writer the writer, e.g. an HttpWriter or a SizeCounter.
+// @param plan the plan of the subquery.
+// @param subquery the subquery.
+// @param mode how the fragments of the subquery are printed.
+template<typename Writer>
+void PrintSubquery(Writer& writer, const QueryPlan& plan, const Subquery& subquery, FragmentPrintMode mode) {
+    GraphQlPrinter<Writer> printer(writer, plan.fragments, mode);
+    printer.Write("{\"query\":\"");
+    printer.PrintOperationHead(plan.operation);
+    printer.Write("{");
+    bool first = true;
+    for (const auto& planned_field : subquery.fields) {
+        if (!first) {
+            printer.Write(" ");
+        }
+        first = false;
+        printer.PrintMergedField(planned_field.fields, planned_field.response_key);
+    }
+    printer.Write("}");
+    printer.PrintFragments();
+    printer.Write("\"");
+    if (!plan.variables.empty()) {
+        printer.Write(",\"variables\":");
+        printer.Write(plan.variables);
+    }
+    printer.Write("}");
+}
+
+// Describe the fan-out of a plan, one line per subquery, for debug output.
+std::string DescribeQueryPlan(const QueryPlan& plan);
+
+}
+
+#endif //FLASHPOINT_QUERY_PLANNER_H
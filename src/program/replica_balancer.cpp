@@ -0,0 +1,202 @@
+#include <program/replica_balancer.h>
+#include <algorithm>
+
+namespace flashpoint {
+
+struct ReplicaProbe {
+    ReplicaBalancer* balancer;
+    UpstreamEndpointPool* endpoint_pool;
+};
+
+ReplicaBalancer::ReplicaBalancer(uv_loop_t* loop, UpstreamPool* upstream_pool, const OutlierDetectionOptions& options):
+    loop_(loop),
+    upstream_pool_(upstream_pool),
+    options_(options),
+    stats_(),
+    random_state_(uv_hrtime() | 1) {
+    uv_timer_init(loop, &timer_);
+    timer_.data = this;
+}
+
+void ReplicaBalancer::Start() {
+    uv_timer_start(&timer_, OnTick, options_.probe_interval, options_.probe_interval);
+    uv_unref((uv_handle_t*)&timer_);
+}
+
+void ReplicaBalancer::Stop() {
+    uv_timer_stop(&timer_);
+}
+
+const ReplicaBalancerStats& ReplicaBalancer::Stats() const {
+    return stats_;
+}
+
+ReplicaHealth& ReplicaBalancer::Health(const BackendReplica* replica) {
+    return upstream_pool_->Endpoint(replica->hostname.c_str(), replica->port)->health;
+}
+
+std::uint64_t ReplicaBalancer::Random() {
+    random_state_ ^= random_state_ >> 12;
+    random_state_ ^= random_state_ << 25;
+    random_state_ ^= random_state_ >> 27;
+    return random_state_ * 0x2545f4914f6cdd1dULL;
+}
+
+const BackendReplica* ReplicaBalancer::Pick(const BackendEndpoint& endpoint, const std::vector<const BackendReplica*>& tried) {
+    auto is_candidate = [&](const BackendReplica* replica, bool ejected) {
+        return std::find(tried.begin(), tried.end(), replica) == tried.end() && Health(replica).ejected == ejected;
+    };
+
+    // Ejected replicas are only picked when no other replica is left, so that
+    // the backend is still tried when all of its replicas are failing.
+    bool ejected = false;
+    std::size_t count = 0;
+    for (const auto& replica : endpoint.replicas) {
+        count += is_candidate(&replica, false) ? 1 : 0;
+    }
+    if (count == 0) {
+        ejected = true;
+        for (const auto& replica : endpoint.replicas) {
+            count += is_candidate(&replica, true) ? 1 : 0;
+        }
+        if (count == 0) {
+            return nullptr;
+        }
+        stats_.panic_picks++;
+    }
+    stats_.picks++;
+    auto nth_candidate = [&](std::size_t n) -> const BackendReplica* {
+        for (const auto& replica : endpoint.replicas) {
+            if (is_candidate(&replica, ejected) && n-- == 0) {
+                return &replica;
+            }
+        }
+        return nullptr;
+    };
+    if (count == 1) {
+        return nth_candidate(0);
+    }
+    std::size_t first = Random() % count;
+    std::size_t second = Random() % (count - 1);
+    if (second >= first) {
+        second++;
+    }
+    const BackendReplica* first_replica = nth_candidate(first);
+    const BackendReplica* second_replica = nth_candidate(second);
+    return Health(first_replica).outstanding_requests <= Health(second_replica).outstanding_requests ? first_replica : second_replica;
+}
+
+void ReplicaBalancer::Begin(const BackendReplica* replica) {
+    Health(replica).outstanding_requests++;
+}
+
+void ReplicaBalancer::Abandon(const BackendReplica* replica) {
+    ReplicaHealth& health = Health(replica);
+    if (health.outstanding_requests > 0) {
+        health.outstanding_requests--;
+    }
+}
+
+void ReplicaBalancer::End(const BackendEndpoint& endpoint, const BackendReplica* replica, bool success, std::uint64_t latency) {
+    UpstreamEndpointPool* endpoint_pool = upstream_pool_->Endpoint(replica->hostname.c_str(), replica->port);
+    ReplicaHealth& health = endpoint_pool->health;
+    if (health.outstanding_requests > 0) {
+        health.outstanding_requests--;
+    }
+    std::uint64_t now = uv_now(loop_);
+    if (now - health.window_start >= options_.interval) {
+        // A replica that made it through a window is no longer ejected in a
+        // row.
+        if (!health.ejected && health.window_requests > 0) {
+            health.ejections = 0;
+        }
+        health.window_start = now;
+        health.window_requests = 0;
+        health.window_failures = 0;
+        health.window_latency = 0;
+    }
+    health.window_requests++;
+    if (success) {
+        health.window_latency += latency;
+    }
+    else {
+        health.window_failures++;
+    }
+    if (health.ejected || health.window_requests < options_.min_requests) {
+        return;
+    }
+    std::size_t successes = health.window_requests - health.window_failures;
+    bool is_outlier = health.window_failures > options_.max_error_rate * health.window_requests ||
+        (options_.max_latency > 0 && successes > 0 && health.window_latency / successes > options_.max_latency);
+    if (is_outlier && CanEject(endpoint)) {
+        Eject(endpoint_pool, now);
+    }
+}
+
+bool ReplicaBalancer::CanEject(const BackendEndpoint& endpoint) {
+    std::size_t ejected = 0;
+    for (const auto& replica : endpoint.replicas) {
+        ejected += Health(&replica).ejected ? 1 : 0;
+    }
+    return ejected + 1 <= options_.max_ejected_ratio * endpoint.replicas.size();
+}
+
+void ReplicaBalancer::Eject(UpstreamEndpointPool* endpoint_pool, std::uint64_t now) {
+    ReplicaHealth& health = endpoint_pool->health;
+    health.ejections++;
+    health.ejected_until = now + std::min(options_.ejection_time * health.ejections, options_.max_ejection_time);
+    stats_.ejections++;
+    if (!health.ejected) {
+        health.ejected = true;
+        ejected_.push_back(endpoint_pool);
+    }
+}
+
+// Connect to the ejected replicas whose ejection time has passed. A replica is
+// readmitted when the connection succeeds, and ejected for longer otherwise.
+void ReplicaBalancer::Probe() {
+    std::uint64_t now = uv_now(loop_);
+
+    // A replica with an idle connection is readmitted before Acquire returns,
+    // which removes it from the ejected replicas.
+    std::vector<UpstreamEndpointPool*> ejected = ejected_;
+    for (const auto& endpoint_pool : ejected) {
+        ReplicaHealth& health = endpoint_pool->health;
+        if (health.probing || now < health.ejected_until) {
+            continue;
+        }
+        health.probing = true;
+        stats_.probes++;
+        auto probe = new ReplicaProbe { this, endpoint_pool };
+        upstream_pool_->Acquire(endpoint_pool->hostname.c_str(), endpoint_pool->port, OnProbeConnected, probe);
+    }
+}
+
+void ReplicaBalancer::OnProbeConnected(UpstreamConnection* connection, int status, void* data) {
+    auto probe = static_cast<ReplicaProbe*>(data);
+    ReplicaBalancer* balancer = probe->balancer;
+    UpstreamEndpointPool* endpoint_pool = probe->endpoint_pool;
+    delete probe;
+    ReplicaHealth& health = endpoint_pool->health;
+    health.probing = false;
+    std::uint64_t now = uv_now(balancer->loop_);
+    if (connection == nullptr) {
+        balancer->Eject(endpoint_pool, now);
+        return;
+    }
+    balancer->upstream_pool_->Release(connection);
+    health.ejected = false;
+    health.window_start = now;
+    health.window_requests = 0;
+    health.window_failures = 0;
+    health.window_latency = 0;
+    auto& ejected = balancer->ejected_;
+    ejected.erase(std::find(ejected.begin(), ejected.end(), endpoint_pool));
+    balancer->stats_.readmissions++;
+}
+
+void ReplicaBalancer::OnTick(uv_timer_t* timer) {
+    static_cast<ReplicaBalancer*>(timer->data)->Probe();
+}
+
+}
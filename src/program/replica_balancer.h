@@ -0,0 +1,111 @@
+#ifndef FLASHPOINT_REPLICA_BALANCER_H
+#define FLASHPOINT_REPLICA_BALANCER_H
+
+#include <uv.h>
+#include <program/http_server.h>
+#include <program/upstream_pool.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace flashpoint {
+
+struct OutlierDetectionOptions {
+    // Milliseconds of a window of results that a replica is judged by.
+    std::uint64_t interval;
+
+    // Results that a window needs before its replica can be ejected.
+    std::size_t min_requests;
+
+    // The share of failed requests in a window above which its replica is
+    // ejected.
+    double max_error_rate;
+
+    // The average latency in milliseconds of a window above which its
+    // replica is ejected, 0 to never eject for latency.
+    std::uint64_t max_latency;
+
+    // Milliseconds of the first ejection, every ejection in a row is longer
+    // by as much, up to max_ejection_time.
+    std::uint64_t ejection_time;
+    std::uint64_t max_ejection_time;
+
+    // The share of a backend's replicas that can be ejected at the same time.
+    double max_ejected_ratio;
+
+    // Milliseconds between the checks for ejected replicas to probe.
+    std::uint64_t probe_interval;
+};
+
+const OutlierDetectionOptions default_outlier_detection_options = { 10000, 5, 0.5, 0, 30000, 300000, 0.5, 1000 };
+
+struct ReplicaBalancerStats {
+    std::size_t picks;
+    std::size_t ejections;
+    std::size_t probes;
+    std::size_t readmissions;
+
+    // Picks when all replicas that were left were ejected.
+    std::size_t panic_picks;
+};
+
+// Balances the requests to a backend over its replicas, with the power of two
+// choices: of two random replicas, the one with the fewest outstanding
+// requests. Replicas whose error rate or latency is too high are ejected, and
+// readmitted when a connection to them succeeds after their ejection time, so
+// that replicas that go down during a rolling deploy only fail a few requests.
+class ReplicaBalancer {
+public:
+    ReplicaBalancer(uv_loop_t* loop, UpstreamPool* upstream_pool, const OutlierDetectionOptions& options = default_outlier_detection_options);
+
+    // Start the probe timer. The timer doesn't keep the loop alive.
+    void Start();
+
+    void Stop();
+
+    // Pick a replica of a backend.
+    // @param endpoint the backend.
+    // @param tried the replicas that are not picked, e.g. the ones that a
+    // request has been sent to already.
+    // @return the replica, or nullptr when all of them have been tried.
+    const BackendReplica* Pick(const BackendEndpoint& endpoint, const std::vector<const BackendReplica*>& tried);
+
+    // A request has been sent to a replica.
+    void Begin(const BackendReplica* replica);
+
+    // A request to a replica has ended.
+    // @param endpoint the backend of the replica.
+    // @param replica the replica.
+    // @param success whether the replica answered.
+    // @param latency milliseconds until the replica answered.
+    void End(const BackendEndpoint& endpoint, const BackendReplica* replica, bool success, std::uint64_t latency);
+
+    // A request to a replica was abandoned, e.g. for a hedged request.
+    void Abandon(const BackendReplica* replica);
+
+    const ReplicaBalancerStats& Stats() const;
+
+private:
+    uv_loop_t* loop_;
+    UpstreamPool* upstream_pool_;
+    OutlierDetectionOptions options_;
+    ReplicaBalancerStats stats_;
+    uv_timer_t timer_;
+    std::uint64_t random_state_;
+
+    // The pools of the replicas that are ejected.
+    std::vector<UpstreamEndpointPool*> ejected_;
+
+    ReplicaHealth& Health(const BackendReplica* replica);
+    std::uint64_t Random();
+    bool CanEject(const BackendEndpoint& endpoint);
+    void Eject(UpstreamEndpointPool* endpoint_pool, std::uint64_t now);
+    void Probe();
+
+    static void OnProbeConnected(UpstreamConnection* connection, int status, void* data);
+    static void OnTick(uv_timer_t* timer);
+};
+
+}
+
+#endif //FLASHPOINT_REPLICA_BALANCER_H
@@ -0,0 +1,172 @@
+#include <program/response_cache.h>
+#include <algorithm>
+#include <functional>
+
+namespace flashpoint {
+
+// Sketch counters per byte of cache, i.e. one per entry of 1KB, and the
+// counters of a small cache, so that its keys rarely share all counters.
+const std::size_t cache_bytes_per_counter = 1024;
+const std::size_t min_sketch_width = 256;
+
+// Odd multipliers that spread a hash to a different counter in every row.
+const std::uint64_t sketch_seeds[] = {
+    0x9e3779b97f4a7c15ULL,
+    0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL,
+    0xd6e8feb86659fd93ULL,
+};
+
+FrequencySketch::FrequencySketch(std::size_t width):
+    width_(1),
+    additions_(0) {
+    while (width_ < width) {
+        width_ <<= 1;
+    }
+    counters_.resize(width_ * rows);
+    sample_size_ = width_ * 10;
+}
+
+std::size_t FrequencySketch::Index(std::uint64_t hash, std::size_t row) const {
+    std::uint64_t spread = (hash ^ (hash >> 29)) * sketch_seeds[row];
+    return row * width_ + static_cast<std::size_t>((spread >> 32) & (width_ - 1));
+}
+
+void FrequencySketch::Increment(std::uint64_t hash) {
+    for (std::size_t row = 0; row < rows; row++) {
+        std::uint8_t& counter = counters_[Index(hash, row)];
+        if (counter < max_count) {
+            counter++;
+        }
+    }
+    if (++additions_ >= sample_size_) {
+        Halve();
+    }
+}
+
+std::uint8_t FrequencySketch::Estimate(std::uint64_t hash) const {
+    std::uint8_t estimate = max_count;
+    for (std::size_t row = 0; row < rows; row++) {
+        std::uint8_t counter = counters_[Index(hash, row)];
+        if (counter < estimate) {
+            estimate = counter;
+        }
+    }
+    return estimate;
+}
+
+void FrequencySketch::Halve() {
+    for (auto& counter : counters_) {
+        counter >>= 1;
+    }
+    additions_ /= 2;
+}
+
+ResponseCache::ResponseCache(uv_loop_t* loop, const ResponseCacheOptions& options):
+    loop_(loop),
+    options_(options),
+    stats_(),
+    shards_(options.shards > 0 ? options.shards : 1),
+    sketch_(std::max(options.max_size / cache_bytes_per_counter, min_sketch_width)) { }
+
+ResponseCacheShard& ResponseCache::GetShard(std::uint64_t hash) {
+    return shards_[hash % shards_.size()];
+}
+
+std::size_t ResponseCache::EntrySize(const CacheEntry& entry) {
+    return entry.key.size() + entry.data.size();
+}
+
+void ResponseCache::Remove(ResponseCacheShard& shard, std::list<CacheEntry>::iterator entry_it) {
+    shard.size -= EntrySize(*entry_it);
+    shard.index.erase(entry_it->key);
+    shard.entries.erase(entry_it);
+}
+
+const std::string* ResponseCache::Get(const std::string& key) {
+    std::uint64_t hash = std::hash<std::string>()(key);
+    sketch_.Increment(hash);
+    ResponseCacheShard& shard = GetShard(hash);
+    auto index_it = shard.index.find(key);
+    if (index_it == shard.index.end()) {
+        stats_.misses++;
+        return nullptr;
+    }
+    auto entry_it = index_it->second;
+    if (uv_now(loop_) >= entry_it->expires_at) {
+        Remove(shard, entry_it);
+        stats_.expirations++;
+        stats_.misses++;
+        return nullptr;
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, entry_it);
+    stats_.hits++;
+    return &entry_it->data;
+}
+
+void ResponseCache::Put(const std::string& key, std::string data, std::uint64_t ttl) {
+    std::size_t shard_max_size = options_.max_size / shards_.size();
+    std::size_t size = key.size() + data.size();
+    if (ttl == 0 || size > options_.max_entry_size || size > shard_max_size) {
+        return;
+    }
+    std::uint64_t hash = std::hash<std::string>()(key);
+    ResponseCacheShard& shard = GetShard(hash);
+    std::uint64_t now = uv_now(loop_);
+    auto index_it = shard.index.find(key);
+    std::size_t free_size = shard_max_size - shard.size;
+    if (index_it != shard.index.end()) {
+        free_size += EntrySize(*index_it->second);
+    }
+
+    // Expired entries and entries that are seen less often than the new one
+    // make room for it, from the least recently used one. The victims are
+    // picked before anything is removed, so a rejected entry leaves the
+    // shard as it was.
+    std::uint8_t frequency = sketch_.Estimate(hash);
+    auto victims_begin = shard.entries.end();
+    while (free_size < size) {
+        victims_begin = std::prev(victims_begin);
+        if (index_it != shard.index.end() && victims_begin == index_it->second) {
+            continue;
+        }
+        if (now < victims_begin->expires_at && sketch_.Estimate(victims_begin->hash) > frequency) {
+            stats_.rejections++;
+            return;
+        }
+        free_size += EntrySize(*victims_begin);
+    }
+    if (index_it != shard.index.end()) {
+        if (index_it->second == victims_begin) {
+            victims_begin = std::next(victims_begin);
+        }
+        Remove(shard, index_it->second);
+    }
+    while (victims_begin != shard.entries.end()) {
+        auto victim_it = victims_begin++;
+        Remove(shard, victim_it);
+        stats_.evictions++;
+    }
+    shard.entries.push_front(CacheEntry { key, std::move(data), hash, now + ttl });
+    shard.index.emplace(shard.entries.front().key, shard.entries.begin());
+    shard.size += size;
+    stats_.insertions++;
+}
+
+std::size_t ResponseCache::Size() const {
+    std::size_t size = 0;
+    for (const auto& shard : shards_) {
+        size += shard.size;
+    }
+    return size;
+}
+
+std::size_t ResponseCache::MaxEntrySize() const {
+    return options_.max_entry_size;
+}
+
+const ResponseCacheStats& ResponseCache::Stats() const {
+    return stats_;
+}
+
+}
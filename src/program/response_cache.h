@@ -0,0 +1,120 @@
+#ifndef FLASHPOINT_RESPONSE_CACHE_H
+#define FLASHPOINT_RESPONSE_CACHE_H
+
+#include <uv.h>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace flashpoint {
+
+// Estimates how often keys have been seen, in a count-min sketch of small
+// saturating counters. The counters are halved after a sample of lookups, so
+// that the estimate follows recent popularity.
+class FrequencySketch {
+public:
+    // @param width the counters per row, rounded up to a power of two.
+    FrequencySketch(std::size_t width);
+
+    void Increment(std::uint64_t hash);
+
+    std::uint8_t Estimate(std::uint64_t hash) const;
+
+private:
+    static const std::size_t rows = 4;
+    static const std::uint8_t max_count = 15;
+
+    std::vector<std::uint8_t> counters_;
+    std::size_t width_;
+    std::size_t additions_;
+    std::size_t sample_size_;
+
+    std::size_t Index(std::uint64_t hash, std::size_t row) const;
+    void Halve();
+};
+
+struct CacheEntry {
+    std::string key;
+    std::string data;
+    std::uint64_t hash;
+
+    // uv_now when the entry expires.
+    std::uint64_t expires_at;
+};
+
+// A shard of the cache, with its own recency list and its share of the size.
+struct ResponseCacheShard {
+    // The entries, the most recently used first.
+    std::list<CacheEntry> entries;
+    std::unordered_map<std::string_view, std::list<CacheEntry>::iterator> index;
+    std::size_t size = 0;
+};
+
+struct ResponseCacheOptions {
+    // Bytes of keys and data that are cached, over all shards.
+    std::size_t max_size;
+
+    // Bytes of an entry's key and data above which it isn't cached.
+    std::size_t max_entry_size;
+
+    std::size_t shards;
+};
+
+const ResponseCacheOptions default_response_cache_options = { 1024 * 1024 * 64, 1024 * 256, 16 };
+
+struct ResponseCacheStats {
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t insertions;
+
+    // Entries that were not admitted, since they were seen less often than
+    // the entries they would have evicted.
+    std::size_t rejections;
+    std::size_t evictions;
+    std::size_t expirations;
+};
+
+// Caches the data of backend subqueries by the subquery's key. Every shard is
+// a least recently used list within its share of max_size. A new entry only
+// evicts entries that are seen less often than itself (TinyLFU), so a burst of
+// one-off queries doesn't flush the popular ones.
+class ResponseCache {
+public:
+    ResponseCache(uv_loop_t* loop, const ResponseCacheOptions& options = default_response_cache_options);
+
+    // Get the data of a key.
+    // @return the data, which is only valid until the next Put, or nullptr
+    // when the key isn't cached or has expired.
+    const std::string* Get(const std::string& key);
+
+    // Cache the data of a key.
+    // @param ttl milliseconds that the data is used.
+    void Put(const std::string& key, std::string data, std::uint64_t ttl);
+
+    // Bytes of keys and data that are cached.
+    std::size_t Size() const;
+
+    // Bytes of a key and its data above which they aren't cached.
+    std::size_t MaxEntrySize() const;
+
+    const ResponseCacheStats& Stats() const;
+
+private:
+    uv_loop_t* loop_;
+    ResponseCacheOptions options_;
+    ResponseCacheStats stats_;
+    std::vector<ResponseCacheShard> shards_;
+    FrequencySketch sketch_;
+
+    ResponseCacheShard& GetShard(std::uint64_t hash);
+    void Remove(ResponseCacheShard& shard, std::list<CacheEntry>::iterator entry_it);
+    static std::size_t EntrySize(const CacheEntry& entry);
+};
+
+}
+
+#endif //FLASHPOINT_RESPONSE_CACHE_H
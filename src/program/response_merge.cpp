@@ -0,0 +1,684 @@
+#include <program/response_merge.h>
+#include <cctype>
+#include <cstring>
+
+namespace flashpoint {
+
+inline bool is_json_whitespace(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+inline bool is_json_digit(char ch) {
+    return ch >= '0' && ch <= '9';
+}
+
+JsonResponseSplitter::JsonResponseSplitter():
+    state_(JsonTokenState::Value),
+    failed_(false),
+    number_state_(JsonNumberState::Integer),
+    string_is_key_(false),
+    pending_comma_(false),
+    unicode_digits_(0),
+    literal_(nullptr),
+    literal_position_(0),
+    depth_(0),
+    key_size_(0),
+    member_region_(JsonRegion::None),
+    region_(JsonRegion::None),
+    region_depth_(0),
+    text_(nullptr),
+    range_start_(-1) { }
+
+bool JsonResponseSplitter::Feed(const char* text, std::size_t size, JsonSpliceSink& sink) {
+    if (failed_) {
+        return false;
+    }
+    text_ = text;
+    range_start_ = -1;
+    std::size_t i = 0;
+    while (i < size && !failed_) {
+        char ch = text[i];
+        switch (state_) {
+            case JsonTokenState::Value:
+            case JsonTokenState::FirstValue:
+                if (is_json_whitespace(ch)) {
+                    Cut(i, sink);
+                }
+                else if (state_ == JsonTokenState::FirstValue && ch == ']') {
+                    CloseContainer(i, sink);
+                }
+                else {
+                    StartValue(ch, i, sink);
+                }
+                break;
+
+            case JsonTokenState::FirstKey:
+            case JsonTokenState::Key:
+                if (is_json_whitespace(ch)) {
+                    Cut(i, sink);
+                }
+                else if (ch == '"') {
+                    Take(i, sink);
+                    state_ = JsonTokenState::String;
+                    string_is_key_ = true;
+                    key_size_ = 0;
+                }
+                else if (state_ == JsonTokenState::FirstKey && ch == '}') {
+                    CloseContainer(i, sink);
+                }
+                else {
+                    Fail(i, sink);
+                }
+                break;
+
+            case JsonTokenState::Colon:
+                if (is_json_whitespace(ch)) {
+                    Cut(i, sink);
+                }
+                else if (ch == ':') {
+                    Take(i, sink);
+                    state_ = JsonTokenState::Value;
+                }
+                else {
+                    Fail(i, sink);
+                }
+                break;
+
+            case JsonTokenState::Next:
+                if (is_json_whitespace(ch)) {
+                    Cut(i, sink);
+                }
+                else if (ch == ',') {
+                    Cut(i, sink);
+                    pending_comma_ = region_ != JsonRegion::None;
+                    state_ = arrays_[depth_ - 1] ? JsonTokenState::Value : JsonTokenState::Key;
+                }
+                else if ((ch == '}' && !arrays_[depth_ - 1]) || (ch == ']' && arrays_[depth_ - 1])) {
+                    CloseContainer(i, sink);
+                }
+                else {
+                    Fail(i, sink);
+                }
+                break;
+
+            case JsonTokenState::String:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    Fail(i, sink);
+                    break;
+                }
+                Take(i, sink);
+                if (ch == '"') {
+                    if (string_is_key_) {
+                        EndKey();
+                    }
+                    else {
+                        EndValue();
+                    }
+                }
+                else if (ch == '\\') {
+                    state_ = JsonTokenState::StringEscape;
+                }
+                else if (string_is_key_ && depth_ == 1 && key_size_ <= sizeof(key_)) {
+                    if (key_size_ < sizeof(key_)) {
+                        key_[key_size_] = ch;
+                    }
+                    key_size_++;
+                }
+                break;
+
+            case JsonTokenState::StringEscape:
+                if (ch == 'u') {
+                    state_ = JsonTokenState::StringUnicode;
+                    unicode_digits_ = 0;
+                }
+                else if (std::strchr("\"\\/bfnrt", ch) != nullptr && ch != '\0') {
+                    state_ = JsonTokenState::String;
+                }
+                else {
+                    Fail(i, sink);
+                    break;
+                }
+                Take(i, sink);
+
+                // Escaped keys are never one of the keys that are looked for.
+                key_size_ = sizeof(key_) + 1;
+                break;
+
+            case JsonTokenState::StringUnicode:
+                if (!std::isxdigit(static_cast<unsigned char>(ch))) {
+                    Fail(i, sink);
+                    break;
+                }
+                Take(i, sink);
+                if (++unicode_digits_ == 4) {
+                    state_ = JsonTokenState::String;
+                }
+                break;
+
+            case JsonTokenState::Number: {
+                bool is_digit = is_json_digit(ch);
+                bool is_exponent = ch == 'e' || ch == 'E';
+                JsonNumberState next = number_state_;
+                switch (number_state_) {
+                    case JsonNumberState::Minus:
+                        if (is_digit) {
+                            next = ch == '0' ? JsonNumberState::Zero : JsonNumberState::Integer;
+                        }
+                        break;
+                    case JsonNumberState::Zero:
+                    case JsonNumberState::Integer:
+                        if (ch == '.') {
+                            next = JsonNumberState::Dot;
+                        }
+                        else if (is_exponent) {
+                            next = JsonNumberState::Exponent;
+                        }
+                        break;
+                    case JsonNumberState::Dot:
+                        if (is_digit) {
+                            next = JsonNumberState::Fraction;
+                        }
+                        break;
+                    case JsonNumberState::Fraction:
+                        if (is_exponent) {
+                            next = JsonNumberState::Exponent;
+                        }
+                        break;
+                    case JsonNumberState::Exponent:
+                        if (is_digit) {
+                            next = JsonNumberState::ExponentDigits;
+                        }
+                        else if (ch == '+' || ch == '-') {
+                            next = JsonNumberState::ExponentSign;
+                        }
+                        break;
+                    case JsonNumberState::ExponentSign:
+                        if (is_digit) {
+                            next = JsonNumberState::ExponentDigits;
+                        }
+                        break;
+                    case JsonNumberState::ExponentDigits:
+                        break;
+                }
+
+                // Digits continue an integer, a fraction or an exponent, but
+                // not a leading zero.
+                bool continues = next != number_state_ || (is_digit &&
+                    (number_state_ == JsonNumberState::Integer ||
+                     number_state_ == JsonNumberState::Fraction ||
+                     number_state_ == JsonNumberState::ExponentDigits));
+                if (continues) {
+                    Take(i, sink);
+                    number_state_ = next;
+                    break;
+                }
+                switch (number_state_) {
+                    case JsonNumberState::Zero:
+                    case JsonNumberState::Integer:
+                    case JsonNumberState::Fraction:
+                    case JsonNumberState::ExponentDigits:
+                        // The character after the number is tokenized again.
+                        EndValue();
+                        continue;
+                    default:
+                        Fail(i, sink);
+                }
+                break;
+            }
+
+            case JsonTokenState::Literal:
+                if (ch != literal_[literal_position_]) {
+                    Fail(i, sink);
+                    break;
+                }
+                Take(i, sink);
+                literal_position_++;
+                if (literal_[literal_position_] == '\0') {
+                    EndValue();
+                }
+                break;
+
+            case JsonTokenState::Done:
+                if (!is_json_whitespace(ch)) {
+                    Fail(i, sink);
+                }
+                break;
+        }
+        i++;
+    }
+    Cut(i < size ? i : size, sink);
+    return !failed_;
+}
+
+void JsonResponseSplitter::StartValue(char ch, std::size_t position, JsonSpliceSink& sink) {
+    if (depth_ == 0 && ch != '{') {
+        Fail(position, sink);
+        return;
+    }
+    switch (ch) {
+        case '{':
+        case '[': {
+            bool is_array = ch == '[';
+            JsonRegion region = is_array ? JsonRegion::Errors : JsonRegion::Data;
+            bool starts_region = depth_ == 1 && member_region_ == region;
+            if (depth_ == max_json_depth) {
+                Fail(position, sink);
+                return;
+            }
+            if (!starts_region) {
+                Take(position, sink);
+            }
+            OpenContainer(is_array);
+            if (starts_region) {
+                region_ = region;
+                region_depth_ = depth_;
+            }
+            state_ = is_array ? JsonTokenState::FirstValue : JsonTokenState::FirstKey;
+            break;
+        }
+        case '"':
+            Take(position, sink);
+            state_ = JsonTokenState::String;
+            string_is_key_ = false;
+            break;
+        case 't':
+        case 'f':
+        case 'n':
+            Take(position, sink);
+            literal_ = ch == 't' ? "true" : ch == 'f' ? "false" : "null";
+            literal_position_ = 1;
+            state_ = JsonTokenState::Literal;
+            break;
+        default:
+            if (ch != '-' && !is_json_digit(ch)) {
+                Fail(position, sink);
+                return;
+            }
+            Take(position, sink);
+            number_state_ = ch == '-' ? JsonNumberState::Minus : ch == '0' ? JsonNumberState::Zero : JsonNumberState::Integer;
+            state_ = JsonTokenState::Number;
+    }
+}
+
+void JsonResponseSplitter::OpenContainer(bool is_array) {
+    arrays_[depth_] = is_array;
+    depth_++;
+}
+
+void JsonResponseSplitter::CloseContainer(std::size_t position, JsonSpliceSink& sink) {
+    if (region_ != JsonRegion::None && depth_ == region_depth_) {
+        Cut(position, sink);
+        region_ = JsonRegion::None;
+        pending_comma_ = false;
+    }
+    else {
+        Take(position, sink);
+    }
+    depth_--;
+    EndValue();
+}
+
+void JsonResponseSplitter::EndValue() {
+    state_ = depth_ == 0 ? JsonTokenState::Done : JsonTokenState::Next;
+}
+
+void JsonResponseSplitter::EndKey() {
+    if (depth_ == 1) {
+        if (key_size_ == 4 && std::memcmp(key_, "data", 4) == 0) {
+            member_region_ = JsonRegion::Data;
+        }
+        else if (key_size_ == 6 && std::memcmp(key_, "errors", 6) == 0) {
+            member_region_ = JsonRegion::Errors;
+        }
+        else {
+            member_region_ = JsonRegion::None;
+        }
+    }
+    state_ = JsonTokenState::Colon;
+}
+
+// Start a range of spliced text at a position, unless one is started. A held
+// back comma is spliced first.
+void JsonResponseSplitter::Take(std::size_t position, JsonSpliceSink& sink) {
+    if (region_ == JsonRegion::None || range_start_ >= 0) {
+        return;
+    }
+    if (pending_comma_) {
+        sink.Splice(region_, ",", 1);
+        pending_comma_ = false;
+    }
+    range_start_ = static_cast<long long>(position);
+}
+
+// Splice the current range, up to a position.
+void JsonResponseSplitter::Cut(std::size_t position, JsonSpliceSink& sink) {
+    if (range_start_ < 0) {
+        return;
+    }
+    sink.Splice(region_, text_ + range_start_, position - static_cast<std::size_t>(range_start_));
+    range_start_ = -1;
+}
+
+void JsonResponseSplitter::Fail(std::size_t position, JsonSpliceSink& sink) {
+    Cut(position, sink);
+    failed_ = true;
+}
+
+bool JsonResponseSplitter::End(JsonSpliceSink& sink) {
+    bool complete = state_ == JsonTokenState::Done && !failed_;
+    if (region_ != JsonRegion::None) {
+        JsonRegion region = region_;
+        auto splice = [&](const char* text) {
+            sink.Splice(region, text, std::strlen(text));
+        };
+        switch (state_) {
+            case JsonTokenState::StringEscape:
+                // The spliced text ends with a backslash, which is escaped.
+                splice("\\");
+                splice(string_is_key_ ? "\":null" : "\"");
+                break;
+            case JsonTokenState::StringUnicode:
+                splice(std::string(4 - unicode_digits_, '0').c_str());
+                splice(string_is_key_ ? "\":null" : "\"");
+                break;
+            case JsonTokenState::String:
+                splice(string_is_key_ ? "\":null" : "\"");
+                break;
+            case JsonTokenState::Colon:
+                splice(":null");
+                break;
+            case JsonTokenState::Value:
+                // In an array a value is only expected after a comma, which
+                // is held back.
+                if (!arrays_[depth_ - 1]) {
+                    splice("null");
+                }
+                break;
+            case JsonTokenState::Number:
+                if (number_state_ == JsonNumberState::Minus ||
+                    number_state_ == JsonNumberState::Dot ||
+                    number_state_ == JsonNumberState::Exponent ||
+                    number_state_ == JsonNumberState::ExponentSign) {
+                    splice("0");
+                }
+                break;
+            case JsonTokenState::Literal:
+                splice(literal_ + literal_position_);
+                break;
+            default:
+                break;
+        }
+        for (std::size_t depth = depth_; depth > region_depth_; depth--) {
+            splice(arrays_[depth - 1] ? "]" : "}");
+        }
+        region_ = JsonRegion::None;
+        pending_comma_ = false;
+    }
+    failed_ = !complete;
+    return complete;
+}
+
+class ResponseMerge::SubquerySink : public JsonSpliceSink {
+public:
+    SubquerySink(ResponseMerge* merge, std::size_t index):
+        merge_(merge),
+        index_(index) { }
+
+    void Splice(JsonRegion region, const char* text, std::size_t size) override {
+        MergedSubquery& subquery = merge_->subqueries_[index_];
+        if (region == JsonRegion::Data) {
+            merge_->CaptureData(subquery, text, size);
+            if (index_ == merge_->head_) {
+                merge_->WriteData(subquery, text, size);
+            }
+            else {
+                subquery.pending.append(text, size);
+            }
+        }
+        else if (region == JsonRegion::Errors) {
+            merge_->AddErrors(subquery, text, size);
+        }
+    }
+
+private:
+    ResponseMerge* merge_;
+    std::size_t index_;
+};
+
+ResponseMerge::ResponseMerge(std::shared_ptr<QueryPlan> plan, std::unique_ptr<ResponseMergeOutput> output, const ResponseMergeOptions& options):
+    plan_(std::move(plan)),
+    output_(std::move(output)),
+    options_(options),
+    subqueries_(plan_->subqueries.size()),
+    head_(0),
+    has_data_(false) { }
+
+void ResponseMerge::Start() {
+    output_->Write("{\"data\":{", 9);
+    if (subqueries_.empty()) {
+        Advance();
+    }
+}
+
+bool ResponseMerge::Feed(std::size_t index, const char* text, std::size_t size) {
+    MergedSubquery& subquery = subqueries_[index];
+    if (subquery.ended) {
+        return true;
+    }
+    SubquerySink sink(this, index);
+    if (!subquery.splitter.Feed(text, size, sink)) {
+        Fail(index, "Invalid JSON response from backend");
+        return true;
+    }
+    if (index == head_) {
+        output_->Flush();
+        return true;
+    }
+    subquery.paused = subquery.pending.size() >= options_.max_pending_size;
+    return !subquery.paused;
+}
+
+void ResponseMerge::End(std::size_t index) {
+    MergedSubquery& subquery = subqueries_[index];
+    if (subquery.ended) {
+        return;
+    }
+    SubquerySink sink(this, index);
+    if (!subquery.splitter.End(sink)) {
+        subquery.failed = true;
+        subquery.failure = "Invalid JSON response from backend";
+    }
+    subquery.ended = true;
+    if (index == head_) {
+        Advance();
+    }
+}
+
+void ResponseMerge::Fail(std::size_t index, std::string_view message) {
+    MergedSubquery& subquery = subqueries_[index];
+    if (subquery.ended) {
+        return;
+    }
+    SubquerySink sink(this, index);
+    subquery.splitter.End(sink);
+    subquery.failed = true;
+    subquery.failure = std::string(message);
+    subquery.ended = true;
+    if (index == head_) {
+        Advance();
+    }
+}
+
+void ResponseMerge::Complete(std::size_t index, std::string_view data) {
+    MergedSubquery& subquery = subqueries_[index];
+    if (subquery.ended) {
+        return;
+    }
+    if (index == head_) {
+        WriteData(subquery, data.data(), data.size());
+    }
+    else {
+        subquery.pending.append(data);
+    }
+    subquery.ended = true;
+    if (index == head_) {
+        Advance();
+    }
+}
+
+void ResponseMerge::Capture(std::size_t index, std::size_t max_size) {
+    subqueries_[index].capturing = true;
+    subqueries_[index].max_capture_size = max_size;
+}
+
+bool ResponseMerge::TakeCapture(std::size_t index, std::string& data) {
+    MergedSubquery& subquery = subqueries_[index];
+    if (!subquery.capturing || !subquery.ended || subquery.failed || subquery.has_errors || subquery.captured.empty()) {
+        return false;
+    }
+    data = std::move(subquery.captured);
+    subquery.capturing = false;
+    return true;
+}
+
+void ResponseMerge::CaptureData(MergedSubquery& subquery, const char* text, std::size_t size) {
+    if (!subquery.capturing) {
+        return;
+    }
+    if (subquery.captured.size() + size > subquery.max_capture_size) {
+        subquery.capturing = false;
+        subquery.captured = std::string();
+        return;
+    }
+    subquery.captured.append(text, size);
+}
+
+void ResponseMerge::SetResumeCallback(std::size_t index, MergeResumeCallback callback, void* data) {
+    subqueries_[index].resume_callback = callback;
+    subqueries_[index].resume_data = data;
+}
+
+bool ResponseMerge::Ended() const {
+    return head_ == subqueries_.size();
+}
+
+void ResponseMerge::WriteData(MergedSubquery& subquery, const char* text, std::size_t size) {
+    if (size == 0) {
+        return;
+    }
+    if (!subquery.has_data) {
+        if (has_data_) {
+            output_->Write(",", 1);
+        }
+        subquery.has_data = true;
+        has_data_ = true;
+    }
+    output_->Write(text, size);
+}
+
+// A subquery whose errors don't fit is taken out of the merged errors, since
+// its last error might be incomplete.
+void ResponseMerge::AddErrors(MergedSubquery& subquery, const char* text, std::size_t size) {
+    if (subquery.errors_truncated || size == 0) {
+        return;
+    }
+    subquery.has_errors = true;
+    if (subquery.errors.size() + size > options_.max_errors_size) {
+        subquery.errors = std::string();
+        subquery.errors_truncated = true;
+        return;
+    }
+    subquery.errors.append(text, size);
+}
+
+void ResponseMerge::AddError(std::string_view message, const std::string* response_key) {
+    if (!errors_.empty()) {
+        errors_ += ',';
+    }
+    errors_ += "{\"message\":\"";
+    errors_ += message;
+    errors_ += '"';
+    if (response_key != nullptr) {
+        errors_ += ",\"path\":[\"";
+        errors_ += *response_key;
+        errors_ += "\"]";
+    }
+    errors_ += '}';
+}
+
+// The fields of a subquery without data are null, and if it failed every
+// field gets an error. The subquery's own errors are merged before them.
+void ResponseMerge::Finish(std::size_t index) {
+    MergedSubquery& subquery = subqueries_[index];
+    bool has_data = subquery.has_data;
+    const Subquery& planned_subquery = plan_->subqueries[index];
+    if (!subquery.errors.empty()) {
+        if (!errors_.empty()) {
+            errors_ += ',';
+        }
+        errors_ += subquery.errors;
+        subquery.errors = std::string();
+    }
+    if (subquery.errors_truncated) {
+        AddError("Too many errors", nullptr);
+    }
+    if (!has_data) {
+        std::string nulls;
+        for (const auto& planned_field : planned_subquery.fields) {
+            if (!nulls.empty()) {
+                nulls += ',';
+            }
+            nulls += '"';
+            nulls += planned_field.response_key;
+            nulls += "\":null";
+        }
+        WriteData(subquery, nulls.data(), nulls.size());
+    }
+    if (!subquery.failed) {
+        return;
+    }
+    if (has_data) {
+        AddError(subquery.failure, nullptr);
+        return;
+    }
+    for (const auto& planned_field : planned_subquery.fields) {
+        AddError(subquery.failure, &planned_field.response_key);
+    }
+}
+
+// Write the buffered data of the next subqueries, until one that is not
+// ended, which is resumed if it was paused. After the last subquery the
+// response is ended.
+void ResponseMerge::Advance() {
+    while (head_ < subqueries_.size()) {
+        MergedSubquery& subquery = subqueries_[head_];
+        if (!subquery.pending.empty()) {
+            std::string pending;
+            pending.swap(subquery.pending);
+            WriteData(subquery, pending.data(), pending.size());
+        }
+        if (!subquery.ended) {
+            if (subquery.paused) {
+                subquery.paused = false;
+                if (subquery.resume_callback != nullptr) {
+                    subquery.resume_callback(subquery.resume_data);
+                }
+            }
+            output_->Flush();
+            return;
+        }
+        Finish(head_);
+        head_++;
+    }
+    output_->Write("}", 1);
+    if (!errors_.empty()) {
+        output_->Write(",\"errors\":[", 11);
+        output_->Write(errors_.data(), errors_.size());
+        output_->Write("]", 1);
+    }
+    output_->Write("}", 1);
+    output_->Flush();
+    output_->End();
+}
+
+}
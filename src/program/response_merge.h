@@ -0,0 +1,248 @@
+#ifndef FLASHPOINT_RESPONSE_MERGE_H
+#define FLASHPOINT_RESPONSE_MERGE_H
+
+#include <program/query_planner.h>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace flashpoint {
+
+enum class JsonRegion {
+    None,
+
+    // The members of the response's data object.
+    Data,
+
+    // The items of the response's errors array.
+    Errors,
+};
+
+// Receives the spliced text of a response. The text points into the fed
+// bytes, or is a constant, and is only valid during the call.
+class JsonSpliceSink {
+public:
+    virtual void Splice(JsonRegion region, const char* text, std::size_t size) = 0;
+};
+
+enum class JsonTokenState : std::uint8_t {
+    // A value is expected, after a colon or a comma in an array.
+    Value,
+
+    // After an array's open bracket, a value or the close bracket.
+    FirstValue,
+
+    // After an object's open brace, a key or the close brace.
+    FirstKey,
+
+    // After a comma in an object.
+    Key,
+    Colon,
+
+    // After a value, a comma or the container's close bracket.
+    Next,
+    String,
+    StringEscape,
+    StringUnicode,
+    Number,
+    Literal,
+    Done,
+};
+
+enum class JsonNumberState : std::uint8_t {
+    Minus,
+    Zero,
+    Integer,
+    Dot,
+    Fraction,
+    Exponent,
+    ExponentSign,
+    ExponentDigits,
+};
+
+const std::size_t max_json_depth = 256;
+
+// Tokenizes a GraphQL response as it arrives and splices the members of its
+// data object and the items of its errors array, without building a DOM. The
+// only state is the nesting of the current value, so the memory doesn't
+// depend on the size of the response.
+//
+// Whitespace is dropped and commas are held back until the next value, so
+// that the text that is spliced out of an incomplete response can be closed
+// into valid JSON.
+class JsonResponseSplitter {
+public:
+    JsonResponseSplitter();
+
+    // Tokenize the next bytes of the response.
+    // @return false when the response is not valid JSON.
+    bool Feed(const char* text, std::size_t size, JsonSpliceSink& sink);
+
+    // End the response. The spliced text of a response that is incomplete or
+    // invalid is closed, e.g. strings are terminated and missing values are
+    // null.
+    // @return whether the response was complete and valid.
+    bool End(JsonSpliceSink& sink);
+
+private:
+    JsonTokenState state_;
+    bool failed_;
+    JsonNumberState number_state_;
+    bool string_is_key_;
+    bool pending_comma_;
+    std::uint8_t unicode_digits_;
+    const char* literal_;
+    std::size_t literal_position_;
+
+    // The containers that are open, a set bit is an array.
+    std::bitset<max_json_depth> arrays_;
+    std::size_t depth_;
+
+    // The key of the current member of the response object.
+    char key_[8];
+    std::size_t key_size_;
+    JsonRegion member_region_;
+
+    // The region that is being spliced, and the depth of its container.
+    JsonRegion region_;
+    std::size_t region_depth_;
+
+    const char* text_;
+    long long range_start_;
+
+    void StartValue(char ch, std::size_t position, JsonSpliceSink& sink);
+    void OpenContainer(bool is_array);
+    void CloseContainer(std::size_t position, JsonSpliceSink& sink);
+    void EndValue();
+    void EndKey();
+    void Take(std::size_t position, JsonSpliceSink& sink);
+    void Cut(std::size_t position, JsonSpliceSink& sink);
+    void Fail(std::size_t position, JsonSpliceSink& sink);
+};
+
+// Writes the merged response to the client.
+class ResponseMergeOutput {
+public:
+    virtual ~ResponseMergeOutput() = default;
+    virtual void Write(const char* text, std::size_t size) = 0;
+
+    // Send what has been written so far.
+    virtual void Flush() = 0;
+
+    // The response is complete.
+    virtual void End() = 0;
+};
+
+struct ResponseMergeOptions {
+    // Data of a subquery that is buffered while earlier subqueries are still
+    // being merged. Above it the subquery's reading is paused.
+    std::size_t max_pending_size;
+
+    // Errors are written after the data, so the errors of each subquery are
+    // buffered up to this size.
+    std::size_t max_errors_size;
+};
+
+const ResponseMergeOptions default_response_merge_options = { 1024 * 64, 1024 * 64 };
+
+typedef void (*MergeResumeCallback)(void* data);
+
+struct MergedSubquery {
+    JsonResponseSplitter splitter;
+
+    // Data that arrived before the subquery was the first unfinished one.
+    std::string pending;
+    bool has_data;
+    bool has_errors;
+
+    // The items of the subquery's errors array. They are merged once the
+    // subquery is finished, so that the errors of subqueries that arrive at
+    // the same time don't interleave.
+    std::string errors;
+    bool errors_truncated;
+    bool ended;
+    bool failed;
+    std::string failure;
+
+    bool paused;
+    MergeResumeCallback resume_callback;
+    void* resume_data;
+
+    // A copy of the merged data, e.g. for the cache, up to max_capture_size.
+    bool capturing;
+    std::size_t max_capture_size;
+    std::string captured;
+};
+
+// Merges the responses of the subqueries of a plan into one response, in plan
+// order. The first unfinished subquery is streamed to the output as it
+// arrives, later subqueries are buffered up to max_pending_size and then
+// paused until it is their turn.
+class ResponseMerge {
+public:
+    ResponseMerge(std::shared_ptr<QueryPlan> plan, std::unique_ptr<ResponseMergeOutput> output, const ResponseMergeOptions& options = default_response_merge_options);
+
+    // Write the start of the response.
+    void Start();
+
+    // Merge the next body bytes of a subquery's response.
+    // @return false when the subquery should stop reading until it is resumed.
+    bool Feed(std::size_t index, const char* text, std::size_t size);
+
+    // The response of a subquery has been read to its end.
+    void End(std::size_t index);
+
+    // A subquery failed, e.g. its backend couldn't be reached. The subquery's
+    // fields are null unless some of their data was already merged.
+    void Fail(std::size_t index, std::string_view message);
+
+    // Merge the data of a subquery that is known without asking its backend,
+    // e.g. from the cache, and end it.
+    // @param data the members of the subquery's data object.
+    void Complete(std::size_t index, std::string_view data);
+
+    // Keep a copy of the data that is merged for a subquery.
+    // @param max_size the size above which the copy is given up.
+    void Capture(std::size_t index, std::size_t max_size);
+
+    // Take the copy of an ended subquery's data.
+    // @return false when the subquery failed, had errors, had no data or its
+    // data exceeded the capture's max size.
+    bool TakeCapture(std::size_t index, std::string& data);
+
+    // Set the callback that resumes the reading of a paused subquery.
+    void SetResumeCallback(std::size_t index, MergeResumeCallback callback, void* data);
+
+    bool Ended() const;
+
+private:
+    class SubquerySink;
+    friend class SubquerySink;
+
+    std::shared_ptr<QueryPlan> plan_;
+    std::unique_ptr<ResponseMergeOutput> output_;
+    ResponseMergeOptions options_;
+    std::vector<MergedSubquery> subqueries_;
+
+    // The first subquery that is not finished.
+    std::size_t head_;
+    bool has_data_;
+
+    // The merged errors of the finished subqueries, in plan order.
+    std::string errors_;
+
+    void WriteData(MergedSubquery& subquery, const char* text, std::size_t size);
+    void CaptureData(MergedSubquery& subquery, const char* text, std::size_t size);
+    void AddErrors(MergedSubquery& subquery, const char* text, std::size_t size);
+    void AddError(std::string_view message, const std::string* response_key);
+    void Finish(std::size_t index);
+    void Advance();
+};
+
+}
+
+#endif //FLASHPOINT_RESPONSE_MERGE_H
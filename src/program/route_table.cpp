@@ -0,0 +1,310 @@
+#include <program/route_table.h>
+#include <json/json.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <utility>
+
+namespace flashpoint {
+
+HttpHeaderSet DefaultForwardedHeaders() {
+    HttpHeaderSet headers;
+    headers.set(static_cast<std::size_t>(HttpHeader::Accept));
+    headers.set(static_cast<std::size_t>(HttpHeader::AcceptLanguage));
+    headers.set(static_cast<std::size_t>(HttpHeader::Authorization));
+    headers.set(static_cast<std::size_t>(HttpHeader::Cookie));
+    headers.set(static_cast<std::size_t>(HttpHeader::UserAgent));
+    return headers;
+}
+
+bool IsForwardableHeader(HttpHeader header) {
+    switch (header) {
+        case HttpHeader::Unknown:
+        case HttpHeader::Connection:
+        case HttpHeader::ContentLength:
+        case HttpHeader::Host:
+        case HttpHeader::ProxyAuthorization:
+        case HttpHeader::TE:
+        case HttpHeader::Trailer:
+        case HttpHeader::TransferEncoding:
+        case HttpHeader::Upgrade:
+        case HttpHeader::End:
+            return false;
+        default:
+            return true;
+    }
+}
+
+RouteTable::RouteTable(std::vector<std::unique_ptr<BackendEndpoint>> endpoints, std::vector<Route> routes, HttpHeaderSet forwarded_headers):
+    endpoints_(std::move(endpoints)),
+    forwarded_headers_(forwarded_headers),
+    size_(routes.size()) {
+
+    // The buckets are placed from the largest, each one at the first
+    // displacement where all of its routes land in free slots. When a bucket
+    // finds none, the slots are doubled and all buckets are placed again.
+    std::size_t slot_count = 1;
+    while (slot_count < routes.size() + routes.size() / 4) {
+        slot_count <<= 1;
+    }
+    std::size_t bucket_count = std::max<std::size_t>(routes.size(), 1);
+    std::vector<std::vector<std::size_t>> buckets(bucket_count);
+    for (std::size_t i = 0; i < routes.size(); i++) {
+        buckets[Hash(routes[i].operation_type, routes[i].field, 0) % bucket_count].push_back(i);
+    }
+    std::vector<std::size_t> order(bucket_count);
+    for (std::size_t i = 0; i < bucket_count; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+    std::vector<std::size_t> bucket_slots;
+    while (true) {
+        slots_.assign(slot_count, Route {});
+        slot_mask_ = slot_count - 1;
+        displacements_.assign(bucket_count, 0);
+        bool placed = true;
+        for (std::size_t bucket : order) {
+            if (buckets[bucket].empty()) {
+                break;
+            }
+            std::uint32_t max_displacement = static_cast<std::uint32_t>(slot_count * 4 + 64);
+            for (std::uint32_t displacement = 1; displacement < max_displacement; displacement++) {
+                bucket_slots.clear();
+                for (std::size_t route : buckets[bucket]) {
+                    std::size_t slot = Hash(routes[route].operation_type, routes[route].field, displacement) & slot_mask_;
+                    if (slots_[slot].endpoint != nullptr || std::find(bucket_slots.begin(), bucket_slots.end(), slot) != bucket_slots.end()) {
+                        break;
+                    }
+                    bucket_slots.push_back(slot);
+                }
+                if (bucket_slots.size() == buckets[bucket].size()) {
+                    for (std::size_t i = 0; i < bucket_slots.size(); i++) {
+                        slots_[bucket_slots[i]] = routes[buckets[bucket][i]];
+                    }
+                    displacements_[bucket] = displacement;
+                    break;
+                }
+            }
+            if (displacements_[bucket] == 0) {
+                placed = false;
+                break;
+            }
+        }
+        if (placed) {
+            break;
+        }
+        slot_count <<= 1;
+    }
+}
+
+const Route* RouteTable::Find(OperationType operation_type, std::string_view field) const {
+    std::uint32_t displacement = displacements_[Hash(operation_type, field, 0) % displacements_.size()];
+    if (displacement == 0) {
+        return nullptr;
+    }
+    const Route& route = slots_[Hash(operation_type, field, displacement) & slot_mask_];
+    if (route.endpoint == nullptr || route.operation_type != operation_type || route.field != field) {
+        return nullptr;
+    }
+    return &route;
+}
+
+const std::vector<std::unique_ptr<BackendEndpoint>>& RouteTable::Endpoints() const {
+    return endpoints_;
+}
+
+const HttpHeaderSet& RouteTable::ForwardedHeaderSet() const {
+    return forwarded_headers_;
+}
+
+std::size_t RouteTable::Size() const {
+    return size_;
+}
+
+// FNV-1a, seeded and then mixed with the finalizer of MurmurHash3, so that
+// every seed gives an independent slot.
+std::uint64_t RouteTable::Hash(OperationType operation_type, std::string_view field, std::uint32_t seed) {
+    std::uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    hash = (hash ^ static_cast<std::uint8_t>(operation_type)) * 0x100000001b3ULL;
+    for (char ch : field) {
+        hash = (hash ^ static_cast<unsigned char>(ch)) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool ParseOperationType(const std::string& text, OperationType& operation_type) {
+    if (text == "query") {
+        operation_type = OperationType::Query;
+    }
+    else if (text == "mutation") {
+        operation_type = OperationType::Mutation;
+    }
+    else if (text == "subscription") {
+        operation_type = OperationType::Subscription;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Parse a replica's "hostname:port", which is also its Host header.
+bool ParseReplica(const std::string& text, BackendReplica& replica) {
+    std::size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    char* end;
+    unsigned long port = std::strtoul(text.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || end == text.c_str() + colon + 1 || port == 0 || port > 65535) {
+        return false;
+    }
+    replica.host = text;
+    replica.hostname = text.substr(0, colon);
+    replica.port = static_cast<unsigned int>(port);
+    return true;
+}
+
+// Get the hostname of an https origin, e.g. "users" of "https://users:4000".
+// @return false when the origin isn't https.
+bool GetHttpsHostname(const std::string& origin, std::string& hostname) {
+    static const char https_scheme[] = "https://";
+    std::size_t scheme_size = sizeof(https_scheme) - 1;
+    if (origin.compare(0, scheme_size, https_scheme) != 0) {
+        return false;
+    }
+    std::size_t host_end;
+    if (origin[scheme_size] == '[') {
+        host_end = origin.find(']', scheme_size);
+        hostname = origin.substr(scheme_size + 1, host_end == std::string::npos ? std::string::npos : host_end - scheme_size - 1);
+        return true;
+    }
+    host_end = origin.find_first_of(":/", scheme_size);
+    hostname = origin.substr(scheme_size, host_end == std::string::npos ? std::string::npos : host_end - scheme_size);
+    return true;
+}
+
+bool ParseRouteTable(const std::string& text, std::shared_ptr<const RouteTable>& table, std::string& error) {
+    Json::Reader json_reader;
+    Json::Value config;
+    if (!json_reader.parse(text, config) || !config.isObject()) {
+        error = "Invalid JSON";
+        return false;
+    }
+    const Json::Value& backends = config["backends"];
+    const Json::Value& routes = config["routes"];
+    if (!backends.isObject() || !routes.isArray()) {
+        error = "Expected a backends object and a routes array";
+        return false;
+    }
+    std::vector<std::unique_ptr<BackendEndpoint>> endpoints;
+    std::map<std::string, const BackendEndpoint*> endpoint_names;
+    for (const auto& name : backends.getMemberNames()) {
+        const Json::Value& backend = backends[name];
+        const Json::Value& replicas = backend["replicas"];
+        const Json::Value& ca_file = backend["caFile"];
+        const Json::Value& http2 = backend["http2"];
+        if (!backend["origin"].isString() || !backend["path"].isString() || !replicas.isArray() || replicas.empty()) {
+            error = "Backend " + name + " needs an origin, a path and replicas";
+            return false;
+        }
+        if (!(ca_file.isNull() || ca_file.isString()) || !(http2.isNull() || http2.isBool())) {
+            error = "Backend " + name + " needs a string caFile and a boolean http2";
+            return false;
+        }
+        auto endpoint = std::make_unique<BackendEndpoint>();
+        endpoint->origin = backend["origin"].asString();
+        endpoint->path = backend["path"].asString();
+        endpoint->http2 = http2.asBool();
+        std::string server_name;
+        if (GetHttpsHostname(endpoint->origin, server_name)) {
+            std::string tls_error;
+            if (server_name.empty() || !CreateUpstreamTls(server_name, ca_file.asString(), endpoint->http2, endpoint->tls, tls_error)) {
+                error = "Backend " + name + " has no TLS: " + (server_name.empty() ? "The origin has no hostname" : tls_error);
+                return false;
+            }
+        }
+        for (const auto& replica : replicas) {
+            BackendReplica backend_replica;
+            if (!replica.isString() || !ParseReplica(replica.asString(), backend_replica)) {
+                error = "Backend " + name + " has a replica that isn't hostname:port";
+                return false;
+            }
+            endpoint->replicas.push_back(std::move(backend_replica));
+        }
+        endpoint_names[name] = endpoint.get();
+        endpoints.push_back(std::move(endpoint));
+    }
+    std::vector<Route> table_routes;
+    std::set<std::pair<OperationType, std::string>> keys;
+    for (const auto& route : routes) {
+        Route table_route {};
+        const Json::Value& cache_ttl = route["cacheTtl"];
+        const Json::Value& batch_window = route["batchWindow"];
+        if (!route["operation"].isString() || !ParseOperationType(route["operation"].asString(), table_route.operation_type) ||
+            !route["field"].isString() || !route["backend"].isString() || !(cache_ttl.isNull() || cache_ttl.isUInt64()) ||
+            !(batch_window.isNull() || batch_window.isUInt64())) {
+            error = "A route needs an operation, a field and a backend";
+            return false;
+        }
+        table_route.field = route["field"].asString();
+        auto endpoint_it = endpoint_names.find(route["backend"].asString());
+        if (endpoint_it == endpoint_names.end()) {
+            error = "Route " + table_route.field + " has an unknown backend";
+            return false;
+        }
+        if (!keys.emplace(table_route.operation_type, table_route.field).second) {
+            error = "Route " + table_route.field + " is defined twice";
+            return false;
+        }
+        table_route.endpoint = endpoint_it->second;
+        table_route.cache_ttl = cache_ttl.isNull() ? 0 : cache_ttl.asUInt64();
+        table_route.batch_window = batch_window.isNull() ? 0 : batch_window.asUInt64();
+        table_routes.push_back(std::move(table_route));
+    }
+    HttpHeaderSet forwarded_headers = DefaultForwardedHeaders();
+    const Json::Value& forwarded_header_names = config["forwardedHeaders"];
+    if (!forwarded_header_names.isNull()) {
+        if (!forwarded_header_names.isArray()) {
+            error = "Expected forwardedHeaders to be an array of header names";
+            return false;
+        }
+        forwarded_headers.reset();
+        for (const auto& name : forwarded_header_names) {
+            HttpHeader header;
+            if (!name.isString()) {
+                error = "Expected forwardedHeaders to be an array of header names";
+                return false;
+            }
+            if (!FindHeader(name.asString(), header) || !IsForwardableHeader(header)) {
+                error = "Header " + name.asString() + " can't be forwarded";
+                return false;
+            }
+            forwarded_headers.set(static_cast<std::size_t>(header));
+        }
+    }
+    table = std::make_shared<RouteTable>(std::move(endpoints), std::move(table_routes), forwarded_headers);
+    return true;
+}
+
+bool LoadRouteTable(const std::string& file, std::shared_ptr<const RouteTable>& table, std::string& error) {
+    std::ifstream stream(file, std::ios::binary);
+    if (!stream.is_open()) {
+        error = "Unable to open " + file;
+        return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    return ParseRouteTable(text, table, error);
+}
+
+}
@@ -0,0 +1,149 @@
+#ifndef FLASHPOINT_ROUTE_TABLE_H
+#define FLASHPOINT_ROUTE_TABLE_H
+
+#include <program/graphql/graphql_syntaxes.h>
+#include <program/http_headers.h>
+#include <program/upstream_tls.h>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace flashpoint::program;
+using namespace flashpoint::program::graphql;
+
+namespace flashpoint {
+
+typedef std::bitset<http_header_size> HttpHeaderSet;
+
+// The client headers that are forwarded to backends by default.
+HttpHeaderSet DefaultForwardedHeaders();
+
+// Hop-by-hop headers and the headers that frame a message only apply to the
+// client connection, so they are never forwarded.
+bool IsForwardableHeader(HttpHeader header);
+
+// One of the servers that serve a backend, e.g. an instance behind a rolling
+// deploy.
+struct BackendReplica {
+    // The Host header of its requests.
+    std::string host;
+    std::string hostname;
+    unsigned int port;
+};
+
+struct BackendEndpoint {
+    std::string origin;
+    std::string path;
+    std::vector<BackendReplica> replicas;
+
+    // The TLS of the replicas' connections when the origin is https, nullptr
+    // otherwise.
+    std::shared_ptr<const UpstreamTls> tls;
+
+    // Whether the replicas speak HTTP/2, so that requests are multiplexed over
+    // a few sessions per replica.
+    bool http2;
+};
+
+// The backend that resolves a root field of an operation type.
+struct Route {
+    OperationType operation_type;
+    std::string field;
+    const BackendEndpoint* endpoint;
+
+    // Milliseconds that the field's data is cached, 0 to use the field's
+    // @cacheControl directive.
+    std::uint64_t cache_ttl;
+
+    // Microseconds that a query of the field waits to be sent in one batch
+    // with the queries of other clients to the backend, 0 to never batch.
+    std::uint64_t batch_window;
+};
+
+// An immutable index of the routes of a config, with a perfect hash of
+// (operation type, field name): a field's bucket gives a displacement, and
+// the hash with the displacement gives the only slot the field can be in. A
+// lookup is two hashes and one comparison, whatever the number of routes.
+//
+// A table is shared, a reload builds a new table and swaps it in, while the
+// plans of the requests in flight keep the old table alive.
+class RouteTable {
+public:
+    // Compile the routes into the index.
+    // @param endpoints the backends that the routes point to.
+    // @param routes the routes, at most one per operation type and field.
+    // @param forwarded_headers the client headers that are forwarded to the
+    // backends.
+    RouteTable(std::vector<std::unique_ptr<BackendEndpoint>> endpoints, std::vector<Route> routes, HttpHeaderSet forwarded_headers = DefaultForwardedHeaders());
+
+    // @return the route, or nullptr when the field has no route.
+    const Route* Find(OperationType operation_type, std::string_view field) const;
+
+    const std::vector<std::unique_ptr<BackendEndpoint>>& Endpoints() const;
+
+    const HttpHeaderSet& ForwardedHeaderSet() const;
+
+    std::size_t Size() const;
+
+private:
+    std::vector<std::unique_ptr<BackendEndpoint>> endpoints_;
+    HttpHeaderSet forwarded_headers_;
+
+    // The routes at their slot, a slot without a route has no endpoint.
+    std::vector<Route> slots_;
+    std::size_t slot_mask_;
+
+    // The displacement of every bucket, 0 for an empty bucket.
+    std::vector<std::uint32_t> displacements_;
+    std::size_t size_;
+
+    static std::uint64_t Hash(OperationType operation_type, std::string_view field, std::uint32_t seed);
+};
+
+// Parse a route config, e.g.:
+//
+//     {
+//         "backends": {
+//             "users": {
+//                 "origin": "http://users:4000",
+//                 "path": "/graphql",
+//                 "replicas": ["users-1:4000", "users-2:4000"]
+//             },
+//             "orders": {
+//                 "origin": "https://orders.internal",
+//                 "path": "/graphql",
+//                 "replicas": ["orders-1:443"],
+//                 "caFile": "/etc/flashpoint/internal-ca.pem",
+//                 "http2": true
+//             }
+//         },
+//         "routes": [
+//             { "operation": "query", "field": "user", "backend": "users", "cacheTtl": 1000, "batchWindow": 200 }
+//         ],
+//         "forwardedHeaders": ["Accept-Language", "Authorization", "Cookie"]
+//     }
+//
+// A backend with an https origin is connected to with TLS, its certificate is
+// verified against the origin's hostname with its caFile, or the system's CAs.
+// An http2 backend is spoken to with HTTP/2, agreed on with ALPN when the
+// origin is https and with prior knowledge otherwise.
+//
+// forwardedHeaders replaces the default set of forwarded client headers, it
+// can only name known headers that aren't hop-by-hop.
+// @param text the config.
+// @param table the compiled table.
+// @param error the reason the config is invalid.
+// @return false when the config is invalid.
+bool ParseRouteTable(const std::string& text, std::shared_ptr<const RouteTable>& table, std::string& error);
+
+// Read and parse a route config file. It blocks, so reloads run it on the
+// loop's thread pool.
+bool LoadRouteTable(const std::string& file, std::shared_ptr<const RouteTable>& table, std::string& error);
+
+}
+
+#endif //FLASHPOINT_ROUTE_TABLE_H
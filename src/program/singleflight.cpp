@@ -0,0 +1,35 @@
+#include <program/singleflight.h>
+
+namespace flashpoint {
+
+bool SingleflightGroup::Join(const std::string& key, const FlightMember& member) {
+    auto flight_it = flights_.find(key);
+    if (flight_it == flights_.end()) {
+        return false;
+    }
+    SubqueryFlight* flight = flight_it->second;
+    flight->members.push_back(member);
+    member.merge->SetResumeCallback(member.index, flight->resume_callback, flight->resume_data);
+    stats_.joins++;
+    return true;
+}
+
+void SingleflightGroup::Lead(SubqueryFlight* flight) {
+    flights_[flight->key] = flight;
+    flight->joinable = true;
+    stats_.leads++;
+}
+
+void SingleflightGroup::Close(SubqueryFlight* flight) {
+    if (!flight->joinable) {
+        return;
+    }
+    flights_.erase(flight->key);
+    flight->joinable = false;
+}
+
+const SingleflightStats& SingleflightGroup::Stats() const {
+    return stats_;
+}
+
+}
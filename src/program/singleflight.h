@@ -0,0 +1,67 @@
+#ifndef FLASHPOINT_SINGLEFLIGHT_H
+#define FLASHPOINT_SINGLEFLIGHT_H
+
+#include <program/response_merge.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace flashpoint {
+
+// A subquery of a client request, i.e. where a response is merged.
+struct FlightMember {
+    std::shared_ptr<ResponseMerge> merge;
+    std::size_t index;
+};
+
+// A subquery that is in flight to its backend, and the members that wait for
+// its response. The first member is the leader, whose request is sent.
+struct SubqueryFlight {
+    // The backend, the forwarded headers that scope the response and the
+    // printed subquery with its variables.
+    std::string key;
+    std::vector<FlightMember> members;
+
+    // Whether the flight is in its group, and can be joined.
+    bool joinable;
+
+    // The callback that resumes the flight when one of its members resumes.
+    MergeResumeCallback resume_callback;
+    void* resume_data;
+};
+
+struct SingleflightStats {
+    std::uint64_t leads;
+    std::uint64_t joins;
+};
+
+// Coalesces identical subqueries that are in flight at the same time, e.g.
+// when many clients send the same query after an app launch. A flight can only
+// be joined until the first bytes of its response have been merged, since
+// later members would miss them.
+class SingleflightGroup {
+public:
+    // Join the flight of a key.
+    // @return whether there was a joinable flight.
+    bool Join(const std::string& key, const FlightMember& member);
+
+    // Add a flight so that later identical subqueries join it.
+    void Lead(SubqueryFlight* flight);
+
+    // Remove a flight from the group, it can't be joined anymore.
+    void Close(SubqueryFlight* flight);
+
+    const SingleflightStats& Stats() const;
+
+private:
+    std::unordered_map<std::string_view, SubqueryFlight*> flights_;
+    SingleflightStats stats_ = {};
+};
+
+}
+
+#endif //FLASHPOINT_SINGLEFLIGHT_H
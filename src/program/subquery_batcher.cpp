@@ -0,0 +1,340 @@
+#include <program/subquery_batcher.h>
+#include <cctype>
+
+namespace flashpoint {
+
+SubqueryBatcher::SubqueryBatcher(uv_loop_t* loop, SubqueryBatchCallback callback, void* data, const SubqueryBatcherOptions& options):
+    loop_(loop),
+    callback_(callback),
+    data_(data),
+    options_(options),
+    stats_(),
+    active_(false) {
+    uv_check_init(loop, &check_);
+    check_.data = this;
+    uv_idle_init(loop, &idle_);
+    idle_.data = this;
+    uv_timer_init(loop, &timer_);
+    timer_.data = this;
+}
+
+void SubqueryBatcher::Add(GatewayClient* gateway_client, BatchedSubquery subquery, std::uint64_t deadline) {
+    const BackendEndpoint* endpoint = subquery.subquery->endpoint;
+    std::string key(reinterpret_cast<const char*>(&endpoint), sizeof(endpoint));
+    const ForwardedHeaders* forwarded_headers = gateway_client->forwarded_headers.get();
+    if (forwarded_headers != nullptr) {
+        key += forwarded_headers->scope;
+    }
+    std::unique_ptr<SubqueryBatch>& batch = batches_[key];
+    bool is_new_batch = batch == nullptr;
+    if (is_new_batch) {
+        batch = std::make_unique<SubqueryBatch>();
+        batch->gateway_client = gateway_client->shared_from_this();
+        batch->deadline = deadline;
+        batch->send_time = uv_hrtime() + subquery.subquery->batch_window * 1000;
+        batch->max_response_size = options_.max_response_size;
+    }
+    batch->deadline = std::min(batch->deadline, deadline);
+    batch->subqueries.push_back(std::move(subquery));
+    stats_.subqueries++;
+    if (batch->subqueries.size() >= options_.max_batch_size) {
+        std::unique_ptr<SubqueryBatch> full_batch = std::move(batch);
+        batches_.erase(key);
+        stats_.batches++;
+        callback_(std::move(full_batch), data_);
+        return;
+    }
+    if (is_new_batch) {
+        Schedule();
+    }
+}
+
+void SubqueryBatcher::Stop() {
+    active_ = false;
+    uv_check_stop(&check_);
+    uv_idle_stop(&idle_);
+    uv_timer_stop(&timer_);
+}
+
+// An active idle handle keeps the poll from blocking, so that the check runs
+// again right away, but it spins the loop. It is only started for the last
+// max_spin_time, before that the timer wakes the loop.
+void SubqueryBatcher::Schedule() {
+    if (batches_.empty()) {
+        Stop();
+        return;
+    }
+    std::uint64_t send_time = UINT64_MAX;
+    for (const auto& batch_entry : batches_) {
+        send_time = std::min(send_time, batch_entry.second->send_time);
+    }
+    if (!active_) {
+        active_ = true;
+        uv_check_start(&check_, OnCheck);
+    }
+    std::uint64_t now = uv_hrtime();
+    std::uint64_t max_spin_time = options_.max_spin_time * 1000;
+    if (send_time <= now + max_spin_time) {
+        uv_timer_stop(&timer_);
+        uv_idle_start(&idle_, OnIdle);
+        return;
+    }
+    uv_idle_stop(&idle_);
+    uv_timer_start(&timer_, OnTimer, (send_time - now - max_spin_time) / 1000000, 0);
+}
+
+const SubqueryBatcherStats& SubqueryBatcher::Stats() const {
+    return stats_;
+}
+
+// The batches are taken out of the map before they are sent, since sending
+// one can end a client request, which can add subqueries of the client's next
+// request.
+void SubqueryBatcher::SendDueBatches() {
+    std::uint64_t now = uv_hrtime();
+    std::vector<std::unique_ptr<SubqueryBatch>> due_batches;
+    for (auto batch_it = batches_.begin(); batch_it != batches_.end();) {
+        if (batch_it->second->send_time <= now) {
+            due_batches.push_back(std::move(batch_it->second));
+            batch_it = batches_.erase(batch_it);
+        }
+        else {
+            batch_it++;
+        }
+    }
+    Schedule();
+    for (auto& batch : due_batches) {
+        stats_.batches++;
+        callback_(std::move(batch), data_);
+    }
+}
+
+void SubqueryBatcher::OnCheck(uv_check_t* check) {
+    static_cast<SubqueryBatcher*>(check->data)->SendDueBatches();
+}
+
+void SubqueryBatcher::OnIdle(uv_idle_t* idle) { }
+
+// The timer runs before the poll, so it sends or schedules the batches itself,
+// or the poll would block without a timer.
+void SubqueryBatcher::OnTimer(uv_timer_t* timer) {
+    static_cast<SubqueryBatcher*>(timer->data)->SendDueBatches();
+}
+
+std::string GetBatchAlias(std::size_t index, std::string_view response_key) {
+    std::string alias = "_b" + std::to_string(index) + "_";
+    alias.append(response_key.data(), response_key.size());
+    return alias;
+}
+
+bool ParseBatchAlias(std::string_view alias, std::size_t subqueries, std::size_t& index, std::string_view& response_key) {
+    if (alias.size() < 4 || alias[0] != '_' || alias[1] != 'b' || !std::isdigit(static_cast<unsigned char>(alias[2]))) {
+        return false;
+    }
+    std::size_t position = 2;
+    index = 0;
+    while (position < alias.size() && std::isdigit(static_cast<unsigned char>(alias[position]))) {
+        index = index * 10 + (alias[position] - '0');
+        if (index >= subqueries) {
+            return false;
+        }
+        position++;
+    }
+    if (position + 1 >= alias.size() || alias[position] != '_') {
+        return false;
+    }
+    response_key = alias.substr(position + 1);
+    return true;
+}
+
+std::size_t SkipJsonWhitespace(std::string_view text, std::size_t position) {
+    while (position < text.size() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\n' || text[position] == '\r')) {
+        position++;
+    }
+    return position;
+}
+
+// Skip a value of a complete response, without validating it. Its splitter
+// validates it when it is merged.
+// @return false when the text ends before the value does.
+bool SkipJsonValue(std::string_view text, std::size_t& position) {
+    std::size_t depth = 0;
+    while (position < text.size()) {
+        char ch = text[position];
+        if (ch == '"') {
+            position++;
+            while (position < text.size() && text[position] != '"') {
+                position += text[position] == '\\' ? 2 : 1;
+            }
+            if (position >= text.size()) {
+                return false;
+            }
+            position++;
+        }
+        else if (ch == '{' || ch == '[') {
+            depth++;
+            position++;
+        }
+        else if (ch == '}' || ch == ']') {
+            if (depth == 0) {
+                return true;
+            }
+            depth--;
+            position++;
+        }
+        else if (ch == ',' && depth == 0) {
+            return true;
+        }
+        else {
+            position++;
+        }
+        if (depth == 0 && (ch == '"' || ch == '}' || ch == ']')) {
+            return true;
+        }
+    }
+    return depth == 0;
+}
+
+// Read the next item of an array or member of an object, after its open
+// bracket or the previous one.
+// @param key the member's key without its quotes, empty for an item.
+// @return false at the end of the container, or of invalid text.
+bool NextJsonValue(std::string_view text, std::size_t& position, bool is_object, std::string_view& key, std::string_view& value) {
+    position = SkipJsonWhitespace(text, position);
+    if (position < text.size() && text[position] == ',') {
+        position = SkipJsonWhitespace(text, position + 1);
+    }
+    if (position >= text.size() || text[position] == '}' || text[position] == ']') {
+        return false;
+    }
+    if (is_object) {
+        std::size_t key_start = position;
+        if (text[position] != '"' || !SkipJsonValue(text, position)) {
+            return false;
+        }
+        key = text.substr(key_start + 1, position - key_start - 2);
+        position = SkipJsonWhitespace(text, position);
+        if (position >= text.size() || text[position] != ':') {
+            return false;
+        }
+        position = SkipJsonWhitespace(text, position + 1);
+    }
+    std::size_t value_start = position;
+    if (!SkipJsonValue(text, position) || position == value_start) {
+        return false;
+    }
+    value = text.substr(value_start, position - value_start);
+    while (!value.empty() && SkipJsonWhitespace(value, value.size() - 1) == value.size()) {
+        value.remove_suffix(1);
+    }
+    return true;
+}
+
+// Give an error to the subquery of the alias at the start of its path, with
+// the alias renamed.
+// @return false when the error's path doesn't start with an alias.
+bool SplitBatchError(std::string_view error, std::size_t subqueries, std::vector<std::string>& errors) {
+    if (error.empty() || error[0] != '{') {
+        return false;
+    }
+    std::size_t position = 1;
+    std::string_view key;
+    std::string_view value;
+    while (NextJsonValue(error, position, true, key, value)) {
+        if (key != "path" || value[0] != '[') {
+            continue;
+        }
+        std::size_t item_position = 1;
+        std::string_view item_key;
+        std::string_view first_item;
+        std::size_t index;
+        std::string_view response_key;
+        if (!NextJsonValue(value, item_position, false, item_key, first_item) || first_item[0] != '"' ||
+            !ParseBatchAlias(first_item.substr(1, first_item.size() - 2), subqueries, index, response_key)) {
+            return false;
+        }
+        std::string& subquery_errors = errors[index];
+        if (!subquery_errors.empty()) {
+            subquery_errors += ",";
+        }
+        std::size_t alias_start = first_item.data() - error.data();
+        subquery_errors.append(error.data(), alias_start);
+        subquery_errors += "\"";
+        subquery_errors.append(response_key.data(), response_key.size());
+        subquery_errors += "\"";
+        subquery_errors.append(error.data() + alias_start + first_item.size(), error.size() - alias_start - first_item.size());
+        return true;
+    }
+    return false;
+}
+
+bool SplitBatchResponse(const SubqueryBatch& batch, std::vector<std::string>& responses) {
+    std::string_view text = batch.response;
+    std::size_t subqueries = batch.subqueries.size();
+    std::size_t position = SkipJsonWhitespace(text, 0);
+    if (position >= text.size() || text[position] != '{') {
+        return false;
+    }
+    position++;
+    std::vector<std::string> data(subqueries);
+    std::vector<std::string> errors(subqueries);
+    std::string shared_errors;
+    bool has_data = false;
+    std::string_view key;
+    std::string_view value;
+    while (NextJsonValue(text, position, true, key, value)) {
+        if (key == "data" && value[0] == '{') {
+            has_data = true;
+            std::size_t member_position = 1;
+            std::string_view alias;
+            std::string_view member;
+            while (NextJsonValue(value, member_position, true, alias, member)) {
+                std::size_t index;
+                std::string_view response_key;
+                if (!ParseBatchAlias(alias, subqueries, index, response_key)) {
+                    continue;
+                }
+                std::string& subquery_data = data[index];
+                if (!subquery_data.empty()) {
+                    subquery_data += ",";
+                }
+                subquery_data += "\"";
+                subquery_data.append(response_key.data(), response_key.size());
+                subquery_data += "\":";
+                subquery_data.append(member.data(), member.size());
+            }
+        }
+        else if (key == "errors" && value[0] == '[') {
+            std::size_t item_position = 1;
+            std::string_view item_key;
+            std::string_view error;
+            while (NextJsonValue(value, item_position, false, item_key, error)) {
+                if (SplitBatchError(error, subqueries, errors)) {
+                    continue;
+                }
+                if (!shared_errors.empty()) {
+                    shared_errors += ",";
+                }
+                shared_errors.append(error.data(), error.size());
+            }
+        }
+    }
+    responses.resize(subqueries);
+    for (std::size_t i = 0; i < subqueries; i++) {
+        std::string& response = responses[i];
+        response = has_data ? "{\"data\":{" + data[i] + "}" : "{\"data\":null";
+        if (!errors[i].empty() || !shared_errors.empty()) {
+            response += ",\"errors\":[";
+            response += errors[i];
+            if (!errors[i].empty() && !shared_errors.empty()) {
+                response += ",";
+            }
+            response += shared_errors;
+            response += "]";
+        }
+        response += "}";
+    }
+    return true;
+}
+
+}
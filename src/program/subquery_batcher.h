@@ -0,0 +1,162 @@
+#ifndef FLASHPOINT_SUBQUERY_BATCHER_H
+#define FLASHPOINT_SUBQUERY_BATCHER_H
+
+#include <uv.h>
+#include <program/http_server.h>
+#include <program/query_planner.h>
+#include <program/singleflight.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace flashpoint {
+
+// A subquery of a client request that waits in a batch.
+struct BatchedSubquery {
+    std::shared_ptr<QueryPlan> plan;
+    const Subquery* subquery;
+
+    // The members whose merges the subquery's part of the batch response is
+    // merged into.
+    std::unique_ptr<SubqueryFlight> flight;
+
+    // Milliseconds that the subquery's data is cached, 0 when it isn't.
+    std::uint64_t cache_ttl;
+};
+
+// Subqueries of different client requests to the same backend, with the same
+// forwarded headers, that are sent as one operation. Every root field is
+// aliased with the index of its subquery, so that the response can be split.
+struct SubqueryBatch {
+    // The client whose forwarded headers are sent, the first subquery's.
+    std::shared_ptr<GatewayClient> gateway_client;
+    std::vector<BatchedSubquery> subqueries;
+
+    // The earliest deadline of the subqueries' client requests.
+    std::uint64_t deadline;
+
+    // uv_hrtime when the batch is sent.
+    std::uint64_t send_time;
+
+    // The response is split once it is complete, so it is buffered up to
+    // max_response_size.
+    std::string response;
+    std::size_t max_response_size;
+};
+
+struct SubqueryBatcherOptions {
+    // Subqueries above which a batch is sent before its window has passed.
+    std::size_t max_batch_size;
+    std::size_t max_response_size;
+
+    // Microseconds before a batch's send time from which the loop doesn't
+    // block in its poll. Until then a timer wakes it, since the timers of the
+    // loop only have millisecond resolution.
+    std::uint64_t max_spin_time;
+};
+
+const SubqueryBatcherOptions default_subquery_batcher_options = { 64, 1024 * 1024 * 4, 1000 };
+
+struct SubqueryBatcherStats {
+    std::uint64_t batches;
+    std::uint64_t subqueries;
+};
+
+// Called when a batch is sent, with the ownership of the batch.
+typedef void (*SubqueryBatchCallback)(std::unique_ptr<SubqueryBatch> batch, void* data);
+
+// Collects compatible subqueries of concurrent client requests during a short
+// window, e.g. many clients that ask one backend for user(id:) with different
+// ids, and sends them as one request. Windows are microseconds, so they are
+// checked after every poll of the loop with uv_hrtime. A timer wakes the loop
+// shortly before the earliest send time, and the loop doesn't block in its
+// poll from then on.
+class SubqueryBatcher {
+public:
+    SubqueryBatcher(uv_loop_t* loop, SubqueryBatchCallback callback, void* data, const SubqueryBatcherOptions& options = default_subquery_batcher_options);
+
+    // Add a subquery to the open batch of its backend and forwarded headers,
+    // or open one for the subquery's batch window.
+    // @param gateway_client the subquery's client.
+    // @param subquery the subquery, which has a batch window.
+    // @param deadline the deadline of the client request.
+    void Add(GatewayClient* gateway_client, BatchedSubquery subquery, std::uint64_t deadline);
+
+    // Stop checking the windows of the open batches.
+    void Stop();
+
+    const SubqueryBatcherStats& Stats() const;
+
+private:
+    uv_loop_t* loop_;
+    SubqueryBatchCallback callback_;
+    void* data_;
+    SubqueryBatcherOptions options_;
+    SubqueryBatcherStats stats_;
+    uv_check_t check_;
+    uv_idle_t idle_;
+    uv_timer_t timer_;
+    bool active_;
+
+    // The open batches by their backend and forwarded headers.
+    std::unordered_map<std::string, std::unique_ptr<SubqueryBatch>> batches_;
+
+    void SendDueBatches();
+
+    // Wait for the earliest send time of the open batches, with the timer
+    // while it is far and with the idle handle when it is close.
+    void Schedule();
+
+    static void OnCheck(uv_check_t* check);
+    static void OnIdle(uv_idle_t* idle);
+    static void OnTimer(uv_timer_t* timer);
+};
+
+// The alias of a root field in a batch.
+std::string GetBatchAlias(std::size_t index, std::string_view response_key);
+
+// Get the subquery and the response key of an alias.
+// @param subqueries the number of subqueries of the batch.
+// @return false when the key isn't an alias of the batch.
+bool ParseBatchAlias(std::string_view alias, std::size_t subqueries, std::size_t& index, std::string_view& response_key);
+
+// Split the response of a batch into the responses of its subqueries. The
+// data members and the errors with a path are given to the subquery of their
+// alias, and renamed to its response key. Errors without a path are given to
+// all subqueries.
+// @param batch the batch, with its complete response.
+// @param responses the response of every subquery.
+// @return false when the response is not a JSON object.
+bool SplitBatchResponse(const SubqueryBatch& batch, std::vector<std::string>& responses);
+
+// Print the JSON request body of a batch. Fragments are inlined, since the
+// fragments of different documents can have the same name.
+// @param writer the writer, e.g. an HttpWriter or a SizeCounter.
+// @param batch the batch.
+template<typename Writer>
+void PrintSubqueryBatch(Writer& writer, const SubqueryBatch& batch) {
+    static const char query_start[] = "{\"query\":\"{";
+    static const char query_end[] = "}\"}";
+    writer.Write(query_start, sizeof(query_start) - 1);
+    bool first = true;
+    for (std::size_t i = 0; i < batch.subqueries.size(); i++) {
+        const BatchedSubquery& batched_subquery = batch.subqueries[i];
+        GraphQlPrinter<Writer> printer(writer, batched_subquery.plan->fragments, FragmentPrintMode::Inline);
+        for (const auto& planned_field : batched_subquery.subquery->fields) {
+            if (!first) {
+                printer.Write(" ");
+            }
+            first = false;
+            printer.PrintMergedField(planned_field.fields, GetBatchAlias(i, planned_field.response_key));
+        }
+    }
+    writer.Write(query_end, sizeof(query_end) - 1);
+}
+
+}
+
+#endif //FLASHPOINT_SUBQUERY_BATCHER_H
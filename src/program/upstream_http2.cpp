@@ -0,0 +1,967 @@
+#include <program/upstream_http2.h>
+#include <program/upstream_tls.h>
+#include <algorithm>
+#include <cctype>
+
+namespace flashpoint {
+
+const char http2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const std::size_t http2_frame_header_size = 9;
+
+// The initial windows and frame size of RFC 7540. We never raise our
+// SETTINGS_MAX_FRAME_SIZE, so no frame that we receive is larger.
+const std::int64_t default_http2_window_size = 65535;
+const std::int64_t max_http2_window_size = 0x7fffffff;
+const std::uint32_t default_http2_frame_size = 16384;
+const std::uint32_t max_http2_frame_size = 16777215;
+const std::uint32_t max_http2_stream_id = 0x7fffffff;
+
+// Header blocks that are continued beyond this are a connection error.
+const std::size_t max_http2_header_block_size = 1024 * 64;
+
+enum class Http2FrameType : std::uint8_t {
+    Data = 0x0,
+    Headers = 0x1,
+    Priority = 0x2,
+    RstStream = 0x3,
+    Settings = 0x4,
+    PushPromise = 0x5,
+    Ping = 0x6,
+    Goaway = 0x7,
+    WindowUpdate = 0x8,
+    Continuation = 0x9,
+};
+
+const std::uint8_t http2_end_stream_flag = 0x1;
+const std::uint8_t http2_ack_flag = 0x1;
+const std::uint8_t http2_end_headers_flag = 0x4;
+const std::uint8_t http2_padded_flag = 0x8;
+const std::uint8_t http2_priority_flag = 0x20;
+
+enum class Http2Setting : std::uint16_t {
+    HeaderTableSize = 0x1,
+    EnablePush = 0x2,
+    MaxConcurrentStreams = 0x3,
+    InitialWindowSize = 0x4,
+    MaxFrameSize = 0x5,
+    MaxHeaderListSize = 0x6,
+};
+
+std::uint32_t ReadHttp2Uint32(const char* text) {
+    auto bytes = reinterpret_cast<const std::uint8_t*>(text);
+    return (std::uint32_t)bytes[0] << 24 | (std::uint32_t)bytes[1] << 16 | (std::uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+std::uint16_t ReadHttp2Uint16(const char* text) {
+    auto bytes = reinterpret_cast<const std::uint8_t*>(text);
+    return (std::uint16_t)(bytes[0] << 8 | bytes[1]);
+}
+
+void WriteHttp2Uint32(std::string& output, std::uint32_t value) {
+    output.push_back((char)(value >> 24));
+    output.push_back((char)(value >> 16));
+    output.push_back((char)(value >> 8));
+    output.push_back((char)value);
+}
+
+void WriteHttp2Setting(std::string& output, Http2Setting setting, std::uint32_t value) {
+    output.push_back((char)((std::uint16_t)setting >> 8));
+    output.push_back((char)setting);
+    WriteHttp2Uint32(output, value);
+}
+
+// Get the status of a response head.
+// @return the status, 0 when it is missing or invalid.
+unsigned int GetHttp2Status(const std::vector<HpackHeader>& headers) {
+    for (const auto& header : headers) {
+        if (header.name != ":status") {
+            continue;
+        }
+        const std::string& value = header.value;
+        if (value.size() != 3 || value[0] < '1' || value[0] > '5' || !std::isdigit((unsigned char)value[1]) || !std::isdigit((unsigned char)value[2])) {
+            return 0;
+        }
+        return (unsigned int)std::stoul(value);
+    }
+    return 0;
+}
+
+// Frames are processed right after they are read, only the bytes of an
+// incomplete frame are copied into the session.
+void AllocateSessionBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    thread_local char buffer[1024 * 64];
+    buf->base = buffer;
+    buf->len = sizeof(buffer);
+}
+
+struct Http2Write {
+    uv_write_t write_request;
+    std::string output;
+};
+
+void OnHttp2Written(uv_write_t* write_request, int status) {
+    delete static_cast<Http2Write*>(write_request->data);
+}
+
+Http2Session::Http2Session(Http2Endpoint* endpoint, UpstreamConnection* connection, const Http2SessionPoolOptions& options):
+    endpoint_(endpoint),
+    connection_(connection),
+    options_(options),
+    next_stream_id_(1),
+    header_stream_id_(0),
+    header_end_stream_(false),
+    has_settings_(false),
+    max_concurrent_streams_(options.max_concurrent_streams),
+    max_frame_size_(default_http2_frame_size),
+    initial_window_size_(default_http2_window_size),
+    send_window_(default_http2_window_size),
+    receive_window_(default_http2_window_size),
+    unacknowledged_size_(0),
+    idle_since_(uv_now(connection->tcp_handle.loop)),
+    processing_(false),
+    going_away_(false),
+    closing_(false) {
+    connection->data = this;
+}
+
+// The backend's preface, a SETTINGS frame, may have arrived with the end of
+// the handshake, so the TLS session is read right away.
+void Http2Session::Start() {
+    output_.append(http2_preface, sizeof(http2_preface) - 1);
+    WriteFrameHeader(12, (std::uint8_t)Http2FrameType::Settings, 0, 0);
+    WriteHttp2Setting(output_, Http2Setting::EnablePush, 0);
+    WriteHttp2Setting(output_, Http2Setting::InitialWindowSize, options_.stream_window_size);
+    if (options_.session_window_size > default_http2_window_size) {
+        WriteWindowUpdate(0, options_.session_window_size - default_http2_window_size);
+        receive_window_ = options_.session_window_size;
+    }
+    uv_read_start((uv_stream_t*)&connection_->tcp_handle, AllocateSessionBuffer, OnRead);
+    if (connection_->ssl_handle != nullptr && HasPendingUpstreamTls(connection_)) {
+        Read(nullptr, 0);
+        return;
+    }
+    Flush();
+}
+
+bool Http2Session::IsAvailable() const {
+    return !going_away_ && !closing_ && streams_.size() < max_concurrent_streams_;
+}
+
+std::size_t Http2Session::StreamCount() const {
+    return streams_.size();
+}
+
+std::uint64_t Http2Session::IdleSince() const {
+    return idle_since_;
+}
+
+void Http2Session::OpenStream(Http2Stream* stream) {
+    stream->session = this;
+    stream->id = next_stream_id_;
+    stream->send_window = initial_window_size_;
+    stream->receive_window = options_.stream_window_size;
+    streams_.emplace(stream->id, stream);
+    next_stream_id_ += 2;
+    if (next_stream_id_ > max_http2_stream_id) {
+        going_away_ = true;
+        endpoint_->pool->RemoveSession(endpoint_, this);
+    }
+
+    std::string block;
+    for (const auto& header : stream->request.headers) {
+        encoder_.Encode(header.name, header.value, header.indexing, block);
+    }
+    stream->request.headers = {};
+    bool has_body = !stream->request.body.empty();
+
+    // A block that is larger than a frame is continued in CONTINUATION frames,
+    // END_STREAM is a flag of the HEADERS frame.
+    std::size_t offset = 0;
+    auto type = Http2FrameType::Headers;
+    do {
+        std::size_t size = std::min(block.size() - offset, (std::size_t)max_frame_size_);
+        std::uint8_t flags = offset + size == block.size() ? http2_end_headers_flag : 0;
+        if (type == Http2FrameType::Headers && !has_body) {
+            flags |= http2_end_stream_flag;
+        }
+        WriteFrameHeader(size, (std::uint8_t)type, flags, stream->id);
+        output_.append(block, offset, size);
+        offset += size;
+        type = Http2FrameType::Continuation;
+    } while (offset < block.size());
+    if (has_body) {
+        sending_streams_.push_back(stream);
+        SendBodies();
+    }
+    if (!processing_) {
+        Flush();
+    }
+}
+
+void Http2Session::CancelStream(Http2Stream* stream) {
+    if (stream->closed) {
+        return;
+    }
+    if (!closing_) {
+        WriteRstStream(stream->id, Http2ErrorCode::Cancel);
+    }
+    RemoveStream(stream);
+    if (!processing_) {
+        FinishProcessing();
+    }
+}
+
+void Http2Session::ResumeStream(Http2Stream* stream) {
+    stream->paused = false;
+    if (stream->closed || stream->unacknowledged_size == 0) {
+        return;
+    }
+    WriteWindowUpdate(stream->id, stream->unacknowledged_size);
+    stream->receive_window += stream->unacknowledged_size;
+    stream->unacknowledged_size = 0;
+    if (!processing_) {
+        Flush();
+    }
+}
+
+// The GOAWAY is sent on a best effort basis, the connection is closed right
+// after it.
+void Http2Session::Close(Http2ErrorCode code, const char* message) {
+    if (closing_) {
+        return;
+    }
+    closing_ = true;
+    Http2SessionPool* pool = endpoint_->pool;
+    pool->RemoveSession(endpoint_, this);
+    WriteFrameHeader(8, (std::uint8_t)Http2FrameType::Goaway, 0, 0);
+    WriteHttp2Uint32(output_, 0);
+    WriteHttp2Uint32(output_, (std::uint32_t)code);
+    Flush();
+    uv_read_stop((uv_stream_t*)&connection_->tcp_handle);
+
+    // A failed stream's callback can cancel the other streams.
+    bool processing = processing_;
+    processing_ = true;
+    std::vector<Http2Stream*> streams;
+    for (const auto& stream_entry : streams_) {
+        streams.push_back(stream_entry.second);
+    }
+    for (const auto& stream : streams) {
+        if (!stream->closed) {
+            FailStream(stream, message, false);
+        }
+    }
+    processing_ = processing;
+    pool->upstream_pool_->Discard(connection_);
+    connection_ = nullptr;
+    pool->Dispatch(endpoint_);
+    if (!processing_) {
+        FinishProcessing();
+    }
+}
+
+void Http2Session::WriteFrameHeader(std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id) {
+    output_.push_back((char)(length >> 16));
+    output_.push_back((char)(length >> 8));
+    output_.push_back((char)length);
+    output_.push_back((char)type);
+    output_.push_back((char)flags);
+    WriteHttp2Uint32(output_, stream_id);
+}
+
+void Http2Session::WriteWindowUpdate(std::uint32_t stream_id, std::size_t increment) {
+    WriteFrameHeader(4, (std::uint8_t)Http2FrameType::WindowUpdate, 0, stream_id);
+    WriteHttp2Uint32(output_, (std::uint32_t)increment);
+}
+
+void Http2Session::WriteRstStream(std::uint32_t stream_id, Http2ErrorCode code) {
+    WriteFrameHeader(4, (std::uint8_t)Http2FrameType::RstStream, 0, stream_id);
+    WriteHttp2Uint32(output_, (std::uint32_t)code);
+}
+
+// Send the bodies that wait for window, in the order of their streams, as far
+// as the windows of the session and of every stream allow.
+void Http2Session::SendBodies() {
+    auto stream_it = sending_streams_.begin();
+    while (stream_it != sending_streams_.end() && send_window_ > 0) {
+        Http2Stream* stream = *stream_it;
+        std::string& body = stream->request.body;
+        while (stream->body_sent < body.size() && stream->send_window > 0 && send_window_ > 0) {
+            std::size_t size = std::min({ body.size() - stream->body_sent, (std::size_t)stream->send_window, (std::size_t)send_window_, (std::size_t)max_frame_size_ });
+            bool is_last = stream->body_sent + size == body.size();
+            WriteFrameHeader(size, (std::uint8_t)Http2FrameType::Data, is_last ? http2_end_stream_flag : 0, stream->id);
+            output_.append(body, stream->body_sent, size);
+            stream->body_sent += size;
+            stream->send_window -= size;
+            send_window_ -= size;
+        }
+        if (stream->body_sent < body.size()) {
+            stream_it++;
+            continue;
+        }
+        body = {};
+        stream_it = sending_streams_.erase(stream_it);
+    }
+}
+
+void Http2Session::Flush() {
+    if (output_.empty()) {
+        return;
+    }
+    if (connection_ == nullptr) {
+        output_.clear();
+        return;
+    }
+    if (connection_->ssl_handle != nullptr) {
+        SSL_write(connection_->ssl_handle, output_.data(), (int)output_.size());
+        output_.clear();
+        FlushUpstreamTls(connection_);
+        return;
+    }
+    auto write = new Http2Write {};
+    write->output = std::move(output_);
+    output_.clear();
+    write->write_request.data = write;
+    uv_buf_t buf = uv_buf_init(&write->output[0], (unsigned int)write->output.size());
+    if (uv_write(&write->write_request, (uv_stream_t*)&connection_->tcp_handle, &buf, 1, OnHttp2Written)) {
+        delete write;
+    }
+}
+
+void Http2Session::OnRead(uv_stream_t* stream, ssize_t length, const uv_buf_t* buf) {
+    if (length == 0) {
+        return;
+    }
+    auto connection = static_cast<UpstreamConnection*>(stream->data);
+    auto session = static_cast<Http2Session*>(connection->data);
+    if (length < 0) {
+        session->Close(Http2ErrorCode::NoError, length == UV_EOF ? "Backend closed the connection" : uv_strerror((int)length));
+        return;
+    }
+    session->Read(buf->base, (std::size_t)length);
+}
+
+void Http2Session::Read(const char* text, std::size_t size) {
+    processing_ = true;
+    if (connection_->ssl_handle == nullptr) {
+        Feed(text, size);
+    }
+    else {
+        if (size > 0) {
+            ReceiveUpstreamTls(connection_, text, size);
+        }
+        thread_local char plaintext[16384];
+        while (!closing_) {
+            std::size_t plaintext_size;
+            UpstreamTlsStatus status = ReadUpstreamTls(connection_, plaintext, sizeof(plaintext), plaintext_size);
+            if (status == UpstreamTlsStatus::WantRead) {
+                break;
+            }
+            if (status != UpstreamTlsStatus::Done) {
+                Close(Http2ErrorCode::NoError, "Backend closed the connection");
+                break;
+            }
+            Feed(plaintext, plaintext_size);
+        }
+    }
+    processing_ = false;
+
+    // The ended streams made room for waiting streams.
+    Http2Endpoint* endpoint = endpoint_;
+    FinishProcessing();
+    endpoint->pool->Dispatch(endpoint);
+}
+
+void Http2Session::Feed(const char* text, std::size_t size) {
+    if (input_.empty()) {
+        std::size_t consumed = ProcessFrames(text, size);
+        if (!closing_) {
+            input_.assign(text + consumed, size - consumed);
+        }
+        return;
+    }
+    input_.append(text, size);
+    std::size_t consumed = ProcessFrames(input_.data(), input_.size());
+    if (!closing_) {
+        input_.erase(0, consumed);
+    }
+}
+
+std::size_t Http2Session::ProcessFrames(const char* text, std::size_t size) {
+    std::size_t consumed = 0;
+    while (!closing_ && size - consumed >= http2_frame_header_size) {
+        auto header = reinterpret_cast<const std::uint8_t*>(text + consumed);
+        std::size_t length = (std::size_t)header[0] << 16 | (std::size_t)header[1] << 8 | header[2];
+        if (length > default_http2_frame_size) {
+            FailSession(Http2ErrorCode::FrameSizeError, "Backend sent an invalid frame");
+            break;
+        }
+        if (size - consumed - http2_frame_header_size < length) {
+            break;
+        }
+        std::uint32_t stream_id = ReadHttp2Uint32(text + consumed + 5) & max_http2_stream_id;
+        const char* payload = text + consumed + http2_frame_header_size;
+        consumed += http2_frame_header_size + length;
+        if (!ProcessFrame(header[3], header[4], stream_id, payload, length)) {
+            break;
+        }
+    }
+    return consumed;
+}
+
+bool Http2Session::FailSession(Http2ErrorCode code, const char* message) {
+    Close(code, message);
+    return false;
+}
+
+bool Http2Session::ProcessFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length) {
+    // A header block is continued by the frames right after it, and the
+    // backend's preface starts with its settings.
+    if (header_stream_id_ != 0 && (type != (std::uint8_t)Http2FrameType::Continuation || stream_id != header_stream_id_)) {
+        return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+    }
+    if (!has_settings_ && type != (std::uint8_t)Http2FrameType::Settings) {
+        return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid preface");
+    }
+    switch ((Http2FrameType)type) {
+        case Http2FrameType::Data:
+            return ProcessData(flags, stream_id, payload, length);
+        case Http2FrameType::Headers:
+            return ProcessHeaders(flags, stream_id, payload, length);
+        case Http2FrameType::Continuation:
+            if (header_stream_id_ == 0) {
+                return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+            }
+            if (header_block_.size() + length > max_http2_header_block_size) {
+                return FailSession(Http2ErrorCode::ProtocolError, "Backend sent too large headers");
+            }
+            header_block_.append(payload, length);
+            if (flags & http2_end_headers_flag) {
+                return ProcessHeaderBlock();
+            }
+            return true;
+        case Http2FrameType::Priority:
+            if (length != 5) {
+                return FailSession(Http2ErrorCode::FrameSizeError, "Backend sent an invalid frame");
+            }
+            return true;
+        case Http2FrameType::RstStream: {
+            if (stream_id == 0 || length != 4) {
+                return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+            }
+            Http2Stream* stream = FindStream(stream_id);
+            if (stream == nullptr) {
+                return true;
+            }
+            bool is_refused = ReadHttp2Uint32(payload) == (std::uint32_t)Http2ErrorCode::RefusedStream;
+            if (is_refused) {
+                endpoint_->pool->stats_.refused_streams++;
+            }
+            FailStream(stream, is_refused ? "Backend refused the stream" : "Backend reset the stream", is_refused);
+            return true;
+        }
+        case Http2FrameType::Settings:
+            return ProcessSettings(flags, stream_id, payload, length);
+        case Http2FrameType::PushPromise:
+            return FailSession(Http2ErrorCode::ProtocolError, "Backend pushed a stream");
+        case Http2FrameType::Ping:
+            if (stream_id != 0 || length != 8) {
+                return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+            }
+            if (!(flags & http2_ack_flag)) {
+                WriteFrameHeader(8, (std::uint8_t)Http2FrameType::Ping, http2_ack_flag, 0);
+                output_.append(payload, 8);
+            }
+            return true;
+        case Http2FrameType::Goaway:
+            return ProcessGoaway(stream_id, payload, length);
+        case Http2FrameType::WindowUpdate:
+            return ProcessWindowUpdate(stream_id, payload, length);
+        default:
+            // Unknown frame types are ignored.
+            return true;
+    }
+}
+
+// Received data uses the window of the session even when its stream has been
+// cancelled, the session's window is given back at once and the stream's only
+// while the stream isn't paused.
+bool Http2Session::ProcessData(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length) {
+    if (stream_id == 0) {
+        return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+    }
+    receive_window_ -= length;
+    if (receive_window_ < 0) {
+        return FailSession(Http2ErrorCode::FlowControlError, "Backend exceeded the session window");
+    }
+    unacknowledged_size_ += length;
+    if (unacknowledged_size_ >= options_.session_window_size / 2) {
+        WriteWindowUpdate(0, unacknowledged_size_);
+        receive_window_ += unacknowledged_size_;
+        unacknowledged_size_ = 0;
+    }
+    const char* data = payload;
+    std::size_t data_size = length;
+    if (flags & http2_padded_flag) {
+        if (length == 0 || (std::uint8_t)payload[0] >= length) {
+            return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+        }
+        data++;
+        data_size -= 1 + (std::uint8_t)payload[0];
+    }
+    Http2Stream* stream = FindStream(stream_id);
+    if (stream == nullptr) {
+        return true;
+    }
+    if (!stream->has_head) {
+        ResetStream(stream, Http2ErrorCode::ProtocolError, "Backend sent data before a head");
+        return true;
+    }
+    stream->receive_window -= length;
+    if (stream->receive_window < 0) {
+        ResetStream(stream, Http2ErrorCode::FlowControlError, "Backend exceeded the stream window");
+        return true;
+    }
+    stream->unacknowledged_size += length;
+    if (data_size > 0) {
+        stream->callbacks->body(stream->data, data, data_size);
+        if (stream->closed) {
+            return true;
+        }
+    }
+    if (flags & http2_end_stream_flag) {
+        EndStream(stream);
+        return true;
+    }
+    if (!stream->paused && stream->unacknowledged_size >= options_.stream_window_size / 2) {
+        WriteWindowUpdate(stream_id, stream->unacknowledged_size);
+        stream->receive_window += stream->unacknowledged_size;
+        stream->unacknowledged_size = 0;
+    }
+    return true;
+}
+
+bool Http2Session::ProcessHeaders(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length) {
+    if (stream_id == 0) {
+        return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+    }
+    const char* block = payload;
+    std::size_t size = length;
+    std::size_t padding = 0;
+    if (flags & http2_padded_flag) {
+        if (size < 1) {
+            return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+        }
+        padding = (std::uint8_t)block[0];
+        block++;
+        size--;
+    }
+    if (flags & http2_priority_flag) {
+        if (size < 5) {
+            return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+        }
+        block += 5;
+        size -= 5;
+    }
+    if (padding > size) {
+        return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+    }
+    header_block_.assign(block, size - padding);
+    header_stream_id_ = stream_id;
+    header_end_stream_ = (flags & http2_end_stream_flag) != 0;
+    if (flags & http2_end_headers_flag) {
+        return ProcessHeaderBlock();
+    }
+    return true;
+}
+
+// Every block is decoded, also of streams that have been cancelled, since the
+// decoder's table changes with it.
+bool Http2Session::ProcessHeaderBlock() {
+    std::uint32_t stream_id = header_stream_id_;
+    header_stream_id_ = 0;
+    std::vector<HpackHeader> headers;
+    if (!decoder_.Decode(header_block_.data(), header_block_.size(), headers)) {
+        return FailSession(Http2ErrorCode::CompressionError, "Backend sent an invalid header block");
+    }
+    header_block_.clear();
+    Http2Stream* stream = FindStream(stream_id);
+    if (stream == nullptr) {
+        return true;
+    }
+    if (!stream->has_head) {
+        unsigned int status = GetHttp2Status(headers);
+        if (status == 0 || status == 101) {
+            ResetStream(stream, Http2ErrorCode::ProtocolError, "Backend sent an invalid head");
+            return true;
+        }
+        if (status < 200) {
+            if (header_end_stream_) {
+                ResetStream(stream, Http2ErrorCode::ProtocolError, "Backend sent an invalid head");
+            }
+            return true;
+        }
+        stream->has_head = true;
+        stream->callbacks->head(stream->data, status);
+        if (stream->closed) {
+            return true;
+        }
+    }
+    else if (!header_end_stream_) {
+        ResetStream(stream, Http2ErrorCode::ProtocolError, "Backend sent headers after the head");
+        return true;
+    }
+    if (header_end_stream_) {
+        EndStream(stream);
+    }
+    return true;
+}
+
+bool Http2Session::ProcessSettings(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length) {
+    if (stream_id != 0) {
+        return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+    }
+    if (flags & http2_ack_flag) {
+        if (length != 0) {
+            return FailSession(Http2ErrorCode::FrameSizeError, "Backend sent an invalid frame");
+        }
+        return true;
+    }
+    if (length % 6 != 0) {
+        return FailSession(Http2ErrorCode::FrameSizeError, "Backend sent an invalid frame");
+    }
+    for (std::size_t offset = 0; offset < length; offset += 6) {
+        std::uint32_t value = ReadHttp2Uint32(payload + offset + 2);
+        switch ((Http2Setting)ReadHttp2Uint16(payload + offset)) {
+            case Http2Setting::HeaderTableSize:
+                encoder_.SetMaxTableSize(value);
+                break;
+            case Http2Setting::MaxConcurrentStreams:
+                max_concurrent_streams_ = std::min(value, options_.max_concurrent_streams);
+                break;
+            case Http2Setting::InitialWindowSize: {
+                if (value > max_http2_window_size) {
+                    return FailSession(Http2ErrorCode::FlowControlError, "Backend sent an invalid window");
+                }
+
+                // The change applies to the windows of the open streams too.
+                std::int64_t delta = (std::int64_t)value - initial_window_size_;
+                for (const auto& stream_entry : streams_) {
+                    stream_entry.second->send_window += delta;
+                    if (stream_entry.second->send_window > max_http2_window_size) {
+                        return FailSession(Http2ErrorCode::FlowControlError, "Backend sent an invalid window");
+                    }
+                }
+                initial_window_size_ = value;
+                break;
+            }
+            case Http2Setting::MaxFrameSize:
+                if (value < default_http2_frame_size || value > max_http2_frame_size) {
+                    return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame size");
+                }
+                max_frame_size_ = value;
+                break;
+            default:
+                break;
+        }
+    }
+    WriteFrameHeader(0, (std::uint8_t)Http2FrameType::Settings, http2_ack_flag, 0);
+    has_settings_ = true;
+    SendBodies();
+    return true;
+}
+
+// The streams after the last one that the backend processes are failed as
+// retryable. The others end, and the session closes after them.
+bool Http2Session::ProcessGoaway(std::uint32_t stream_id, const char* payload, std::size_t length) {
+    if (stream_id != 0 || length < 8) {
+        return FailSession(Http2ErrorCode::ProtocolError, "Backend sent an invalid frame");
+    }
+    std::uint32_t last_stream_id = ReadHttp2Uint32(payload) & max_http2_stream_id;
+    going_away_ = true;
+    endpoint_->pool->RemoveSession(endpoint_, this);
+    std::vector<Http2Stream*> streams;
+    for (auto stream_it = streams_.upper_bound(last_stream_id); stream_it != streams_.end(); stream_it++) {
+        streams.push_back(stream_it->second);
+    }
+    for (const auto& stream : streams) {
+        if (!stream->closed) {
+            endpoint_->pool->stats_.refused_streams++;
+            FailStream(stream, "Backend went away", true);
+        }
+    }
+    return true;
+}
+
+bool Http2Session::ProcessWindowUpdate(std::uint32_t stream_id, const char* payload, std::size_t length) {
+    if (length != 4) {
+        return FailSession(Http2ErrorCode::FrameSizeError, "Backend sent an invalid frame");
+    }
+    std::uint32_t increment = ReadHttp2Uint32(payload) & max_http2_stream_id;
+    if (stream_id == 0) {
+        send_window_ += increment;
+        if (increment == 0 || send_window_ > max_http2_window_size) {
+            return FailSession(Http2ErrorCode::FlowControlError, "Backend sent an invalid window");
+        }
+    }
+    else {
+        Http2Stream* stream = FindStream(stream_id);
+        if (stream == nullptr) {
+            return true;
+        }
+        stream->send_window += increment;
+        if (increment == 0 || stream->send_window > max_http2_window_size) {
+            ResetStream(stream, Http2ErrorCode::FlowControlError, "Backend sent an invalid window");
+            return true;
+        }
+    }
+    SendBodies();
+    return true;
+}
+
+Http2Stream* Http2Session::FindStream(std::uint32_t stream_id) const {
+    auto stream_it = streams_.find(stream_id);
+    return stream_it != streams_.end() ? stream_it->second : nullptr;
+}
+
+// A response can end before its request body is sent, the rest of the body is
+// cancelled.
+void Http2Session::EndStream(Http2Stream* stream) {
+    if (std::find(sending_streams_.begin(), sending_streams_.end(), stream) != sending_streams_.end()) {
+        WriteRstStream(stream->id, Http2ErrorCode::Cancel);
+    }
+    RemoveStream(stream);
+    stream->callbacks->end(stream->data);
+}
+
+void Http2Session::FailStream(Http2Stream* stream, const char* message, bool retryable) {
+    RemoveStream(stream);
+    stream->callbacks->error(stream->data, message, retryable);
+}
+
+void Http2Session::ResetStream(Http2Stream* stream, Http2ErrorCode code, const char* message) {
+    WriteRstStream(stream->id, code);
+    FailStream(stream, message, false);
+}
+
+void Http2Session::RemoveStream(Http2Stream* stream) {
+    stream->closed = true;
+    streams_.erase(stream->id);
+    auto sending_it = std::find(sending_streams_.begin(), sending_streams_.end(), stream);
+    if (sending_it != sending_streams_.end()) {
+        sending_streams_.erase(sending_it);
+    }
+    closed_streams_.push_back(stream);
+    if (streams_.empty()) {
+        idle_since_ = uv_now(endpoint_->pool->loop_);
+    }
+}
+
+// Free the closed streams, and the session when it is closed or has gone away
+// and its last stream ended, or write the frames of the read or call.
+void Http2Session::FinishProcessing() {
+    for (const auto& stream : closed_streams_) {
+        delete stream;
+    }
+    closed_streams_.clear();
+    if (closing_) {
+        delete this;
+        return;
+    }
+    if (going_away_ && streams_.empty()) {
+        Close(Http2ErrorCode::NoError, "Backend went away");
+        return;
+    }
+    Flush();
+}
+
+Http2SessionPool::Http2SessionPool(uv_loop_t* loop, UpstreamPool* upstream_pool, const Http2SessionPoolOptions& options):
+    loop_(loop),
+    upstream_pool_(upstream_pool),
+    options_(options),
+    stats_() {
+    uv_timer_init(loop, &timer_);
+    timer_.data = this;
+}
+
+void Http2SessionPool::Start() {
+    uv_timer_start(&timer_, OnTick, options_.eviction_interval, options_.eviction_interval);
+    uv_unref((uv_handle_t*)&timer_);
+}
+
+void Http2SessionPool::Stop() {
+    uv_timer_stop(&timer_);
+}
+
+const Http2SessionPoolStats& Http2SessionPool::Stats() const {
+    return stats_;
+}
+
+Http2Endpoint* Http2SessionPool::GetEndpoint(const char* hostname, unsigned int port) {
+    std::string key = std::string(hostname) + ":" + std::to_string(port);
+    auto endpoint_it = endpoints_.find(key);
+    if (endpoint_it != endpoints_.end()) {
+        return endpoint_it->second;
+    }
+    auto endpoint = new Http2Endpoint {};
+    endpoint->pool = this;
+    endpoint->hostname = hostname;
+    endpoint->port = port;
+    endpoints_.emplace(key, endpoint);
+    return endpoint;
+}
+
+// The session with the fewest streams, so that a second session takes only
+// the streams that don't fit into the first.
+Http2Session* PickHttp2Session(const Http2Endpoint* endpoint) {
+    Http2Session* picked_session = nullptr;
+    for (const auto& session : endpoint->sessions) {
+        if (session->IsAvailable() && (picked_session == nullptr || session->StreamCount() < picked_session->StreamCount())) {
+            picked_session = session;
+        }
+    }
+    return picked_session;
+}
+
+void Http2SessionPool::Open(const char* hostname, unsigned int port, Http2Request request, const Http2StreamCallbacks* callbacks, void* data, Http2Stream*& stream) {
+    stats_.streams++;
+    auto endpoint = GetEndpoint(hostname, port);
+    stream = new Http2Stream {};
+    stream->endpoint = endpoint;
+    stream->request = std::move(request);
+    stream->callbacks = callbacks;
+    stream->data = data;
+    Http2Session* session = PickHttp2Session(endpoint);
+    if (session != nullptr && endpoint->waiting_streams.empty()) {
+        session->OpenStream(stream);
+        return;
+    }
+    stats_.queued_streams++;
+    endpoint->waiting_streams.push_back(stream);
+    Dispatch(endpoint);
+}
+
+// A stream is still allocated while its end or error callback runs, so it can
+// be cancelled from them, which does nothing.
+void Http2SessionPool::Cancel(Http2Stream* stream) {
+    if (stream->closed) {
+        return;
+    }
+    stats_.cancelled_streams++;
+    Http2Endpoint* endpoint = stream->endpoint;
+    if (stream->session == nullptr) {
+        auto& waiting_streams = endpoint->waiting_streams;
+        waiting_streams.erase(std::find(waiting_streams.begin(), waiting_streams.end(), stream));
+        delete stream;
+        return;
+    }
+    stream->session->CancelStream(stream);
+    Dispatch(endpoint);
+}
+
+void Http2SessionPool::Pause(Http2Stream* stream) {
+    stream->paused = true;
+}
+
+void Http2SessionPool::Resume(Http2Stream* stream) {
+    if (stream->session == nullptr) {
+        stream->paused = false;
+        return;
+    }
+    stream->session->ResumeStream(stream);
+}
+
+void Http2SessionPool::Dispatch(Http2Endpoint* endpoint) {
+    auto& waiting_streams = endpoint->waiting_streams;
+    while (!waiting_streams.empty()) {
+        Http2Session* session = PickHttp2Session(endpoint);
+        if (session == nullptr) {
+            break;
+        }
+        Http2Stream* stream = waiting_streams.front();
+        waiting_streams.pop_front();
+        session->OpenStream(stream);
+    }
+
+    // A connecting session takes as many of the waiting streams as it can, so
+    // another one is only connected for the rest.
+    std::size_t connecting_streams = endpoint->connecting_sessions * options_.max_concurrent_streams;
+    if (waiting_streams.size() > connecting_streams && endpoint->sessions.size() + endpoint->connecting_sessions < options_.max_sessions) {
+        endpoint->connecting_sessions++;
+        upstream_pool_->Acquire(endpoint->hostname.c_str(), endpoint->port, OnConnected, endpoint);
+    }
+}
+
+// Fail the streams that wait when no session is left to open them. A stream's
+// callback can open a stream to the same endpoint, which waits for the next
+// connect.
+void Http2SessionPool::FailWaitingStreams(Http2Endpoint* endpoint, const char* message) {
+    auto& waiting_streams = endpoint->waiting_streams;
+    std::size_t count = waiting_streams.size();
+    while (count > 0 && !waiting_streams.empty()) {
+        Http2Stream* stream = waiting_streams.front();
+        waiting_streams.pop_front();
+        count--;
+        stream->closed = true;
+        stream->callbacks->error(stream->data, message, true);
+        delete stream;
+    }
+}
+
+void Http2SessionPool::RemoveSession(Http2Endpoint* endpoint, Http2Session* session) {
+    auto& sessions = endpoint->sessions;
+    auto session_it = std::find(sessions.begin(), sessions.end(), session);
+    if (session_it != sessions.end()) {
+        sessions.erase(session_it);
+    }
+}
+
+// A TLS connection must have agreed on h2 with ALPN, a plain one speaks HTTP/2
+// with prior knowledge.
+void Http2SessionPool::OnConnected(UpstreamConnection* connection, int status, void* data) {
+    auto endpoint = static_cast<Http2Endpoint*>(data);
+    auto pool = endpoint->pool;
+    endpoint->connecting_sessions--;
+    if (connection == nullptr) {
+        pool->stats_.session_failures++;
+        if (endpoint->sessions.empty() && endpoint->connecting_sessions == 0) {
+            pool->FailWaitingStreams(endpoint, uv_strerror(status));
+        }
+        return;
+    }
+    if (connection->ssl_handle != nullptr && !HasNegotiatedHttp2(connection)) {
+        pool->stats_.session_failures++;
+        pool->upstream_pool_->Discard(connection);
+        if (endpoint->sessions.empty() && endpoint->connecting_sessions == 0) {
+            pool->FailWaitingStreams(endpoint, "Backend doesn't support HTTP/2");
+        }
+        return;
+    }
+    pool->stats_.sessions++;
+    auto session = new Http2Session(endpoint, connection, pool->options_);
+    endpoint->sessions.push_back(session);
+    session->Start();
+    pool->Dispatch(endpoint);
+}
+
+void Http2SessionPool::Evict() {
+    std::uint64_t now = uv_now(loop_);
+    std::vector<Http2Session*> idle_sessions;
+    for (const auto& endpoint_entry : endpoints_) {
+        for (const auto& session : endpoint_entry.second->sessions) {
+            if (session->StreamCount() == 0 && now - session->IdleSince() >= options_.max_idle_time) {
+                idle_sessions.push_back(session);
+            }
+        }
+    }
+    for (const auto& session : idle_sessions) {
+        stats_.evictions++;
+        session->Close(Http2ErrorCode::NoError, "Session is idle");
+    }
+}
+
+void Http2SessionPool::OnTick(uv_timer_t* timer) {
+    static_cast<Http2SessionPool*>(timer->data)->Evict();
+}
+
+}
@@ -0,0 +1,318 @@
+#ifndef FLASHPOINT_UPSTREAM_HTTP2_H
+#define FLASHPOINT_UPSTREAM_HTTP2_H
+
+#include <uv.h>
+#include <program/hpack.h>
+#include <program/upstream_pool.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace flashpoint {
+
+class Http2Session;
+class Http2SessionPool;
+struct Http2Endpoint;
+
+// The error codes of RST_STREAM and GOAWAY, see
+// https://tools.ietf.org/html/rfc7540#section-7.
+enum class Http2ErrorCode : std::uint32_t {
+    NoError = 0x0,
+    ProtocolError = 0x1,
+    InternalError = 0x2,
+    FlowControlError = 0x3,
+    SettingsTimeout = 0x4,
+    StreamClosed = 0x5,
+    FrameSizeError = 0x6,
+    RefusedStream = 0x7,
+    Cancel = 0x8,
+    CompressionError = 0x9,
+};
+
+struct Http2Header {
+    // The lowercase name, pseudo-headers start with a colon.
+    std::string name;
+    std::string value;
+    HpackIndexing indexing;
+};
+
+// A request of a stream. Its headers are encoded when the stream is opened on
+// a session, since the dynamic table is the session's.
+struct Http2Request {
+    std::vector<Http2Header> headers;
+    std::string body;
+};
+
+// The callbacks of a stream. None of them is called after the stream ended or
+// failed, or after it was cancelled, and the stream is freed after end and
+// error return.
+struct Http2StreamCallbacks {
+    // The final response head arrived, informational heads are skipped.
+    void (*head)(void* data, unsigned int status);
+
+    // A part of the response body arrived.
+    void (*body)(void* data, const char* text, std::size_t size);
+    void (*end)(void* data);
+
+    // @param message the reason.
+    // @param retryable whether the backend didn't process the request, e.g.
+    // it refused the stream or went away before it, so it can be sent again.
+    void (*error)(void* data, const char* message, bool retryable);
+};
+
+// A request and its response on a session, or a request that waits for a
+// session with room for it.
+struct Http2Stream {
+    Http2Endpoint* endpoint;
+
+    // The session, nullptr while the stream waits.
+    Http2Session* session;
+    std::uint32_t id;
+    Http2Request request;
+
+    // The size of the body that has been sent.
+    std::size_t body_sent;
+    const Http2StreamCallbacks* callbacks;
+    void* data;
+
+    // The bytes that may be sent, and received, on the stream.
+    std::int64_t send_window;
+    std::int64_t receive_window;
+
+    // Received bytes that have not been given back to the backend with a
+    // WINDOW_UPDATE.
+    std::size_t unacknowledged_size;
+
+    // A paused stream gives nothing back, so the backend stops once the
+    // stream's window is used.
+    bool paused;
+    bool has_head;
+    bool closed;
+};
+
+struct Http2SessionPoolOptions {
+    // Sessions per endpoint. A stream waits when all of them are full.
+    std::size_t max_sessions;
+
+    // Streams per session, when the backend allows more.
+    std::uint32_t max_concurrent_streams;
+
+    // Our SETTINGS_INITIAL_WINDOW_SIZE, the bytes of a response that the
+    // backend sends before the stream gives them back.
+    std::uint32_t stream_window_size;
+
+    // The window of a session, which all of its streams share.
+    std::uint32_t session_window_size;
+
+    // Sessions without streams are closed after this many milliseconds.
+    std::uint64_t max_idle_time;
+
+    // Milliseconds between the checks of idle time.
+    std::uint64_t eviction_interval;
+};
+
+const Http2SessionPoolOptions default_http2_session_pool_options = { 2, 100, 1024 * 256, 1024 * 1024 * 16, 30000, 1000 };
+
+struct Http2SessionPoolStats {
+    std::size_t sessions;
+    std::size_t session_failures;
+    std::size_t streams;
+
+    // Streams that waited for a session with room for them.
+    std::size_t queued_streams;
+
+    // Streams that the backend refused or went away before.
+    std::size_t refused_streams;
+    std::size_t cancelled_streams;
+    std::size_t evictions;
+};
+
+// The sessions and waiting streams of one backend endpoint.
+struct Http2Endpoint {
+    Http2SessionPool* pool;
+    std::string hostname;
+    unsigned int port;
+    std::vector<Http2Session*> sessions;
+    std::deque<Http2Stream*> waiting_streams;
+    std::size_t connecting_sessions;
+};
+
+// An HTTP/2 connection to a backend, see https://tools.ietf.org/html/rfc7540.
+// It runs on a connection of the upstream pool, which connects it and does its
+// TLS handshake, and keeps the connection until it is closed.
+//
+// A stream's callback can cancel any stream or open new ones, so closed
+// streams are freed once a read has been processed, and the frames of a read
+// are written at its end.
+class Http2Session {
+public:
+    Http2Session(Http2Endpoint* endpoint, UpstreamConnection* connection, const Http2SessionPoolOptions& options);
+
+    // Send the connection preface and start reading.
+    void Start();
+
+    // Whether a new stream can be opened, i.e. the session isn't going away
+    // and has fewer streams than the backend allows.
+    bool IsAvailable() const;
+
+    std::size_t StreamCount() const;
+
+    // uv_now when the last stream ended.
+    std::uint64_t IdleSince() const;
+
+    // Open a stream, and send its request as far as the windows allow.
+    void OpenStream(Http2Stream* stream);
+
+    // Reset a stream. Its callbacks aren't called anymore.
+    void CancelStream(Http2Stream* stream);
+
+    // Give the received bytes of a paused stream back to the backend.
+    void ResumeStream(Http2Stream* stream);
+
+    // Fail the streams and close the connection.
+    // @param code the code of the GOAWAY that is sent.
+    // @param message the reason that the streams fail with.
+    void Close(Http2ErrorCode code, const char* message);
+
+private:
+    Http2Endpoint* endpoint_;
+    UpstreamConnection* connection_;
+    Http2SessionPoolOptions options_;
+    HpackEncoder encoder_;
+    HpackDecoder decoder_;
+    std::map<std::uint32_t, Http2Stream*> streams_;
+
+    // Streams whose body waits for window.
+    std::vector<Http2Stream*> sending_streams_;
+
+    // Closed streams that are freed once the read is processed.
+    std::vector<Http2Stream*> closed_streams_;
+    std::uint32_t next_stream_id_;
+
+    // Received bytes of an incomplete frame, and frames that are written at
+    // the end of a read or a call.
+    std::string input_;
+    std::string output_;
+
+    // The header block that is continued with CONTINUATION frames, of a
+    // stream that is 0 when there is none.
+    std::string header_block_;
+    std::uint32_t header_stream_id_;
+    bool header_end_stream_;
+
+    // The backend's settings.
+    bool has_settings_;
+    std::uint32_t max_concurrent_streams_;
+    std::uint32_t max_frame_size_;
+    std::int64_t initial_window_size_;
+
+    // The bytes that may be sent and received on the connection.
+    std::int64_t send_window_;
+    std::int64_t receive_window_;
+    std::size_t unacknowledged_size_;
+    std::uint64_t idle_since_;
+    bool processing_;
+    bool going_away_;
+    bool closing_;
+
+    void WriteFrameHeader(std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id);
+    void WriteWindowUpdate(std::uint32_t stream_id, std::size_t increment);
+    void WriteRstStream(std::uint32_t stream_id, Http2ErrorCode code);
+    void SendBodies();
+    void Flush();
+
+    // Process bytes that were read from the connection, through the TLS
+    // session when it has one.
+    void Read(const char* text, std::size_t size);
+    void Feed(const char* text, std::size_t size);
+    std::size_t ProcessFrames(const char* text, std::size_t size);
+
+    // Close the session on a connection error.
+    // @return false, to stop processing.
+    bool FailSession(Http2ErrorCode code, const char* message);
+    bool ProcessFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length);
+    bool ProcessData(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length);
+    bool ProcessHeaders(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length);
+    bool ProcessHeaderBlock();
+    bool ProcessSettings(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length);
+    bool ProcessGoaway(std::uint32_t stream_id, const char* payload, std::size_t length);
+    bool ProcessWindowUpdate(std::uint32_t stream_id, const char* payload, std::size_t length);
+
+    Http2Stream* FindStream(std::uint32_t stream_id) const;
+    void EndStream(Http2Stream* stream);
+    void FailStream(Http2Stream* stream, const char* message, bool retryable);
+    void ResetStream(Http2Stream* stream, Http2ErrorCode code, const char* message);
+    void RemoveStream(Http2Stream* stream);
+    void FinishProcessing();
+
+    static void OnRead(uv_stream_t* stream, ssize_t length, const uv_buf_t* buf);
+};
+
+// Multiplexes the requests to backends that speak HTTP/2 over a few sessions
+// per endpoint. Concurrent requests share a connection instead of each holding
+// one, and the HPACK tables of a session make the repeated headers of its
+// requests a few bytes.
+//
+// A response is read only as fast as its stream gives its window back, so a
+// paused stream holds back its own response and not the session's others.
+class Http2SessionPool {
+public:
+    Http2SessionPool(uv_loop_t* loop, UpstreamPool* upstream_pool, const Http2SessionPoolOptions& options = default_http2_session_pool_options);
+
+    // Start the eviction timer. The timer doesn't keep the loop alive.
+    void Start();
+
+    void Stop();
+
+    // Open a stream to an endpoint, on the session with the fewest streams,
+    // or wait for one. The stream is set before the endpoint is connected,
+    // since a connect can fail before Open returns.
+    // @param hostname the hostname of the endpoint.
+    // @param port the port of the endpoint.
+    // @param request the request.
+    // @param callbacks the callbacks of the stream.
+    // @param data passed to the callbacks.
+    // @param stream set to the stream.
+    void Open(const char* hostname, unsigned int port, Http2Request request, const Http2StreamCallbacks* callbacks, void* data, Http2Stream*& stream);
+
+    // Cancel a stream. A stream that has ended or failed is only cancelled
+    // from its own callbacks, which does nothing.
+    void Cancel(Http2Stream* stream);
+
+    // Stop giving the window of a stream back, e.g. while its merges are
+    // paused.
+    void Pause(Http2Stream* stream);
+
+    void Resume(Http2Stream* stream);
+
+    const Http2SessionPoolStats& Stats() const;
+
+private:
+    friend class Http2Session;
+
+    uv_loop_t* loop_;
+    UpstreamPool* upstream_pool_;
+    Http2SessionPoolOptions options_;
+    Http2SessionPoolStats stats_;
+    uv_timer_t timer_;
+    std::map<std::string, Http2Endpoint*> endpoints_;
+
+    Http2Endpoint* GetEndpoint(const char* hostname, unsigned int port);
+
+    // Open waiting streams on the sessions with room for them, and connect a
+    // session when they don't have room.
+    void Dispatch(Http2Endpoint* endpoint);
+    void FailWaitingStreams(Http2Endpoint* endpoint, const char* message);
+    void RemoveSession(Http2Endpoint* endpoint, Http2Session* session);
+    void Evict();
+
+    static void OnConnected(UpstreamConnection* connection, int status, void* data);
+    static void OnTick(uv_timer_t* timer);
+};
+
+}
+
+#endif //FLASHPOINT_UPSTREAM_HTTP2_H
@@ -0,0 +1,66 @@
+#include <program/upstream_latency.h>
+#include <algorithm>
+#include <cmath>
+
+namespace flashpoint {
+
+std::size_t LatencyHistogram::BucketOf(std::uint64_t latency) {
+    auto bucket = static_cast<std::size_t>(4 * std::log2(static_cast<double>(latency) + 1));
+    return std::min(bucket, bucket_count - 1);
+}
+
+std::uint64_t LatencyHistogram::BucketLimit(std::size_t bucket) {
+    return static_cast<std::uint64_t>(std::ceil(std::exp2((bucket + 1) / 4.0) - 1));
+}
+
+void LatencyHistogram::Record(std::uint64_t latency) {
+    buckets_[BucketOf(latency)]++;
+    if (++count_ < sample_size) {
+        return;
+    }
+    count_ = 0;
+    for (auto& bucket : buckets_) {
+        bucket >>= 1;
+        count_ += bucket;
+    }
+}
+
+std::uint64_t LatencyHistogram::Percentile(double percentile) const {
+    auto rank = static_cast<std::size_t>(std::ceil(percentile * count_));
+    std::size_t count = 0;
+    for (std::size_t bucket = 0; bucket < bucket_count; bucket++) {
+        count += buckets_[bucket];
+        if (count >= rank && count > 0) {
+            return BucketLimit(bucket);
+        }
+    }
+    return BucketLimit(bucket_count - 1);
+}
+
+std::size_t LatencyHistogram::Count() const {
+    return count_;
+}
+
+RetryBudget::RetryBudget(const RetryBudgetOptions& options):
+    options_(options),
+    balance_(options.max_balance),
+    refilled_at_(0) { }
+
+void RetryBudget::Deposit() {
+    balance_ = std::min(balance_ + options_.ratio, options_.max_balance);
+}
+
+bool RetryBudget::Withdraw(std::uint64_t now) {
+    if (now > refilled_at_) {
+        double refill = options_.min_per_second * static_cast<double>(now - refilled_at_) / 1000;
+        balance_ = std::min(balance_ + refill, options_.max_balance);
+        refilled_at_ = now;
+    }
+    if (balance_ < 1) {
+        return false;
+    }
+    balance_--;
+    return true;
+}
+
+}
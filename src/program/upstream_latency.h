@@ -0,0 +1,92 @@
+#ifndef FLASHPOINT_UPSTREAM_LATENCY_H
+#define FLASHPOINT_UPSTREAM_LATENCY_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace flashpoint {
+
+// Latencies in milliseconds, in buckets that grow by a quarter power of two,
+// i.e. up to 19% wide, up to a minute. The counts are halved after a sample, so
+// that percentiles follow the recent latencies.
+class LatencyHistogram {
+public:
+    void Record(std::uint64_t latency);
+
+    // Get the latency that a share of the recorded latencies are below, i.e.
+    // the upper bound of its bucket.
+    // @param percentile the share, e.g. 0.95.
+    std::uint64_t Percentile(double percentile) const;
+
+    // The recorded latencies since the counts were last halved, and half of
+    // the ones before.
+    std::size_t Count() const;
+
+private:
+    static const std::size_t bucket_count = 64;
+    static const std::size_t sample_size = 1024;
+
+    std::uint32_t buckets_[bucket_count] = {};
+    std::size_t count_ = 0;
+
+    static std::size_t BucketOf(std::uint64_t latency);
+    static std::uint64_t BucketLimit(std::size_t bucket);
+};
+
+struct RetryBudgetOptions {
+    // Retries that every request adds to the budget, e.g. 0.1 for 10%.
+    double ratio;
+
+    // Retries that are added per second regardless of the requests, so that
+    // an endpoint with little traffic can retry too.
+    double min_per_second;
+
+    // The most retries that can be saved up.
+    double max_balance;
+};
+
+const RetryBudgetOptions default_retry_budget_options = { 0.1, 1, 10 };
+
+// Limits retries, e.g. hedged requests, to a share of the requests, so that
+// retries don't multiply the load on a backend that is slow already.
+class RetryBudget {
+public:
+    RetryBudget(const RetryBudgetOptions& options = default_retry_budget_options);
+
+    // Add a request's share of retries.
+    void Deposit();
+
+    // Take a retry from the budget.
+    // @param now uv_now.
+    // @return false when the budget is spent.
+    bool Withdraw(std::uint64_t now);
+
+private:
+    RetryBudgetOptions options_;
+    double balance_;
+    std::uint64_t refilled_at_;
+};
+
+// The load and the recent results of a replica, for balancing and outlier
+// ejection.
+struct ReplicaHealth {
+    // Requests that have been sent and have not ended.
+    std::size_t outstanding_requests;
+
+    // uv_now when the current window of results started, and its results.
+    std::uint64_t window_start;
+    std::size_t window_requests;
+    std::size_t window_failures;
+    std::uint64_t window_latency;
+
+    // An ejected replica gets no requests until it is probed after
+    // ejected_until. The ejection time grows with every ejection in a row.
+    bool ejected;
+    bool probing;
+    std::uint64_t ejected_until;
+    std::size_t ejections;
+};
+
+}
+
+#endif //FLASHPOINT_UPSTREAM_LATENCY_H
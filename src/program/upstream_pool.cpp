@@ -0,0 +1,410 @@
+#include <program/upstream_pool.h>
+#include <cstring>
+
+namespace flashpoint {
+
+double UpstreamPoolStats::ReuseRatio() const {
+    if (acquires == 0) {
+        return 0;
+    }
+    return static_cast<double>(reuses) / acquires;
+}
+
+double UpstreamPoolStats::AverageConnectLatency() const {
+    if (connects == 0) {
+        return 0;
+    }
+    return static_cast<double>(connect_time) / connects / 1000;
+}
+
+// Idle connections only read to find out whether the backend closed them, so
+// the bytes are never used.
+void AllocateIdleBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    thread_local char buffer[64];
+    buf->base = buffer;
+    buf->len = sizeof(buffer);
+}
+
+// Handshake bytes are copied into the connection's TLS session right away.
+void AllocateHandshakeBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    thread_local char buffer[16384];
+    buf->base = buffer;
+    buf->len = sizeof(buffer);
+}
+
+UpstreamPool::UpstreamPool(uv_loop_t* loop, DnsCache* dns_cache, const UpstreamPoolOptions& options):
+    loop_(loop),
+    dns_cache_(dns_cache),
+    options_(options),
+    stats_() {
+    uv_timer_init(loop, &timer_);
+    timer_.data = this;
+}
+
+void UpstreamPool::Start() {
+    uv_timer_start(&timer_, OnTick, options_.eviction_interval, options_.eviction_interval);
+    uv_unref((uv_handle_t*)&timer_);
+}
+
+void UpstreamPool::Stop() {
+    uv_timer_stop(&timer_);
+}
+
+const UpstreamPoolStats& UpstreamPool::Stats() const {
+    return stats_;
+}
+
+UpstreamEndpointPool* UpstreamPool::GetEndpoint(const char* hostname, unsigned int port) {
+    std::string key = std::string(hostname) + ":" + std::to_string(port);
+    auto endpoint_it = endpoints_.find(key);
+    if (endpoint_it != endpoints_.end()) {
+        return endpoint_it->second;
+    }
+    auto endpoint = new UpstreamEndpointPool {};
+    endpoint->pool = this;
+    endpoint->hostname = hostname;
+    endpoint->port = port;
+    endpoints_.emplace(key, endpoint);
+    return endpoint;
+}
+
+void UpstreamPool::ConfigureTls(const char* hostname, unsigned int port, std::shared_ptr<const UpstreamTls> tls) {
+    auto endpoint = GetEndpoint(hostname, port);
+    if (IsSameUpstreamTls(endpoint->tls.get(), tls.get())) {
+        return;
+    }
+    endpoint->tls = std::move(tls);
+    if (endpoint->ssl_session != nullptr) {
+        SSL_SESSION_free(endpoint->ssl_session);
+        endpoint->ssl_session = nullptr;
+    }
+    for (const auto& connection : endpoint->idle_connections) {
+        uv_read_stop((uv_stream_t*)&connection->tcp_handle);
+        CloseConnection(connection);
+    }
+    endpoint->idle_connections.clear();
+}
+
+void UpstreamPool::SetMultiplexed(const char* hostname, unsigned int port, bool multiplexed) {
+    GetEndpoint(hostname, port)->multiplexed = multiplexed;
+}
+
+UpstreamEndpointPool* UpstreamPool::Endpoint(const char* hostname, unsigned int port) {
+    return GetEndpoint(hostname, port);
+}
+
+void UpstreamPool::Acquire(const char* hostname, unsigned int port, UpstreamAcquireCallback callback, void* data) {
+    stats_.acquires++;
+    auto endpoint = GetEndpoint(hostname, port);
+    auto connection = TakeIdleConnection(endpoint);
+    if (connection != nullptr) {
+        stats_.reuses++;
+        connection->state = UpstreamConnectionState::Busy;
+        connection->requests++;
+        callback(connection, 0, data);
+        return;
+    }
+    Connect(endpoint, callback, data);
+}
+
+void UpstreamPool::Release(UpstreamConnection* connection) {
+    if (connection->state != UpstreamConnectionState::Busy) {
+        return;
+    }
+    uv_read_stop((uv_stream_t*)&connection->tcp_handle);
+    AddIdleConnection(connection);
+}
+
+void UpstreamPool::Discard(UpstreamConnection* connection) {
+    stats_.discards++;
+    CloseConnection(connection);
+}
+
+UpstreamConnection* UpstreamPool::TakeIdleConnection(UpstreamEndpointPool* endpoint) {
+    std::uint64_t now = uv_now(loop_);
+    while (!endpoint->idle_connections.empty()) {
+        auto connection = endpoint->idle_connections.back();
+        endpoint->idle_connections.pop_back();
+        uv_read_stop((uv_stream_t*)&connection->tcp_handle);
+        if (now - connection->idle_since >= options_.max_idle_time) {
+            stats_.evictions++;
+            CloseConnection(connection);
+            continue;
+        }
+        connection->data = nullptr;
+        return connection;
+    }
+    return nullptr;
+}
+
+void UpstreamPool::Connect(UpstreamEndpointPool* endpoint, UpstreamAcquireCallback callback, void* data) {
+    auto connection = new UpstreamConnection {};
+    connection->endpoint = endpoint;
+    connection->state = UpstreamConnectionState::Resolving;
+    connection->connect_start = uv_hrtime();
+    connection->acquire_callback = callback;
+    connection->data = data;
+    endpoint->connecting_connections++;
+    dns_cache_->Resolve(endpoint->hostname.c_str(), endpoint->port, OnResolved, connection);
+}
+
+void UpstreamPool::FailConnect(UpstreamConnection* connection, int status) {
+    stats_.connect_failures++;
+    connection->endpoint->connecting_connections--;
+    auto callback = connection->acquire_callback;
+    auto data = connection->data;
+    connection->acquire_callback = nullptr;
+    connection->data = nullptr;
+    if (connection->state == UpstreamConnectionState::Resolving) {
+        delete connection;
+    }
+    else {
+        CloseConnection(connection);
+    }
+    if (callback != nullptr) {
+        callback(nullptr, status, data);
+    }
+}
+
+void UpstreamPool::OnResolved(const std::vector<sockaddr_storage>& addresses, int status, void* data) {
+    auto connection = static_cast<UpstreamConnection*>(data);
+    auto pool = connection->endpoint->pool;
+    if (status < 0) {
+        pool->FailConnect(connection, status);
+        return;
+    }
+    connection->addresses = addresses;
+    uv_timer_init(pool->loop_, &connection->connect_timer);
+    connection->connect_timer.data = connection;
+    pool->ConnectAddress(connection);
+}
+
+// Connect to the connection's current address. Every address gets the whole
+// connect timeout.
+void UpstreamPool::ConnectAddress(UpstreamConnection* connection) {
+    uv_tcp_init(loop_, &connection->tcp_handle);
+    connection->tcp_handle.data = connection;
+    connection->connect_request.data = connection;
+    connection->state = UpstreamConnectionState::Connecting;
+    uv_tcp_nodelay(&connection->tcp_handle, 1);
+    uv_tcp_keepalive(&connection->tcp_handle, 1, 60);
+    uv_timer_start(&connection->connect_timer, OnConnectTimeout, options_.connect_timeout, 0);
+    auto address = reinterpret_cast<const sockaddr*>(&connection->addresses[connection->address_index]);
+    int r = uv_tcp_connect(&connection->connect_request, &connection->tcp_handle, address, OnConnect);
+    if (r) {
+        ConnectNextAddress(connection, r);
+    }
+}
+
+// Connect to the next address after a connect failed, e.g. to the IPv4 address
+// of a hostname whose IPv6 address isn't reachable. The connect fails once the
+// last address failed.
+void UpstreamPool::ConnectNextAddress(UpstreamConnection* connection, int status) {
+    if (connection->address_index + 1 >= connection->addresses.size()) {
+        FailConnect(connection, status);
+        return;
+    }
+    stats_.address_fallbacks++;
+    connection->address_index++;
+    uv_timer_stop(&connection->connect_timer);
+    uv_close((uv_handle_t*)&connection->tcp_handle, OnFallbackClose);
+}
+
+void UpstreamPool::OnFallbackClose(uv_handle_t* handle) {
+    auto connection = static_cast<UpstreamConnection*>(handle->data);
+    connection->endpoint->pool->ConnectAddress(connection);
+}
+
+void UpstreamPool::OnConnect(uv_connect_t* request, int status) {
+    auto connection = static_cast<UpstreamConnection*>(request->data);
+    auto endpoint = connection->endpoint;
+    auto pool = endpoint->pool;
+
+    // The handle was closed, after the connect timed out.
+    if (status == UV_ECANCELED) {
+        return;
+    }
+    if (status < 0) {
+        pool->ConnectNextAddress(connection, status);
+        return;
+    }
+    if (endpoint->tls == nullptr) {
+        pool->FinishConnect(connection);
+        return;
+    }
+    connection->state = UpstreamConnectionState::Handshaking;
+    StartUpstreamTls(connection);
+    uv_read_start((uv_stream_t*)&connection->tcp_handle, AllocateHandshakeBuffer, OnHandshakeRead);
+    pool->Handshake(connection);
+}
+
+// A connect that times out moves on to the next address, a handshake fails.
+void UpstreamPool::OnConnectTimeout(uv_timer_t* timer) {
+    auto connection = static_cast<UpstreamConnection*>(timer->data);
+    auto pool = connection->endpoint->pool;
+    if (connection->state == UpstreamConnectionState::Connecting) {
+        pool->ConnectNextAddress(connection, UV_ETIMEDOUT);
+        return;
+    }
+    pool->FailConnect(connection, UV_ETIMEDOUT);
+}
+
+void UpstreamPool::Handshake(UpstreamConnection* connection) {
+    switch (ContinueUpstreamHandshake(connection)) {
+        case UpstreamTlsStatus::Done:
+            uv_read_stop((uv_stream_t*)&connection->tcp_handle);
+            stats_.tls_handshakes++;
+            if (SSL_session_reused(connection->ssl_handle)) {
+                stats_.tls_resumptions++;
+            }
+            FinishConnect(connection);
+            break;
+        case UpstreamTlsStatus::WantRead:
+            break;
+        default:
+            FailConnect(connection, UV_EPROTO);
+            break;
+    }
+}
+
+void UpstreamPool::OnHandshakeRead(uv_stream_t* stream, ssize_t length, const uv_buf_t* buf) {
+    if (length == 0) {
+        return;
+    }
+    auto connection = static_cast<UpstreamConnection*>(stream->data);
+    auto pool = connection->endpoint->pool;
+    if (length < 0) {
+        pool->FailConnect(connection, length == UV_EOF ? UV_ECONNRESET : (int)length);
+        return;
+    }
+    ReceiveUpstreamTls(connection, buf->base, (std::size_t)length);
+    pool->Handshake(connection);
+}
+
+// The connection is connected, and its handshake is done when it has TLS.
+void UpstreamPool::FinishConnect(UpstreamConnection* connection) {
+    auto endpoint = connection->endpoint;
+    endpoint->connecting_connections--;
+    uv_timer_stop(&connection->connect_timer);
+    std::uint64_t connect_time = uv_hrtime() - connection->connect_start;
+    stats_.connects++;
+    stats_.connect_time += connect_time;
+    if (connect_time > stats_.max_connect_time) {
+        stats_.max_connect_time = connect_time;
+    }
+    auto callback = connection->acquire_callback;
+    if (callback == nullptr) {
+        AddIdleConnection(connection);
+        return;
+    }
+    auto data = connection->data;
+    connection->acquire_callback = nullptr;
+    connection->state = UpstreamConnectionState::Busy;
+    connection->requests = 1;
+    callback(connection, 0, data);
+}
+
+
+void UpstreamPool::AddIdleConnection(UpstreamConnection* connection) {
+    auto endpoint = connection->endpoint;
+
+    // The endpoint's TLS may have changed while the connection was busy.
+    bool has_other_tls = connection->ssl_handle == nullptr ?
+        endpoint->tls != nullptr :
+        endpoint->tls == nullptr || SSL_get_SSL_CTX(connection->ssl_handle) != endpoint->tls->ssl_ctx;
+    if (has_other_tls || endpoint->multiplexed || endpoint->idle_connections.size() >= options_.max_idle_connections) {
+        CloseConnection(connection);
+        return;
+    }
+    connection->state = UpstreamConnectionState::Idle;
+    connection->idle_since = uv_now(loop_);
+    connection->data = nullptr;
+    endpoint->idle_connections.push_back(connection);
+    uv_read_start((uv_stream_t*)&connection->tcp_handle, AllocateIdleBuffer, OnIdleRead);
+}
+
+void UpstreamPool::RemoveIdleConnection(UpstreamConnection* connection) {
+    auto& idle_connections = connection->endpoint->idle_connections;
+    for (auto it = idle_connections.begin(); it != idle_connections.end(); it++) {
+        if (*it == connection) {
+            idle_connections.erase(it);
+            return;
+        }
+    }
+}
+
+// An idle connection must not get anything from the backend. Both EOF and
+// unexpected bytes, e.g. the rest of a response that was not read to its
+// end, make the connection unusable. On a TLS connection only plaintext does,
+// records without it, e.g. a session ticket, are fine.
+void UpstreamPool::OnIdleRead(uv_stream_t* stream, ssize_t length, const uv_buf_t* buf) {
+    if (length == 0) {
+        return;
+    }
+    auto connection = static_cast<UpstreamConnection*>(stream->data);
+    auto pool = connection->endpoint->pool;
+    if (length > 0 && connection->ssl_handle != nullptr) {
+        ReceiveUpstreamTls(connection, buf->base, (std::size_t)length);
+        char plaintext[1];
+        std::size_t plaintext_size;
+        if (ReadUpstreamTls(connection, plaintext, sizeof(plaintext), plaintext_size) == UpstreamTlsStatus::WantRead) {
+            return;
+        }
+    }
+    pool->stats_.health_check_failures++;
+    pool->RemoveIdleConnection(connection);
+    pool->CloseConnection(connection);
+}
+
+void UpstreamPool::CloseConnection(UpstreamConnection* connection) {
+    if (connection->state == UpstreamConnectionState::Closing) {
+        return;
+    }
+    connection->state = UpstreamConnectionState::Closing;
+    uv_timer_stop(&connection->connect_timer);
+    uv_close((uv_handle_t*)&connection->tcp_handle, OnClose);
+}
+
+// The connection is freed once its connect timer is closed too.
+void UpstreamPool::OnClose(uv_handle_t* handle) {
+    auto connection = static_cast<UpstreamConnection*>(handle->data);
+    if (connection->ssl_handle != nullptr) {
+        // A session that is freed without a shutdown can't be resumed, the
+        // connection is closed without close_notify but its session is fine.
+        SSL_set_shutdown(connection->ssl_handle, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        SSL_free(connection->ssl_handle);
+        connection->ssl_handle = nullptr;
+    }
+    uv_close((uv_handle_t*)&connection->connect_timer, OnTimerClose);
+}
+
+void UpstreamPool::OnTimerClose(uv_handle_t* handle) {
+    delete static_cast<UpstreamConnection*>(handle->data);
+}
+
+// Close the connections that have been idle for too long, which are at the
+// front, and open connections up to the minimum of idle connections.
+void UpstreamPool::Evict() {
+    std::uint64_t now = uv_now(loop_);
+    for (const auto& endpoint_entry : endpoints_) {
+        auto endpoint = endpoint_entry.second;
+        auto& idle_connections = endpoint->idle_connections;
+        std::size_t expired = 0;
+        while (expired < idle_connections.size() && now - idle_connections[expired]->idle_since >= options_.max_idle_time) {
+            stats_.evictions++;
+            uv_read_stop((uv_stream_t*)&idle_connections[expired]->tcp_handle);
+            CloseConnection(idle_connections[expired]);
+            expired++;
+        }
+        idle_connections.erase(idle_connections.begin(), idle_connections.begin() + expired);
+        while (!endpoint->multiplexed && idle_connections.size() + endpoint->connecting_connections < options_.min_idle_connections) {
+            Connect(endpoint, nullptr, nullptr);
+        }
+    }
+}
+
+void UpstreamPool::OnTick(uv_timer_t* timer) {
+    static_cast<UpstreamPool*>(timer->data)->Evict();
+}
+
+}
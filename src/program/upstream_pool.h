@@ -0,0 +1,223 @@
+#ifndef FLASHPOINT_UPSTREAM_POOL_H
+#define FLASHPOINT_UPSTREAM_POOL_H
+
+#include <uv.h>
+#include <program/dns_cache.h>
+#include <program/upstream_latency.h>
+#include <program/upstream_tls.h>
+#include <openssl/ssl.h>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace flashpoint {
+
+class UpstreamPool;
+struct UpstreamEndpointPool;
+
+enum class UpstreamConnectionState {
+    Resolving,
+    Connecting,
+    Handshaking,
+    Idle,
+    Busy,
+    Closing,
+};
+
+struct UpstreamConnection;
+
+// Called with an open connection and status 0, or with nullptr and a libuv
+// error. It is called before Acquire returns when an idle connection is reused.
+typedef void (*UpstreamAcquireCallback)(UpstreamConnection* connection, int status, void* data);
+
+// A keep-alive connection to a backend. The handle's data points to the
+// connection, a request that holds the connection uses the connection's data.
+struct UpstreamConnection {
+    uv_tcp_t tcp_handle;
+    uv_connect_t connect_request;
+
+    // Fails the connect when it, or its TLS handshake, takes too long.
+    uv_timer_t connect_timer;
+
+    // The resolved addresses of the endpoint, and the one that is connected.
+    // A connect that fails moves on to the next address.
+    std::vector<sockaddr_storage> addresses;
+    std::size_t address_index;
+    UpstreamEndpointPool* endpoint;
+    UpstreamConnectionState state;
+
+    // The TLS session, nullptr on a plain connection. Its BIOs are memory
+    // BIOs, the handle's bytes are passed through them.
+    SSL* ssl_handle;
+
+    // uv_hrtime when the connect started, for the connect latency.
+    std::uint64_t connect_start;
+
+    // uv_now when the connection was released.
+    std::uint64_t idle_since;
+    std::size_t requests;
+
+    // The request that waits for the connection to be connected. A connection
+    // that is opened to keep the minimum of idle connections has no callback.
+    UpstreamAcquireCallback acquire_callback;
+    void* data;
+};
+
+struct UpstreamPoolOptions {
+    // Idle connections that are kept open to every endpoint that has been used.
+    std::size_t min_idle_connections;
+
+    // Idle connections above this are closed when they are released.
+    std::size_t max_idle_connections;
+
+    // Idle connections are closed after this many milliseconds.
+    std::uint64_t max_idle_time;
+
+    // Milliseconds between the checks of idle time and minimum idle connections.
+    std::uint64_t eviction_interval;
+
+    // Milliseconds that a connect and its TLS handshake may take, before the
+    // connect fails with UV_ETIMEDOUT.
+    std::uint64_t connect_timeout;
+};
+
+const UpstreamPoolOptions default_upstream_pool_options = { 1, 16, 30000, 1000, 5000 };
+
+struct UpstreamPoolStats {
+    std::size_t acquires;
+    std::size_t reuses;
+    std::size_t connects;
+    std::size_t connect_failures;
+
+    // Connects that moved on to the next address of an endpoint.
+    std::size_t address_fallbacks;
+
+    // Total and maximum connect latency in nanoseconds, including resolving.
+    std::uint64_t connect_time;
+    std::uint64_t max_connect_time;
+
+    std::size_t evictions;
+    std::size_t health_check_failures;
+    std::size_t discards;
+
+    // TLS handshakes, and the ones that resumed a session.
+    std::size_t tls_handshakes;
+    std::size_t tls_resumptions;
+
+    // Share of acquires that reused an idle connection.
+    double ReuseRatio() const;
+
+    // Average connect latency in microseconds.
+    double AverageConnectLatency() const;
+};
+
+// The connections to one backend endpoint, keyed by hostname and port.
+struct UpstreamEndpointPool {
+    UpstreamPool* pool;
+    std::string hostname;
+    unsigned int port;
+
+    // Idle connections, the most recently released last. Connections are
+    // reused from the back, so that the front ones get idle and are evicted.
+    std::vector<UpstreamConnection*> idle_connections;
+    std::size_t connecting_connections;
+
+    // The time to the response heads of the endpoint, and its budget of
+    // hedged requests.
+    LatencyHistogram latency;
+    RetryBudget retry_budget;
+    ReplicaHealth health;
+
+    // The TLS of the endpoint's connections, nullptr for plain connections,
+    // and the last session that the endpoint gave, to resume.
+    std::shared_ptr<const UpstreamTls> tls;
+    SSL_SESSION* ssl_session;
+
+    // Whether the endpoint's connections carry HTTP/2 sessions. The sessions
+    // keep their connections, so none are kept idle, a backend would send its
+    // settings to an idle one.
+    bool multiplexed;
+};
+
+// Keep-alive connections to the backends of a loop. Idle connections are read
+// while they are idle, a connection that gets data or EOF from the backend is
+// closed, so a reused connection is never one that the backend has closed.
+//
+// A TLS connection is acquired once its handshake is done, so the handshake is
+// paid once per pooled connection, and it resumes the endpoint's last session
+// when it can.
+class UpstreamPool {
+public:
+    UpstreamPool(uv_loop_t* loop, DnsCache* dns_cache, const UpstreamPoolOptions& options = default_upstream_pool_options);
+
+    // Start the eviction timer. The timer doesn't keep the loop alive.
+    void Start();
+
+    void Stop();
+
+    // Get an idle connection to an endpoint, or connect a new one.
+    // @param hostname the hostname of the endpoint.
+    // @param port the port of the endpoint.
+    // @param callback called with the connection.
+    // @param data passed to the callback.
+    void Acquire(const char* hostname, unsigned int port, UpstreamAcquireCallback callback, void* data);
+
+    // Return a connection that has read a complete response, so that it can be
+    // reused. The holder must not read from the connection after this.
+    void Release(UpstreamConnection* connection);
+
+    // Close a connection that can't be reused, e.g. after an error or a
+    // response that is not read to its end.
+    void Discard(UpstreamConnection* connection);
+
+    // Set the TLS of an endpoint's connections. Idle connections with a
+    // different TLS are closed, the sessions of the same TLS are kept.
+    // @param tls the TLS, or nullptr for plain connections.
+    void ConfigureTls(const char* hostname, unsigned int port, std::shared_ptr<const UpstreamTls> tls);
+
+    // Set whether an endpoint's connections carry HTTP/2 sessions.
+    void SetMultiplexed(const char* hostname, unsigned int port, bool multiplexed);
+
+    // Get the pool of an endpoint, e.g. to record its latency.
+    UpstreamEndpointPool* Endpoint(const char* hostname, unsigned int port);
+
+    const UpstreamPoolStats& Stats() const;
+
+private:
+    uv_loop_t* loop_;
+    DnsCache* dns_cache_;
+    UpstreamPoolOptions options_;
+    UpstreamPoolStats stats_;
+    uv_timer_t timer_;
+    std::map<std::string, UpstreamEndpointPool*> endpoints_;
+
+    UpstreamEndpointPool* GetEndpoint(const char* hostname, unsigned int port);
+    UpstreamConnection* TakeIdleConnection(UpstreamEndpointPool* endpoint);
+    void Connect(UpstreamEndpointPool* endpoint, UpstreamAcquireCallback callback, void* data);
+    void ConnectAddress(UpstreamConnection* connection);
+    void ConnectNextAddress(UpstreamConnection* connection, int status);
+    void FailConnect(UpstreamConnection* connection, int status);
+    void Handshake(UpstreamConnection* connection);
+    void FinishConnect(UpstreamConnection* connection);
+    void AddIdleConnection(UpstreamConnection* connection);
+    void RemoveIdleConnection(UpstreamConnection* connection);
+    void CloseConnection(UpstreamConnection* connection);
+    void Evict();
+
+    static void OnResolved(const std::vector<sockaddr_storage>& addresses, int status, void* data);
+    static void OnConnect(uv_connect_t* request, int status);
+    static void OnHandshakeRead(uv_stream_t* stream, ssize_t length, const uv_buf_t* buf);
+    static void OnIdleRead(uv_stream_t* stream, ssize_t length, const uv_buf_t* buf);
+    static void OnConnectTimeout(uv_timer_t* timer);
+    static void OnFallbackClose(uv_handle_t* handle);
+    static void OnClose(uv_handle_t* handle);
+    static void OnTimerClose(uv_handle_t* handle);
+    static void OnTick(uv_timer_t* timer);
+};
+
+}
+
+#endif //FLASHPOINT_UPSTREAM_POOL_H
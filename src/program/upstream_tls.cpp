@@ -0,0 +1,184 @@
+#include <program/upstream_tls.h>
+#include <program/upstream_pool.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <arpa/inet.h>
+#include <cstdio>
+
+namespace flashpoint {
+
+UpstreamTls::~UpstreamTls() {
+    SSL_CTX_free(ssl_ctx);
+}
+
+// Keep the newest session of a replica, e.g. a TLS 1.3 ticket that arrives
+// after the handshake, for the replica's next connection. The session is kept
+// by the endpoint, so the context doesn't store it.
+int OnNewUpstreamSession(SSL* ssl, SSL_SESSION* session) {
+    auto connection = static_cast<UpstreamConnection*>(SSL_get_app_data(ssl));
+    UpstreamEndpointPool* endpoint = connection->endpoint;
+    if (endpoint->tls == nullptr || endpoint->tls->ssl_ctx != SSL_get_SSL_CTX(ssl)) {
+        return 0;
+    }
+    if (endpoint->ssl_session != nullptr) {
+        SSL_SESSION_free(endpoint->ssl_session);
+    }
+    endpoint->ssl_session = session;
+    return 1;
+}
+
+bool CreateUpstreamTls(const std::string& server_name, const std::string& ca_file, bool http2, std::shared_ptr<const UpstreamTls>& tls, std::string& error) {
+    SSL_CTX* ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx == nullptr) {
+        error = "Couldn't create a TLS context";
+        return false;
+    }
+    auto upstream_tls = std::make_shared<UpstreamTls>();
+    upstream_tls->ssl_ctx = ssl_ctx;
+    upstream_tls->server_name = server_name;
+    upstream_tls->ca_file = ca_file;
+    upstream_tls->http2 = http2;
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, nullptr);
+    int loaded = ca_file.empty() ?
+        SSL_CTX_set_default_verify_paths(ssl_ctx) :
+        SSL_CTX_load_verify_locations(ssl_ctx, ca_file.c_str(), nullptr);
+    if (loaded != 1) {
+        ERR_clear_error();
+        error = "Couldn't load the CAs of " + server_name;
+        return false;
+    }
+    static const unsigned char http1_alpn_protocols[] = "\x08http/1.1";
+    static const unsigned char http2_alpn_protocols[] = "\x02h2";
+    if (http2) {
+        SSL_CTX_set_alpn_protos(ssl_ctx, http2_alpn_protocols, sizeof(http2_alpn_protocols) - 1);
+    }
+    else {
+        SSL_CTX_set_alpn_protos(ssl_ctx, http1_alpn_protocols, sizeof(http1_alpn_protocols) - 1);
+    }
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, OnNewUpstreamSession);
+    tls = std::move(upstream_tls);
+    return true;
+}
+
+bool IsSameUpstreamTls(const UpstreamTls* a, const UpstreamTls* b) {
+    if (a == nullptr || b == nullptr) {
+        return a == b;
+    }
+    return a->server_name == b->server_name && a->ca_file == b->ca_file && a->http2 == b->http2;
+}
+
+void StartUpstreamTls(UpstreamConnection* connection) {
+    UpstreamEndpointPool* endpoint = connection->endpoint;
+    const UpstreamTls* tls = endpoint->tls.get();
+    SSL* ssl_handle = SSL_new(tls->ssl_ctx);
+    SSL_set_bio(ssl_handle, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+    SSL_set_connect_state(ssl_handle);
+    SSL_set_app_data(ssl_handle, connection);
+
+    // SNI can't be an IP address, and its certificate names the address.
+    in6_addr address;
+    if (inet_pton(AF_INET, tls->server_name.c_str(), &address) == 1 || inet_pton(AF_INET6, tls->server_name.c_str(), &address) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl_handle), tls->server_name.c_str());
+    }
+    else {
+        SSL_set_tlsext_host_name(ssl_handle, tls->server_name.c_str());
+        SSL_set1_host(ssl_handle, tls->server_name.c_str());
+    }
+    if (endpoint->ssl_session != nullptr) {
+        SSL_set_session(ssl_handle, endpoint->ssl_session);
+    }
+    connection->ssl_handle = ssl_handle;
+}
+
+UpstreamTlsStatus ContinueUpstreamHandshake(UpstreamConnection* connection) {
+    SSL* ssl_handle = connection->ssl_handle;
+    int result = SSL_do_handshake(ssl_handle);
+    FlushUpstreamTls(connection);
+    if (result == 1) {
+        return UpstreamTlsStatus::Done;
+    }
+    if (SSL_get_error(ssl_handle, result) == SSL_ERROR_WANT_READ) {
+        return UpstreamTlsStatus::WantRead;
+    }
+    long verify_result = SSL_get_verify_result(ssl_handle);
+    if (verify_result != X509_V_OK) {
+        std::fprintf(stderr, "Error at backend TLS handshake: %s.\n", X509_verify_cert_error_string(verify_result));
+    }
+    else {
+        const char* reason = ERR_reason_error_string(ERR_peek_error());
+        std::fprintf(stderr, "Error at backend TLS handshake: %s.\n", reason != nullptr ? reason : "connection closed");
+    }
+    ERR_clear_error();
+    return UpstreamTlsStatus::Error;
+}
+
+void ReceiveUpstreamTls(UpstreamConnection* connection, const char* text, std::size_t size) {
+    BIO_write(SSL_get_rbio(connection->ssl_handle), text, (int)size);
+}
+
+UpstreamTlsStatus ReadUpstreamTls(UpstreamConnection* connection, char* buffer, std::size_t capacity, std::size_t& size) {
+    SSL* ssl_handle = connection->ssl_handle;
+    int read_size = SSL_read(ssl_handle, buffer, (int)capacity);
+    if (read_size > 0) {
+        size = (std::size_t)read_size;
+        return UpstreamTlsStatus::Done;
+    }
+    size = 0;
+    int error = SSL_get_error(ssl_handle, read_size);
+
+    // Reading can answer the backend, e.g. a key update.
+    FlushUpstreamTls(connection);
+    switch (error) {
+        case SSL_ERROR_WANT_READ:
+            return UpstreamTlsStatus::WantRead;
+        case SSL_ERROR_ZERO_RETURN:
+            return UpstreamTlsStatus::Closed;
+        default:
+            ERR_clear_error();
+            return UpstreamTlsStatus::Error;
+    }
+}
+
+bool HasNegotiatedHttp2(UpstreamConnection* connection) {
+    const unsigned char* protocol;
+    unsigned int protocol_size;
+    SSL_get0_alpn_selected(connection->ssl_handle, &protocol, &protocol_size);
+    return protocol_size == 2 && protocol[0] == 'h' && protocol[1] == '2';
+}
+
+bool HasPendingUpstreamTls(UpstreamConnection* connection) {
+    return SSL_pending(connection->ssl_handle) > 0 || BIO_ctrl_pending(SSL_get_rbio(connection->ssl_handle)) > 0;
+}
+
+struct UpstreamTlsWrite {
+    uv_write_t write_request;
+    char* records;
+};
+
+void OnUpstreamTlsWritten(uv_write_t* write_request, int status) {
+    auto write = static_cast<UpstreamTlsWrite*>(write_request->data);
+    delete[] write->records;
+    delete write;
+}
+
+// A failed write isn't reported, the connection's next read fails too.
+void FlushUpstreamTls(UpstreamConnection* connection) {
+    BIO* write_bio = SSL_get_wbio(connection->ssl_handle);
+    std::size_t pending_size = BIO_ctrl_pending(write_bio);
+    if (pending_size == 0) {
+        return;
+    }
+    auto write = new UpstreamTlsWrite {};
+    write->records = new char[pending_size];
+    BIO_read(write_bio, write->records, (int)pending_size);
+    write->write_request.data = write;
+    uv_buf_t buf = uv_buf_init(write->records, (unsigned int)pending_size);
+    if (uv_write(&write->write_request, (uv_stream_t*)&connection->tcp_handle, &buf, 1, OnUpstreamTlsWritten)) {
+        delete[] write->records;
+        delete write;
+    }
+}
+
+}
@@ -0,0 +1,85 @@
+#ifndef FLASHPOINT_UPSTREAM_TLS_H
+#define FLASHPOINT_UPSTREAM_TLS_H
+
+#include <openssl/ssl.h>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace flashpoint {
+
+struct UpstreamConnection;
+
+// The client side TLS of a backend's connections. The context is shared by the
+// backend's replicas, while every replica resumes its own sessions.
+struct UpstreamTls {
+    SSL_CTX* ssl_ctx;
+
+    // The name that is sent with SNI and that the certificate is verified
+    // against, the hostname of the backend's origin.
+    std::string server_name;
+
+    // PEM file of the CAs that the certificate is verified with, empty for
+    // the system's.
+    std::string ca_file;
+
+    // Whether h2 is offered with ALPN instead of http/1.1.
+    bool http2;
+
+    ~UpstreamTls();
+};
+
+// Create the TLS of a backend. Certificates are verified, TLS 1.2 is the
+// minimum, and http/1.1 or h2 is offered with ALPN.
+// @param server_name the hostname of the backend's origin.
+// @param ca_file the CAs of the backend, empty for the system's.
+// @param http2 whether the backend speaks HTTP/2.
+// @param tls the created TLS.
+// @param error the reason the context couldn't be created.
+// @return false when the context couldn't be created, e.g. the CA file is
+// missing.
+bool CreateUpstreamTls(const std::string& server_name, const std::string& ca_file, bool http2, std::shared_ptr<const UpstreamTls>& tls, std::string& error);
+
+// Whether two backends' connections can be shared, i.e. they are both plain
+// or verified the same way.
+bool IsSameUpstreamTls(const UpstreamTls* a, const UpstreamTls* b);
+
+enum class UpstreamTlsStatus {
+    Done,
+    WantRead,
+
+    // The backend sent close_notify.
+    Closed,
+    Error,
+};
+
+// Start the client handshake of a connected connection, with the last session
+// of its endpoint when there is one.
+void StartUpstreamTls(UpstreamConnection* connection);
+
+// Advance the handshake with the bytes that have been received.
+UpstreamTlsStatus ContinueUpstreamHandshake(UpstreamConnection* connection);
+
+// Pass bytes that were read from the socket to the TLS session.
+void ReceiveUpstreamTls(UpstreamConnection* connection, const char* text, std::size_t size);
+
+// Decrypt the next bytes that have been received.
+// @param buffer the buffer of the plaintext.
+// @param capacity the size of the buffer.
+// @param size set to the size of the plaintext.
+// @return Done with plaintext, WantRead when more bytes are needed.
+UpstreamTlsStatus ReadUpstreamTls(UpstreamConnection* connection, char* buffer, std::size_t capacity, std::size_t& size);
+
+// Whether the backend agreed on h2 with ALPN.
+bool HasNegotiatedHttp2(UpstreamConnection* connection);
+
+// Whether received bytes are left in the TLS session, after a response.
+bool HasPendingUpstreamTls(UpstreamConnection* connection);
+
+// Write the records that the TLS session has produced to the socket, e.g. the
+// handshake.
+void FlushUpstreamTls(UpstreamConnection* connection);
+
+}
+
+#endif //FLASHPOINT_UPSTREAM_TLS_H
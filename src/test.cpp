@@ -1,5 +1,6 @@
 #include <iostream>
 #include <test/baseline_test_runner.h>
+#include <test/unit_tests.h>
 #include <lib/command.h>
 #include <signal.h> // signals
 #include <future>
@@ -46,6 +47,7 @@ int main(int argc, char* argv[]) {
     }
     else {
         if (command.has_flag("use-external-server")) {
+            DefineUnitTests(run_option);
             test_runner.DefineGraphQlTests(run_option);
             test_runner.DefineHttpTests(run_option);
             test_runner.Run(run_option);
@@ -62,6 +64,7 @@ int main(int argc, char* argv[]) {
             }
         }
         else {
+            DefineUnitTests(run_option);
             test_runner.DefineGraphQlTests(run_option);
 //            test_runner.DefineHttpTests(run_option);
             test_runner.Run(run_option);
@@ -0,0 +1,2450 @@
+#include <program/graphql/graphql_executor.h>
+#include <program/graphql/graphql_schema.h>
+#include <program/hpack.h>
+#include <program/http_parser.h>
+#include <program/http_response.h>
+#include <program/query_planner.h>
+#include <program/replica_balancer.h>
+#include <program/response_cache.h>
+#include <program/response_merge.h>
+#include <program/route_table.h>
+#include <program/singleflight.h>
+#include <program/subquery_batcher.h>
+#include <program/upstream_http2.h>
+#include <program/upstream_pool.h>
+#include <test/test_definition.h>
+#include <test/unit_tests.h>
+#include <json/json.h>
+#include <lib/character.h>
+#include <lib/number_format.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <limits>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace flashpoint::lib;
+using namespace flashpoint::program;
+using namespace flashpoint::program::graphql;
+
+namespace flashpoint::test {
+
+static void assert_true(bool condition, const std::string& message) {
+    if (!condition) {
+        throw BaselineAssertionError(message);
+    }
+}
+
+static void assert_equal(const std::string& actual, const std::string& expected, const std::string& message) {
+    if (actual != expected) {
+        throw BaselineAssertionError(message + "\n        Expected: " + expected + "\n        Actual:   " + actual);
+    }
+}
+
+static void define_test(const RunOption& run_option, const std::string& name, std::function<void(Test* t)> procedure) {
+    if (run_option.folder != nullptr || (run_option.test != nullptr && *run_option.test != name)) {
+        return;
+    }
+    test(name, procedure);
+}
+
+class SplicedResponse : public JsonSpliceSink {
+public:
+    std::string data;
+    std::string errors;
+
+    void Splice(JsonRegion region, const char* text, std::size_t size) override {
+        if (region == JsonRegion::Data) {
+            data.append(text, size);
+        }
+        else if (region == JsonRegion::Errors) {
+            errors.append(text, size);
+        }
+    }
+};
+
+// Feed a response to a splitter in parts of a size.
+// @return whether every part was valid JSON.
+static bool split_response(JsonResponseSplitter& splitter, const std::string& response, std::size_t part_size, SplicedResponse& spliced) {
+    bool valid = true;
+    for (std::size_t position = 0; position < response.size(); position += part_size) {
+        std::size_t size = std::min(part_size, response.size() - position);
+        valid = splitter.Feed(response.data() + position, size, spliced) && valid;
+    }
+    return valid;
+}
+
+static bool is_json(const std::string& text) {
+    Json::Reader json_reader;
+    Json::Value value;
+    return json_reader.parse(text, value, false);
+}
+
+static std::string format_unsigned(std::uint64_t value) {
+    char text[max_u64_size];
+    return std::string(text, format_u64(value, text));
+}
+
+static std::string format_signed(std::int64_t value) {
+    char text[max_i64_size];
+    return std::string(text, format_i64(value, text));
+}
+
+static std::string format_floating(double value) {
+    char text[max_double_size];
+    return std::string(text, format_double(value, text));
+}
+
+static void define_number_format_tests(const RunOption& run_option) {
+    domain("Number formatting");
+    define_test(run_option, "formats integers at every digit count", [](Test* t) {
+        std::vector<std::uint64_t> values = { 0, 1, std::numeric_limits<std::uint64_t>::max() };
+        for (std::uint64_t power = 10; power <= 10000000000000000000ULL; power *= 10) {
+            values.push_back(power - 1);
+            values.push_back(power);
+            values.push_back(power + 1);
+            if (power == 10000000000000000000ULL) {
+                break;
+            }
+        }
+        for (std::uint64_t value : values) {
+            assert_equal(format_unsigned(value), std::to_string(value), "Unsigned " + std::to_string(value));
+            auto signed_value = static_cast<std::int64_t>(value);
+            assert_equal(format_signed(signed_value), std::to_string(signed_value), "Signed " + std::to_string(signed_value));
+            assert_equal(format_signed(-signed_value), std::to_string(-signed_value), "Signed " + std::to_string(-signed_value));
+        }
+        assert_equal(format_signed(std::numeric_limits<std::int64_t>::min()), "-9223372036854775808", "Smallest signed");
+        assert_true(format_unsigned(std::numeric_limits<std::uint64_t>::max()).size() == max_u64_size, "Size of the largest unsigned");
+        assert_true(format_signed(std::numeric_limits<std::int64_t>::min()).size() == max_i64_size, "Size of the smallest signed");
+    });
+    define_test(run_option, "formats doubles that read back as the same value", [](Test* t) {
+        assert_equal(format_floating(0.1), "0.1", "0.1");
+        assert_equal(format_floating(-2.5), "-2.5", "-2.5");
+        assert_equal(format_floating(100), "100", "100");
+        assert_equal(format_floating(1e21), "1e+21", "1e21");
+        double values[] = {
+            0.1 + 0.2,
+            1.0 / 3,
+            -std::numeric_limits<double>::max(),
+            std::numeric_limits<double>::denorm_min(),
+            -std::numeric_limits<double>::min(),
+        };
+        for (double value : values) {
+            std::string text = format_floating(value);
+            assert_true(text.size() <= max_double_size, "Size of " + text);
+            assert_true(std::strtod(text.c_str(), nullptr) == value, "Value of " + text);
+        }
+    });
+    define_test(run_option, "formats NaN and infinities as null", [](Test* t) {
+        assert_equal(format_floating(std::nan("")), "null", "NaN");
+        assert_equal(format_floating(std::numeric_limits<double>::infinity()), "null", "Infinity");
+        assert_equal(format_floating(-std::numeric_limits<double>::infinity()), "null", "-Infinity");
+    });
+}
+
+static const std::string split_response_text = R"({"data": {"user": {"name": "A\"b", "ids": [1, 2.5e3, true, null]}, "x": "y"}, "errors": [{"message": "m"}], "extensions": {"data": 1}})";
+
+static void define_character_class_tests(const RunOption& run_option) {
+    domain("Character classes");
+    define_test(run_option, "classifies ASCII like the C locale", [](Test* t) {
+        for (int ch = 0; ch < 128; ch++) {
+            std::string character = "character " + std::to_string(ch);
+            char byte = static_cast<char>(ch);
+            assert_true(is_character_class(byte, CharacterClass::Digit) == (std::isdigit(ch) != 0), "Digit of " + character);
+            assert_true(is_character_class(byte, CharacterClass::HexDigit) == (std::isxdigit(ch) != 0), "HexDigit of " + character);
+            assert_true(is_character_class(byte, CharacterClass::Alpha) == (std::isalpha(ch) != 0), "Alpha of " + character);
+            assert_true(is_character_class(byte, CharacterClass::Upper) == (std::isupper(ch) != 0), "Upper of " + character);
+            assert_true(is_character_class(byte, CharacterClass::VisibleCharacter) == (std::isgraph(ch) != 0), "VisibleCharacter of " + character);
+            assert_true(is_character_class(byte, CharacterClass::NamePart) == (std::isalnum(ch) != 0 || ch == '_'), "NamePart of " + character);
+            assert_true(is_character_class(byte, CharacterClass::HeaderFieldPart) == (std::isalnum(ch) != 0 || (ch != 0 && std::strchr("!#$%&'*+-.^_`|~", ch) != nullptr)), "HeaderFieldPart of " + character);
+            assert_true(is_character_class(byte, CharacterClass::Whitespace) == (ch == ' ' || ch == '\t'), "Whitespace of " + character);
+            assert_true(!is_character_class(byte, CharacterClass::ObsText), "ObsText of " + character);
+            assert_true(to_lower(byte) == static_cast<char>(std::tolower(ch)), "Lower case of " + character);
+        }
+    });
+    define_test(run_option, "classifies bytes above ASCII as obs-text only", [](Test* t) {
+        for (int ch = 128; ch < 256; ch++) {
+            std::string character = "character " + std::to_string(ch);
+            char byte = static_cast<char>(ch);
+            assert_true(character_classes[ch] == static_cast<std::uint16_t>(CharacterClass::ObsText), "Classes of " + character);
+            assert_true(is_character_class(byte, CharacterClass::ObsText), "ObsText of " + character);
+            assert_true(to_lower(byte) == byte, "Lower case of " + character);
+        }
+        assert_true(!is_character_class(U'Ā', CharacterClass::NamePart), "NamePart of a code point above Latin-1");
+    });
+    define_test(run_option, "finds header names in any case", [](Test* t) {
+        std::string request = "POST / HTTP/1.1\r\nCONTENT-LENGTH: 2\r\ncOnTeNt-TyPe: a\r\n\r\n{}";
+        HttpParser parser(request.data(), request.size());
+        HttpParseResult result = parser.Parse();
+        assert_true(result.error == HttpParseError::None, "Error of upper-cased names");
+        assert_true(result.request->content_length == 2, "Content length");
+        assert_equal(result.request->headers.Get(HttpHeader::ContentType), "a", "Content type");
+    });
+}
+
+static HttpParseResult parse_request(const std::string& request) {
+    HttpParser parser(request.data(), request.size());
+    return parser.Parse();
+}
+
+static void define_request_parser_tests(const RunOption& run_option) {
+    domain("HTTP request parser");
+    define_test(run_option, "parses requests", [](Test* t) {
+        std::string request = "POST /graphql?x=1 HTTP/1.1\r\nHost: a\r\nContent-Length: 2\r\n";
+        for (std::size_t i = 0; i < INLINE_UNKNOWN_HEADERS + 2; i++) {
+            request += "X-Header-" + std::string(1, static_cast<char>('a' + i)) + ": " + std::to_string(i) + "\r\n";
+        }
+        request += "\r\n{}";
+        HttpParseResult result = parse_request(request);
+        assert_true(result.error == HttpParseError::None, "Error of a valid request");
+        const HttpHeaders& headers = result.request->headers;
+        assert_true(result.request->method == HttpMethod::Post, "Method");
+        assert_equal(headers.Get(HttpHeader::Host), "a", "Host");
+        assert_true(result.request->body_encoding == HttpBodyEncoding::ContentLength, "Body encoding");
+        assert_equal(result.request->body, "{}", "Body");
+        assert_true(headers.UnknownSize() == INLINE_UNKNOWN_HEADERS + 2, "Unknown headers");
+        for (std::size_t i = 0; i < headers.UnknownSize(); i++) {
+            assert_equal(headers.GetUnknown(i).name, "X-Header-" + std::string(1, static_cast<char>('a' + i)), "Unknown header name");
+            assert_equal(headers.GetUnknown(i).value, std::to_string(i), "Unknown header value");
+        }
+    });
+    define_test(run_option, "accepts header names of token characters", [](Test* t) {
+        HttpParseResult result = parse_request("GET / HTTP/1.1\r\nHTTP2-Settings: a\r\nX-B3-1: b\r\n1~x!#$%&'*+.^_`|: c\r\n\r\n");
+        assert_true(result.error == HttpParseError::None, "Error of token names");
+        const HttpHeaders& headers = result.request->headers;
+        assert_equal(headers.Get(HttpHeader::HTTP2Settings), "a", "Known header with a digit");
+        assert_true(headers.UnknownSize() == 2, "Unknown headers");
+        assert_equal(headers.GetUnknown(0).name, "X-B3-1", "Name ending with a digit");
+        assert_equal(headers.GetUnknown(1).name, "1~x!#$%&'*+.^_`|", "Name of symbols");
+        assert_equal(headers.GetUnknown(1).value, "c", "Value of a name of symbols");
+        assert_true(parse_request("GET / HTTP/1.1\r\nX@Y: a\r\n\r\n").error != HttpParseError::None, "Error of a name with a delimiter");
+    });
+    define_test(run_option, "stores known headers past the inline ones", [](Test* t) {
+        HttpHeaders headers;
+        for (std::size_t i = 1; i < http_header_size; i++) {
+            std::string value = std::to_string(i);
+            char* owned_value = new char[value.size() + 1];
+            std::memcpy(owned_value, value.c_str(), value.size() + 1);
+            headers.Set(static_cast<HttpHeader>(i), owned_value);
+        }
+        headers.Set(HttpHeader::Host, nullptr);
+        for (std::size_t i = 1; i < http_header_size; i++) {
+            HttpHeader header = static_cast<HttpHeader>(i);
+            if (header == HttpHeader::Host) {
+                assert_true(!headers.Has(header), "Host after it was cleared");
+                continue;
+            }
+            assert_equal(headers.Get(header), std::to_string(i), "Known header value");
+        }
+        assert_true(headers.Get(HttpHeader::Unknown) == nullptr, "Unknown header value");
+        assert_true(headers.GetField(HttpHeader::Accept).text == nullptr, "Field of a header without field lines");
+    });
+    define_test(run_option, "accepts a repeated Content-Length of the same length", [](Test* t) {
+        HttpParseResult result = parse_request("POST / HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 2\r\n\r\n{}");
+        assert_true(result.error == HttpParseError::None, "Error of a repeated length");
+        assert_true(result.request->content_length == 2, "Content length");
+    });
+    define_test(run_option, "rejects invalid requests", [](Test* t) {
+        struct InvalidCase {
+            const char* request;
+            HttpParseError error;
+        };
+        InvalidCase cases[] = {
+            { "GET / HTTP/2.0\r\n\r\n", HttpParseError::InvalidHttpVersion },
+            { "GET / HTTP/1.1\r\nHost a\r\n\r\n", HttpParseError::ExpectedCharacter },
+            { "GET / HTTP/1.1\r\nHost: a\r\n", HttpParseError::UnexpectedEndOfRequest },
+            { "POST / HTTP/1.1\r\nContent-Length: 2x\r\n\r\n{}", HttpParseError::InvalidContentLength },
+            { "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n", HttpParseError::InvalidContentLength },
+            { "POST / HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 3\r\n\r\n{}", HttpParseError::InvalidContentLength },
+            { "POST / HTTP/1.1\r\nContent-Length: 2\r\nTransfer-Encoding: chunked\r\n\r\n{}", HttpParseError::InvalidContentLength },
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n", HttpParseError::UnsupportedTransferEncoding },
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n", HttpParseError::UnsupportedTransferEncoding },
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", HttpParseError::UnsupportedTransferEncoding },
+            { "POST / HTTP/1.1\r\nContent-Length: 2\r\n\r\n{", HttpParseError::UnexpectedEndOfRequest },
+            { "POST / HTTP/1.1\r\nContent-Length: 2000000\r\n\r\n", HttpParseError::PayloadTooLarge },
+        };
+        for (const auto& invalid_case : cases) {
+            HttpParseResult result = parse_request(invalid_case.request);
+            assert_true(result.error == invalid_case.error, std::string("Error of ") + invalid_case.request + " was " + std::to_string(static_cast<int>(result.error)));
+            assert_true(result.request == nullptr, std::string("Request of ") + invalid_case.request);
+        }
+    });
+    define_test(run_option, "doesn't truncate the lengths of bodies", [](Test* t) {
+        HttpParserLimits limits = default_http_parser_limits;
+        limits.max_body_size = std::numeric_limits<std::size_t>::max();
+        std::string request = "POST / HTTP/1.1\r\nContent-Length: 4294967298\r\n\r\n{}";
+        HttpParser parser(request.data(), request.size(), limits);
+        HttpParseResult result = parser.Parse();
+        assert_true(result.error == HttpParseError::UnexpectedEndOfRequest, "Error of a body longer than 32 bits");
+    });
+    define_test(run_option, "rejects too large header fields", [](Test* t) {
+        std::string many_fields = "GET / HTTP/1.1\r\n";
+        for (std::size_t i = 0; i <= default_http_parser_limits.max_header_fields; i++) {
+            many_fields += "X: 1\r\n";
+        }
+        assert_true(parse_request(many_fields + "\r\n").error == HttpParseError::HeaderFieldsTooLarge, "Error of too many fields");
+        std::string large_field = "GET / HTTP/1.1\r\nX: " + std::string(default_http_parser_limits.max_header_fields_size, 'x') + "\r\n\r\n";
+        assert_true(parse_request(large_field).error == HttpParseError::HeaderFieldsTooLarge, "Error of a too large field");
+    });
+    define_test(run_option, "answers parse errors with 400, 413 and 431", [](Test* t) {
+        assert_true(GetParseErrorResponse(HttpParseError::InvalidContentLength).status == HttpStatus::BadRequest, "Status of an invalid length");
+        assert_true(GetParseErrorResponse(HttpParseError::UnsupportedTransferEncoding).status == HttpStatus::BadRequest, "Status of an unsupported encoding");
+        assert_true(GetParseErrorResponse(HttpParseError::PayloadTooLarge).status == HttpStatus::PayloadTooLarge, "Status of a too large payload");
+        assert_true(GetParseErrorResponse(HttpParseError::HeaderFieldsTooLarge).status == HttpStatus::RequestHeaderFieldsTooLarge, "Status of too large header fields");
+        std::string_view tail = GetParseErrorResponse(HttpParseError::InvalidHeader).tail;
+        std::size_t body_position = tail.find("\r\n\r\n") + 4;
+        assert_true(tail.find("Content-Length: " + std::to_string(tail.size() - body_position) + "\r\n") != std::string_view::npos, "Length of the body");
+        assert_true(is_json(std::string(tail.substr(body_position))), "JSON body");
+    });
+}
+
+static void append_body(void* data, const char* text, std::size_t size) {
+    static_cast<std::string*>(data)->append(text, size);
+}
+
+// Start reading the body of a request, and feed the text after its head to
+// the reader in parts of a size, until the body is complete or invalid.
+// @param consumed set to the bytes after the head that were read.
+static HttpBodyStatus read_request_body(HttpRequestBodyReader& reader, const std::string& request, std::size_t part_size, std::string& body, std::size_t& consumed, const HttpParserLimits& limits = default_http_parser_limits) {
+    HttpParser parser(request.data(), request.size(), limits);
+    HttpParseResult result = parser.ParseHead();
+    if (result.error != HttpParseError::None) {
+        throw BaselineAssertionError("Invalid head of " + request);
+    }
+    consumed = 0;
+    if (reader.Start(*result.request, limits)) {
+        return HttpBodyStatus::Complete;
+    }
+    std::string text = request.substr(result.body_position);
+    HttpBodyStatus status = HttpBodyStatus::Incomplete;
+    while (consumed < text.size() && status == HttpBodyStatus::Incomplete) {
+        std::size_t size = std::min(part_size, text.size() - consumed);
+        std::size_t part_consumed;
+        status = reader.Feed(text.data() + consumed, size, part_consumed, append_body, &body);
+        consumed += part_consumed;
+    }
+    return status;
+}
+
+static void define_request_body_tests(const RunOption& run_option) {
+    domain("HTTP request body");
+    define_test(run_option, "completes empty bodies without reading", [](Test* t) {
+        const char* requests[] = {
+            "POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\n",
+            "POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\nGET / HTTP/1.1\r\n\r\n",
+            "GET / HTTP/1.1\r\n\r\n",
+        };
+        for (const auto& request : requests) {
+            HttpRequestBodyReader reader;
+            std::string body;
+            std::size_t consumed;
+            assert_true(read_request_body(reader, request, 1, body, consumed) == HttpBodyStatus::Complete, std::string("Incomplete body of ") + request);
+            assert_true(consumed == 0 && body.empty(), std::string("Read the body of ") + request);
+        }
+    });
+    define_test(run_option, "reads bodies split across reads", [](Test* t) {
+        std::string request = "POST / HTTP/1.1\r\nContent-Length: 11\r\n\r\n{\"query\":1}GET / HTTP/1.1\r\n\r\n";
+        for (std::size_t part_size = 1; part_size <= 20; part_size++) {
+            HttpRequestBodyReader reader;
+            std::string body;
+            std::size_t consumed;
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_true(read_request_body(reader, request, part_size, body, consumed) == HttpBodyStatus::Complete, "Incomplete body in " + parts);
+            assert_equal(body, "{\"query\":1}", "Body in " + parts);
+            assert_true(consumed == 11, "Read the next request in " + parts);
+        }
+    });
+    define_test(run_option, "decodes chunked bodies split across reads", [](Test* t) {
+        std::string chunks = "4\r\n{\"qu\r\nA;name=value\r\nery\":1234}\r\n0\r\nTrailer: a\r\n\r\n";
+        std::string request = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" + chunks + "GET / HTTP/1.1\r\n\r\n";
+        for (std::size_t part_size = 1; part_size <= chunks.size() + 1; part_size++) {
+            HttpRequestBodyReader reader;
+            std::string body;
+            std::size_t consumed;
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_true(read_request_body(reader, request, part_size, body, consumed) == HttpBodyStatus::Complete, "Incomplete body in " + parts);
+            assert_equal(body, "{\"query\":1234}", "Body in " + parts);
+            assert_true(consumed == chunks.size(), "Read the next request in " + parts);
+        }
+    });
+    define_test(run_option, "rejects invalid chunked bodies", [](Test* t) {
+        struct InvalidCase {
+            const char* chunks;
+            HttpParseError error;
+        };
+        InvalidCase cases[] = {
+            { "x\r\n", HttpParseError::InvalidChunkedBody },
+            { ";\r\n", HttpParseError::InvalidChunkedBody },
+            { "2\n{}\r\n", HttpParseError::InvalidChunkedBody },
+            { "2\r\n{}0\r\n\r\n", HttpParseError::InvalidChunkedBody },
+            { "0\r\n\r\r", HttpParseError::InvalidChunkedBody },
+            { "10\r\n", HttpParseError::PayloadTooLarge },
+            { "8\r\n12345678\r\n9\r\n", HttpParseError::PayloadTooLarge },
+            { "fffffffffffffffffffff\r\n", HttpParseError::PayloadTooLarge },
+        };
+        HttpParserLimits limits = default_http_parser_limits;
+        limits.max_body_size = 15;
+        for (const auto& invalid_case : cases) {
+            HttpRequestBodyReader reader;
+            std::string body;
+            std::size_t consumed;
+            std::string request = std::string("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") + invalid_case.chunks;
+            assert_true(read_request_body(reader, request, 1, body, consumed, limits) == HttpBodyStatus::Error, std::string("Valid body ") + invalid_case.chunks);
+            assert_true(reader.Error() == invalid_case.error, std::string("Error of ") + invalid_case.chunks);
+        }
+    });
+}
+
+static void define_response_splitter_tests(const RunOption& run_option) {
+    domain("Response splitter");
+    define_test(run_option, "splits the data and errors of a response", [](Test* t) {
+        for (std::size_t part_size = 1; part_size <= split_response_text.size(); part_size++) {
+            JsonResponseSplitter splitter;
+            SplicedResponse spliced;
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_true(split_response(splitter, split_response_text, part_size, spliced), "Invalid JSON in " + parts);
+            assert_true(splitter.End(spliced), "Incomplete response in " + parts);
+            assert_equal(spliced.data, R"("user":{"name":"A\"b","ids":[1,2.5e3,true,null]},"x":"y")", "Data in " + parts);
+            assert_equal(spliced.errors, R"({"message":"m"})", "Errors in " + parts);
+        }
+    });
+    define_test(run_option, "closes the spliced text of truncated responses", [](Test* t) {
+        for (std::size_t size = 0; size < split_response_text.size(); size++) {
+            JsonResponseSplitter splitter;
+            SplicedResponse spliced;
+            std::string truncated = split_response_text.substr(0, size);
+            assert_true(split_response(splitter, truncated, truncated.size() + 1, spliced), "Invalid JSON in " + truncated);
+            assert_true(!splitter.End(spliced), "Complete response of " + truncated);
+            assert_true(is_json("{" + spliced.data + "}"), "Unclosed data " + spliced.data + " of " + truncated);
+            assert_true(is_json("[" + spliced.errors + "]"), "Unclosed errors " + spliced.errors + " of " + truncated);
+        }
+        JsonResponseSplitter splitter;
+        SplicedResponse spliced;
+        split_response(splitter, R"({"data": {"user": {"name": "A)", 1, spliced);
+        splitter.End(spliced);
+        assert_equal(spliced.data, R"("user":{"name":"A"})", "Data of a truncated string");
+    });
+    define_test(run_option, "rejects invalid responses", [](Test* t) {
+        const char* responses[] = {
+            R"({"data": {"a": 1}} x)",
+            R"({"data": {"a": tru}})",
+            R"({"data": {"a" 1}})",
+            R"({"data": {"a": [1 2]}})",
+        };
+        for (const auto& response : responses) {
+            JsonResponseSplitter splitter;
+            SplicedResponse spliced;
+            assert_true(!split_response(splitter, response, 1, spliced), "Valid JSON of " + std::string(response));
+            assert_true(!splitter.End(spliced), "Complete response of " + std::string(response));
+            assert_true(is_json("{" + spliced.data + "}"), "Unclosed data " + spliced.data + " of " + response);
+        }
+    });
+}
+
+class MergedResponse : public ResponseMergeOutput {
+public:
+    MergedResponse(std::string& text, bool& ended):
+        text_(text),
+        ended_(ended) { }
+
+    void Write(const char* text, std::size_t size) override {
+        text_.append(text, size);
+    }
+
+    void Flush() override { }
+
+    void End() override {
+        ended_ = true;
+    }
+
+private:
+    std::string& text_;
+    bool& ended_;
+};
+
+// Make a merge of subqueries that each resolve one field.
+static std::unique_ptr<ResponseMerge> merge_subqueries(const std::vector<std::string>& response_keys, std::string& text, bool& ended, const ResponseMergeOptions& options = default_response_merge_options) {
+    auto plan = std::make_shared<QueryPlan>();
+    for (const auto& response_key : response_keys) {
+        Subquery subquery {};
+        subquery.fields.push_back(PlannedField { response_key, {} });
+        plan->subqueries.push_back(std::move(subquery));
+    }
+    auto merge = std::make_unique<ResponseMerge>(plan, std::make_unique<MergedResponse>(text, ended), options);
+    merge->Start();
+    return merge;
+}
+
+// Feed the responses of subqueries in turns of parts of a size, the last
+// subquery first, and end each one once it has been fed.
+static void feed_interleaved(ResponseMerge& merge, const std::vector<std::string>& responses, std::size_t part_size) {
+    std::vector<std::size_t> positions(responses.size(), 0);
+    bool fed = true;
+    while (fed) {
+        fed = false;
+        for (std::size_t i = responses.size(); i-- > 0; ) {
+            if (positions[i] == responses[i].size()) {
+                continue;
+            }
+            std::size_t size = std::min(part_size, responses[i].size() - positions[i]);
+            merge.Feed(i, responses[i].data() + positions[i], size);
+            positions[i] += size;
+            if (positions[i] == responses[i].size()) {
+                merge.End(i);
+            }
+            fed = true;
+        }
+    }
+}
+
+static void define_response_merge_tests(const RunOption& run_option) {
+    domain("Response merge");
+    define_test(run_option, "merges data and errors in plan order", [](Test* t) {
+        std::vector<std::string> responses = {
+            R"({"data": {"a": {"x": [1, 2]}}, "errors": [{"message": "a1", "path": ["a", "x"]}, {"message": "a2"}]})",
+            R"({"errors": [{"message": "b1", "locations": [{"line": 1, "column": 2}]}, {"message": "b2"}], "data": {"b": "y"}})",
+        };
+        for (std::size_t part_size = 1; part_size <= responses[0].size(); part_size++) {
+            std::string text;
+            bool ended = false;
+            auto merge = merge_subqueries({ "a", "b" }, text, ended);
+            feed_interleaved(*merge, responses, part_size);
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_true(ended && merge->Ended(), "Unended response in " + parts);
+            assert_equal(text, R"({"data":{"a":{"x":[1,2]},"b":"y"},"errors":[{"message":"a1","path":["a","x"]},{"message":"a2"},{"message":"b1","locations":[{"line":1,"column":2}]},{"message":"b2"}]})", "Response in " + parts);
+        }
+    });
+    define_test(run_option, "caps the errors of each subquery", [](Test* t) {
+        std::vector<std::string> responses = {
+            R"({"data": {"a": 1}, "errors": [{"message": "a1"}, {"message": "a2"}, {"message": "a3"}]})",
+            R"({"data": {"b": 2}, "errors": [{"message": "b1"}]})",
+            R"({"data": {"c": 3}, "errors": [{"message": "c1"}, {"message": "c2"}, {"message": "c3"}]})",
+        };
+        ResponseMergeOptions options = default_response_merge_options;
+        options.max_errors_size = 40;
+        for (std::size_t part_size = 1; part_size <= responses[0].size(); part_size++) {
+            std::string text;
+            bool ended = false;
+            auto merge = merge_subqueries({ "a", "b", "c" }, text, ended, options);
+            feed_interleaved(*merge, responses, part_size);
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_equal(text, R"({"data":{"a":1,"b":2,"c":3},"errors":[{"message":"Too many errors"},{"message":"b1"},{"message":"Too many errors"}]})", "Response in " + parts);
+            assert_true(is_json(text), "Invalid JSON in " + parts);
+        }
+    });
+    define_test(run_option, "nulls the fields of failed subqueries", [](Test* t) {
+        std::string text;
+        bool ended = false;
+        auto merge = merge_subqueries({ "a", "b", "c" }, text, ended);
+        std::string response = R"({"data": {"c": 3}, "errors": [{"message": "c1"}]})";
+        merge->Feed(2, response.data(), response.size());
+        merge->End(2);
+        merge->Fail(1, "Backend unavailable");
+        std::string truncated = R"({"data": {"a": {"x": "y)";
+        merge->Feed(0, truncated.data(), truncated.size());
+        assert_true(!ended, "Ended before the first subquery");
+        merge->Fail(0, "Connection closed");
+        assert_true(ended, "Unended response");
+        assert_equal(text, R"({"data":{"a":{"x":"y"},"b":null,"c":3},"errors":[{"message":"Connection closed"},{"message":"Backend unavailable","path":["b"]},{"message":"c1"}]})", "Response");
+    });
+}
+
+static void resume_flight(void* data) {
+    (*static_cast<std::size_t*>(data))++;
+}
+
+static void define_singleflight_tests(const RunOption& run_option) {
+    domain("Singleflight");
+    define_test(run_option, "joins flights of the same key", [](Test* t) {
+        std::string text;
+        bool ended = false;
+        std::shared_ptr<ResponseMerge> merge = merge_subqueries({ "a", "b", "c" }, text, ended);
+        std::size_t resumes = 0;
+        SingleflightGroup group;
+        SubqueryFlight flight { "users {a}", { FlightMember { merge, 0 } }, false, resume_flight, &resumes };
+        assert_true(!group.Join(flight.key, FlightMember { merge, 1 }), "Joined before the lead");
+        group.Lead(&flight);
+        assert_true(flight.joinable, "Unjoinable flight");
+        assert_true(group.Join(std::string("users ") + "{a}", FlightMember { merge, 1 }), "Join of the same key");
+        assert_true(!group.Join("users {b}", FlightMember { merge, 2 }), "Join of another key");
+        assert_true(flight.members.size() == 2 && flight.members[1].index == 1, "Members");
+        assert_true(group.Stats().leads == 1 && group.Stats().joins == 1, "Stats");
+    });
+    define_test(run_option, "resumes flights through their members", [](Test* t) {
+        std::string text;
+        bool ended = false;
+        ResponseMergeOptions options = default_response_merge_options;
+        options.max_pending_size = 4;
+        std::shared_ptr<ResponseMerge> merge = merge_subqueries({ "a", "b" }, text, ended, options);
+        std::size_t resumes = 0;
+        SingleflightGroup group;
+        SubqueryFlight flight { "orders", { }, false, resume_flight, &resumes };
+        group.Lead(&flight);
+        group.Join("orders", FlightMember { merge, 1 });
+        std::string response = R"({"data": {"b": "long enough to pause"}})";
+        assert_true(!merge->Feed(1, response.data(), response.size()), "Unpaused member");
+        merge->Complete(0, R"("a":1)");
+        assert_true(resumes == 1, "Resumes of the flight");
+    });
+    define_test(run_option, "closes flights once", [](Test* t) {
+        std::string text;
+        bool ended = false;
+        std::shared_ptr<ResponseMerge> merge = merge_subqueries({ "a" }, text, ended);
+        SingleflightGroup group;
+        SubqueryFlight flight { "users", { }, false, nullptr, nullptr };
+        group.Lead(&flight);
+        group.Close(&flight);
+        assert_true(!flight.joinable, "Joinable closed flight");
+        assert_true(!group.Join("users", FlightMember { merge, 0 }), "Join of a closed flight");
+        SubqueryFlight next_flight { "users", { }, false, nullptr, nullptr };
+        group.Lead(&next_flight);
+        group.Close(&flight);
+        assert_true(group.Join("users", FlightMember { merge, 0 }), "Join of the next flight after closing the first again");
+        assert_true(next_flight.members.size() == 1, "Members of the next flight");
+    });
+}
+
+// Cache entries of 10 bytes in one shard of 3 entries.
+static const ResponseCacheOptions small_cache_options = { 30, 20, 1 };
+
+static bool is_cached(ResponseCache& cache, const std::string& key) {
+    return cache.Get(key) != nullptr;
+}
+
+static void define_response_cache_tests(const RunOption& run_option) {
+    domain("Response cache");
+    define_test(run_option, "gets entries until they expire", [](Test* t) {
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        ResponseCache cache(&loop, small_cache_options);
+        cache.Put("a", "123456789", 1);
+        cache.Put("b", "123456789", 60000);
+        const std::string* data = cache.Get("a");
+        assert_true(data != nullptr && *data == "123456789", "Data of a");
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        uv_update_time(&loop);
+        assert_true(!is_cached(cache, "a"), "Expired entry");
+        assert_true(is_cached(cache, "b"), "Unexpired entry");
+        assert_true(cache.Size() == 10 && cache.Stats().expirations == 1, "Size after the expiration");
+        uv_loop_close(&loop);
+    });
+    define_test(run_option, "doesn't cache entries without a TTL or that are too large", [](Test* t) {
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        ResponseCache cache(&loop, small_cache_options);
+        cache.Put("a", "123456789", 0);
+        cache.Put("b", std::string(20, 'x'), 1000);
+        assert_true(!is_cached(cache, "a") && !is_cached(cache, "b") && cache.Size() == 0, "Cached entries");
+        uv_loop_close(&loop);
+    });
+    define_test(run_option, "evicts the least recently used entries", [](Test* t) {
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        ResponseCache cache(&loop, small_cache_options);
+        cache.Put("a", "123456789", 1000);
+        cache.Put("b", "123456789", 1000);
+        cache.Put("c", "123456789", 1000);
+        assert_true(is_cached(cache, "a"), "Cached a");
+        cache.Put("d", "123456789", 1000);
+        assert_true(cache.Stats().evictions == 1 && cache.Size() == 30, "Evictions");
+        assert_true(!is_cached(cache, "b"), "Evicted b");
+        assert_true(is_cached(cache, "a") && is_cached(cache, "c") && is_cached(cache, "d"), "Kept entries");
+        uv_loop_close(&loop);
+    });
+    define_test(run_option, "replaces the data of a key", [](Test* t) {
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        ResponseCache cache(&loop, small_cache_options);
+        cache.Put("a", "123456789", 1000);
+        cache.Put("b", "123456789", 1000);
+        cache.Put("a", "1234567890123456789", 1000);
+        assert_true(*cache.Get("a") == "1234567890123456789" && is_cached(cache, "b"), "Replaced entry");
+        assert_true(cache.Size() == 30 && cache.Stats().evictions == 0, "Size of the replaced entry");
+        uv_loop_close(&loop);
+    });
+    define_test(run_option, "only admits entries that are seen as often as their victims", [](Test* t) {
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        ResponseCache cache(&loop, small_cache_options);
+        cache.Put("a", "123456789", 1000);
+        cache.Put("b", "123456789", 1000);
+        cache.Put("c", "123456789", 1000);
+        for (std::size_t i = 0; i < 3; i++) {
+            is_cached(cache, "a");
+            is_cached(cache, "b");
+            is_cached(cache, "c");
+        }
+        cache.Put("d", "1234567890123456789", 1000);
+        assert_true(cache.Stats().rejections == 1 && cache.Stats().evictions == 0, "Rejection of a one-off entry");
+        assert_true(is_cached(cache, "a") && is_cached(cache, "b") && is_cached(cache, "c") && cache.Size() == 30, "Entries after the rejection");
+        for (std::size_t i = 0; i < 8; i++) {
+            is_cached(cache, "e");
+        }
+        cache.Put("e", "1234567890123456789", 1000);
+        assert_true(cache.Stats().evictions == 2 && is_cached(cache, "e"), "Admission of a popular entry");
+        assert_true(cache.Size() == 30, "Size after the admission");
+        uv_loop_close(&loop);
+    });
+}
+
+static uv_loop_t* new_test_loop() {
+    auto loop = new uv_loop_t;
+    uv_loop_init(loop);
+    return loop;
+}
+
+// Close the handles that are left on a loop, e.g. the timers of its pools,
+// and free the loop. The owners of the handles must still be alive.
+static void close_test_loop(uv_loop_t* loop) {
+    // A close callback can close another handle, e.g. the connect timer of an
+    // upstream connection, so the closes that are under way finish first.
+    bool closing = true;
+    while (closing) {
+        closing = false;
+        uv_walk(loop, [](uv_handle_t* handle, void* arg) {
+            if (uv_is_closing(handle)) {
+                *static_cast<bool*>(arg) = true;
+            }
+        }, &closing);
+        if (closing) {
+            uv_run(loop, UV_RUN_NOWAIT);
+        }
+    }
+    uv_walk(loop, [](uv_handle_t* handle, void*) {
+        if (!uv_is_closing(handle)) {
+            uv_close(handle, nullptr);
+        }
+    }, nullptr);
+    uv_run(loop, UV_RUN_DEFAULT);
+    uv_loop_close(loop);
+    delete loop;
+}
+
+// A balancer with its own loop and pools, which are closed with the test.
+struct BalancerTest {
+    uv_loop_t* loop;
+    DnsCache dns_cache;
+    UpstreamPool upstream_pool;
+    ReplicaBalancer balancer;
+
+    BalancerTest(const OutlierDetectionOptions& options = default_outlier_detection_options):
+        loop(new_test_loop()),
+        dns_cache(loop),
+        upstream_pool(loop, &dns_cache),
+        balancer(loop, &upstream_pool, options)
+    { }
+
+    ~BalancerTest() {
+        close_test_loop(loop);
+    }
+};
+
+static BackendEndpoint make_replicated_endpoint(std::size_t replicas) {
+    BackendEndpoint endpoint {};
+    for (std::size_t i = 0; i < replicas; i++) {
+        unsigned int port = 4000 + static_cast<unsigned int>(i);
+        endpoint.replicas.push_back(BackendReplica { "replica:" + std::to_string(port), "replica", port });
+    }
+    return endpoint;
+}
+
+static void define_replica_balancer_tests(const RunOption& run_option) {
+    domain("Replica balancer");
+    define_test(run_option, "picks the replica with fewer outstanding requests", [](Test* t) {
+        BalancerTest test;
+        ReplicaBalancer& balancer = test.balancer;
+        BackendEndpoint endpoint = make_replicated_endpoint(2);
+        balancer.Begin(&endpoint.replicas[0]);
+        for (std::size_t i = 0; i < 100; i++) {
+            assert_true(balancer.Pick(endpoint, {}) == &endpoint.replicas[1], "Pick of the less loaded replica");
+        }
+        balancer.Abandon(&endpoint.replicas[0]);
+        balancer.Begin(&endpoint.replicas[1]);
+        assert_true(balancer.Pick(endpoint, {}) == &endpoint.replicas[0], "Pick after the load moved");
+        assert_true(balancer.Stats().picks == 101, "Picks");
+    });
+    define_test(run_option, "spreads picks over equally loaded replicas", [](Test* t) {
+        BalancerTest test;
+        ReplicaBalancer& balancer = test.balancer;
+        BackendEndpoint endpoint = make_replicated_endpoint(3);
+        std::size_t picks[3] = { 0, 0, 0 };
+        for (std::size_t i = 0; i < 300; i++) {
+            picks[balancer.Pick(endpoint, {}) - endpoint.replicas.data()]++;
+        }
+        for (std::size_t i = 0; i < 3; i++) {
+            assert_true(picks[i] > 50, "Picks of replica " + std::to_string(i));
+        }
+    });
+    define_test(run_option, "picks replicas that weren't tried", [](Test* t) {
+        BalancerTest test;
+        ReplicaBalancer& balancer = test.balancer;
+        BackendEndpoint endpoint = make_replicated_endpoint(2);
+        for (std::size_t i = 0; i < 10; i++) {
+            assert_true(balancer.Pick(endpoint, { &endpoint.replicas[0] }) == &endpoint.replicas[1], "Pick of the untried replica");
+        }
+        assert_true(balancer.Pick(endpoint, { &endpoint.replicas[0], &endpoint.replicas[1] }) == nullptr, "Pick when all were tried");
+    });
+    define_test(run_option, "ejects replicas with too many errors", [](Test* t) {
+        BalancerTest test;
+        ReplicaBalancer& balancer = test.balancer;
+        BackendEndpoint endpoint = make_replicated_endpoint(2);
+        const BackendReplica* failing = &endpoint.replicas[0];
+        for (std::size_t i = 0; i < default_outlier_detection_options.min_requests - 1; i++) {
+            balancer.End(endpoint, failing, false, 0);
+        }
+        assert_true(balancer.Stats().ejections == 0, "Ejection below the minimum of requests");
+        balancer.End(endpoint, failing, false, 0);
+        assert_true(balancer.Stats().ejections == 1, "Ejection of the failing replica");
+        for (std::size_t i = 0; i < 10; i++) {
+            assert_true(balancer.Pick(endpoint, {}) == &endpoint.replicas[1], "Pick of an ejected replica");
+        }
+        assert_true(balancer.Stats().panic_picks == 0, "Panic picks");
+    });
+    define_test(run_option, "ejects slow replicas", [](Test* t) {
+        OutlierDetectionOptions options = default_outlier_detection_options;
+        options.max_latency = 100;
+        BalancerTest test(options);
+        ReplicaBalancer& balancer = test.balancer;
+        BackendEndpoint endpoint = make_replicated_endpoint(2);
+        for (std::size_t i = 0; i < options.min_requests; i++) {
+            balancer.End(endpoint, &endpoint.replicas[0], true, 90);
+            balancer.End(endpoint, &endpoint.replicas[1], true, 500);
+        }
+        assert_true(balancer.Stats().ejections == 1, "Ejections");
+        assert_true(balancer.Pick(endpoint, {}) == &endpoint.replicas[0], "Pick of the fast replica");
+    });
+    define_test(run_option, "keeps a share of the replicas and picks ejected ones in panic", [](Test* t) {
+        BalancerTest test;
+        ReplicaBalancer& balancer = test.balancer;
+        BackendEndpoint endpoint = make_replicated_endpoint(2);
+        for (std::size_t i = 0; i < default_outlier_detection_options.min_requests; i++) {
+            balancer.End(endpoint, &endpoint.replicas[0], false, 0);
+            balancer.End(endpoint, &endpoint.replicas[1], false, 0);
+        }
+        assert_true(balancer.Stats().ejections == 1, "Ejections above max_ejected_ratio");
+        assert_true(balancer.Pick(endpoint, {}) == &endpoint.replicas[1], "Pick of the replica that was kept");
+        assert_true(balancer.Pick(endpoint, { &endpoint.replicas[1] }) == &endpoint.replicas[0], "Pick of the ejected replica");
+        assert_true(balancer.Stats().panic_picks == 1, "Panic picks");
+    });
+}
+
+static std::vector<std::string> split_batch_response(std::size_t subqueries, const std::string& response, bool& split) {
+    SubqueryBatch batch;
+    batch.subqueries.resize(subqueries);
+    batch.response = response;
+    std::vector<std::string> responses;
+    split = SplitBatchResponse(batch, responses);
+    return responses;
+}
+
+static void define_upstream_request_tests(const RunOption& run_option) {
+    domain("Upstream requests");
+    define_test(run_option, "hedges requests after a percentile of their endpoint's latencies", [](Test* t) {
+        UpstreamRequestOptions options = default_upstream_request_options;
+        LatencyHistogram latency;
+        for (std::size_t i = 0; i < 31; i++) {
+            latency.Record(10);
+        }
+        assert_true(!IsHedgedRequest(options, latency, true), "Hedged with fewer samples than min_hedge_samples");
+        assert_true(GetForwardRequestTimeout(options, latency, 1000, 11000, false) == 10000, "Timeout of an unhedged request");
+        for (std::size_t i = 0; i < 64; i++) {
+            latency.Record(10);
+        }
+        for (std::size_t i = 0; i < 5; i++) {
+            latency.Record(1000);
+        }
+        assert_true(IsHedgedRequest(options, latency, true), "Hedged with min_hedge_samples");
+        assert_true(!IsHedgedRequest(options, latency, false), "Hedged mutation");
+        options.hedging = false;
+        assert_true(!IsHedgedRequest(options, latency, true), "Hedged without hedging");
+
+        // The delay is the upper bound of the percentile's bucket, 95 of the
+        // 100 latencies are 10ms and the rest are 1s.
+        options = default_upstream_request_options;
+        assert_true(GetForwardRequestTimeout(options, latency, 1000, 11000, true) == 11, "Delay of the 95th percentile");
+        options.hedge_percentile = 0.99;
+        assert_true(GetForwardRequestTimeout(options, latency, 1000, 11000, true) == 1023, "Delay of the 99th percentile");
+        assert_true(GetForwardRequestTimeout(options, latency, 1000, 1500, true) == 500, "Delay after the deadline");
+        assert_true(GetForwardRequestTimeout(options, latency, 2000, 1500, true) == 0, "Timeout of a passed deadline");
+    });
+    define_test(run_option, "fails requests at their deadline", [](Test* t) {
+        RetryBudget retry_budget({ 0.5, 0, 1 });
+        assert_true(GetForwardTimerAction(1500, 1500, false, retry_budget) == ForwardTimerAction::Fail, "Action at the deadline");
+        assert_true(GetForwardTimerAction(1000, 1500, true, retry_budget) == ForwardTimerAction::Wait, "Action with a winner");
+        assert_true(GetForwardTimerAction(1000, 1500, false, retry_budget) == ForwardTimerAction::Hedge, "Action without a winner");
+
+        // Hedges are limited by the retry budget, which requests refill.
+        assert_true(GetForwardTimerAction(1000, 1500, false, retry_budget) == ForwardTimerAction::Wait, "Action with a spent budget");
+        retry_budget.Deposit();
+        retry_budget.Deposit();
+        assert_true(GetForwardTimerAction(1000, 1500, false, retry_budget) == ForwardTimerAction::Hedge, "Action with a refilled budget");
+
+        BackendReplica replica { "replica:8080", "replica", 8080 };
+        assert_true(CanFailOver(&replica, 1000, 1500), "Fail over before the deadline");
+        assert_true(!CanFailOver(&replica, 1500, 1500), "Fail over at the deadline");
+        assert_true(!CanFailOver(nullptr, 1000, 1500), "Fail over without a replica");
+    });
+}
+
+static void define_subquery_batch_tests(const RunOption& run_option) {
+    domain("Subquery batch");
+    define_test(run_option, "parses the aliases of a batch", [](Test* t) {
+        std::size_t index;
+        std::string_view response_key;
+        assert_true(ParseBatchAlias(GetBatchAlias(12, "user"), 13, index, response_key), "Alias of subquery 12");
+        assert_true(index == 12 && response_key == "user", "Index and response key of subquery 12");
+        assert_true(ParseBatchAlias("_b0__x", 1, index, response_key) && index == 0 && response_key == "_x", "Response key that starts with an underscore");
+        for (const char* alias : { "_b12_user", "_b1", "_b1_", "_bx_user", "_c1_user", "b1_user", "_b1user", "user" }) {
+            assert_true(!ParseBatchAlias(alias, 2, index, response_key), std::string("Alias ") + alias);
+        }
+    });
+    define_test(run_option, "splits the data of a batch by alias", [](Test* t) {
+        bool split;
+        std::vector<std::string> responses = split_batch_response(2, R"({ "data": { "_b1_user": {"name": "b"}, "_b0_user": {"name": "a"}, "_b0_me": null, "_b5_user": 1, "other": 2 } })", split);
+        assert_true(split && responses.size() == 2, "Split batch");
+        assert_equal(responses[0], R"({"data":{"user":{"name": "a"},"me":null}})", "Response of subquery 0");
+        assert_equal(responses[1], R"({"data":{"user":{"name": "b"}}})", "Response of subquery 1");
+    });
+    define_test(run_option, "gives errors to the subqueries of their paths", [](Test* t) {
+        bool split;
+        std::vector<std::string> responses = split_batch_response(2, R"({"errors":[{"message":"a","path":["_b1_user","name"]},{"message":"all"}],"data":null})", split);
+        assert_true(split && responses.size() == 2, "Split batch");
+        assert_equal(responses[0], R"({"data":null,"errors":[{"message":"all"}]})", "Response of subquery 0");
+        assert_equal(responses[1], R"({"data":null,"errors":[{"message":"a","path":["user","name"]},{"message":"all"}]})", "Response of subquery 1");
+    });
+    define_test(run_option, "rejects responses that aren't objects", [](Test* t) {
+        bool split;
+        split_batch_response(1, "[]", split);
+        assert_true(!split, "Array response");
+        split_batch_response(1, "  ", split);
+        assert_true(!split, "Empty response");
+    });
+}
+
+static const char* printer_schema = "directive @cached(ttl: Int) on FIELD type Query { user(id: ID, name: String): User posts(first: Int, ratio: Float, tags: [String], active: Boolean): [Post] } type User { id: ID name: String } type Post { title: String author: User }";
+
+// Plan a query with all root fields on one backend, and print its subquery.
+static std::string print_subquery(const char* query, FragmentPrintMode mode) {
+    static MemoryPool memory_pool(1024 * 4 * 64, 1024 * 4);
+    QueryPlan plan;
+    plan.memory_pool = &memory_pool;
+    plan.ticket = memory_pool.TakeTicket();
+    GraphQlSchema schema(printer_schema, plan.memory_pool, plan.ticket);
+    GraphQlExecutor executor(plan.memory_pool, plan.ticket);
+    executor.add_schema(schema);
+    ExecutableDefinition* document = executor.Execute(query);
+    if (!document->diagnostics.empty()) {
+        throw BaselineAssertionError(document->diagnostics.front().message + " in " + query);
+    }
+    std::vector<std::unique_ptr<BackendEndpoint>> endpoints;
+    endpoints.push_back(std::make_unique<BackendEndpoint>());
+    std::vector<Route> routes = {
+        { OperationType::Query, "user", endpoints[0].get(), 0, 0 },
+        { OperationType::Query, "posts", endpoints[0].get(), 0, 0 },
+    };
+    auto route_table = std::make_shared<const RouteTable>(std::move(endpoints), std::move(routes));
+    QueryPlanError error = PlanQuery(document->operation_definitions.at(0), &document->fragment_definitions, route_table, plan);
+    assert_true(error == QueryPlanError::None, std::string(GetQueryPlanErrorMessage(error)) + " in " + query);
+    StringWriter writer;
+    PrintSubquery(writer, plan, plan.subqueries.at(0), mode);
+    return writer.Text();
+}
+
+static void define_printer_tests(const RunOption& run_option) {
+    domain("GraphQL printer");
+    define_test(run_option, "prints aliases", [](Test* t) {
+        assert_equal(
+            print_subquery(R"({ me: user(id: "1") { name } friend: user(id: "2") { name } user: user { id } })", FragmentPrintMode::Inline),
+            R"({"query":"{me:user(id:\"1\"){name} friend:user(id:\"2\"){name} user{id}}"})",
+            "Aliases");
+    });
+    define_test(run_option, "merges the selections of a response key", [](Test* t) {
+        assert_equal(
+            print_subquery("{ user { id } posts { title } user { name } }", FragmentPrintMode::Inline),
+            R"({"query":"{user{id name} posts{title}}"})",
+            "Merged selections");
+    });
+    define_test(run_option, "prints the operation head", [](Test* t) {
+        assert_equal(
+            print_subquery("query Users { user { id } }", FragmentPrintMode::Inline),
+            R"({"query":"query Users{user{id}}"})",
+            "Named query");
+    });
+    define_test(run_option, "prints values and directives", [](Test* t) {
+        assert_equal(
+            print_subquery(R"({ posts(first: 10, ratio: 0.5, tags: ["a", "b"], active: false) @cached(ttl: 60) { title } })", FragmentPrintMode::Inline),
+            R"({"query":"{posts(active:false,first:10,ratio:0.5,tags:[\"a\",\"b\"])@cached(ttl:60){title}}"})",
+            "Values and directives");
+    });
+    define_test(run_option, "inlines fragments", [](Test* t) {
+        assert_equal(
+            print_subquery("{ posts { ...PostFields } } fragment PostFields on Post { title author { ...on User { name } } }", FragmentPrintMode::Inline),
+            R"({"query":"{posts{...on Post{title author{...on User{name}}}}}"})",
+            "Inlined fragments");
+    });
+    define_test(run_option, "hoists fragments", [](Test* t) {
+        assert_equal(
+            print_subquery("{ posts { ...PostFields author { ...UserFields } } } fragment PostFields on Post { title author { ...UserFields } } fragment UserFields on User { name }", FragmentPrintMode::Hoist),
+            R"({"query":"{posts{...PostFields author{...UserFields}}}fragment PostFields on Post{title author{...UserFields}}fragment UserFields on User{name}"})",
+            "Hoisted fragments");
+    });
+    define_test(run_option, "escapes strings for JSON", [](Test* t) {
+        assert_equal(
+            print_subquery(R"({ user(id: "a\"b\\c\u0001", name: """x
+y""") { id } })", FragmentPrintMode::Inline),
+            R"({"query":"{user(id:\"a\\\"b\\\\c\\u0001\",name:\"\"\"x\u000ay\"\"\"){id}}"})",
+            "Escaped strings");
+    });
+}
+
+static const char* route_config = R"({
+    "backends": {
+        "users": { "origin": "http://users:4000", "path": "/graphql", "replicas": ["users-1:4000"] },
+        "orders": { "origin": "http://orders:4000", "path": "/graphql", "replicas": ["orders-1:4000", "orders-2:4001"] }
+    },
+    "routes": [
+        { "operation": "query", "field": "user", "backend": "users", "cacheTtl": 1000 },
+        { "operation": "query", "field": "orders", "backend": "orders", "batchWindow": 200 },
+        { "operation": "mutation", "field": "createOrder", "backend": "orders" }
+    ]
+})";
+
+static void define_route_table_tests(const RunOption& run_option) {
+    domain("Route table");
+    define_test(run_option, "finds the routes of fields", [](Test* t) {
+        std::shared_ptr<const RouteTable> route_table;
+        std::string error;
+        assert_true(ParseRouteTable(route_config, route_table, error), error);
+        const Route* user = route_table->Find(OperationType::Query, "user");
+        assert_true(user != nullptr && user->endpoint->origin == "http://users:4000" && user->cache_ttl == 1000, "Route of user");
+        const Route* orders = route_table->Find(OperationType::Query, "orders");
+        assert_true(orders != nullptr && orders->endpoint->replicas.size() == 2 && orders->batch_window == 200, "Route of orders");
+        const Route* create_order = route_table->Find(OperationType::Mutation, "createOrder");
+        assert_true(create_order != nullptr && create_order->endpoint == orders->endpoint, "Route of createOrder");
+    });
+    define_test(run_option, "misses fields without routes", [](Test* t) {
+        std::shared_ptr<const RouteTable> route_table;
+        std::string error;
+        assert_true(ParseRouteTable(route_config, route_table, error), error);
+        assert_true(route_table->Find(OperationType::Mutation, "user") == nullptr, "Route of mutation user");
+        assert_true(route_table->Find(OperationType::Subscription, "orders") == nullptr, "Route of subscription orders");
+        assert_true(route_table->Find(OperationType::Query, "users") == nullptr, "Route of users");
+        assert_true(route_table->Find(OperationType::Query, "use") == nullptr, "Route of use");
+        assert_true(route_table->Find(OperationType::Query, "") == nullptr, "Route of an empty field");
+    });
+    define_test(run_option, "finds the routes of large configs", [](Test* t) {
+        for (std::size_t size : { 0, 1, 2, 7, 100, 5000 }) {
+            std::string config = R"({"backends":{"a":{"origin":"http://a","path":"/g","replicas":["a:1"]}},"routes":[)";
+            for (std::size_t i = 0; i < size; i++) {
+                config += i == 0 ? "" : ",";
+                config += R"({"operation":")" + std::string(i % 2 == 0 ? "query" : "mutation") + R"(","field":"f)" + std::to_string(i) + R"(","backend":"a","cacheTtl":)" + std::to_string(i) + "}";
+            }
+            config += "]}";
+            std::shared_ptr<const RouteTable> route_table;
+            std::string error;
+            assert_true(ParseRouteTable(config, route_table, error), error);
+            assert_true(route_table->Size() == size, "Size of " + std::to_string(size) + " routes");
+            for (std::size_t i = 0; i < size; i++) {
+                std::string field = "f" + std::to_string(i);
+                OperationType operation_type = i % 2 == 0 ? OperationType::Query : OperationType::Mutation;
+                OperationType other_operation_type = i % 2 == 0 ? OperationType::Mutation : OperationType::Query;
+                const Route* route = route_table->Find(operation_type, field);
+                assert_true(route != nullptr && route->cache_ttl == i, "Route of " + field);
+                assert_true(route_table->Find(other_operation_type, field) == nullptr, "Route of " + field + " with the other operation type");
+                assert_true(route_table->Find(operation_type, "g" + std::to_string(i)) == nullptr, "Route of g" + std::to_string(i));
+            }
+        }
+    });
+    define_test(run_option, "rejects invalid configs", [](Test* t) {
+        std::shared_ptr<const RouteTable> route_table;
+        std::string error;
+        assert_true(!ParseRouteTable(R"({"backends":{},"routes":[{"operation":"query","field":"x","backend":"z"}]})", route_table, error), "Unknown backend");
+        assert_equal(error, "Route x has an unknown backend", "Error of an unknown backend");
+        assert_true(!ParseRouteTable(R"({"backends":{},"routes":[],"forwardedHeaders":["Connection"]})", route_table, error), "Hop-by-hop header");
+        assert_equal(error, "Header Connection can't be forwarded", "Error of a hop-by-hop header");
+        for (const char* name : { "1", "{}", "[\"Authorization\"]", "null" }) {
+            std::string config = R"({"backends":{},"routes":[],"forwardedHeaders":[)" + std::string(name) + "]}";
+            assert_true(!ParseRouteTable(config, route_table, error), std::string("Forwarded header ") + name);
+            assert_equal(error, "Expected forwardedHeaders to be an array of header names", std::string("Error of forwarded header ") + name);
+        }
+        for (const char* option : { R"("caFile":1)", R"("caFile":["a"])", R"("http2":"yes")", R"("http2":{})" }) {
+            std::string config = R"({"backends":{"a":{"origin":"http://a","path":"/g","replicas":["a:1"],)" + std::string(option) + R"(}},"routes":[]})";
+            assert_true(!ParseRouteTable(config, route_table, error), std::string("Backend option ") + option);
+            assert_equal(error, "Backend a needs a string caFile and a boolean http2", std::string("Error of backend option ") + option);
+        }
+        assert_true(!ParseRouteTable(R"({"backends":{"a":{"origin":"http://a","path":"/g","replicas":[]}},"routes":[]})", route_table, error), "Backend without replicas");
+        assert_equal(error, "Backend a needs an origin, a path and replicas", "Error of a backend without replicas");
+        assert_true(!ParseRouteTable("{", route_table, error), "Invalid JSON");
+        assert_equal(error, "Invalid JSON", "Error of invalid JSON");
+        assert_true(!ParseRouteTable(R"({"backends":{"a":{"origin":"http://a","path":"/g","replicas":["a:1"]}},"routes":[{"operation":"query","field":"x","backend":"a"},{"operation":"query","field":"x","backend":"a"}]})", route_table, error), "Route defined twice");
+        assert_equal(error, "Route x is defined twice", "Error of a route defined twice");
+        for (const char* replica : { "a", ":1", "a:", "a:0", "a:65536", "a:1x" }) {
+            std::string config = R"({"backends":{"a":{"origin":"http://a","path":"/g","replicas":[")" + std::string(replica) + R"("]}},"routes":[]})";
+            assert_true(!ParseRouteTable(config, route_table, error), std::string("Replica ") + replica);
+            assert_equal(error, "Backend a has a replica that isn't hostname:port", std::string("Error of replica ") + replica);
+        }
+    });
+    define_test(run_option, "parses replicas and forwarded headers", [](Test* t) {
+        std::shared_ptr<const RouteTable> route_table;
+        std::string error;
+        assert_true(ParseRouteTable(R"({"backends":{"a":{"origin":"http://a","path":"/g","replicas":["a-1:4000","[::1]:4001"]}},"routes":[],"forwardedHeaders":["Authorization"]})", route_table, error), error);
+        const std::vector<BackendReplica>& replicas = route_table->Endpoints().front()->replicas;
+        assert_true(replicas.size() == 2, "Replicas");
+        assert_true(replicas[0].host == "a-1:4000" && replicas[0].hostname == "a-1" && replicas[0].port == 4000, "First replica");
+        assert_true(replicas[1].hostname == "[::1]" && replicas[1].port == 4001, "IPv6 replica");
+        const HttpHeaderSet& forwarded_headers = route_table->ForwardedHeaderSet();
+        assert_true(forwarded_headers.count() == 1 && forwarded_headers.test(static_cast<std::size_t>(HttpHeader::Authorization)), "Forwarded headers");
+        assert_true(ParseRouteTable(route_config, route_table, error), error);
+        assert_true(route_table->ForwardedHeaderSet() == DefaultForwardedHeaders(), "Default forwarded headers");
+    });
+}
+
+static void append_response_body(void* data, const char* text, std::size_t size) {
+    static_cast<std::string*>(data)->append(text, size);
+}
+
+// Feed a response to a parser in parts of a size, until the response is
+// complete or invalid.
+// @param consumed set to the bytes that were read.
+static HttpResponseStatus parse_response(HttpResponseParser& parser, const std::string& response, std::size_t part_size, std::string& body, std::size_t& consumed) {
+    HttpResponseStatus status = HttpResponseStatus::Incomplete;
+    consumed = 0;
+    while (consumed < response.size()) {
+        const char* text = response.data() + consumed;
+        std::size_t size = std::min(part_size, response.size() - consumed);
+        do {
+            std::size_t part_consumed;
+            status = parser.Feed(text, size, part_consumed, append_response_body, &body);
+            text += part_consumed;
+            size -= part_consumed;
+            consumed += part_consumed;
+        }
+        while (status == HttpResponseStatus::Head);
+        if (status != HttpResponseStatus::Incomplete || size > 0) {
+            break;
+        }
+    }
+    return status;
+}
+
+static void define_response_parser_tests(const RunOption& run_option) {
+    domain("HTTP response parser");
+    define_test(run_option, "reads responses split across reads", [](Test* t) {
+        std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nX-Trace: a\r\n\r\nhello";
+        std::string next_response = "HTTP/1.1 200 OK\r\n";
+        for (std::size_t part_size = 1; part_size <= response.size() + next_response.size(); part_size++) {
+            HttpResponseParser parser;
+            std::string body;
+            std::size_t consumed;
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_true(parse_response(parser, response + next_response, part_size, body, consumed) == HttpResponseStatus::Complete, "Incomplete response in " + parts);
+            assert_true(parser.Head().status == 200 && parser.Head().keep_alive, "Head in " + parts);
+            assert_equal(body, "hello", "Body in " + parts);
+            assert_true(consumed == response.size(), "Read the next response in " + parts);
+        }
+    });
+    define_test(run_option, "reads chunked bodies", [](Test* t) {
+        std::string response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\nA;name=value\r\n0123456789\r\n0\r\n\r\n";
+        for (std::size_t part_size = 1; part_size <= response.size(); part_size++) {
+            HttpResponseParser parser;
+            std::string body;
+            std::size_t consumed;
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_true(parse_response(parser, response, part_size, body, consumed) == HttpResponseStatus::Complete, "Incomplete response in " + parts);
+            assert_true(parser.Head().body_encoding == HttpBodyEncoding::Chunked && parser.Head().keep_alive, "Head in " + parts);
+            assert_equal(body, "abc0123456789", "Body in " + parts);
+        }
+    });
+    define_test(run_option, "skips interim responses", [](Test* t) {
+        std::string response = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 103 Early Hints\r\nLink: </a>\r\n\r\nHTTP/1.1 503 Service Unavailable\r\nContent-Length: 2\r\n\r\nno";
+        for (std::size_t part_size = 1; part_size <= response.size(); part_size++) {
+            HttpResponseParser parser;
+            std::string body;
+            std::size_t consumed;
+            std::string parts = "parts of " + std::to_string(part_size);
+            assert_true(parse_response(parser, response, part_size, body, consumed) == HttpResponseStatus::Complete, "Incomplete response in " + parts);
+            assert_true(parser.Head().status == 503, "Status in " + parts);
+            assert_equal(body, "no", "Body in " + parts);
+        }
+    });
+    define_test(run_option, "decides whether connections are kept alive", [](Test* t) {
+        struct KeepAliveCase {
+            const char* response;
+            bool keep_alive;
+        };
+        KeepAliveCase cases[] = {
+            { "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", true },
+            { "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", false },
+            { "HTTP/1.1 204 No Content\r\n\r\n", true },
+            { "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n", false },
+            { "HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 0\r\n\r\n", true },
+        };
+        for (const auto& keep_alive_case : cases) {
+            HttpResponseParser parser;
+            std::string body;
+            std::size_t consumed;
+            assert_true(parse_response(parser, keep_alive_case.response, 1, body, consumed) == HttpResponseStatus::Complete, std::string("Incomplete response ") + keep_alive_case.response);
+            assert_true(parser.Head().keep_alive == keep_alive_case.keep_alive, std::string("Keep-alive of ") + keep_alive_case.response);
+        }
+    });
+    define_test(run_option, "reads bodies until the connection closes", [](Test* t) {
+        HttpResponseParser parser;
+        std::string body;
+        std::size_t consumed;
+        assert_true(parse_response(parser, "HTTP/1.1 200 OK\r\n\r\nuntil close", 3, body, consumed) == HttpResponseStatus::Incomplete, "Response without a length");
+        assert_true(parser.Head().body_encoding == HttpBodyEncoding::UntilClose && !parser.Head().keep_alive, "Head");
+        assert_true(parser.End(), "End of the body");
+        assert_equal(body, "until close", "Body");
+
+        HttpResponseParser truncated_parser;
+        parse_response(truncated_parser, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhel", 3, body, consumed);
+        assert_true(!truncated_parser.End(), "End of a truncated body");
+    });
+    define_test(run_option, "rejects invalid responses", [](Test* t) {
+        struct InvalidCase {
+            const char* response;
+            HttpParseError error;
+        };
+        InvalidCase cases[] = {
+            { "HTTP/1.1 2x0 OK\r\n\r\n", HttpParseError::InvalidStatusCode },
+            { "HTTP/1.1 200 OK\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n", HttpParseError::InvalidContentLength },
+            { "HTTP/1.1 200 OK\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc", HttpParseError::InvalidContentLength },
+            { "HTTP/1.1 200 OK\r\nContent-Length: 3\r\nContent-Length: 5\r\n\r\nabc", HttpParseError::InvalidContentLength },
+            { "HTTP/1.1 200 OK\r\nContent-Length: 3x\r\n\r\nabc", HttpParseError::InvalidContentLength },
+            { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nx\r\n", HttpParseError::InvalidChunkedBody },
+        };
+        for (const auto& invalid_case : cases) {
+            HttpResponseParser parser;
+            std::string body;
+            std::size_t consumed;
+            assert_true(parse_response(parser, invalid_case.response, 1, body, consumed) == HttpResponseStatus::Error, std::string("Valid response ") + invalid_case.response);
+            assert_true(parser.Error() == invalid_case.error, std::string("Error of ") + invalid_case.response);
+        }
+    });
+    define_test(run_option, "rejects responses above the limits and upgrades", [](Test* t) {
+        HttpParserLimits limits = { 64, 100, 8 };
+        struct LimitCase {
+            std::string response;
+            HttpParseError error;
+        };
+        LimitCase cases[] = {
+            { "HTTP/1.1 200 OK\r\nX-Trace: " + std::string(64, 'a') + "\r\n\r\n", HttpParseError::HeaderFieldsTooLarge },
+            { "HTTP/1.1 200 OK\r\nContent-Length: 9\r\n\r\n123456789", HttpParseError::PayloadTooLarge },
+            { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\n12345\r\n4\r\n6789\r\n0\r\n\r\n", HttpParseError::PayloadTooLarge },
+            { "HTTP/1.1 200 OK\r\n\r\n123456789", HttpParseError::PayloadTooLarge },
+            { "HTTP/1.1 101 Switching Protocols\r\nUpgrade: h2c\r\n\r\n", HttpParseError::InvalidStatusCode },
+        };
+        for (const auto& limit_case : cases) {
+            for (std::size_t part_size : { std::size_t(1), limit_case.response.size() }) {
+                HttpResponseParser parser(limits);
+                std::string body;
+                std::size_t consumed;
+                std::string name = limit_case.response + " in parts of " + std::to_string(part_size);
+                assert_true(parse_response(parser, limit_case.response, part_size, body, consumed) == HttpResponseStatus::Error, "Valid response " + name);
+                assert_true(parser.Error() == limit_case.error, "Error of " + name);
+            }
+        }
+    });
+}
+
+static std::string from_hex(const char* hex) {
+    std::string bytes;
+    for (const char* position = hex; *position != '\0'; ) {
+        if (*position == ' ') {
+            position++;
+            continue;
+        }
+        unsigned int byte;
+        std::sscanf(position, "%2x", &byte);
+        bytes.push_back(static_cast<char>(byte));
+        position += 2;
+    }
+    return bytes;
+}
+
+static std::string decode_headers(HpackDecoder& decoder, const char* hex) {
+    std::string block = from_hex(hex);
+    std::vector<HpackHeader> headers;
+    if (!decoder.Decode(block.data(), block.size(), headers)) {
+        return "Invalid block";
+    }
+    std::string text;
+    for (const auto& header : headers) {
+        text += header.name + ": " + header.value + "\n";
+    }
+    return text;
+}
+
+static const char* hpack_request_headers[] = {
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+    ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n",
+};
+
+static const char* hpack_response_headers[] = {
+    ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+    ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+    ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\ncontent-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n",
+};
+
+// The header blocks of RFC 7541 Appendix C, see
+// https://tools.ietf.org/html/rfc7541#appendix-C.
+static const char* hpack_request_blocks[] = {
+    "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+    "8286 84be 5808 6e6f 2d63 6163 6865",
+    "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+};
+
+static const char* hpack_huffman_request_blocks[] = {
+    "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+    "8286 84be 5886 a8eb 1064 9cbf",
+    "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+};
+
+static const char* hpack_response_blocks[] = {
+    "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+    "4803 3330 37c1 c0bf",
+    "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31",
+};
+
+static const char* hpack_huffman_response_blocks[] = {
+    "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+    "4883 640e ffc1 c0bf",
+    "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+};
+
+static void define_hpack_tests(const RunOption& run_option) {
+    domain("HPACK");
+    define_test(run_option, "decodes the requests of RFC 7541 C.3 and C.4", [](Test* t) {
+        HpackDecoder decoder;
+        HpackDecoder huffman_decoder;
+        for (std::size_t i = 0; i < 3; i++) {
+            std::string example = "C.3." + std::to_string(i + 1);
+            assert_equal(decode_headers(decoder, hpack_request_blocks[i]), hpack_request_headers[i], example);
+            example = "C.4." + std::to_string(i + 1);
+            assert_equal(decode_headers(huffman_decoder, hpack_huffman_request_blocks[i]), hpack_request_headers[i], example);
+        }
+    });
+    define_test(run_option, "decodes the responses of RFC 7541 C.5 and C.6", [](Test* t) {
+        // The examples evict entries from a table of 256 bytes.
+        HpackDecoder decoder(256);
+        HpackDecoder huffman_decoder(256);
+        for (std::size_t i = 0; i < 3; i++) {
+            std::string example = "C.5." + std::to_string(i + 1);
+            assert_equal(decode_headers(decoder, hpack_response_blocks[i]), hpack_response_headers[i], example);
+            example = "C.6." + std::to_string(i + 1);
+            assert_equal(decode_headers(huffman_decoder, hpack_huffman_response_blocks[i]), hpack_response_headers[i], example);
+        }
+    });
+    define_test(run_option, "encodes the requests of RFC 7541 C.4", [](Test* t) {
+        const char* requests[][5][2] = {
+            { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } },
+            { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { "cache-control", "no-cache" } },
+            { { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" }, { "custom-key", "custom-value" } },
+        };
+        HpackEncoder encoder;
+        for (std::size_t i = 0; i < 3; i++) {
+            std::string block;
+            for (const auto& header : requests[i]) {
+                if (header[0] != nullptr) {
+                    encoder.Encode(header[0], header[1], HpackIndexing::Incremental, block);
+                }
+            }
+            assert_true(block == from_hex(hpack_huffman_request_blocks[i]), "C.4." + std::to_string(i + 1));
+        }
+    });
+    define_test(run_option, "rejects invalid blocks", [](Test* t) {
+        HpackDecoder decoder;
+        // A Huffman string padded with a zero bit, and an index past the tables.
+        assert_equal(decode_headers(decoder, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 fe"), "Invalid block", "Invalid padding");
+        assert_equal(decode_headers(decoder, "ff00"), "Invalid block", "Index out of range");
+
+        // A size update after a header, and one above our table size.
+        assert_equal(decode_headers(decoder, "8220"), "Invalid block", "Size update after a header");
+        HpackDecoder small_decoder(256);
+        assert_equal(decode_headers(small_decoder, "3fe11f"), "Invalid block", "Size update above the table size");
+    });
+    define_test(run_option, "signals table size updates in the next block", [](Test* t) {
+        const char* headers[][2] = { { ":authority", "www.example.com" }, { "custom-key", "custom-value" }, { "cookie", "secret" } };
+        HpackIndexing indexings[] = { HpackIndexing::Incremental, HpackIndexing::Incremental, HpackIndexing::Never };
+
+        // The table sizes that are set before each block, and the size updates
+        // that start the block. A shrink and a grow before one block are both
+        // signaled.
+        std::vector<std::size_t> max_sizes[] = { {}, { 0 }, { 100 }, { 0, 100 }, { 8192 } };
+        const char* size_updates[] = { "", "20", "3f45", "20 3f45", "3fe11f" };
+        HpackEncoder encoder;
+        HpackDecoder decoder;
+        for (std::size_t block_index = 0; block_index < 5; block_index++) {
+            for (std::size_t max_size : max_sizes[block_index]) {
+                encoder.SetMaxTableSize(max_size);
+            }
+            std::string block;
+            std::string expected_headers;
+            for (std::size_t i = 0; i < 3; i++) {
+                encoder.Encode(headers[i][0], headers[i][1], indexings[i], block);
+                expected_headers += std::string(headers[i][0]) + ": " + headers[i][1] + "\n";
+            }
+            std::string name = "Block " + std::to_string(block_index + 1);
+            std::string size_update = from_hex(size_updates[block_index]);
+            assert_true(block.compare(0, size_update.size(), size_update) == 0 && (block[size_update.size()] & 0xe0) != 0x20, "Size updates of " + name);
+            std::vector<HpackHeader> decoded_headers;
+            assert_true(decoder.Decode(block.data(), block.size(), decoded_headers), name);
+            std::string text;
+            for (const auto& header : decoded_headers) {
+                text += header.name + ": " + header.value + "\n";
+            }
+            assert_equal(text, expected_headers, "Headers of " + name);
+        }
+    });
+}
+
+// Run a loop until a condition holds, for at most 5 seconds.
+// @return whether the condition holds.
+static bool run_until(uv_loop_t* loop, const std::function<bool()>& condition) {
+    uv_timer_t guard;
+    uv_timer_init(loop, &guard);
+    uv_timer_start(&guard, [](uv_timer_t* timer) { }, 10, 10);
+    uv_update_time(loop);
+    std::uint64_t deadline = uv_now(loop) + 5000;
+    while (!condition() && uv_now(loop) < deadline) {
+        uv_run(loop, UV_RUN_ONCE);
+    }
+    uv_close((uv_handle_t*)&guard, nullptr);
+    uv_run(loop, UV_RUN_NOWAIT);
+    return condition();
+}
+
+struct TestBackendConnection {
+    uv_tcp_t tcp_handle;
+
+    // The server side TLS session, nullptr on a plain backend.
+    SSL* ssl_handle;
+
+    // The bytes that were received, decrypted on a TLS backend.
+    std::string received;
+    bool closed;
+
+    ~TestBackendConnection() {
+        SSL_free(ssl_handle);
+    }
+};
+
+struct TestBackendWrite {
+    uv_write_t write_request;
+    std::string bytes;
+};
+
+// A backend of a test on a port of 127.0.0.1, which runs on the loop of the
+// test. It keeps the bytes that each of its connections received, and the
+// test answers them with canned bytes. Its handles are closed with the loop.
+class TestBackend {
+public:
+    // @param ssl_ctx the context of a TLS backend, nullptr for a plain one.
+    TestBackend(uv_loop_t* loop, SSL_CTX* ssl_ctx = nullptr):
+        ssl_ctx_(ssl_ctx) {
+        uv_tcp_init(loop, &server_);
+        server_.data = this;
+        sockaddr_in address;
+        uv_ip4_addr("127.0.0.1", 0, &address);
+        uv_tcp_bind(&server_, reinterpret_cast<const sockaddr*>(&address), 0);
+        uv_listen((uv_stream_t*)&server_, 16, OnConnection);
+        sockaddr_storage bound_address;
+        int size = sizeof(bound_address);
+        uv_tcp_getsockname(&server_, reinterpret_cast<sockaddr*>(&bound_address), &size);
+        port_ = ntohs(reinterpret_cast<sockaddr_in*>(&bound_address)->sin_port);
+    }
+
+    unsigned int Port() const {
+        return port_;
+    }
+
+    std::size_t ConnectionCount() const {
+        return connections_.size();
+    }
+
+    TestBackendConnection& Connection(std::size_t index) {
+        return *connections_[index];
+    }
+
+    void Send(std::size_t index, const std::string& bytes) {
+        TestBackendConnection* connection = connections_[index].get();
+        if (connection->ssl_handle == nullptr) {
+            Write(connection, bytes);
+            return;
+        }
+        SSL_write(connection->ssl_handle, bytes.data(), static_cast<int>(bytes.size()));
+        FlushTls(connection);
+    }
+
+    void Close(std::size_t index) {
+        connections_[index]->closed = true;
+        uv_close((uv_handle_t*)&connections_[index]->tcp_handle, nullptr);
+    }
+
+private:
+    SSL_CTX* ssl_ctx_;
+    uv_tcp_t server_;
+    unsigned int port_;
+    std::vector<std::unique_ptr<TestBackendConnection>> connections_;
+
+    static void Write(TestBackendConnection* connection, const std::string& bytes) {
+        auto write = new TestBackendWrite { {}, bytes };
+        write->write_request.data = write;
+        uv_buf_t buf = uv_buf_init(&write->bytes[0], static_cast<unsigned int>(write->bytes.size()));
+        uv_write(&write->write_request, (uv_stream_t*)&connection->tcp_handle, &buf, 1, [](uv_write_t* write_request, int status) {
+            delete static_cast<TestBackendWrite*>(write_request->data);
+        });
+    }
+
+    static void FlushTls(TestBackendConnection* connection) {
+        BIO* write_bio = SSL_get_wbio(connection->ssl_handle);
+        std::string records(BIO_ctrl_pending(write_bio), '\0');
+        if (!records.empty()) {
+            BIO_read(write_bio, &records[0], static_cast<int>(records.size()));
+            Write(connection, records);
+        }
+    }
+
+    static void OnConnection(uv_stream_t* server, int status) {
+        auto backend = static_cast<TestBackend*>(server->data);
+        auto connection = new TestBackendConnection {};
+        backend->connections_.emplace_back(connection);
+        if (backend->ssl_ctx_ != nullptr) {
+            connection->ssl_handle = SSL_new(backend->ssl_ctx_);
+            SSL_set_bio(connection->ssl_handle, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+            SSL_set_accept_state(connection->ssl_handle);
+        }
+        uv_tcp_init(server->loop, &connection->tcp_handle);
+        connection->tcp_handle.data = connection;
+        uv_accept(server, (uv_stream_t*)&connection->tcp_handle);
+        uv_read_start((uv_stream_t*)&connection->tcp_handle, [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+            thread_local char buffer[1024 * 64];
+            *buf = uv_buf_init(buffer, sizeof(buffer));
+        }, OnRead);
+    }
+
+    static void OnRead(uv_stream_t* stream, ssize_t length, const uv_buf_t* buf) {
+        auto connection = static_cast<TestBackendConnection*>(stream->data);
+        if (length < 0) {
+            connection->closed = true;
+            uv_read_stop(stream);
+            return;
+        }
+        if (connection->ssl_handle == nullptr) {
+            connection->received.append(buf->base, static_cast<std::size_t>(length));
+            return;
+        }
+
+        // The handshake is done by the first reads.
+        BIO_write(SSL_get_rbio(connection->ssl_handle), buf->base, static_cast<int>(length));
+        char plaintext[16384];
+        int size;
+        while ((size = SSL_read(connection->ssl_handle, plaintext, sizeof(plaintext))) > 0) {
+            connection->received.append(plaintext, static_cast<std::size_t>(size));
+        }
+        ERR_clear_error();
+        FlushTls(connection);
+    }
+};
+
+// A pool of connections to a test backend, with its own loop.
+struct UpstreamTest {
+    uv_loop_t* loop;
+    DnsCache dns_cache;
+    UpstreamPool upstream_pool;
+    TestBackend backend;
+
+    UpstreamTest(const UpstreamPoolOptions& options = default_upstream_pool_options, SSL_CTX* backend_ssl_ctx = nullptr):
+        loop(new_test_loop()),
+        dns_cache(loop),
+        upstream_pool(loop, &dns_cache, options),
+        backend(loop, backend_ssl_ctx)
+    { }
+
+    ~UpstreamTest() {
+        close_test_loop(loop);
+    }
+};
+
+struct AcquiredConnection {
+    bool acquired;
+    UpstreamConnection* connection;
+    int status;
+};
+
+static void on_acquired(UpstreamConnection* connection, int status, void* data) {
+    auto acquired_connection = static_cast<AcquiredConnection*>(data);
+    *acquired_connection = AcquiredConnection { true, connection, status };
+}
+
+static AcquiredConnection acquire_connection(UpstreamTest& test, const char* hostname, unsigned int port) {
+    AcquiredConnection acquired_connection {};
+    test.upstream_pool.Acquire(hostname, port, on_acquired, &acquired_connection);
+    run_until(test.loop, [&]() { return acquired_connection.acquired; });
+    return acquired_connection;
+}
+
+static void define_upstream_pool_tests(const RunOption& run_option) {
+    domain("Upstream pool");
+    define_test(run_option, "reuses released connections", [](Test* t) {
+        UpstreamTest test;
+        AcquiredConnection first = acquire_connection(test, "127.0.0.1", test.backend.Port());
+        assert_true(first.acquired && first.status == 0 && first.connection != nullptr, "First acquire");
+        assert_true(run_until(test.loop, [&]() { return test.backend.ConnectionCount() == 1; }), "Accepted connection");
+        test.upstream_pool.Release(first.connection);
+
+        // An idle connection is acquired before Acquire returns.
+        AcquiredConnection second {};
+        test.upstream_pool.Acquire("127.0.0.1", test.backend.Port(), on_acquired, &second);
+        assert_true(second.acquired && second.connection == first.connection, "Reused connection");
+        assert_true(second.connection->requests == 2, "Requests of the reused connection");
+        const UpstreamPoolStats& stats = test.upstream_pool.Stats();
+        assert_true(stats.acquires == 2 && stats.reuses == 1 && stats.connects == 1, "Stats of the reuse");
+        test.upstream_pool.Discard(second.connection);
+        assert_true(run_until(test.loop, [&]() { return test.backend.Connection(0).closed; }), "Closed discarded connection");
+    });
+    define_test(run_option, "closes idle connections that the backend closed", [](Test* t) {
+        UpstreamTest test;
+        AcquiredConnection first = acquire_connection(test, "127.0.0.1", test.backend.Port());
+        assert_true(first.connection != nullptr, "First acquire");
+        assert_true(run_until(test.loop, [&]() { return test.backend.ConnectionCount() == 1; }), "Accepted connection");
+        test.upstream_pool.Release(first.connection);
+        test.backend.Close(0);
+        assert_true(run_until(test.loop, [&]() { return test.upstream_pool.Stats().health_check_failures == 1; }), "Health check failure");
+        AcquiredConnection second = acquire_connection(test, "127.0.0.1", test.backend.Port());
+        assert_true(second.connection != nullptr && test.backend.ConnectionCount() == 2, "New connection");
+        assert_true(test.upstream_pool.Stats().reuses == 0 && test.upstream_pool.Stats().connects == 2, "Stats of the new connection");
+        test.upstream_pool.Discard(second.connection);
+    });
+    define_test(run_option, "times out connects", [](Test* t) {
+        UpstreamPoolOptions options = default_upstream_pool_options;
+        options.connect_timeout = 50;
+        UpstreamTest test(options);
+
+        // A listener whose backlog is full doesn't answer connects.
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        uv_ip4_addr("127.0.0.1", 0, &address);
+        bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+        listen(listener, 0);
+        socklen_t size = sizeof(address);
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &size);
+        int fillers[2];
+        for (int& filler : fillers) {
+            filler = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            connect(filler, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+        }
+        AcquiredConnection acquired_connection = acquire_connection(test, "127.0.0.1", ntohs(address.sin_port));
+        for (int filler : fillers) {
+            close(filler);
+        }
+        close(listener);
+        assert_true(acquired_connection.acquired, "Acquire");
+        assert_true(acquired_connection.connection == nullptr && acquired_connection.status == UV_ETIMEDOUT, "Timed out connect");
+        assert_true(test.upstream_pool.Stats().connect_failures == 1 && test.upstream_pool.Stats().connects == 0, "Stats of the timeout");
+    });
+    define_test(run_option, "falls back to the next address of a hostname", [](Test* t) {
+        UpstreamTest test;
+
+        // The backend only listens on the IPv4 address, so ::1 refuses.
+        sockaddr_storage ipv6_address {};
+        uv_ip6_addr("::1", 0, reinterpret_cast<sockaddr_in6*>(&ipv6_address));
+        sockaddr_storage ipv4_address {};
+        uv_ip4_addr("127.0.0.1", 0, reinterpret_cast<sockaddr_in*>(&ipv4_address));
+        test.dns_cache.Set("replica", { ipv6_address, ipv4_address });
+        AcquiredConnection acquired_connection = acquire_connection(test, "replica", test.backend.Port());
+        assert_true(acquired_connection.connection != nullptr && acquired_connection.status == 0, "Connect after the fallback");
+        assert_true(acquired_connection.connection->address_index == 1, "Connected address");
+        const UpstreamPoolStats& stats = test.upstream_pool.Stats();
+        assert_true(stats.address_fallbacks == 1 && stats.connects == 1 && stats.connect_failures == 0, "Stats of the fallback");
+        assert_true(run_until(test.loop, [&]() { return test.backend.ConnectionCount() == 1; }), "Accepted connection");
+        test.upstream_pool.Discard(acquired_connection.connection);
+    });
+    define_test(run_option, "fails connects once every address failed", [](Test* t) {
+        UpstreamTest test;
+        sockaddr_storage ipv6_address {};
+        uv_ip6_addr("::1", 0, reinterpret_cast<sockaddr_in6*>(&ipv6_address));
+        test.dns_cache.Set("replica", { ipv6_address, ipv6_address });
+        AcquiredConnection acquired_connection = acquire_connection(test, "replica", test.backend.Port());
+        assert_true(acquired_connection.acquired && acquired_connection.connection == nullptr, "Failed connect");
+        assert_true(acquired_connection.status == UV_ECONNREFUSED, "Status of the failed connect");
+        const UpstreamPoolStats& stats = test.upstream_pool.Stats();
+        assert_true(stats.address_fallbacks == 1 && stats.connect_failures == 1, "Stats of the failed connect");
+    });
+}
+
+struct ResolvedAddresses {
+    bool resolved;
+    std::vector<sockaddr_storage> addresses;
+    int status;
+};
+
+static void on_resolved(const std::vector<sockaddr_storage>& addresses, int status, void* data) {
+    *static_cast<ResolvedAddresses*>(data) = ResolvedAddresses { true, addresses, status };
+}
+
+static unsigned int get_address_port(const sockaddr_storage& address) {
+    if (address.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<const sockaddr_in6*>(&address)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<const sockaddr_in*>(&address)->sin_port);
+}
+
+// A DNS cache with its own loop.
+struct DnsCacheTest {
+    uv_loop_t* loop;
+    DnsCache dns_cache;
+
+    DnsCacheTest():
+        loop(new_test_loop()),
+        dns_cache(loop)
+    { }
+
+    ~DnsCacheTest() {
+        close_test_loop(loop);
+    }
+};
+
+static void define_dns_cache_tests(const RunOption& run_option) {
+    domain("DNS cache");
+    define_test(run_option, "answers lookups of resolved hostnames from the cache", [](Test* t) {
+        DnsCacheTest test;
+        DnsCache& dns_cache = test.dns_cache;
+        ResolvedAddresses first {};
+        dns_cache.Resolve("localhost", 80, on_resolved, &first);
+        assert_true(!first.resolved, "Answer before the resolver");
+        assert_true(run_until(test.loop, [&]() { return first.resolved; }), "Resolution of localhost");
+        assert_true(first.status == 0 && !first.addresses.empty(), "Addresses of localhost");
+        assert_true(get_address_port(first.addresses.front()) == 80, "Port of the resolution");
+
+        // A cached hostname is answered before Resolve returns.
+        ResolvedAddresses second {};
+        dns_cache.Resolve("localhost", 81, on_resolved, &second);
+        assert_true(second.resolved && second.addresses.size() == first.addresses.size(), "Cached addresses");
+        assert_true(get_address_port(second.addresses.front()) == 81, "Port of the cached addresses");
+        const DnsCacheStats& stats = dns_cache.Stats();
+        assert_true(stats.misses == 1 && stats.hits == 1 && stats.resolutions == 1, "Stats of the lookups");
+    });
+    define_test(run_option, "answers set addresses in their order", [](Test* t) {
+        DnsCacheTest test;
+        DnsCache& dns_cache = test.dns_cache;
+        sockaddr_storage ipv6_address {};
+        uv_ip6_addr("::1", 0, reinterpret_cast<sockaddr_in6*>(&ipv6_address));
+        sockaddr_storage ipv4_address {};
+        uv_ip4_addr("127.0.0.1", 0, reinterpret_cast<sockaddr_in*>(&ipv4_address));
+        dns_cache.Set("replica", { ipv6_address, ipv4_address });
+        ResolvedAddresses resolved {};
+        dns_cache.Resolve("replica", 4000, on_resolved, &resolved);
+        assert_true(resolved.resolved && resolved.status == 0 && resolved.addresses.size() == 2, "Set addresses");
+        assert_true(resolved.addresses[0].ss_family == AF_INET6 && resolved.addresses[1].ss_family == AF_INET, "Order of the addresses");
+        assert_true(get_address_port(resolved.addresses[0]) == 4000 && get_address_port(resolved.addresses[1]) == 4000, "Ports of the addresses");
+        assert_true(dns_cache.Stats().resolutions == 0, "Resolutions");
+    });
+}
+
+// A self-signed certificate of localhost, which is its own CA.
+class TestCertificate {
+public:
+    TestCertificate() {
+        EVP_PKEY_CTX* key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        EVP_PKEY_keygen_init(key_ctx);
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1);
+        EVP_PKEY_keygen(key_ctx, &key_);
+        EVP_PKEY_CTX_free(key_ctx);
+        certificate_ = X509_new();
+        X509_set_version(certificate_, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate_), 1);
+        X509_gmtime_adj(X509_getm_notBefore(certificate_), -60);
+        X509_gmtime_adj(X509_getm_notAfter(certificate_), 3600);
+        X509_set_pubkey(certificate_, key_);
+        X509_NAME* name = X509_get_subject_name(certificate_);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+        X509_set_issuer_name(certificate_, name);
+        X509V3_CTX extension_ctx;
+        X509V3_set_ctx_nodb(&extension_ctx);
+        X509V3_set_ctx(&extension_ctx, certificate_, certificate_, nullptr, nullptr, 0);
+        for (const auto& extension : { std::make_pair(NID_subject_alt_name, "DNS:localhost"), std::make_pair(NID_basic_constraints, "critical,CA:TRUE") }) {
+            X509_EXTENSION* x509_extension = X509V3_EXT_conf_nid(nullptr, &extension_ctx, extension.first, extension.second);
+            X509_add_ext(certificate_, x509_extension, -1);
+            X509_EXTENSION_free(x509_extension);
+        }
+        X509_sign(certificate_, key_, EVP_sha256());
+    }
+
+    ~TestCertificate() {
+        X509_free(certificate_);
+        EVP_PKEY_free(key_);
+    }
+
+    // Create the context of a backend that serves the certificate, and picks
+    // h2 over http/1.1 with ALPN.
+    // @param max_version the highest TLS version, e.g. TLS 1.2, whose
+    // sessions are resumed with the handshake's session ticket.
+    SSL_CTX* CreateBackendContext(int max_version = 0) const {
+        SSL_CTX* ssl_ctx = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_use_certificate(ssl_ctx, certificate_);
+        SSL_CTX_use_PrivateKey(ssl_ctx, key_);
+        SSL_CTX_set_max_proto_version(ssl_ctx, max_version);
+        SSL_CTX_set_alpn_select_cb(ssl_ctx, [](SSL* ssl, const unsigned char** selected, unsigned char* selected_size, const unsigned char* offered, unsigned int offered_size, void* arg) {
+            static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+            if (SSL_select_next_proto(const_cast<unsigned char**>(selected), selected_size, protocols, sizeof(protocols) - 1, offered, offered_size) != OPENSSL_NPN_NEGOTIATED) {
+                return SSL_TLSEXT_ERR_NOACK;
+            }
+            return SSL_TLSEXT_ERR_OK;
+        }, nullptr);
+        return ssl_ctx;
+    }
+
+    // Create the TLS of a backend whose CA is the certificate.
+    bool CreateUpstreamTls(const std::string& server_name, bool http2, std::shared_ptr<const UpstreamTls>& tls, std::string& error) const {
+        char ca_file[] = "/tmp/flash-test-ca-XXXXXX";
+        int fd = mkstemp(ca_file);
+        FILE* file = fdopen(fd, "w");
+        PEM_write_X509(file, certificate_);
+        std::fclose(file);
+        bool created = flashpoint::CreateUpstreamTls(server_name, ca_file, http2, tls, error);
+        unlink(ca_file);
+        return created;
+    }
+
+private:
+    EVP_PKEY* key_ = nullptr;
+    X509* certificate_;
+};
+
+// Connect to a TLS backend of the certificate.
+static AcquiredConnection acquire_tls_connection(UpstreamTest& test, const TestCertificate& certificate, const std::string& server_name, bool http2) {
+    std::shared_ptr<const UpstreamTls> tls;
+    std::string error;
+    assert_true(certificate.CreateUpstreamTls(server_name, http2, tls, error), error);
+    test.upstream_pool.ConfigureTls("localhost", test.backend.Port(), tls);
+    return acquire_connection(test, "localhost", test.backend.Port());
+}
+
+static void define_upstream_tls_tests(const RunOption& run_option) {
+    domain("Upstream TLS");
+    define_test(run_option, "offers h2 or http/1.1 with ALPN", [](Test* t) {
+        TestCertificate certificate;
+        SSL_CTX* backend_ssl_ctx = certificate.CreateBackendContext();
+        for (bool http2 : { false, true }) {
+            std::string name = http2 ? "h2" : "http/1.1";
+            UpstreamTest test(default_upstream_pool_options, backend_ssl_ctx);
+            AcquiredConnection acquired_connection = acquire_tls_connection(test, certificate, "localhost", http2);
+            assert_true(acquired_connection.connection != nullptr && acquired_connection.status == 0, "Handshake of " + name);
+            assert_true(acquired_connection.connection->ssl_handle != nullptr, "TLS session of " + name);
+            assert_true(HasNegotiatedHttp2(acquired_connection.connection) == http2, "Negotiated protocol of " + name);
+            assert_true(test.upstream_pool.Stats().tls_handshakes == 1, "Handshakes of " + name);
+
+            // The connection carries plaintext through the TLS sessions.
+            SSL_write(acquired_connection.connection->ssl_handle, "ping", 4);
+            FlushUpstreamTls(acquired_connection.connection);
+            assert_true(run_until(test.loop, [&]() { return test.backend.Connection(0).received == "ping"; }), "Plaintext of " + name);
+            test.upstream_pool.Discard(acquired_connection.connection);
+        }
+        SSL_CTX_free(backend_ssl_ctx);
+    });
+    define_test(run_option, "fails handshakes with certificates that don't verify", [](Test* t) {
+        TestCertificate certificate;
+        TestCertificate other_certificate;
+        SSL_CTX* backend_ssl_ctx = certificate.CreateBackendContext();
+        {
+            UpstreamTest test(default_upstream_pool_options, backend_ssl_ctx);
+            AcquiredConnection acquired_connection = acquire_tls_connection(test, other_certificate, "localhost", false);
+            assert_true(acquired_connection.acquired && acquired_connection.connection == nullptr, "Handshake with an unknown CA");
+            assert_true(acquired_connection.status == UV_EPROTO, "Status of an unknown CA");
+            assert_true(test.upstream_pool.Stats().connect_failures == 1 && test.upstream_pool.Stats().tls_handshakes == 0, "Stats of an unknown CA");
+        }
+        {
+            UpstreamTest test(default_upstream_pool_options, backend_ssl_ctx);
+            AcquiredConnection acquired_connection = acquire_tls_connection(test, certificate, "backend.example", false);
+            assert_true(acquired_connection.acquired && acquired_connection.connection == nullptr, "Handshake with another name");
+            assert_true(acquired_connection.status == UV_EPROTO, "Status of another name");
+        }
+        SSL_CTX_free(backend_ssl_ctx);
+        std::shared_ptr<const UpstreamTls> tls;
+        std::string error;
+        assert_true(!CreateUpstreamTls("localhost", "/nonexistent/ca.pem", false, tls, error), "TLS with a missing CA file");
+        assert_equal(error, "Couldn't load the CAs of localhost", "Error of a missing CA file");
+    });
+    define_test(run_option, "resumes the last session of an endpoint", [](Test* t) {
+        TestCertificate certificate;
+        SSL_CTX* backend_ssl_ctx = certificate.CreateBackendContext(TLS1_2_VERSION);
+        {
+            UpstreamTest test(default_upstream_pool_options, backend_ssl_ctx);
+            AcquiredConnection first = acquire_tls_connection(test, certificate, "localhost", false);
+            assert_true(first.connection != nullptr, "First handshake");
+            assert_true(!SSL_session_reused(first.connection->ssl_handle), "Session of the first handshake");
+            assert_true(test.upstream_pool.Endpoint("localhost", test.backend.Port())->ssl_session != nullptr, "Kept session");
+            test.upstream_pool.Discard(first.connection);
+            AcquiredConnection second = acquire_connection(test, "localhost", test.backend.Port());
+            assert_true(second.connection != nullptr, "Second handshake");
+            assert_true(SSL_session_reused(second.connection->ssl_handle), "Session of the second handshake");
+            const UpstreamPoolStats& stats = test.upstream_pool.Stats();
+            assert_true(stats.tls_handshakes == 2 && stats.tls_resumptions == 1, "Stats of the resumption");
+            test.upstream_pool.Discard(second.connection);
+        }
+        SSL_CTX_free(backend_ssl_ctx);
+    });
+}
+
+// The frame types and flags of RFC 7540 that the canned backends use.
+const std::uint8_t test_http2_data = 0x0;
+const std::uint8_t test_http2_headers = 0x1;
+const std::uint8_t test_http2_rst_stream = 0x3;
+const std::uint8_t test_http2_settings = 0x4;
+const std::uint8_t test_http2_goaway = 0x7;
+const std::uint8_t test_http2_window_update = 0x8;
+const std::uint8_t test_http2_end_stream = 0x1;
+const std::uint8_t test_http2_end_headers = 0x4;
+
+// The HPACK block of ":status: 200", the 8th entry of the static table.
+const char test_http2_ok_head[] = "\x88";
+
+struct TestHttp2Frame {
+    std::uint8_t type;
+    std::uint8_t flags;
+    std::uint32_t stream_id;
+    std::string payload;
+};
+
+static std::string http2_uint32(std::uint32_t value) {
+    return { static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8), static_cast<char>(value) };
+}
+
+static std::string http2_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id, const std::string& payload = "") {
+    std::size_t length = payload.size();
+    std::string frame = { static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length), static_cast<char>(type), static_cast<char>(flags) };
+    return frame + http2_uint32(stream_id) + payload;
+}
+
+static std::string http2_setting(std::uint16_t setting, std::uint32_t value) {
+    return std::string { static_cast<char>(setting >> 8), static_cast<char>(setting) } + http2_uint32(value);
+}
+
+// Split the bytes that a backend received into frames, after the connection
+// preface. An incomplete frame at the end is left out.
+static std::vector<TestHttp2Frame> received_http2_frames(const std::string& received) {
+    std::vector<TestHttp2Frame> frames;
+    const std::string preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    if (received.compare(0, preface.size(), preface) != 0) {
+        return frames;
+    }
+    std::size_t offset = preface.size();
+    while (received.size() - offset >= 9) {
+        auto header = reinterpret_cast<const std::uint8_t*>(received.data() + offset);
+        std::size_t length = static_cast<std::size_t>(header[0]) << 16 | static_cast<std::size_t>(header[1]) << 8 | header[2];
+        if (received.size() - offset - 9 < length) {
+            break;
+        }
+        std::uint32_t stream_id = static_cast<std::uint32_t>(header[5] & 0x7f) << 24 | static_cast<std::uint32_t>(header[6]) << 16 | static_cast<std::uint32_t>(header[7]) << 8 | header[8];
+        frames.push_back(TestHttp2Frame { header[3], header[4], stream_id, received.substr(offset + 9, length) });
+        offset += 9 + length;
+    }
+    return frames;
+}
+
+// The frames of a type that a backend received.
+static std::vector<TestHttp2Frame> received_http2_frames(const std::string& received, std::uint8_t type) {
+    std::vector<TestHttp2Frame> frames;
+    for (const auto& frame : received_http2_frames(received)) {
+        if (frame.type == type) {
+            frames.push_back(frame);
+        }
+    }
+    return frames;
+}
+
+static std::size_t received_http2_body_size(const std::string& received, std::uint32_t stream_id) {
+    std::size_t size = 0;
+    for (const auto& frame : received_http2_frames(received, test_http2_data)) {
+        if (frame.stream_id == stream_id) {
+            size += frame.payload.size();
+        }
+    }
+    return size;
+}
+
+// What the callbacks of a stream got.
+struct TestHttp2Response {
+    unsigned int status;
+    std::string body;
+    bool ended;
+    bool failed;
+    std::string error;
+    bool retryable;
+};
+
+static const Http2StreamCallbacks test_http2_callbacks = {
+    [](void* data, unsigned int status) {
+        static_cast<TestHttp2Response*>(data)->status = status;
+    },
+    [](void* data, const char* text, std::size_t size) {
+        static_cast<TestHttp2Response*>(data)->body.append(text, size);
+    },
+    [](void* data) {
+        static_cast<TestHttp2Response*>(data)->ended = true;
+    },
+    [](void* data, const char* message, bool retryable) {
+        auto response = static_cast<TestHttp2Response*>(data);
+        response->failed = true;
+        response->error = message;
+        response->retryable = retryable;
+    },
+};
+
+// A session pool on the loop of an upstream test, whose backend answers with
+// canned frames. Plain connections speak HTTP/2 with prior knowledge.
+struct Http2Test: UpstreamTest {
+    Http2SessionPool session_pool;
+
+    Http2Test():
+        session_pool(loop, &upstream_pool)
+    { }
+
+    void Open(const std::string& body, TestHttp2Response& response) {
+        Http2Request request {
+            {
+                { ":method", "POST", HpackIndexing::Incremental },
+                { ":scheme", "http", HpackIndexing::Incremental },
+                { ":path", "/graphql", HpackIndexing::Incremental },
+                { ":authority", "localhost", HpackIndexing::Incremental },
+            },
+            body,
+        };
+        Http2Stream* stream;
+        session_pool.Open("localhost", backend.Port(), std::move(request), &test_http2_callbacks, &response, stream);
+    }
+
+    // Wait until the backend received the HEADERS of a stream.
+    bool WaitForStream(std::uint32_t stream_id) {
+        return run_until(loop, [&]() {
+            if (backend.ConnectionCount() == 0) {
+                return false;
+            }
+            for (const auto& frame : received_http2_frames(backend.Connection(0).received, test_http2_headers)) {
+                if (frame.stream_id == stream_id) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+};
+
+static void define_http2_session_tests(const RunOption& run_option) {
+    domain("HTTP/2 sessions");
+    define_test(run_option, "frames a request and its response", [](Test* t) {
+        Http2Test test;
+        TestHttp2Response response {};
+        test.Open("{\"query\":\"{a}\"}", response);
+        assert_true(test.WaitForStream(1), "Request");
+        assert_true(run_until(test.loop, [&]() { return received_http2_body_size(test.backend.Connection(0).received, 1) == 15; }), "Request body");
+        std::vector<TestHttp2Frame> frames = received_http2_frames(test.backend.Connection(0).received);
+        assert_true(frames.size() == 4, "Frames of the request");
+        assert_true(frames[0].type == test_http2_settings && frames[0].stream_id == 0, "Settings");
+        assert_true(frames[0].payload == http2_setting(0x2, 0) + http2_setting(0x4, 1024 * 256), "Settings of the session");
+        assert_true(frames[1].type == test_http2_window_update && frames[1].payload == http2_uint32(1024 * 1024 * 16 - 65535), "Window of the session");
+        assert_true(frames[2].flags == test_http2_end_headers, "Flags of the headers");
+        HpackDecoder decoder;
+        std::vector<HpackHeader> headers;
+        assert_true(decoder.Decode(frames[2].payload.data(), frames[2].payload.size(), headers), "Header block");
+        std::string text;
+        for (const auto& header : headers) {
+            text += header.name + ": " + header.value + "\n";
+        }
+        assert_equal(text, ":method: POST\n:scheme: http\n:path: /graphql\n:authority: localhost\n", "Headers");
+        assert_true(frames[3].type == test_http2_data && frames[3].flags == test_http2_end_stream && frames[3].payload == "{\"query\":\"{a}\"}", "Body");
+
+        test.backend.Send(0, http2_frame(test_http2_settings, 0, 0)
+            + http2_frame(test_http2_headers, test_http2_end_headers, 1, test_http2_ok_head)
+            + http2_frame(test_http2_data, 0, 1, "{\"data\":")
+            + http2_frame(test_http2_data, test_http2_end_stream, 1, "{\"a\":1}}"));
+        assert_true(run_until(test.loop, [&]() { return response.ended || response.failed; }), "Response");
+        assert_true(response.ended && response.status == 200, "Head of the response");
+        assert_equal(response.body, "{\"data\":{\"a\":1}}", "Body of the response");
+        assert_true(run_until(test.loop, [&]() { return !received_http2_frames(test.backend.Connection(0).received, test_http2_settings).empty(); }), "Acknowledged settings");
+        std::vector<TestHttp2Frame> settings = received_http2_frames(test.backend.Connection(0).received, test_http2_settings);
+        assert_true(settings.size() == 2 && settings[1].flags == 0x1 && settings[1].payload.empty(), "Settings ACK");
+    });
+    define_test(run_option, "sends bodies as far as the windows allow", [](Test* t) {
+        Http2Test test;
+        TestHttp2Response response {};
+        test.Open(std::string(70000, 'a'), response);
+        assert_true(test.WaitForStream(1), "Request");
+
+        // The initial windows are 65535 bytes, sent in frames of 16384 bytes.
+        assert_true(run_until(test.loop, [&]() { return received_http2_body_size(test.backend.Connection(0).received, 1) == 65535; }), "Body within the initial windows");
+        std::vector<TestHttp2Frame> data = received_http2_frames(test.backend.Connection(0).received, test_http2_data);
+        assert_true(data.size() == 4 && data[0].payload.size() == 16384 && data[3].flags == 0, "Frames of the body");
+
+        // The session's window alone doesn't let the stream send more.
+        test.backend.Send(0, http2_frame(test_http2_settings, 0, 0) + http2_frame(test_http2_window_update, 0, 0, http2_uint32(10000)));
+        assert_true(run_until(test.loop, [&]() { return received_http2_frames(test.backend.Connection(0).received, test_http2_settings).size() == 2; }), "Settings ACK");
+        assert_true(received_http2_body_size(test.backend.Connection(0).received, 1) == 65535, "Body within the stream window");
+        test.backend.Send(0, http2_frame(test_http2_window_update, 0, 1, http2_uint32(10000)));
+        assert_true(run_until(test.loop, [&]() { return received_http2_body_size(test.backend.Connection(0).received, 1) == 70000; }), "Rest of the body");
+        data = received_http2_frames(test.backend.Connection(0).received, test_http2_data);
+        assert_true(data.back().payload.size() == 70000 - 65535 && data.back().flags == test_http2_end_stream, "Last frame of the body");
+
+        test.backend.Send(0, http2_frame(test_http2_headers, test_http2_end_headers | test_http2_end_stream, 1, test_http2_ok_head));
+        assert_true(run_until(test.loop, [&]() { return response.ended || response.failed; }) && response.ended, "Response");
+    });
+    define_test(run_option, "fails the streams that the backend resets", [](Test* t) {
+        Http2Test test;
+        TestHttp2Response refused {};
+        TestHttp2Response reset {};
+        test.Open("", refused);
+        test.Open("", reset);
+        assert_true(test.WaitForStream(3), "Requests");
+        test.backend.Send(0, http2_frame(test_http2_settings, 0, 0)
+            + http2_frame(test_http2_rst_stream, 0, 1, http2_uint32(static_cast<std::uint32_t>(Http2ErrorCode::RefusedStream)))
+            + http2_frame(test_http2_rst_stream, 0, 3, http2_uint32(static_cast<std::uint32_t>(Http2ErrorCode::InternalError))));
+        assert_true(run_until(test.loop, [&]() { return refused.failed && reset.failed; }), "Errors");
+        assert_true(refused.retryable && refused.error == "Backend refused the stream", "Refused stream");
+        assert_true(!reset.retryable && reset.error == "Backend reset the stream", "Reset stream");
+        const Http2SessionPoolStats& stats = test.session_pool.Stats();
+        assert_true(stats.sessions == 1 && stats.streams == 2 && stats.refused_streams == 1, "Stats of the resets");
+    });
+    define_test(run_option, "retries the streams after the last one of a GOAWAY", [](Test* t) {
+        Http2Test test;
+        TestHttp2Response processed {};
+        TestHttp2Response unprocessed {};
+        test.Open("", processed);
+        test.Open("", unprocessed);
+        assert_true(test.WaitForStream(3), "Requests");
+        test.backend.Send(0, http2_frame(test_http2_settings, 0, 0) + http2_frame(test_http2_goaway, 0, 0, http2_uint32(1) + http2_uint32(0)));
+        assert_true(run_until(test.loop, [&]() { return unprocessed.failed; }), "Stream after the last one");
+        assert_true(unprocessed.retryable && unprocessed.error == "Backend went away", "Error of the stream");
+        assert_true(!processed.ended && !processed.failed, "Last stream");
+
+        // The session closes once its last stream ended.
+        test.backend.Send(0, http2_frame(test_http2_headers, test_http2_end_headers | test_http2_end_stream, 1, test_http2_ok_head));
+        assert_true(run_until(test.loop, [&]() { return processed.ended && test.backend.Connection(0).closed; }), "Closed session");
+        std::vector<TestHttp2Frame> goaway = received_http2_frames(test.backend.Connection(0).received, test_http2_goaway);
+        assert_true(goaway.size() == 1 && goaway[0].payload == http2_uint32(0) + http2_uint32(0), "GOAWAY of the session");
+
+        // The next stream connects a new session.
+        TestHttp2Response next {};
+        test.Open("", next);
+        assert_true(run_until(test.loop, [&]() { return test.backend.ConnectionCount() == 2; }), "New session");
+        assert_true(test.session_pool.Stats().sessions == 2 && test.session_pool.Stats().refused_streams == 1, "Stats of the GOAWAY");
+    });
+    define_test(run_option, "reuses a session for the next streams", [](Test* t) {
+        Http2Test test;
+        TestHttp2Response first {};
+        test.Open("", first);
+        assert_true(test.WaitForStream(1), "First request");
+        test.backend.Send(0, http2_frame(test_http2_settings, 0, 0) + http2_frame(test_http2_headers, test_http2_end_headers | test_http2_end_stream, 1, test_http2_ok_head));
+        assert_true(run_until(test.loop, [&]() { return first.ended; }), "First response");
+
+        TestHttp2Response second {};
+        test.Open("", second);
+        assert_true(test.WaitForStream(3), "Second request");
+        test.backend.Send(0, http2_frame(test_http2_headers, test_http2_end_headers | test_http2_end_stream, 3, test_http2_ok_head));
+        assert_true(run_until(test.loop, [&]() { return second.ended; }), "Second response");
+        assert_true(test.backend.ConnectionCount() == 1 && !test.backend.Connection(0).closed, "Connection of the streams");
+        const Http2SessionPoolStats& stats = test.session_pool.Stats();
+        assert_true(stats.sessions == 1 && stats.streams == 2 && stats.queued_streams == 1, "Stats of the session");
+    });
+}
+
+// A writer's end of a socket pair on a test loop. The test reads what was
+// written from the other end.
+struct WriterTest {
+    uv_loop_t* loop;
+    uv_pipe_t pipe;
+    int peer_fd;
+
+    WriterTest():
+        loop(new_test_loop()) {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        uv_pipe_init(loop, &pipe, 0);
+        uv_pipe_open(&pipe, fds[0]);
+        peer_fd = fds[1];
+    }
+
+    ~WriterTest() {
+        close_test_loop(loop);
+        close(peer_fd);
+    }
+
+    uv_stream_t* Stream() {
+        return (uv_stream_t*)&pipe;
+    }
+
+    // Read until a number of bytes arrived.
+    std::string Receive(std::size_t size) {
+        std::string received;
+        run_until(loop, [&]() {
+            char buffer[1024 * 16];
+            ssize_t length;
+            while ((length = recv(peer_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                received.append(buffer, static_cast<std::size_t>(length));
+            }
+            return received.size() >= size;
+        });
+        return received;
+    }
+};
+
+// A TLS session on memory BIOs between a writer and a client, which decrypts
+// what the writer wrote.
+struct TestTlsPair {
+    SSL* server;
+    SSL* client;
+
+    TestTlsPair(SSL_CTX* server_ssl_ctx, SSL_CTX* client_ssl_ctx):
+        server(SSL_new(server_ssl_ctx)),
+        client(SSL_new(client_ssl_ctx)) {
+        SSL_set_bio(server, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+        SSL_set_bio(client, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+        SSL_set_accept_state(server);
+        SSL_set_connect_state(client);
+    }
+
+    ~TestTlsPair() {
+        SSL_free(server);
+        SSL_free(client);
+    }
+
+    bool Handshake() {
+        for (std::size_t i = 0; i < 10 && !(SSL_is_init_finished(server) && SSL_is_init_finished(client)); i++) {
+            SSL_do_handshake(client);
+            Transfer(client, server);
+            SSL_do_handshake(server);
+            Transfer(server, client);
+        }
+        ERR_clear_error();
+        return SSL_is_init_finished(server) && SSL_is_init_finished(client);
+    }
+
+    // Read and decrypt until a number of plaintext bytes arrived. SSL_read
+    // returns the plaintext of one record at a time.
+    // @param records set to the plaintext sizes of the records.
+    std::string Receive(WriterTest& test, std::size_t size, std::vector<std::size_t>& records) {
+        std::string plaintext;
+        records.clear();
+        run_until(test.loop, [&]() {
+            char buffer[max_ssl_record_size];
+            ssize_t length;
+            while ((length = recv(test.peer_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                BIO_write(SSL_get_rbio(client), buffer, static_cast<int>(length));
+            }
+            int plaintext_size;
+            while ((plaintext_size = SSL_read(client, buffer, sizeof(buffer))) > 0) {
+                plaintext.append(buffer, static_cast<std::size_t>(plaintext_size));
+                records.push_back(static_cast<std::size_t>(plaintext_size));
+            }
+            return plaintext.size() >= size;
+        });
+        ERR_clear_error();
+        return plaintext;
+    }
+
+private:
+    static void Transfer(SSL* from, SSL* to) {
+        char buffer[1024 * 16];
+        int size;
+        while ((size = BIO_read(SSL_get_wbio(from), buffer, sizeof(buffer))) > 0) {
+            BIO_write(SSL_get_rbio(to), buffer, size);
+        }
+    }
+};
+
+static std::string numbered_text(std::size_t size) {
+    std::string text;
+    for (std::size_t i = 0; text.size() < size; i++) {
+        text += std::to_string(i) + ",";
+    }
+    text.resize(size);
+    return text;
+}
+
+static void define_http_writer_tests(const RunOption& run_option) {
+    domain("HTTP writer");
+    define_test(run_option, "assembles copies and references in order", [](Test* t) {
+        WriterTest test;
+        std::string large = numbered_text(10000);
+        std::string reference = numbered_text(5000);
+        HttpWriter writer(test.Stream());
+        writer.WriteRequest(HttpMethod::Post, "/graphql");
+        writer.WriteLine("Host: ", "localhost");
+        writer.Write("Content-Length: ");
+        writer.WriteUnsigned(18446744073709551615u);
+        writer.WriteLine();
+        writer.WriteSigned(-42);
+        writer.Write(large);
+        writer.WriteReference(reference.data(), reference.size());
+        writer.Write("end");
+        std::string expected = "POST /graphql HTTP/1.1\r\nHost: localhost\r\nContent-Length: 18446744073709551615\r\n-42" + large + reference + "end";
+        assert_true(writer.Size() == expected.size(), "Size of the message");
+        writer.End();
+        assert_equal(test.Receive(expected.size()), expected, "Written message");
+    });
+    define_test(run_option, "copies only small references", [](Test* t) {
+        WriterTest test;
+        std::string small(HttpWriter::min_reference_size - 1, 's');
+        std::string large(HttpWriter::min_reference_size, 'l');
+        HttpWriter writer(test.Stream());
+        writer.WriteReference(small.data(), small.size());
+        writer.WriteReference(large.data(), large.size());
+
+        // Referenced text is written when the writer ends, copied text as it
+        // was when it was written.
+        small.assign(small.size(), 'S');
+        large.assign(large.size(), 'L');
+        writer.End();
+        std::string expected = std::string(small.size(), 's') + large;
+        assert_equal(test.Receive(expected.size()), expected, "Written message");
+    });
+    define_test(run_option, "reuses the write requests and buffers of its pool", [](Test* t) {
+        WriterTest test;
+        MemoryPool memory_pool(1024 * 4 * 4, 1024 * 4);
+        HttpWriterPool writer_pool(&memory_pool);
+        std::size_t free_blocks = memory_pool.FreeBlocks();
+        std::string text = numbered_text(10000);
+        for (std::size_t i = 0; i < 2; i++) {
+            HttpWriter writer(test.Stream(), &writer_pool);
+            writer.Write(text);
+            writer.End();
+            assert_equal(test.Receive(text.size()), text, "Written message " + std::to_string(i));
+            assert_true(run_until(test.loop, [&]() { return memory_pool.FreeBlocks() == free_blocks; }), "Returned blocks " + std::to_string(i));
+        }
+        const HttpWriterPoolStats& stats = writer_pool.Stats();
+        assert_true(stats.write_requests_taken == 2 && stats.write_request_allocations == 1, "Write requests of the messages");
+        assert_true(stats.buffers_taken == 6 && stats.buffer_allocations == 0, "Buffers of the messages");
+        assert_true(stats.socket_writes == 2, "Writes of the messages");
+
+        // The buffers after the pool's blocks are allocated, and freed again.
+        std::string large = numbered_text(1024 * 4 * free_blocks + 1);
+        {
+            HttpWriter writer(test.Stream(), &writer_pool);
+            writer.Write(large);
+            writer.End();
+        }
+        assert_equal(test.Receive(large.size()), large, "Message larger than the pool");
+        assert_true(run_until(test.loop, [&]() { return memory_pool.FreeBlocks() == free_blocks; }), "Returned blocks of the large message");
+        assert_true(stats.buffer_allocations == 1 && stats.write_request_allocations == 1, "Allocations of the large message");
+    });
+    define_test(run_option, "encrypts a message in full sized records", [](Test* t) {
+        WriterTest test;
+        MemoryPool memory_pool(1024 * 4 * 32, 1024 * 4);
+        HttpWriterPool writer_pool(&memory_pool);
+        TestCertificate certificate;
+        SSL_CTX* server_ssl_ctx = certificate.CreateBackendContext(TLS1_2_VERSION);
+        SSL_CTX* client_ssl_ctx = SSL_CTX_new(TLS_client_method());
+        TestTlsPair tls(server_ssl_ctx, client_ssl_ctx);
+        assert_true(tls.Handshake(), "Handshake");
+
+        // The segments are 100, 30000 and 9900 bytes, the records 16384,
+        // 16384 and 7232 bytes.
+        std::string reference = numbered_text(30000);
+        std::string expected = numbered_text(100) + reference + numbered_text(9900);
+        {
+            HttpWriter writer(test.Stream(), tls.server, &writer_pool);
+            writer.Write(expected.substr(0, 100));
+            writer.WriteReference(reference.data(), reference.size());
+            writer.Write(expected.substr(30100));
+            writer.End();
+        }
+        std::vector<std::size_t> records;
+        assert_equal(tls.Receive(test, expected.size(), records), expected, "Decrypted message");
+        assert_true(records == std::vector<std::size_t> { 16384, 16384, 7232 }, "Records of the message");
+
+        // Small writes are coalesced into one record.
+        {
+            HttpWriter writer(test.Stream(), tls.server, &writer_pool);
+            writer.Write("HTTP/1.1 200 OK\r\n");
+            writer.WriteLine("Content-Length: 2");
+            writer.WriteLine();
+            writer.Write("{}");
+            writer.End();
+        }
+        assert_equal(tls.Receive(test, 40, records), "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n{}", "Decrypted small message");
+        assert_true(records == std::vector<std::size_t> { 40 }, "Records of the small message");
+        const HttpWriterPoolStats& stats = writer_pool.Stats();
+        assert_true(stats.ssl_writes == 4 && stats.socket_writes == 2, "Writes of the messages");
+        assert_true(run_until(test.loop, [&]() { return memory_pool.FreeBlocks() == 32; }), "Returned blocks");
+        SSL_CTX_free(server_ssl_ctx);
+        SSL_CTX_free(client_ssl_ctx);
+    });
+}
+
+static void define_http_response_tests(const RunOption& run_option) {
+    domain("HTTP response");
+    define_test(run_option, "writes a JSON response with its Content-Length", [](Test* t) {
+        WriterTest test;
+        HttpDateClock date(test.loop);
+        HttpResponse response(HttpStatus::Ok);
+        response.Write("{\"data\":null}");
+        assert_true(response.ContentLength() == 13 && response.KeepAlive(), "Response");
+        HttpWriter writer(test.Stream());
+        response.WriteTo(writer, date);
+        writer.End();
+        std::string expected = "HTTP/1.1 200 OK\r\nServer: flash\r\nContent-Type: application/json\r\n" + std::string(date.Header()) + "Content-Length: 13\r\nConnection: keep-alive\r\n\r\n{\"data\":null}";
+        assert_equal(test.Receive(expected.size()), expected, "Written response");
+    });
+    define_test(run_option, "writes the headers and referenced body of a response", [](Test* t) {
+        WriterTest test;
+        HttpDateClock date(test.loop);
+        std::string reference = numbered_text(2000);
+        HttpResponse response(HttpStatus::Ok);
+        response.SetStatus(HttpStatus::NotFound);
+        response.SetHeader(HttpHeader::ContentType, "text/plain");
+
+        // The framing headers are the response's own.
+        response.SetHeader(HttpHeader::ContentLength, "1");
+        response.SetHeader(HttpHeader::Server, "other");
+        response.SetHeader(HttpHeader::Connection, "upgrade");
+        response.AddCustomHeader("X-Request-Id", "7");
+        response.SetKeepAlive(false);
+        response.Write("ab");
+        response.WriteReference(reference);
+        response.Write("cd");
+        assert_true(response.ContentLength() == 2004 && !response.KeepAlive(), "Response");
+        HttpWriter writer(test.Stream());
+        response.WriteTo(writer, date);
+        writer.End();
+        std::string expected = "HTTP/1.1 404 Not Found\r\nServer: flash\r\n" + std::string(date.Header()) + "Content-Type: text/plain\r\nX-Request-Id: 7\r\nContent-Length: 2004\r\nConnection: close\r\n\r\nab" + reference + "cd";
+        assert_equal(test.Receive(expected.size()), expected, "Written response");
+    });
+}
+
+void DefineUnitTests(const RunOption& run_option) {
+    define_character_class_tests(run_option);
+    define_request_parser_tests(run_option);
+    define_request_body_tests(run_option);
+    define_number_format_tests(run_option);
+    define_response_splitter_tests(run_option);
+    define_response_merge_tests(run_option);
+    define_singleflight_tests(run_option);
+    define_response_cache_tests(run_option);
+    define_replica_balancer_tests(run_option);
+    define_upstream_request_tests(run_option);
+    define_subquery_batch_tests(run_option);
+    define_printer_tests(run_option);
+    define_route_table_tests(run_option);
+    define_response_parser_tests(run_option);
+    define_hpack_tests(run_option);
+    define_upstream_pool_tests(run_option);
+    define_dns_cache_tests(run_option);
+    define_upstream_tls_tests(run_option);
+    define_http2_session_tests(run_option);
+    define_http_writer_tests(run_option);
+    define_http_response_tests(run_option);
+}
+
+}
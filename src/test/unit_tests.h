@@ -0,0 +1,16 @@
+#ifndef FLASH_UNIT_TESTS_H
+#define FLASH_UNIT_TESTS_H
+
+#include "baseline_test_runner.h"
+
+namespace flashpoint::test {
+
+// Define the tests of the gateway's components that run without a server,
+// e.g. the request and response parsers, the response merge, the cache, the
+// replica balancer, the GraphQL printer, the route table and HPACK. The
+// upstream tests connect to backends that run on their loop.
+void DefineUnitTests(const RunOption& run_option);
+
+}
+
+#endif //FLASH_UNIT_TESTS_H